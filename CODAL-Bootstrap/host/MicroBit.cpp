@@ -0,0 +1,200 @@
+#include "MicroBit.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <map>
+
+namespace {
+// bumped by system_timer_cancel_event(), pending timer events of an older generation are dropped
+thread_local std::map<uint32_t, uint64_t> timer_generation;
+
+void invoke_handler(void *fn, uint16_t id, uint16_t value, Sim::sim_time_t timestamp)
+{
+    MicroBitEvent e(id, value, CREATE_ONLY);
+    e.timestamp = timestamp;
+    ((void (*)(MicroBitEvent))fn)(e);
+}
+}
+
+MicroBitEvent::MicroBitEvent(uint16_t s, uint16_t v, MicroBitEventLaunchMode mode)
+    : source(s), value(v), timestamp(Sim::CurrentNode().LocalTimeUs())
+{
+    if (mode == CREATE_AND_FIRE)
+        fire();
+}
+
+MicroBitEvent::MicroBitEvent() : source(0), value(0), timestamp(Sim::CurrentNode().LocalTimeUs()) {}
+
+void MicroBitEvent::fire()
+{
+    Sim::CurrentNode().Fire(source, value, timestamp);
+}
+
+int MicroBitMessageBus::listen(uint16_t id, uint16_t value, void (*handler)(MicroBitEvent), uint16_t flags)
+{
+    bool immediate = (flags & MESSAGE_BUS_LISTENER_IMMEDIATE) == MESSAGE_BUS_LISTENER_IMMEDIATE;
+    Sim::CurrentNode().Listen(id, value, invoke_handler, (void *)handler, immediate);
+    return DEVICE_OK;
+}
+
+int MicroBitMessageBus::ignore(uint16_t id, uint16_t value, void (*handler)(MicroBitEvent))
+{
+    Sim::CurrentNode().Ignore(id, value, (void *)handler);
+    return DEVICE_OK;
+}
+
+int MicroBitRadioDatagram::send(const uint8_t *buffer, int len)
+{
+    return Sim::CurrentNode().Send(buffer, len);
+}
+
+int MicroBitRadioDatagram::recv(uint8_t *buf, int len)
+{
+    return Sim::CurrentNode().Recv(buf, len);
+}
+
+int MicroBitRadio::enable()
+{
+    Sim::CurrentNode().EnableRadio();
+    return DEVICE_OK;
+}
+
+int MicroBitRadio::disable()
+{
+    Sim::CurrentNode().DisableRadio();
+    return DEVICE_OK;
+}
+
+int MicroBitRadio::setGroup(uint8_t group)
+{
+    Sim::CurrentNode().SetGroup(group);
+    return DEVICE_OK;
+}
+
+int MicroBitRadio::dataReady()
+{
+    return Sim::CurrentNode().RxQueued();
+}
+
+int MicroBitSerial::printf(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    Sim::CurrentNode().Print(format, args);
+    va_end(args);
+    return DEVICE_OK;
+}
+
+int MicroBitSerial::send(uint8_t *buffer, int len)
+{
+    Sim::CurrentNode().Write(buffer, len);
+    return len;
+}
+
+int MicroBit::init()
+{
+    return DEVICE_OK;
+}
+
+unsigned long MicroBit::systemTime()
+{
+    return Sim::CurrentNode().LocalTimeUs() / 1000;
+}
+
+void MicroBit::sleep(uint32_t milliseconds)
+{
+    fiber_sleep(milliseconds);
+}
+
+int MicroBit::random(int max)
+{
+    return Sim::CurrentNode().Random(max);
+}
+
+uint64_t system_timer_current_time_us()
+{
+    return Sim::CurrentNode().LocalTimeUs();
+}
+
+int system_timer_event_after_us(uint64_t period, uint16_t id, uint16_t value)
+{
+    uint32_t key = ((uint32_t)id << 16) | value;
+    uint64_t generation = timer_generation[key];
+    // the timer interrupt raises the event, which runs immediate listeners at once
+    Sim::CurrentNode().Spawn([period, id, value, key, generation] {
+        Sim::CurrentNode().Sleep((Sim::sim_time_t)period);
+        if (timer_generation[key] == generation)
+            Sim::CurrentNode().Fire(id, value, Sim::CurrentNode().LocalTimeUs());
+    });
+    return DEVICE_OK;
+}
+
+int system_timer_cancel_event(uint16_t id, uint16_t value)
+{
+    timer_generation[((uint32_t)id << 16) | value]++;
+    return DEVICE_OK;
+}
+
+int Pin::setAnalogValue(int v)
+{
+    value = v;
+    changes.push_back({Sim::Now(), period_us, value});
+    return DEVICE_OK;
+}
+
+int Pin::setAnalogPeriodUs(int period)
+{
+    period_us = period;
+    changes.push_back({Sim::Now(), period_us, value});
+    return DEVICE_OK;
+}
+
+MixerChannel *Mixer2::addChannel(DataSource &stream, float sampleRate, int sampleRange)
+{
+    channels.push_back(std::unique_ptr<MixerChannel>(new MixerChannel{&stream, sampleRate, sampleRange}));
+    return channels.back().get();
+}
+
+int Mixer2::removeChannel(MixerChannel *channel)
+{
+    for (auto i = channels.begin(); i != channels.end(); ++i)
+        if (i->get() == channel) {
+            channels.erase(i);
+            return DEVICE_OK;
+        }
+    return DEVICE_INVALID_PARAMETER;
+}
+
+uint32_t microbit_serial_number()
+{
+    return Sim::CurrentNode().Config().serial;
+}
+
+void fiber_sleep(unsigned long t)
+{
+    Sim::CurrentNode().Sleep((Sim::sim_time_t)t * 1000);
+}
+
+int fiber_wait_for_event(uint16_t id, uint16_t value)
+{
+    Sim::CurrentNode().WaitForEvent(id, value);
+    return DEVICE_OK;
+}
+
+void schedule()
+{
+    Sim::CurrentNode().Yield();
+}
+
+void create_fiber(void (*entry)(void))
+{
+    Sim::CurrentNode().Spawn(entry);
+}
+
+void target_panic(int statusCode)
+{
+    fprintf(stderr, "node %d: panic %d\n", Sim::CurrentNode().Index(), statusCode);
+    abort();
+}
@@ -0,0 +1,195 @@
+#ifndef MICROBIT_H
+#define MICROBIT_H
+
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+#include "Simulator.h"
+
+/*
+    Host stand-in for the part of CODAL (codal-core + codal-microbit-v2) that the firmware in
+    ../source uses. Every call is forwarded to the simulated node the calling thread belongs to,
+    see Simulator.h. Numeric ids are local to the host build and need not match CODAL.
+*/
+
+// Per-device state of the firmware lives on the node's thread
+#define NODE_LOCAL thread_local
+
+#define DEVICE_OK 0
+#define DEVICE_INVALID_PARAMETER -1001
+
+#define DATASTREAM_FORMAT_16BIT_SIGNED 3
+
+#define MICROBIT_ID_RADIO 29
+#define MICROBIT_RADIO_EVT_DATAGRAM 1
+#define MICROBIT_RADIO_MAX_PACKET_SIZE 32
+
+#define MESSAGE_BUS_LISTENER_REENTRANT 0x0008
+#define MESSAGE_BUS_LISTENER_QUEUE_IF_BUSY 0x0010
+#define MESSAGE_BUS_LISTENER_DROP_IF_BUSY 0x0020
+#define MESSAGE_BUS_LISTENER_NONBLOCKING 0x0040
+#define MESSAGE_BUS_LISTENER_URGENT 0x0080
+#define MESSAGE_BUS_LISTENER_IMMEDIATE (MESSAGE_BUS_LISTENER_NONBLOCKING | MESSAGE_BUS_LISTENER_URGENT)
+#define EVENT_LISTENER_DEFAULT_FLAGS MESSAGE_BUS_LISTENER_QUEUE_IF_BUSY
+
+enum MicroBitEventLaunchMode { CREATE_ONLY, CREATE_AND_FIRE };
+
+class MicroBitEvent
+{
+public:
+    uint16_t source;
+    uint16_t value;
+    uint64_t timestamp;
+
+    MicroBitEvent(uint16_t source, uint16_t value, MicroBitEventLaunchMode mode = CREATE_AND_FIRE);
+    MicroBitEvent();
+
+    void fire();
+};
+
+class MicroBitMessageBus
+{
+public:
+    int listen(uint16_t id, uint16_t value, void (*handler)(MicroBitEvent),
+               uint16_t flags = EVENT_LISTENER_DEFAULT_FLAGS);
+    int ignore(uint16_t id, uint16_t value, void (*handler)(MicroBitEvent));
+};
+
+class MicroBitRadioDatagram
+{
+public:
+    int send(const uint8_t *buffer, int len);
+    int recv(uint8_t *buf, int len);
+};
+
+class MicroBitRadio
+{
+public:
+    MicroBitRadioDatagram datagram;
+
+    int enable();
+    int disable();
+    int setGroup(uint8_t group);
+    int dataReady();
+};
+
+class MicroBitSerial
+{
+public:
+    int printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+    int send(uint8_t *buffer, int len);
+};
+
+/*
+    Records every change with the true time it happened at, so that a harness can compare what
+    the nodes played
+*/
+class Pin
+{
+public:
+    struct Change
+    {
+        Sim::sim_time_t at;
+        int period_us;
+        int value;
+    };
+
+    int value = 0;
+    int period_us = 0;
+    std::vector<Change> changes;
+
+    int setAnalogValue(int value);
+    int setAnalogPeriodUs(int period);
+};
+
+class ManagedBuffer
+{
+public:
+    ManagedBuffer() = default;
+    explicit ManagedBuffer(int length) : data(std::make_shared<std::vector<uint8_t>>(length)) {}
+
+    uint8_t *getBytes() { return data ? data->data() : nullptr; }
+    int length() const { return data ? (int)data->size() : 0; }
+
+private:
+    std::shared_ptr<std::vector<uint8_t>> data;
+};
+
+class DataSink
+{
+public:
+    virtual ~DataSink() = default;
+    virtual int pullRequest() { return DEVICE_OK; }
+};
+
+class DataSource
+{
+public:
+    virtual ~DataSource() = default;
+    virtual ManagedBuffer pull() { return ManagedBuffer(); }
+    virtual void connect(DataSink &sink) {}
+    virtual void disconnect() {}
+    virtual int getFormat() { return DATASTREAM_FORMAT_16BIT_SIGNED; }
+    virtual float getSampleRate() { return 44100; }
+};
+
+/*
+    Nothing plays the channels on the host, a harness pulls them itself
+*/
+class MixerChannel
+{
+public:
+    DataSource *stream;
+    float sampleRate;
+    int range;
+};
+
+class Mixer2
+{
+public:
+    std::vector<std::unique_ptr<MixerChannel>> channels;
+
+    MixerChannel *addChannel(DataSource &stream, float sampleRate = 0, int sampleRange = 1023);
+    int removeChannel(MixerChannel *channel);
+};
+
+class MicroBitAudio
+{
+public:
+    Pin virtualOutputPin;
+    Mixer2 mixer;
+};
+
+class MicroBit
+{
+public:
+    MicroBitSerial serial;
+    MicroBitMessageBus messageBus;
+    MicroBitRadio radio;
+    MicroBitAudio audio;
+
+    int init();
+    unsigned long systemTime();
+    void sleep(uint32_t milliseconds);
+    int random(int max);
+};
+
+uint32_t microbit_serial_number();
+uint64_t system_timer_current_time_us();
+int system_timer_event_after_us(uint64_t period, uint16_t id, uint16_t value);
+int system_timer_cancel_event(uint16_t id, uint16_t value);
+void fiber_sleep(unsigned long t);
+int fiber_wait_for_event(uint16_t id, uint16_t value);
+void schedule();
+void create_fiber(void (*entry)(void));
+
+// only one node runs at a time on the host, there is nothing to mask
+inline void target_disable_irq() {}
+inline void target_enable_irq() {}
+
+// the device shows the code on the display and halts
+[[noreturn]] void target_panic(int statusCode);
+
+#endif
@@ -0,0 +1,11 @@
+#include "RadioStamp.h"
+#include "MicroBit.h"
+
+// stand-in for the PPI capture of source/RadioStamp.cpp, the simulated radio stamps each frame
+namespace RadioStamp {
+
+void Init(handler_t handler)
+{
+    Sim::CurrentNode().SetRadioStamp(handler);
+}
+}
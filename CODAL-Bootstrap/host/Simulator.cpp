@@ -0,0 +1,417 @@
+#include "Simulator.h"
+
+#include "MicroBit.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#define FIBER_STACK_SIZE (256 * 1024)
+
+namespace {
+thread_local Sim::Network *current_network;
+thread_local Sim::Node *current_node;
+}
+
+namespace Sim {
+
+Network &CurrentNetwork()
+{
+    return *current_network;
+}
+
+Node &CurrentNode()
+{
+    if (current_node == nullptr) {
+        fprintf(stderr, "sim: device API used outside of a simulated node\n");
+        abort();
+    }
+    return *current_node;
+}
+
+sim_time_t Now()
+{
+    return current_network->Now();
+}
+
+double Percentile(std::vector<double> values, double p)
+{
+    if (values.empty())
+        return NAN;
+    std::sort(values.begin(), values.end());
+    long rank = (long)std::ceil(p / 100.0 * values.size()) - 1;
+    rank = std::clamp(rank, 0L, (long)values.size() - 1);
+    return values[rank];
+}
+
+// -------------------------------------------------------------------
+
+Node::Node(Network &n, int i, const NodeConfig &c, std::function<void()> main)
+    : net(n), index(i), config(c), rng(n.Config().seed * 7919 + i)
+{
+    Spawn(std::move(main));
+    main_fiber = runnable.back();
+    runnable.clear();
+}
+
+Node::~Node() = default;
+
+sim_time_t Node::LocalTimeUs(sim_time_t t) const
+{
+    return config.clock_offset_us + t + (sim_time_t)std::llround(t * config.drift_ppm * 1e-6);
+}
+
+sim_time_t Node::LocalTimeUs() const
+{
+    return LocalTimeUs(net.now);
+}
+
+void Node::Schedule(Fiber *f, sim_time_t at)
+{
+    f->sleeping = true;
+    f->wake_token++;
+    Network::Event e = {};
+    e.at = at;
+    e.kind = Network::WAKE;
+    e.node = this;
+    e.fiber = f;
+    e.token = f->wake_token;
+    net.Push(e);
+}
+
+void Node::Sleep(sim_time_t local_us)
+{
+    if (current == nullptr) {
+        fprintf(stderr, "sim: node %d blocked outside of a fiber (interrupt context?)\n", index);
+        abort();
+    }
+    // invert the local clock to find the true time at which it reads `target`
+    sim_time_t target = LocalTimeUs() + std::max<sim_time_t>(local_us, 0);
+    sim_time_t at = (sim_time_t)std::ceil((target - config.clock_offset_us) / (1 + config.drift_ppm * 1e-6));
+    while (LocalTimeUs(at) < target)
+        at++;
+    WaitUntil(at);
+}
+
+void Node::WaitUntil(sim_time_t at)
+{
+    Fiber *self = current;
+    Schedule(self, std::max(at, net.now));
+    swapcontext(&self->ctx, &scheduler_ctx);
+}
+
+void Node::Yield()
+{
+    // Virtual time only advances when every fiber blocks, so a fiber must not spin on Yield()
+    // waiting for the clock to change
+    Sleep(0);
+}
+
+void Node::Spawn(std::function<void()> entry)
+{
+    auto f = std::make_unique<Fiber>();
+    f->entry = std::move(entry);
+    f->stack = std::make_unique<uint8_t[]>(FIBER_STACK_SIZE);
+    getcontext(&f->ctx);
+    f->ctx.uc_stack.ss_sp = f->stack.get();
+    f->ctx.uc_stack.ss_size = FIBER_STACK_SIZE;
+    f->ctx.uc_link = nullptr;
+    uintptr_t p = (uintptr_t)f.get();
+    makecontext(&f->ctx, (void (*)())FiberEntry, 2, (unsigned int)(p & 0xffffffff), (unsigned int)(p >> 32));
+    runnable.push_back(f.get());
+    fibers.push_back(std::move(f));
+}
+
+void Node::WaitForEvent(uint16_t id, uint16_t value)
+{
+    if (current == nullptr) {
+        fprintf(stderr, "sim: node %d blocked outside of a fiber (interrupt context?)\n", index);
+        abort();
+    }
+    Fiber *self = current;
+    // a wake-up still queued from an earlier Sleep() must not end the wait
+    self->sleeping = true;
+    self->wake_token++;
+    waiters.push_back({self, id, value});
+    swapcontext(&self->ctx, &scheduler_ctx);
+}
+
+void Node::FiberEntry(unsigned int lo, unsigned int hi)
+{
+    Fiber *f = (Fiber *)(((uintptr_t)hi << 32) | lo);
+    f->entry();
+    f->done = true;
+    setcontext(&current_node->scheduler_ctx);
+}
+
+void Node::Listen(uint16_t id, uint16_t value, invoke_t invoke, void *fn, bool immediate)
+{
+    for (const BusEntry &l : listeners)
+        if (l.id == id && l.value == value && l.fn == fn)
+            return;
+    listeners.push_back({id, value, invoke, fn, immediate});
+}
+
+void Node::Ignore(uint16_t id, uint16_t value, void *fn)
+{
+    listeners.erase(std::remove_if(listeners.begin(), listeners.end(),
+                                   [&](const BusEntry &l) { return l.id == id && l.value == value && l.fn == fn; }),
+                    listeners.end());
+}
+
+void Node::Fire(uint16_t id, uint16_t value, sim_time_t timestamp)
+{
+    std::vector<BusEntry> matching;
+    for (const BusEntry &l : listeners)
+        if ((l.id == 0 || l.id == id) && (l.value == 0 || l.value == value))
+            matching.push_back(l);
+
+    for (const BusEntry &m : matching) {
+        // an earlier handler may have removed this one
+        bool still_listening = std::any_of(listeners.begin(), listeners.end(), [&](const BusEntry &l) {
+            return l.id == m.id && l.value == m.value && l.fn == m.fn;
+        });
+        if (!still_listening)
+            continue;
+        if (m.immediate)
+            m.invoke(m.fn, id, value, timestamp);
+        else
+            Spawn([m, id, value, timestamp] { m.invoke(m.fn, id, value, timestamp); });
+    }
+
+    // like CODAL's scheduler_event(), every fiber waiting for the event becomes runnable
+    for (auto w = waiters.begin(); w != waiters.end();) {
+        if ((w->id == 0 || w->id == id) && (w->value == 0 || w->value == value)) {
+            w->fiber->sleeping = false;
+            runnable.push_back(w->fiber);
+            w = waiters.erase(w);
+        } else {
+            ++w;
+        }
+    }
+}
+
+int Node::Send(const uint8_t *buf, int len)
+{
+    if (buf == nullptr || len < 0 || len > RADIO_MAX_PACKET_SIZE || !radio_enabled)
+        return DEVICE_INVALID_PARAMETER;
+    Datagram d = {};
+    d.group = group;
+    d.len = len;
+    memcpy(d.data, buf, len);
+    sim_time_t sent = net.Transmit(*this, d);
+    // interrupt handlers cannot block, their send() just queues the frame
+    if (current != nullptr)
+        WaitUntil(sent);
+    return DEVICE_OK;
+}
+
+int Node::Recv(uint8_t *buf, int len)
+{
+    if (buf == nullptr || rx_queue.empty() || len < 0)
+        return DEVICE_INVALID_PARAMETER;
+    Datagram d = rx_queue.front();
+    rx_queue.pop_front();
+    int l = std::min<int>(len, d.len);
+    memcpy(buf, d.data, l);
+    return l;
+}
+
+void Node::Deliver(const Datagram &d)
+{
+    if (!radio_enabled || d.group != group)
+        return;
+    if (radio_stamp)
+        radio_stamp(LocalTimeUs(d.raised));
+    if (rx_queue.size() >= RADIO_RX_BUFFERS) {
+        net.packets_lost++;
+        return;
+    }
+    net.packets_delivered++;
+    rx_queue.push_back(d);
+    Fire(MICROBIT_ID_RADIO, MICROBIT_RADIO_EVT_DATAGRAM, LocalTimeUs());
+}
+
+int Node::Random(int max)
+{
+    if (max <= 0)
+        return DEVICE_INVALID_PARAMETER;
+    return std::uniform_int_distribution<int>(0, max - 1)(rng);
+}
+
+void Node::Print(const char *fmt, va_list args)
+{
+    char line[256];
+    int len = vsnprintf(line, sizeof(line), fmt, args);
+    Write((const uint8_t *)line, std::min<int>(len, sizeof(line) - 1));
+    if (!net.config.verbose)
+        return;
+    printf("[%10.3f ms] node %3d: %s", net.now / 1000.0, index, line);
+}
+
+void Node::Write(const uint8_t *buf, int len)
+{
+    serial_out.insert(serial_out.end(), buf, buf + len);
+}
+
+void Node::ThreadMain()
+{
+    current_network = &net;
+    current_node = this;
+
+    std::unique_lock<std::mutex> lock(net.mutex);
+    while (true) {
+        cv.wait(lock, [this] { return baton; });
+        baton = false;
+        if (shutdown)
+            break;
+        Slice();
+        net.returned = true;
+        net.cv.notify_one();
+    }
+    net.returned = true;
+    net.cv.notify_one();
+}
+
+void Node::Slice()
+{
+    while (!inbox.empty()) {
+        Datagram d = inbox.front();
+        inbox.pop_front();
+        Deliver(d);
+    }
+
+    while (!runnable.empty()) {
+        Fiber *f = runnable.front();
+        runnable.pop_front();
+        current = f;
+        swapcontext(&scheduler_ctx, &f->ctx);
+        current = nullptr;
+
+        if (f->done) {
+            if (f == main_fiber)
+                net.mains_running--;
+            // keep the Fiber itself, stale wake-ups may still point at it
+            f->stack.reset();
+        }
+    }
+}
+
+// -------------------------------------------------------------------
+
+Network::Network(const NetworkConfig &c) : config(c), rng(c.seed)
+{
+    current_network = this;
+}
+
+Network::~Network() = default;
+
+int Network::AddNode(const NodeConfig &c, std::function<void()> main)
+{
+    int index = nodes.size();
+    nodes.push_back(std::make_unique<Node>(*this, index, c, std::move(main)));
+    Node &node = *nodes.back();
+    node.Schedule(node.main_fiber, c.boot_us);
+    mains_running++;
+    return index;
+}
+
+void Network::Push(Event e)
+{
+    e.seq = seq++;
+    events.push(e);
+}
+
+sim_time_t Network::Transmit(Node &from, const Datagram &d)
+{
+    packets_sent++;
+    std::uniform_real_distribution<double> coin(0, 1);
+    std::uniform_int_distribution<sim_time_t> jitter(0, config.jitter_us / 2);
+    std::uniform_int_distribution<sim_time_t> dispatch(0, config.dispatch_us);
+
+    sim_time_t start = std::max(now + config.latency_us / 2 + jitter(rng), from.tx_busy_until);
+    sim_time_t end = start + RADIO_BYTE_US * (d.len + RADIO_FRAME_OVERHEAD);
+    from.tx_busy_until = end;
+    airtime_us += end - start;
+
+    size_t frame = corrupted.size();
+    corrupted.push_back(false);
+    if (config.collisions) {
+        on_air.erase(std::remove_if(on_air.begin(), on_air.end(), [this](const OnAir &a) { return a.end < now; }),
+                     on_air.end());
+        for (const OnAir &a : on_air) {
+            if (a.start < end && start < a.end) {
+                corrupted[a.frame] = true;
+                corrupted[frame] = true;
+            }
+        }
+        on_air.push_back({start, end, frame});
+    }
+
+    for (auto &n : nodes) {
+        if (n.get() == &from)
+            continue;
+        if (config.loss > 0 && coin(rng) < config.loss) {
+            packets_lost++;
+            continue;
+        }
+        Event e = {};
+        e.kind = DELIVER;
+        e.node = n.get();
+        e.frame = frame;
+        e.datagram = d;
+        e.datagram.raised = end + config.latency_us - config.latency_us / 2 + jitter(rng);
+        e.at = std::max(e.datagram.raised + dispatch(rng), n->dispatched_until);
+        n->dispatched_until = e.at;
+        Push(e);
+    }
+    if (config.return_us > 0)
+        return end + std::uniform_int_distribution<sim_time_t>(0, config.return_us)(rng);
+    return end;
+}
+
+void Network::Handoff(Node &node)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    node.baton = true;
+    node.cv.notify_one();
+    cv.wait(lock, [this] { return returned; });
+    returned = false;
+}
+
+bool Network::Run(sim_time_t until)
+{
+    for (auto &n : nodes)
+        n->thread = std::thread(&Node::ThreadMain, n.get());
+
+    while (mains_running > 0 && !events.empty() && events.top().at <= until) {
+        Event e = events.top();
+        events.pop();
+        now = e.at;
+
+        if (e.kind == WAKE) {
+            if (!e.fiber->sleeping || e.fiber->wake_token != e.token)
+                continue;
+            e.fiber->sleeping = false;
+            e.node->runnable.push_back(e.fiber);
+        } else {
+            if (corrupted[e.frame]) {
+                packets_collided++;
+                continue;
+            }
+            e.node->inbox.push_back(e.datagram);
+        }
+        Handoff(*e.node);
+    }
+    bool finished = mains_running == 0;
+
+    for (auto &n : nodes) {
+        n->shutdown = true;
+        Handoff(*n);
+        n->thread.join();
+    }
+    return finished;
+}
+}
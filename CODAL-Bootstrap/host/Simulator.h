@@ -0,0 +1,286 @@
+#ifndef SIMULATOR_H
+#define SIMULATOR_H
+
+#include <stdarg.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <ucontext.h>
+
+/*
+    Main idea:
+        Run N virtual micro:bits inside one process so that the firmware in ../source can be
+        exercised without hardware.
+
+        1) Every node gets its own OS thread, so the firmware's per-device globals (declared
+           NODE_LOCAL, i.e. thread_local on the host) are private to that node
+        2) Fibers of one node are ucontexts switched on that node's thread, which mirrors the
+           cooperative CODAL scheduler
+        3) Only one node thread runs at a time. The network owns a single queue of timed events
+           (fiber wake-ups and radio deliveries) and hands the baton to whichever node the next
+           event belongs to, so a run is fully deterministic for a given seed
+
+    Time:
+        sim_time_t is the "true" time in microseconds. Each node sees its own local clock
+            local_us = clock_offset_us + t * (1 + drift_ppm / 1e6)
+        which is what systemTime() and friends report on that node.
+
+    Radio:
+        A frame goes on air after the sender's stack latency (half of latency_us plus up to half
+        of jitter_us, shared by every receiver), occupies the channel for its airtime at 1Mbps,
+        and is handed to each receiver after that receiver's own stack latency (the other halves).
+        That is when the receiver's radio takes the frame in and SetRadioStamp()'s handler gets its
+        time, as the PPI capture of source/RadioStamp.h does. The datagram event is raised and
+        stamped up to dispatch_us later, as CODAL raises it from the idle callback.
+        Frames from one node are serialised and send() blocks the calling fiber until its frame
+        is out, like MicroBitRadio::send, and up to return_us longer: the interrupt and the
+        scheduler stand between the end of the frame and the sender reading its clock. With collisions enabled, frames overlapping on air are
+        lost for everyone.
+*/
+
+namespace Sim {
+typedef int64_t sim_time_t;
+
+const int RADIO_MAX_PACKET_SIZE = 32;
+const int RADIO_RX_BUFFERS = 4;
+const int RADIO_FRAME_OVERHEAD = 12;    // preamble, address, header and CRC bytes
+const sim_time_t RADIO_BYTE_US = 8;     // 1Mbps
+
+struct NetworkConfig
+{
+    sim_time_t latency_us = 300;    // fixed one-way stack latency, on top of the airtime
+    sim_time_t jitter_us = 200;     // uniform extra stack latency in [0, jitter_us]
+    sim_time_t dispatch_us = 0;     // uniform delay in [0, dispatch_us] from event to handler
+    sim_time_t return_us = 0;       // uniform delay in [0, return_us] from frame out to send() returning
+    double loss = 0.0;              // independent drop probability per receiver
+    bool collisions = true;         // drop frames that overlap on air
+    uint64_t seed = 1;
+    bool verbose = false;           // echo uBit->serial.printf output to stdout
+};
+
+struct NodeConfig
+{
+    uint32_t serial = 0;
+    sim_time_t boot_us = 0;         // true time at which the node's main() starts
+    sim_time_t clock_offset_us = 0; // local clock reading at true time 0, must be >= 0
+    double drift_ppm = 0;
+};
+
+struct Datagram
+{
+    uint8_t group;
+    uint8_t len;
+    uint8_t data[RADIO_MAX_PACKET_SIZE];
+    sim_time_t raised;              // true time the receiver's radio took the frame in
+};
+
+class Network;
+
+struct Fiber
+{
+    ucontext_t ctx;
+    std::unique_ptr<uint8_t[]> stack;
+    std::function<void()> entry;
+    uint64_t wake_token = 0;
+    bool sleeping = false;
+    bool done = false;
+};
+
+class Node
+{
+public:
+    Node(Network &net, int index, const NodeConfig &config, std::function<void()> main);
+    ~Node();
+
+    int Index() const { return index; }
+    const NodeConfig &Config() const { return config; }
+    sim_time_t LocalTimeUs(sim_time_t t) const;
+    sim_time_t LocalTimeUs() const;
+
+    // Fibers
+    void Sleep(sim_time_t local_us);
+    void Yield();
+    void Spawn(std::function<void()> entry);
+    bool InFiber() const { return current != nullptr; }
+    // blocks the calling fiber until Fire() raises a matching event, id/value 0 match any
+    void WaitForEvent(uint16_t id, uint16_t value);
+
+    // Message bus, id/value 0 act as wildcards. `invoke` calls `fn` with the event, which keeps
+    // this class independent of the MicroBitEvent type. `timestamp` is the local time in us the
+    // event was raised at
+    typedef void (*invoke_t)(void *fn, uint16_t id, uint16_t value, sim_time_t timestamp);
+    void Listen(uint16_t id, uint16_t value, invoke_t invoke, void *fn, bool immediate);
+    void Ignore(uint16_t id, uint16_t value, void *fn);
+    void Fire(uint16_t id, uint16_t value, sim_time_t timestamp);
+
+    // Radio
+    void EnableRadio() { radio_enabled = true; }
+    void DisableRadio() { radio_enabled = false; }
+    void SetGroup(uint8_t g) { group = g; }
+    int Send(const uint8_t *buf, int len);
+    int Recv(uint8_t *buf, int len);
+    // frames received and not taken yet
+    int RxQueued() const { return (int)rx_queue.size(); }
+    // `stamp` gets the local time each frame of the group was received at, even one the receive
+    // buffers have no room for
+    void SetRadioStamp(void (*stamp)(uint64_t)) { radio_stamp = stamp; }
+
+    int Random(int max);
+
+    // Serial port, what the node wrote is kept for the harness
+    void Print(const char *fmt, va_list args);
+    void Write(const uint8_t *buf, int len);
+    const std::vector<uint8_t> &SerialOutput() const { return serial_out; }
+
+private:
+    friend class Network;
+
+    struct BusEntry
+    {
+        uint16_t id;
+        uint16_t value;
+        invoke_t invoke;
+        void *fn;
+        bool immediate;
+    };
+
+    struct Waiter
+    {
+        Fiber *fiber;
+        uint16_t id;
+        uint16_t value;
+    };
+
+    void ThreadMain();
+    void Slice();
+    void Deliver(const Datagram &d);
+    void Schedule(Fiber *f, sim_time_t at);
+    void WaitUntil(sim_time_t at);
+    static void FiberEntry(unsigned int lo, unsigned int hi);
+
+    Network &net;
+    int index;
+    NodeConfig config;
+    std::mt19937 rng;
+
+    // scheduling
+    std::thread thread;
+    std::condition_variable cv;
+    bool baton = false;
+    bool shutdown = false;
+    ucontext_t scheduler_ctx;
+    std::vector<std::unique_ptr<Fiber>> fibers;
+    std::deque<Fiber *> runnable;
+    Fiber *current = nullptr;
+    Fiber *main_fiber = nullptr;
+
+    // devices
+    std::vector<BusEntry> listeners;
+    std::vector<Waiter> waiters;
+    std::deque<Datagram> inbox;
+    std::deque<Datagram> rx_queue;
+    bool radio_enabled = false;
+    void (*radio_stamp)(uint64_t) = nullptr;
+    uint8_t group = 0;
+    sim_time_t tx_busy_until = 0;
+    sim_time_t dispatched_until = 0;    // handlers see datagrams in the order they were raised
+    std::vector<uint8_t> serial_out;
+};
+
+class Network
+{
+public:
+    explicit Network(const NetworkConfig &config);
+    ~Network();
+
+    /*
+        Adds a node which starts running main at config.boot_us
+    */
+    int AddNode(const NodeConfig &config, std::function<void()> main);
+
+    /*
+        Post:
+            runs the simulation until every node's main() has returned or the true time
+            reaches `until`, returns true in the former case
+    */
+    bool Run(sim_time_t until);
+
+    sim_time_t Now() const { return now; }
+    size_t Size() const { return nodes.size(); }
+    Node &At(int i) { return *nodes[i]; }
+    const NetworkConfig &Config() const { return config; }
+
+    uint64_t packets_sent = 0;
+    uint64_t airtime_us = 0;        // summed over every frame sent, overhead included
+    uint64_t packets_delivered = 0;
+    uint64_t packets_lost = 0;
+    uint64_t packets_collided = 0;
+
+private:
+    friend class Node;
+
+    enum EventKind { WAKE, DELIVER };
+
+    struct Event
+    {
+        sim_time_t at;
+        uint64_t seq;
+        EventKind kind;
+        Node *node;
+        Fiber *fiber;
+        uint64_t token;
+        size_t frame;
+        Datagram datagram;
+
+        bool operator>(const Event &o) const { return at != o.at ? at > o.at : seq > o.seq; }
+    };
+
+    void Push(Event e);
+    // returns when the sender's send() returns
+    sim_time_t Transmit(Node &from, const Datagram &d);
+    void Handoff(Node &node);
+
+    NetworkConfig config;
+    std::mt19937_64 rng;
+    sim_time_t now = 0;
+    uint64_t seq = 0;
+    int mains_running = 0;
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event>> events;
+    std::vector<std::unique_ptr<Node>> nodes;
+
+    struct OnAir
+    {
+        sim_time_t start, end;
+        size_t frame;
+    };
+    std::vector<OnAir> on_air;
+    std::vector<bool> corrupted;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool returned = false;
+};
+
+/*
+    Accessors usable from code running on a node (firmware, handlers, fibers)
+*/
+Network &CurrentNetwork();
+Node &CurrentNode();
+sim_time_t Now();
+
+/*
+    Returns the p-th percentile (0 <= p <= 100) of the values, by nearest rank
+*/
+double Percentile(std::vector<double> values, double p);
+}
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef SYNTHETIC_SONG_H
+#define SYNTHETIC_SONG_H
+
+#include "PackedSong.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+/*
+    Random but song-like parts for the host benchmarks: notes on a scale, durations in multiples
+    of a sixteenth at 120 bpm, occasional rests and long holds. Everything is on the 5 ms grid,
+    so packing loses nothing.
+*/
+
+namespace SyntheticSong {
+
+inline int note_of_period(int period_us)
+{
+    for (int n = 1; n < 128; n++)
+        if ((int)Song::PERIOD_US[n] == period_us)
+            return n;
+    return 0;
+}
+
+inline int velocity_level(int velocity)
+{
+    int best = 0;
+    for (int i = 1; i < 8; i++)
+        if (abs(Song::VELOCITY[i] - velocity) < abs(Song::VELOCITY[best] - velocity))
+            best = i;
+    return best;
+}
+
+/*
+    Same as pack_events() in tools/generate-music.py, except that the events here are already
+    on the unit grid
+*/
+inline std::vector<uint8_t> Pack(const std::vector<music_event_t> &events, int unit_ms)
+{
+    std::vector<uint8_t> data;
+    for (const music_event_t &e : events) {
+        int pitch = note_of_period(e.period_us);
+        int level = pitch ? velocity_level(e.velocity) : 0;
+        uint32_t units = e.duration_ms / unit_ms;
+        uint32_t field = units < Song::LONG_DURATION ? units : Song::LONG_DURATION;
+        uint16_t word = pitch | (level << Song::PITCH_BITS) | (field << Song::DURATION_SHIFT);
+        data.push_back(word & 0xff);
+        data.push_back(word >> 8);
+        if (field == Song::LONG_DURATION) {
+            data.push_back(units & 0xff);
+            data.push_back(units >> 8);
+        }
+    }
+    return data;
+}
+
+inline std::vector<music_event_t> Make(int count, uint64_t seed)
+{
+    std::mt19937_64 rng(seed);
+    const int scale[] = {0, 2, 4, 5, 7, 9, 11};
+    const int sixteenth_ms = 125;
+    std::vector<music_event_t> events;
+    int degree = 14;
+    while ((int)events.size() < count) {
+        int r = rng() % 100;
+        int length = r < 50 ? 2 : r < 80 ? 1 : r < 95 ? 4 : 16;
+        if (rng() % 10 == 0) {
+            events.push_back({0, length * sixteenth_ms, 0});
+            continue;
+        }
+        degree = std::max(0, std::min(27, degree + (int)(rng() % 5) - 2));
+        int note = 48 + 12 * (degree / 7) + scale[degree % 7];
+        int velocity = Song::VELOCITY[3 + rng() % 4];
+        events.push_back({(int)Song::PERIOD_US[note], length * sixteenth_ms, velocity});
+    }
+    return events;
+}
+}
+
+#endif
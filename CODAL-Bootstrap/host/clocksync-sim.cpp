@@ -0,0 +1,491 @@
+#include "MicroBit.h"
+#include "Synchronization.h"
+#include "Telemetry.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <set>
+#include <string>
+#include <vector>
+
+/*
+    Benchmark for ClockSync on simulated ensembles.
+
+    Every node runs
+        ClockSync::Init(uBit); ClockSync::Sync(mode);
+    like main.cpp does (plus ClockSync::StartBackgroundSync() with --background), and records when each step finished together with the difference
+    between its ClockSync::SystemTime() and the master's local clock at that moment. The master
+    is the node with the lowest serial, which is what master_selection agrees on. The master's
+    barrier is reported by the time it left the followers (lead), the UNBLOCKs it sent and
+    the followers that never acknowledged it. depth is the most hops between the master and a
+    node, est the error the nodes expect of their clocks (ClockSync::GetTreeStats()), to compare
+    with the measured |offset|. Nodes whose ClockSync::Rank() is not their place in
+    serial order, or whose ClockSync::EnsembleSize() is not n, are counted as misranked. The election is not told n unless --expected is given.
+
+    Usage:
+        clocksync-sim [--nodes 3,10,30,100] [--trials 5] [--mode sequential|broadcast|tree|rbs]
+                      [--fanout 8] [--samples 8] [--keep 4]
+                      [--latency-us 300] [--jitter-us 200] [--dispatch-us 0] [--return-us 0] [--loss 0.0]
+                      [--no-collisions]
+                      [--max-offset-ms 10000] [--max-drift-ppm 50]
+                      [--boot-spread-ms 200] [--hold-ms 0] [--expected] [--background] [--async] [--timeout-s 120]
+                      [--kill-master-ms 0] [--reboot-ms 0] [--reboot-rank 1] [--reboot-down-ms 1000]
+                      [--silent-rank -1] [--seed 1] [--verbose] [--telemetry PREFIX]
+
+    --return-us makes send() return up to that long after the frame is out, so the times of
+    departure PTP reads are late by a random amount; --mode rbs reads none and should not mind.
+
+    --async starts the sync with ClockSync::SyncAsync() instead and keeps the node's main fiber
+    waking every millisecond until ClockSync::PollSync() says it is done, as an application
+    that goes on with its own work would; the sync is timed by the callback.
+
+    With --hold-ms the nodes keep running after Sync() and the error is measured again at the
+    end. SystemTime() is sampled every 10 ms meanwhile, the smallest step between samples shows
+    whether background corrections ever made it go backwards.
+
+    --kill-master-ms T switches the master's radio off T ms into the hold, as a brown-out would
+    (use with --background and a longer --hold-ms). The error after the hold is still measured
+    against the old master's clock, which keeps running, so it shows whether the new master
+    carried on the timebase. gap is the longest a follower went without a SYNC across the
+    handover, spread how far apart the survivors' clocks are after the hold (largest minus
+    smallest error of a trial), split the trials whose survivors did not all end up with the
+    same master.
+
+    --reboot-ms T resets the node of rank --reboot-rank (1) T ms into the hold: it drops off the
+    air for --reboot-down-ms, starts again from ClockSync::Init() on a fresh MicroBit and calls
+    ClockSync::Join() if ClockSync::EnsembleRunning() (use with --background, the master answers
+    JOINs from its background fiber). rejoin is the time from the restart until Join()
+    returned, |offset| the error right then, joined the reboots that made it back.
+
+    --silent-rank R switches the radio of the node of rank R off once Init() has returned, as if
+    it died just before Sync(); 0 is the master. partial counts the nodes whose Sync() returned
+    SYNC_PARTIAL, having left out a silent node or given up on their source. The silent node
+    itself is left out of the |offset| figures.
+
+    --telemetry PREFIX has every node call Telemetry::Dump() at the end and writes what each
+    node sent over serial to PREFIX-<nodes>-<seed>-<node>.log, for tools/telemetry.py.
+*/
+
+namespace {
+
+struct Options
+{
+    std::vector<int> nodes = {3, 10, 30, 100};
+    int trials = 5;
+    ClockSync::SyncMode mode = ClockSync::SEQUENTIAL_SYNC;
+    int fanout = ClockSync::TREE_FANOUT;
+    int samples = 8;
+    int keep = 4;
+    Sim::NetworkConfig net;
+    double max_offset_ms = 10000;
+    double max_drift_ppm = 50;
+    double boot_spread_ms = 200;
+    double hold_ms = 0;
+    double kill_master_ms = 0;
+    double reboot_ms = 0;
+    int reboot_rank = 1;
+    double reboot_down_ms = 1000;
+    int silent_rank = -1;
+    bool background = false;
+    bool expected = false;
+    bool async = false;
+    double timeout_s = 120;
+    std::string telemetry;
+};
+
+struct NodeResult
+{
+    Sim::sim_time_t init_done = -1;
+    Sim::sim_time_t sync_done = -1;
+    int rank = -1;
+    int members = 0;
+    int rounds = 0;
+    ClockSync::BarrierStats barrier = {};
+    ClockSync::TreeStats tree = {};
+    ClockSync::FailoverStats failover = {};
+    bool rebooted = false;
+    bool joined = false;
+    double rejoin_ms = 0;
+    double rejoin_error_ms = 0;
+    double error_ms = 0;
+    double hold_error_ms = 0;
+    int32_t min_step_ms = 0;
+    bool partial = false;
+};
+
+struct TrialResult
+{
+    std::vector<NodeResult> nodes;
+    int master;
+    std::vector<uint32_t> serials;
+    Sim::sim_time_t last_boot;
+    uint64_t packets;
+    uint64_t airtime_us;
+};
+
+// when the calling node's SyncAsync() finished, see --async
+thread_local Sim::sim_time_t synced_at;
+
+void on_synced()
+{
+    synced_at = Sim::Now();
+}
+
+/*
+    Returns SystemTime() - master's local clock, in ms, for the calling node
+*/
+double clock_error_ms(int master)
+{
+    Sim::sim_time_t ref_us = Sim::CurrentNetwork().At(master).LocalTimeUs();
+    return (int64_t)(ClockSync::SystemTime() - (ClockSync::timestamp_t)ref_us) / 1000.0;
+}
+
+/*
+    Stands in for a reset of the calling node, see --reboot-ms
+*/
+void reboot(std::shared_ptr<MicroBit> &uBit, const Options &opt, int master, NodeResult *r)
+{
+    // the barrier figures are of the first boot
+    r->barrier = ClockSync::GetBarrierStats();
+    ClockSync::StopBackgroundSync();
+    uBit->radio.disable();
+    uBit->sleep(opt.reboot_down_ms);
+
+    Sim::sim_time_t restart = Sim::Now();
+    uBit = std::make_shared<MicroBit>();
+    uBit->init();
+    ClockSync::Init(uBit);
+    r->rebooted = true;
+    r->joined = ClockSync::EnsembleRunning() && ClockSync::Join();
+    r->rejoin_ms = (Sim::Now() - restart) / 1000.0;
+    r->rejoin_error_ms = clock_error_ms(master);
+    if (opt.background)
+        ClockSync::StartBackgroundSync();
+}
+
+TrialResult run_trial(const Options &opt, int n, uint64_t seed)
+{
+    Sim::NetworkConfig net_config = opt.net;
+    net_config.seed = seed;
+    Sim::Network net(net_config);
+    std::mt19937_64 rng(seed);
+    std::uniform_real_distribution<double> unit(0, 1);
+
+    TrialResult trial;
+    trial.nodes.resize(n);
+    trial.last_boot = 0;
+
+    std::set<uint32_t> serials;
+    while ((int)serials.size() < n)
+        serials.insert((uint32_t)rng());
+    std::vector<uint32_t> shuffled(serials.begin(), serials.end());
+    std::shuffle(shuffled.begin(), shuffled.end(), rng);
+
+    trial.master = 0;
+    for (int i = 0; i < n; i++) {
+        Sim::NodeConfig c;
+        c.serial = shuffled[i];
+        c.boot_us = (Sim::sim_time_t)(unit(rng) * opt.boot_spread_ms * 1000);
+        c.clock_offset_us = (Sim::sim_time_t)(unit(rng) * opt.max_offset_ms * 1000);
+        c.drift_ppm = (2 * unit(rng) - 1) * opt.max_drift_ppm;
+        trial.last_boot = std::max(trial.last_boot, c.boot_us);
+        if (c.serial < shuffled[trial.master])
+            trial.master = i;
+
+        NodeResult *r = &trial.nodes[i];
+        int *master = &trial.master;
+        net.AddNode(c, [r, n, master, &opt] {
+            auto uBit = std::make_shared<MicroBit>();
+            uBit->init();
+            ClockSync::SetSampleWindow(opt.samples, opt.keep);
+            ClockSync::SetTreeFanout(opt.fanout);
+            ClockSync::Init(uBit, opt.expected ? n : 0);
+            r->init_done = Sim::Now();
+            r->rank = ClockSync::Rank();
+            r->members = ClockSync::EnsembleSize();
+            r->rounds = ClockSync::ElectionRounds();
+            if (r->rank == opt.silent_rank)
+                uBit->radio.disable();
+            if (opt.async) {
+                ClockSync::SyncAsync(on_synced, opt.mode);
+                while (ClockSync::PollSync() < ClockSync::SYNC_DONE)
+                    uBit->sleep(1);
+                r->sync_done = synced_at;
+            } else {
+                ClockSync::Sync(opt.mode);
+                r->sync_done = Sim::Now();
+            }
+            r->partial = ClockSync::PollSync() == ClockSync::SYNC_PARTIAL;
+            r->error_ms = clock_error_ms(*master);
+            r->tree = ClockSync::GetTreeStats();
+            if (opt.background)
+                ClockSync::StartBackgroundSync();
+            if (opt.hold_ms > 0) {
+                ClockSync::timestamp_t last = ClockSync::SystemTime();
+                r->min_step_ms = INT32_MAX;
+                for (uint32_t held = 0; held < opt.hold_ms; held += 10) {
+                    if (opt.kill_master_ms > 0 && r->rank == 0 && held == (uint32_t)opt.kill_master_ms / 10 * 10)
+                        uBit->radio.disable();
+                    if (opt.reboot_ms > 0 && r->rank == opt.reboot_rank && held == (uint32_t)opt.reboot_ms / 10 * 10) {
+                        reboot(uBit, opt, *master, r);
+                        last = ClockSync::SystemTime();
+                    }
+                    uBit->sleep(10);
+                    ClockSync::timestamp_t now = ClockSync::SystemTime();
+                    r->min_step_ms = std::min(r->min_step_ms, (int32_t)((int64_t)(now - last) / 1000));
+                    last = now;
+                }
+                r->hold_error_ms = clock_error_ms(*master);
+                r->failover = ClockSync::GetFailoverStats();
+            }
+            ClockSync::StopBackgroundSync();
+            // the master repeats the barrier for a while after it has returned
+            uBit->sleep(1000);
+            if (!r->rebooted)
+                r->barrier = ClockSync::GetBarrierStats();
+            if (!opt.telemetry.empty())
+                Telemetry::Dump(uBit);
+        });
+    }
+
+    net.Run((Sim::sim_time_t)(opt.timeout_s * 1e6));
+    for (int i = 0; i < n && !opt.telemetry.empty(); i++) {
+        std::string path = opt.telemetry + "-" + std::to_string(n) + "-" + std::to_string(seed) + "-" + std::to_string(i) + ".log";
+        FILE *f = fopen(path.c_str(), "wb");
+        if (!f) {
+            perror(path.c_str());
+            exit(1);
+        }
+        const std::vector<uint8_t> &out = net.At(i).SerialOutput();
+        fwrite(out.data(), 1, out.size(), f);
+        fclose(f);
+    }
+    trial.serials = shuffled;
+    trial.packets = net.packets_sent;
+    trial.airtime_us = net.airtime_us;
+    return trial;
+}
+
+void report(const Options &opt, int n, const std::vector<TrialResult> &trials)
+{
+    std::vector<double> rounds, lead_ms, elect_ms, sync_ms, total_ms, err_ms, est_ms, hold_err_ms, gap_ms, spread_ms, rejoin_ms, rejoin_err_ms;
+    int depth = 0, split = 0, joined = 0;
+    int done = 0, total = 0, misranked = 0, partial = 0;
+    int32_t min_step_ms = INT32_MAX;
+    double packets = 0, airtime_ms = 0, barrier_sent = 0;
+    int missing = 0;
+    for (const TrialResult &t : trials) {
+        packets += t.packets;
+        airtime_ms += t.airtime_us / 1000.0;
+        std::vector<uint32_t> sorted = t.serials;
+        std::sort(sorted.begin(), sorted.end());
+        std::set<int> masters;
+        double low = INFINITY, high = -INFINITY;
+        for (int i = 0; i < n; i++) {
+            const NodeResult &r = t.nodes[i];
+            total++;
+            // the part a node plays is chosen by its rank, it has to be its place in serial order
+            if (r.init_done >= 0 && (r.members != n || r.rank != std::lower_bound(sorted.begin(), sorted.end(), t.serials[i]) - sorted.begin()))
+                misranked++;
+            if (r.sync_done < 0)
+                continue;
+            done++;
+            partial += r.partial;
+            rounds.push_back(r.rounds);
+            elect_ms.push_back((r.init_done - t.last_boot) / 1000.0);
+            sync_ms.push_back((r.sync_done - r.init_done) / 1000.0);
+            total_ms.push_back((r.sync_done - t.last_boot) / 1000.0);
+            if (r.rebooted) {
+                joined += r.joined;
+                if (r.joined) {
+                    rejoin_ms.push_back(r.rejoin_ms);
+                    rejoin_err_ms.push_back(std::fabs(r.rejoin_error_ms));
+                }
+            }
+            if (i == t.master) {
+                lead_ms.push_back(r.barrier.lead_us / 1000.0);
+                barrier_sent += r.barrier.transmissions;
+                missing += r.barrier.missing;
+                continue;
+            }
+            if (r.rank == opt.silent_rank)
+                continue;
+            err_ms.push_back(std::fabs(r.error_ms));
+            est_ms.push_back(r.tree.error_us / 1000.0);
+            depth = std::max(depth, r.tree.depth);
+            if (opt.hold_ms > 0) {
+                hold_err_ms.push_back(std::fabs(r.hold_error_ms));
+                min_step_ms = std::min(min_step_ms, r.min_step_ms);
+            }
+            masters.insert(r.failover.master);
+            low = std::min(low, r.hold_error_ms);
+            high = std::max(high, r.hold_error_ms);
+            if (r.failover.gap_us > 0)
+                gap_ms.push_back(r.failover.gap_us / 1000.0);
+        }
+        split += masters.size() > 1;
+        if (high >= low)
+            spread_ms.push_back(high - low);
+    }
+
+    printf("%5d %4d/%-5d %6.0f %4.0f %9.0f %9.0f %9.0f %9.0f %9.0f   %7.2f %7.2f %7.2f %7.2f",
+           n, done, total, Sim::Percentile(rounds, 50), Sim::Percentile(rounds, 100),
+           Sim::Percentile(elect_ms, 50), Sim::Percentile(elect_ms, 90),
+           Sim::Percentile(sync_ms, 50), Sim::Percentile(sync_ms, 90),
+           Sim::Percentile(total_ms, 100),
+           Sim::Percentile(err_ms, 50), Sim::Percentile(err_ms, 90),
+           Sim::Percentile(err_ms, 99), Sim::Percentile(err_ms, 100));
+    if (opt.hold_ms > 0)
+        printf("   %7.2f %7.2f %4d", Sim::Percentile(hold_err_ms, 50), Sim::Percentile(hold_err_ms, 99),
+               (int)min_step_ms);
+    if (opt.kill_master_ms > 0)
+        printf("   %7.0f %7.0f %7.2f %7.2f %5d", Sim::Percentile(gap_ms, 50), Sim::Percentile(gap_ms, 100),
+               Sim::Percentile(spread_ms, 50), Sim::Percentile(spread_ms, 100), split);
+    if (opt.reboot_ms > 0)
+        printf("   %7.0f %7.0f %7.2f %7.2f %4d/%-3d", Sim::Percentile(rejoin_ms, 50), Sim::Percentile(rejoin_ms, 100),
+               Sim::Percentile(rejoin_err_ms, 50), Sim::Percentile(rejoin_err_ms, 100), joined, (int)trials.size());
+    printf("   %5d %7.2f %7.2f", depth, Sim::Percentile(est_ms, 50), Sim::Percentile(est_ms, 100));
+    printf("   %6.0f %6.1f %7d   %8.0f %7.0f %9d %7d\n", Sim::Percentile(lead_ms, 50), barrier_sent / trials.size(), missing,
+           packets / trials.size(), airtime_ms / trials.size(), misranked, partial);
+}
+
+std::vector<int> parse_list(const char *s)
+{
+    std::vector<int> out;
+    while (*s) {
+        out.push_back(atoi(s));
+        const char *comma = strchr(s, ',');
+        if (comma == nullptr)
+            break;
+        s = comma + 1;
+    }
+    return out;
+}
+
+void usage()
+{
+    fprintf(stderr, "usage: clocksync-sim [--nodes 3,10,30,100] [--trials N] [--mode sequential|broadcast|tree|rbs]\n"
+                    "                     [--fanout N] [--samples N] [--keep N]\n"
+                    "                     [--latency-us US] [--jitter-us US] [--dispatch-us US] [--return-us US] [--loss P]\n"
+                    "                     [--no-collisions]\n"
+                    "                     [--max-offset-ms MS] [--max-drift-ppm PPM]\n"
+                    "                     [--boot-spread-ms MS] [--hold-ms MS] [--expected] [--background] [--async]\n"
+                    "                     [--timeout-s S] [--kill-master-ms MS] [--seed N]\n"
+                    "                     [--reboot-ms MS] [--reboot-rank R] [--reboot-down-ms MS] [--silent-rank R]\n"
+                    "                     [--verbose] [--telemetry PREFIX]\n");
+    exit(1);
+}
+}
+
+int main(int argc, char **argv)
+{
+    Options opt;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--verbose") {
+            opt.net.verbose = true;
+            continue;
+        }
+        if (arg == "--expected") {
+            opt.expected = true;
+            continue;
+        }
+        if (arg == "--background") {
+            opt.background = true;
+            continue;
+        }
+        if (arg == "--async") {
+            opt.async = true;
+            continue;
+        }
+        if (arg == "--no-collisions") {
+            opt.net.collisions = false;
+            continue;
+        }
+        if (i + 1 >= argc)
+            usage();
+        const char *v = argv[++i];
+        if (arg == "--nodes")
+            opt.nodes = parse_list(v);
+        else if (arg == "--trials")
+            opt.trials = atoi(v);
+        else if (arg == "--samples")
+            opt.samples = atoi(v);
+        else if (arg == "--keep")
+            opt.keep = atoi(v);
+        else if (arg == "--mode" && strcmp(v, "broadcast") == 0)
+            opt.mode = ClockSync::BROADCAST_SYNC;
+        else if (arg == "--mode" && strcmp(v, "sequential") == 0)
+            opt.mode = ClockSync::SEQUENTIAL_SYNC;
+        else if (arg == "--mode" && strcmp(v, "tree") == 0)
+            opt.mode = ClockSync::TREE_SYNC;
+        else if (arg == "--mode" && strcmp(v, "rbs") == 0)
+            opt.mode = ClockSync::RBS_SYNC;
+        else if (arg == "--fanout")
+            opt.fanout = atoi(v);
+        else if (arg == "--latency-us")
+            opt.net.latency_us = atoll(v);
+        else if (arg == "--jitter-us")
+            opt.net.jitter_us = atoll(v);
+        else if (arg == "--dispatch-us")
+            opt.net.dispatch_us = atoll(v);
+        else if (arg == "--return-us")
+            opt.net.return_us = atoll(v);
+        else if (arg == "--loss")
+            opt.net.loss = atof(v);
+        else if (arg == "--max-offset-ms")
+            opt.max_offset_ms = atof(v);
+        else if (arg == "--max-drift-ppm")
+            opt.max_drift_ppm = atof(v);
+        else if (arg == "--boot-spread-ms")
+            opt.boot_spread_ms = atof(v);
+        else if (arg == "--hold-ms")
+            opt.hold_ms = atof(v);
+        else if (arg == "--kill-master-ms")
+            opt.kill_master_ms = atof(v);
+        else if (arg == "--telemetry")
+            opt.telemetry = v;
+        else if (arg == "--reboot-ms")
+            opt.reboot_ms = atof(v);
+        else if (arg == "--reboot-rank")
+            opt.reboot_rank = atoi(v);
+        else if (arg == "--reboot-down-ms")
+            opt.reboot_down_ms = atof(v);
+        else if (arg == "--silent-rank")
+            opt.silent_rank = atoi(v);
+        else if (arg == "--timeout-s")
+            opt.timeout_s = atof(v);
+        else if (arg == "--seed")
+            opt.net.seed = strtoull(v, nullptr, 10);
+        else
+            usage();
+    }
+
+    const char *modes[] = {"sequential", "broadcast", "tree", "rbs"};
+    printf("%s sync, %d/%d samples, latency %lld us, jitter %lld us, dispatch %lld us, return %lld us, loss %.3f, collisions %s, "
+           "offsets <= %.0f ms, drift <= %.0f ppm, %d trials\n",
+           modes[opt.mode], opt.keep, opt.samples, (long long)opt.net.latency_us, (long long)opt.net.jitter_us,
+           (long long)opt.net.dispatch_us, (long long)opt.net.return_us, opt.net.loss, opt.net.collisions ? "on" : "off",
+           opt.max_offset_ms, opt.max_drift_ppm, opt.trials);
+    printf("times in ms from the last node booting; |offset| is SystemTime() - master clock\n");
+    printf("nodes   done       rounds p50/max  elect p50/p90     sync p50/p90   all-done    |offset| p50/p90/p99/max");
+    if (opt.hold_ms > 0)
+        printf("   after hold p50/p99 step");
+    if (opt.kill_master_ms > 0)
+        printf("   failover gap p50/max  spread p50/max split");
+    if (opt.reboot_ms > 0)
+        printf("    rejoin p50/max  |offset| p50/max joined");
+    printf("   depth est p50/max");
+    printf("   barrier lead  sent missing   packets  air ms misranked partial\n");
+
+    for (int n : opt.nodes) {
+        std::vector<TrialResult> trials;
+        for (int t = 0; t < opt.trials; t++)
+            trials.push_back(run_trial(opt, n, opt.net.seed + t));
+        report(opt, n, trials);
+    }
+    return 0;
+}
@@ -0,0 +1,226 @@
+#include "Packet.h"
+#include "Simulator.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+/*
+    Cost of Packet.h frames against the fixed 13 byte packets ClockSync used to send,
+    FLAG | SERIAL (4) | TIMESTAMP (8), decoded into a heap allocated struct per datagram.
+
+    Encoding and decoding are timed over DELAY_RESPs, the record the master sends most of: the
+    old way one packet each, the new way batched as many to a frame as fit. The airtime of one
+    broadcast round (SYNC, FOLLOW_UP, a DELAY_REQ and a DELAY_RESP per follower) is worked out
+    from the frame sizes at the simulator's 1 Mbps, RADIO_FRAME_OVERHEAD included, with the
+    DELAY_RESPs sharing frames as they do when the followers answer close together.
+
+    Usage:
+        codec-bench [--records 100000] [--repeat 50] [--followers 3,10,30,100]
+*/
+
+namespace {
+
+constexpr Packet::Writer example_frame()
+{
+    Packet::Writer w;
+    w.Add(Packet::DelayResp{3, 0x01020304});
+    w.Add(Packet::FollowUp{0, 7, 0x1122334455667788ull, 250, 58});
+    w.Seal();
+    return w;
+}
+
+constexpr bool example_round_trip()
+{
+    Packet::Writer w = example_frame();
+    const uint8_t *data = w.Seal();
+    Packet::Reader r(data, w.Size());
+    Packet::DelayResp resp = {};
+    Packet::FollowUp follow_up = {};
+    bool ok = r.Next() && r.Get(resp) && !r.Get(follow_up) && r.Next() && r.Get(follow_up) && !r.Next();
+    return ok && resp.node == 3 && resp.arrival == 0x01020304 && follow_up.round == 7 &&
+           follow_up.departure == 0x1122334455667788ull && follow_up.error_us == 250 && follow_up.slots == 58;
+}
+
+static_assert(example_frame().Size() == Packet::HEADER_SIZE + 6 + 18);
+static_assert(example_round_trip());
+static_assert(Packet::widen(0x00000010, 0x1fffffff0ull) == 0x200000010ull);
+static_assert(Packet::widen(0xfffffff0, 0x200000010ull) == 0x1fffffff0ull);
+
+// what Synchronization.cpp did before Packet.h
+const int LEGACY_SIZE = 13;
+
+struct LegacyPacket
+{
+    uint8_t flag;
+    uint32_t serial;
+    uint64_t timestamp;
+};
+
+void legacy_encode(uint8_t *buf, uint8_t flag, uint32_t serial, uint64_t timestamp)
+{
+    buf[0] = flag;
+    buf[1] = serial >> 24;
+    buf[2] = serial >> 16;
+    buf[3] = serial >> 8;
+    buf[4] = serial;
+    for (int i = 0; i < 8; i++)
+        buf[5 + i] = timestamp >> (56 - 8 * i);
+}
+
+// kept out of line, the compiler may leave out a new/delete pair it sees both ends of
+__attribute__((noinline)) std::unique_ptr<LegacyPacket> legacy_decode(const uint8_t *buffer)
+{
+    auto packet = std::make_unique<LegacyPacket>();
+    packet->flag = buffer[0];
+    packet->serial = (buffer[1] << 24) + (buffer[2] << 16) + (buffer[3] << 8) + buffer[4];
+    packet->timestamp = 0;
+    for (int i = 0; i < 8; i++)
+        packet->timestamp = (packet->timestamp << 8) | buffer[5 + i];
+    return packet;
+}
+
+struct Options
+{
+    int records = 100000;
+    int repeat = 50;
+    std::vector<int> followers = {3, 10, 30, 100};
+};
+
+template <typename F> double time_ns_per_record(const Options &opt, F run)
+{
+    auto start = std::chrono::steady_clock::now();
+    uint64_t sink = 0;
+    for (int r = 0; r < opt.repeat; r++)
+        sink += run();
+    auto end = std::chrono::steady_clock::now();
+    // keep the loop from being optimised away
+    if (sink == 42)
+        printf(" ");
+    return std::chrono::duration<double, std::nano>(end - start).count() / ((double)opt.repeat * opt.records);
+}
+
+double airtime_us(int bytes)
+{
+    return Sim::RADIO_BYTE_US * (bytes + Sim::RADIO_FRAME_OVERHEAD);
+}
+
+std::vector<int> parse_list(const char *s)
+{
+    std::vector<int> out;
+    while (*s) {
+        out.push_back(atoi(s));
+        const char *comma = strchr(s, ',');
+        if (comma == nullptr)
+            break;
+        s = comma + 1;
+    }
+    return out;
+}
+
+void usage()
+{
+    fprintf(stderr, "usage: codec-bench [--records N] [--repeat N] [--followers 3,10,30,100]\n");
+    exit(1);
+}
+}
+
+int main(int argc, char **argv)
+{
+    Options opt;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc)
+            usage();
+        const char *v = argv[++i];
+        if (arg == "--records")
+            opt.records = atoi(v);
+        else if (arg == "--repeat")
+            opt.repeat = atoi(v);
+        else if (arg == "--followers")
+            opt.followers = parse_list(v);
+        else
+            usage();
+    }
+
+    const int per_frame = (Packet::MAX_FRAME_SIZE - Packet::HEADER_SIZE) / Packet::RECORD_SIZE[Packet::DELAY_RESP];
+    std::vector<uint8_t> legacy(LEGACY_SIZE * opt.records);
+    std::vector<Packet::Writer> frames((opt.records + per_frame - 1) / per_frame);
+
+    double legacy_encode_ns = time_ns_per_record(opt, [&] {
+        for (int k = 0; k < opt.records; k++)
+            legacy_encode(&legacy[LEGACY_SIZE * k], 2, 0x9e3779b9 + k, 1000000 + 37 * k);
+        return (uint64_t)legacy[LEGACY_SIZE * (opt.records - 1) + 12];
+    });
+    double legacy_decode_ns = time_ns_per_record(opt, [&] {
+        uint64_t total = 0;
+        for (int k = 0; k < opt.records; k++) {
+            auto p = legacy_decode(&legacy[LEGACY_SIZE * k]);
+            total += p->serial + p->timestamp;
+        }
+        return total;
+    });
+    double encode_ns = time_ns_per_record(opt, [&] {
+        for (Packet::Writer &f : frames)
+            f.Clear();
+        for (int k = 0; k < opt.records; k++)
+            frames[k / per_frame].Add(Packet::DelayResp{(uint8_t)k, (uint32_t)(1000000 + 37 * k)});
+        uint64_t total = 0;
+        for (Packet::Writer &f : frames)
+            total += f.Seal()[1];
+        return total;
+    });
+    // what the radio hands over
+    std::vector<uint8_t> sealed(Packet::MAX_FRAME_SIZE * frames.size());
+    for (size_t k = 0; k < frames.size(); k++)
+        std::copy(frames[k].Seal(), frames[k].Seal() + frames[k].Size(), &sealed[Packet::MAX_FRAME_SIZE * k]);
+    double decode_ns = time_ns_per_record(opt, [&] {
+        uint64_t total = 0;
+        for (size_t k = 0; k < frames.size(); k++) {
+            Packet::Reader r(&sealed[Packet::MAX_FRAME_SIZE * k], frames[k].Size());
+            Packet::DelayResp p;
+            while (r.Next())
+                if (r.Get(p))
+                    total += p.node + p.arrival;
+        }
+        return total;
+    });
+
+    int decoded = 0;
+    for (Packet::Writer &f : frames) {
+        Packet::Reader r(f.Seal(), f.Size());
+        Packet::DelayResp p;
+        while (r.Next())
+            decoded += r.Get(p) && p.arrival == (uint32_t)(1000000 + 37 * decoded);
+    }
+    if (decoded != opt.records) {
+        fprintf(stderr, "decoded %d of %d records\n", decoded, opt.records);
+        return 1;
+    }
+
+    printf("%d DELAY_RESPs, %d to a frame\n", opt.records, per_frame);
+    printf("format        bytes/record  encode ns  decode ns\n");
+    printf("13 byte         %10.2f  %9.2f  %9.2f\n", (double)LEGACY_SIZE, legacy_encode_ns, legacy_decode_ns);
+    printf("Packet.h        %10.2f  %9.2f  %9.2f\n",
+           (double)(Packet::HEADER_SIZE + per_frame * Packet::RECORD_SIZE[Packet::DELAY_RESP]) / per_frame, encode_ns,
+           decode_ns);
+
+    printf("\nairtime of one broadcast round, ms\n");
+    printf("followers   13 byte   Packet.h   frames before/after\n");
+    for (int n : opt.followers) {
+        int resp_frames = (n + per_frame - 1) / per_frame;
+        double before = (2 + 2 * n) * airtime_us(LEGACY_SIZE);
+        double after = airtime_us(Packet::HEADER_SIZE + Packet::RECORD_SIZE[Packet::SYNC_BROADCAST]) +
+                       airtime_us(Packet::HEADER_SIZE + Packet::RECORD_SIZE[Packet::FOLLOW_UP]) +
+                       n * airtime_us(Packet::HEADER_SIZE + Packet::RECORD_SIZE[Packet::DELAY_REQ]) +
+                       (n / per_frame) * airtime_us(Packet::HEADER_SIZE + per_frame * Packet::RECORD_SIZE[Packet::DELAY_RESP]) +
+                       (n % per_frame ? airtime_us(Packet::HEADER_SIZE + (n % per_frame) * Packet::RECORD_SIZE[Packet::DELAY_RESP]) : 0);
+        printf("%9d  %8.2f  %9.2f   %6d/%d\n", n, before / 1000, after / 1000, 2 + 2 * n, 2 + n + resp_frames);
+    }
+    return 0;
+}
@@ -0,0 +1,541 @@
+#include "MicroBit.h"
+#include "Playback.h"
+#include "Synchronization.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/*
+    Renders what an ensemble plays and measures how well it plays together.
+
+    Takes the song.cpp files written by tools/generate-music.py or midi-compile, a set list, and
+    plays each on N boards (one per part by default, board r plays part r mod parts). Every
+    board runs
+        ClockSync::Init(uBit, N); ClockSync::Sync(); ClockSync::StartBackgroundSync();
+        Playback::Play(uBit, pin, part, ClockSync::UnblockTime() + START_DELAY_US);
+    on the simulator, as main.cpp does when the song is compiled in (SONG_OVER_THE_AIR 0), with
+    random clock offsets and drifts, and the pin changes are taken from Pin::changes. With
+    --trace FILE no radio is simulated: each board's cues (Playback::CueList, articulation
+    gaps included) are placed by the clock error the trace gives for it, lines of
+        board time_s offset_us
+    where offset_us is how far the board's SystemTime() is ahead of the reference at time_s,
+    interpolated linearly between lines and held beyond them. A capture gives one line per
+    board from the offset and skew tools/telemetry.py reports, or one per sample of a log.
+
+    All times are on the reference clock, the master's local clock in the simulation. The
+    intended onset of a note is its cue time, which is the master's clock reading it is
+    scheduled for. Onsets heard are the pin going from silent to a period, matched in order to
+    the intended ones of the same pitch within MATCH_US, the rest count as dropped. The report
+    gives per board the error of the first and the last onset, the largest, and the drift of
+    the error over the song as a least-squares slope; skew is the spread of the onsets of
+    notes that the score starts at the same time on different boards.
+
+    With --wav DIR, DIR/<song>.wav is the sum of the boards' square waves (duty cycle
+    value / 1024 as on the speaker pin), 16-bit mono.
+
+    Usage:
+        ensemble-render [--boards N] [--wav DIR] [--rate 44100] [--trace FILE]
+                        [--no-background] [--latency-us 300] [--jitter-us 200] [--loss 0]
+                        [--max-drift-ppm 50] [--seed 1] song.cpp...
+*/
+
+namespace {
+
+const ClockSync::timestamp_t START_DELAY_US = 100000;
+
+// an onset heard further than this from the intended one is not taken for it
+const int64_t MATCH_US = 50000;
+
+// pin value of a permanently high output
+const int ANALOG_RANGE = 1024;
+
+struct Options
+{
+    int boards = 0;     // 0: one per part
+    std::string wav;
+    int rate = 44100;
+    std::string trace;
+    bool background = true;
+    double max_drift_ppm = 50;
+    Sim::NetworkConfig net;
+    std::vector<std::string> files;
+};
+
+struct SongFile
+{
+    std::string name;
+    std::vector<std::vector<uint8_t>> data;
+    std::vector<Song::PackedSong> parts;
+    int64_t length_us = 0;  // of the longest part
+};
+
+// the pin of one board, times on the reference clock
+struct Change
+{
+    int64_t at;
+    int period_us;
+    int value;
+};
+
+struct Onset
+{
+    int64_t at;
+    int period_us;
+};
+
+struct Board
+{
+    int rank = -1;
+    int part = 0;
+    std::vector<Change> changes;
+    std::vector<Onset> intended;
+    Playback::Stats playback = {};
+};
+
+struct BoardReport
+{
+    int heard = 0;
+    int dropped = 0;
+    int extra = 0;
+    double first_ms = 0, last_ms = 0, worst_ms = 0, drift_ppm = 0;
+};
+
+// (board, offset_us) samples by time, one list per board
+typedef std::vector<std::vector<std::pair<double, double>>> Trace;
+
+bool load_song(const std::string &path, SongFile &song)
+{
+    std::ifstream in(path);
+    if (!in)
+        return false;
+    std::stringstream ss;
+    ss << in.rdbuf();
+    std::string source = ss.str();
+
+    song.name = path.substr(path.find_last_of('/') + 1);
+    song.name = song.name.substr(0, song.name.find_last_of('.'));
+    // the arrays are megabytes for long songs, too much for std::regex
+    const std::string array = "_data[] = {";
+    for (size_t at = source.find(array); at != std::string::npos; at = source.find(array, at)) {
+        size_t end = source.find('}', at);
+        std::vector<uint8_t> bytes;
+        for (size_t p = source.find("0x", at); p < end; p = source.find("0x", p + 2))
+            bytes.push_back((uint8_t)strtoul(source.c_str() + p + 2, nullptr, 16));
+        song.data.push_back(bytes);
+        at = end;
+    }
+    const std::string unit = "_data), ";
+    size_t u = source.find(unit);
+    uint16_t unit_ms = u == std::string::npos ? 5 : (uint16_t)atoi(source.c_str() + u + unit.size());
+    for (const std::vector<uint8_t> &d : song.data)
+        song.parts.push_back({d.data(), (uint32_t)d.size(), unit_ms});
+    for (const Song::PackedSong &part : song.parts) {
+        Song::PackedSource packed(part);
+        music_event_t e;
+        int64_t length = 0;
+        while (packed.Next(e) == Song::Source::EVENT)
+            length += (int64_t)e.duration_ms * 1000;
+        song.length_us = std::max(song.length_us, length);
+    }
+    return !song.parts.empty();
+}
+
+bool load_trace(const std::string &path, Trace &trace)
+{
+    std::ifstream in(path);
+    if (!in)
+        return false;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty() || line[0] == '#')
+            continue;
+        int board;
+        double time_s, offset_us;
+        if (sscanf(line.c_str(), "%d %lf %lf", &board, &time_s, &offset_us) != 3 || board < 0)
+            return false;
+        if ((int)trace.size() <= board)
+            trace.resize(board + 1);
+        trace[board].push_back({time_s * 1e6, offset_us});
+    }
+    for (auto &samples : trace)
+        std::sort(samples.begin(), samples.end());
+    return !trace.empty();
+}
+
+double offset_at(const std::vector<std::pair<double, double>> &samples, double t)
+{
+    if (samples.empty())
+        return 0;
+    if (t <= samples.front().first)
+        return samples.front().second;
+    if (t >= samples.back().first)
+        return samples.back().second;
+    auto hi = std::upper_bound(samples.begin(), samples.end(), std::make_pair(t, -1e300));
+    auto lo = hi - 1;
+    return lo->second + (hi->second - lo->second) * (t - lo->first) / (hi->first - lo->first);
+}
+
+// the onsets the part schedules from `start`
+std::vector<Onset> intended_onsets(const Song::PackedSong &part, ClockSync::timestamp_t start)
+{
+    std::vector<Onset> onsets;
+    Song::PackedSource packed(part);
+    Playback::CueList cues(packed, start);
+    for (; !cues.Done(); cues.Pop())
+        if (cues.FrontIsOnset())
+            onsets.push_back({(int64_t)cues.Front().at, cues.Front().period_us});
+    return onsets;
+}
+
+/*
+    Plays the song on simulated boards, times on the master's local clock
+*/
+std::vector<Board> simulate(const Options &opt, const SongFile &song, int n, uint64_t seed)
+{
+    Sim::NetworkConfig net_config = opt.net;
+    net_config.seed = seed;
+    Sim::Network net(net_config);
+    std::mt19937_64 rng(seed);
+
+    std::vector<Board> boards(n);
+    std::vector<Sim::NodeConfig> configs(n);
+    std::vector<ClockSync::timestamp_t> starts(n);
+    for (int i = 0; i < n; i++) {
+        Sim::NodeConfig &c = configs[i];
+        do
+            c.serial = (uint32_t)rng();
+        while (std::any_of(configs.begin(), configs.begin() + i, [&](const Sim::NodeConfig &o) { return o.serial == c.serial; }));
+        c.boot_us = rng() % 200000;
+        c.clock_offset_us = rng() % 10000000;
+        c.drift_ppm = std::uniform_real_distribution<double>(-opt.max_drift_ppm, opt.max_drift_ppm)(rng);
+
+        Board *b = &boards[i];
+        ClockSync::timestamp_t *start_out = &starts[i];
+        net.AddNode(c, [b, n, start_out, &opt, &song] {
+            auto uBit = std::make_shared<MicroBit>();
+            uBit->init();
+            ClockSync::Init(uBit, n);
+            ClockSync::Sync();
+            if (opt.background)
+                ClockSync::StartBackgroundSync();
+            b->rank = ClockSync::Rank();
+            b->part = b->rank % (int)song.parts.size();
+            ClockSync::timestamp_t start = ClockSync::UnblockTime() + START_DELAY_US;
+            *start_out = start;
+            Pin &pin = uBit->audio.virtualOutputPin;
+            Playback::Play(uBit, &pin, song.parts[b->part], start);
+            while (Playback::Playing())
+                uBit->sleep(100);
+            b->playback = Playback::GetStats();
+            for (const Pin::Change &ch : pin.changes)
+                b->changes.push_back({ch.at, ch.period_us, ch.value});
+            ClockSync::StopBackgroundSync();
+        });
+    }
+    net.Run((Sim::sim_time_t)(song.length_us + 120000000));
+
+    // the master's SystemTime() is its local clock
+    int master = std::min_element(configs.begin(), configs.end(),
+                                  [](const Sim::NodeConfig &a, const Sim::NodeConfig &b) { return a.serial < b.serial; }) -
+                 configs.begin();
+    const Sim::NodeConfig &m = configs[master];
+    for (int i = 0; i < n; i++) {
+        Board &b = boards[i];
+        for (Change &ch : b.changes)
+            ch.at = m.clock_offset_us + ch.at + (int64_t)std::llround(ch.at * m.drift_ppm * 1e-6);
+        if (b.rank >= 0)
+            b.intended = intended_onsets(song.parts[b.part], starts[i]);
+    }
+    return boards;
+}
+
+/*
+    Places every board's cues by the clock error of the trace, the song starting at 1 s
+*/
+std::vector<Board> from_trace(const SongFile &song, const Trace &trace)
+{
+    const ClockSync::timestamp_t start = 1000000;
+    std::vector<Board> boards(trace.size());
+    for (size_t i = 0; i < trace.size(); i++) {
+        Board &b = boards[i];
+        b.rank = i;
+        b.part = i % song.parts.size();
+        b.intended = intended_onsets(song.parts[b.part], start);
+        Song::PackedSource packed(song.parts[b.part]);
+        Playback::CueList cues(packed, start);
+        for (; !cues.Done(); cues.Pop()) {
+            const Playback::Cue &c = cues.Front();
+            // SystemTime() reaches c.at when t + offset(t) = c.at, one correction is plenty for
+            // offsets that change by microseconds per second
+            double t = c.at - offset_at(trace[i], c.at);
+            t = c.at - offset_at(trace[i], t);
+            b.changes.push_back({(int64_t)std::llround(t), c.period_us, c.velocity});
+        }
+    }
+    return boards;
+}
+
+// onsets the pin actually played
+std::vector<Onset> heard_onsets(const Board &b)
+{
+    std::vector<Onset> onsets;
+    int period = 0;
+    for (const Change &ch : b.changes) {
+        if (period == 0 && ch.period_us != 0)
+            onsets.push_back({ch.at, ch.period_us});
+        period = ch.period_us;
+    }
+    return onsets;
+}
+
+/*
+    Matches heard onsets to intended ones. matched[k] is the heard time of intended onset k, or
+    INT64_MIN when it was dropped
+*/
+BoardReport analyse(const Board &b, std::vector<int64_t> &matched)
+{
+    BoardReport r;
+    std::vector<Onset> heard = heard_onsets(b);
+    matched.assign(b.intended.size(), INT64_MIN);
+    size_t h = 0;
+    double n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+    for (size_t k = 0; k < b.intended.size(); k++) {
+        const Onset &want = b.intended[k];
+        // heard onsets too early for this one are extras
+        while (h < heard.size() && heard[h].at < want.at - MATCH_US) {
+            r.extra++;
+            h++;
+        }
+        if (h >= heard.size() || heard[h].at > want.at + MATCH_US || heard[h].period_us != want.period_us) {
+            r.dropped++;
+            continue;
+        }
+        matched[k] = heard[h].at;
+        double error = heard[h].at - want.at;
+        if (r.heard == 0)
+            r.first_ms = error / 1000;
+        r.last_ms = error / 1000;
+        r.worst_ms = std::max(r.worst_ms, fabs(error) / 1000);
+        r.heard++;
+        double x = (want.at - b.intended.front().at) / 1e6;
+        n++;
+        sx += x;
+        sy += error;
+        sxx += x * x;
+        sxy += x * error;
+        h++;
+    }
+    r.extra += heard.size() - h;
+    double denominator = n * sxx - sx * sx;
+    // us of error per s of song
+    r.drift_ppm = denominator > 0 ? (n * sxy - sx * sy) / denominator : 0;
+    return r;
+}
+
+std::vector<int16_t> render(const std::vector<Board> &boards, int rate, int64_t &t0)
+{
+    t0 = INT64_MAX;
+    int64_t t1 = INT64_MIN;
+    for (const Board &b : boards) {
+        if (b.changes.empty())
+            continue;
+        t0 = std::min(t0, b.changes.front().at);
+        t1 = std::max(t1, b.changes.back().at);
+    }
+    if (t0 > t1)
+        return {};
+    // half a second of silence either side
+    t0 -= 500000;
+    t1 += 500000;
+    std::vector<float> mix((size_t)((t1 - t0) * rate / 1000000), 0.0f);
+
+    for (const Board &b : boards) {
+        double phase = 0;
+        for (size_t c = 0; c < b.changes.size(); c++) {
+            const Change &ch = b.changes[c];
+            if (ch.period_us == 0 || ch.value == 0)
+                continue;
+            if (c > 0 && b.changes[c - 1].period_us == 0)
+                phase = 0;
+            int64_t end = c + 1 < b.changes.size() ? b.changes[c + 1].at : t1;
+            size_t from = (size_t)((ch.at - t0) * rate / 1000000);
+            size_t to = std::min(mix.size(), (size_t)((end - t0) * rate / 1000000));
+            double duty = std::min(ch.value, ANALOG_RANGE) / (double)ANALOG_RANGE;
+            double step = 1e6 / ((double)ch.period_us * rate);
+            for (size_t s = from; s < to; s++) {
+                // without the DC, which a speaker does not play either
+                mix[s] += (phase < duty ? 1.0f : 0.0f) - (float)duty;
+                phase += step;
+                if (phase >= 1)
+                    phase -= std::floor(phase);
+            }
+        }
+    }
+
+    std::vector<int16_t> out(mix.size());
+    float scale = 0.8f * INT16_MAX / std::max<size_t>(boards.size(), 1);
+    for (size_t s = 0; s < mix.size(); s++)
+        out[s] = (int16_t)std::lround(std::max(-1.0f, std::min(1.0f, mix[s] * scale / INT16_MAX)) * INT16_MAX);
+    return out;
+}
+
+void put_u32(FILE *f, uint32_t v)
+{
+    uint8_t b[4] = {(uint8_t)v, (uint8_t)(v >> 8), (uint8_t)(v >> 16), (uint8_t)(v >> 24)};
+    fwrite(b, 1, 4, f);
+}
+
+void put_u16(FILE *f, uint16_t v)
+{
+    uint8_t b[2] = {(uint8_t)v, (uint8_t)(v >> 8)};
+    fwrite(b, 1, 2, f);
+}
+
+bool write_wav(const std::string &path, const std::vector<int16_t> &samples, int rate)
+{
+    FILE *f = fopen(path.c_str(), "wb");
+    if (f == nullptr)
+        return false;
+    uint32_t bytes = samples.size() * 2;
+    fwrite("RIFF", 1, 4, f);
+    put_u32(f, 36 + bytes);
+    fwrite("WAVEfmt ", 1, 8, f);
+    put_u32(f, 16);
+    put_u16(f, 1);          // PCM
+    put_u16(f, 1);          // mono
+    put_u32(f, rate);
+    put_u32(f, rate * 2);
+    put_u16(f, 2);
+    put_u16(f, 16);
+    fwrite("data", 1, 4, f);
+    put_u32(f, bytes);
+    for (int16_t s : samples)
+        put_u16(f, (uint16_t)s);
+    return fclose(f) == 0;
+}
+
+void usage()
+{
+    fprintf(stderr, "usage: ensemble-render [--boards N] [--wav DIR] [--rate HZ] [--trace FILE]\n"
+                    "                       [--no-background] [--latency-us US] [--jitter-us US] [--loss P]\n"
+                    "                       [--max-drift-ppm PPM] [--seed N] song.cpp...\n");
+    exit(1);
+}
+}
+
+int main(int argc, char **argv)
+{
+    Options opt;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--no-background") {
+            opt.background = false;
+            continue;
+        }
+        if (arg.compare(0, 2, "--") != 0) {
+            opt.files.push_back(arg);
+            continue;
+        }
+        if (i + 1 >= argc)
+            usage();
+        const char *v = argv[++i];
+        if (arg == "--boards")
+            opt.boards = atoi(v);
+        else if (arg == "--wav")
+            opt.wav = v;
+        else if (arg == "--rate")
+            opt.rate = atoi(v);
+        else if (arg == "--trace")
+            opt.trace = v;
+        else if (arg == "--latency-us")
+            opt.net.latency_us = atoll(v);
+        else if (arg == "--jitter-us")
+            opt.net.jitter_us = atoll(v);
+        else if (arg == "--loss")
+            opt.net.loss = atof(v);
+        else if (arg == "--max-drift-ppm")
+            opt.max_drift_ppm = atof(v);
+        else if (arg == "--seed")
+            opt.net.seed = strtoull(v, nullptr, 10);
+        else
+            usage();
+    }
+    if (opt.files.empty() || opt.rate <= 0 || opt.boards < 0)
+        usage();
+
+    Trace trace;
+    if (!opt.trace.empty() && !load_trace(opt.trace, trace)) {
+        fprintf(stderr, "%s: not a trace\n", opt.trace.c_str());
+        return 1;
+    }
+
+    auto began = std::chrono::steady_clock::now();
+    double played_s = 0;
+    int total_dropped = 0;
+    for (size_t f = 0; f < opt.files.size(); f++) {
+        SongFile song;
+        if (!load_song(opt.files[f], song)) {
+            fprintf(stderr, "%s: no song parts\n", opt.files[f].c_str());
+            return 1;
+        }
+        auto song_began = std::chrono::steady_clock::now();
+        int n = opt.boards ? opt.boards : song.parts.size();
+        std::vector<Board> boards = trace.empty() ? simulate(opt, song, n, opt.net.seed + f) : from_trace(song, trace);
+        played_s += song.length_us / 1e6;
+
+        printf("%s: %zu parts, %.1f s, %zu boards, %s\n", song.name.c_str(), song.parts.size(),
+               song.length_us / 1e6, boards.size(), trace.empty() ? "simulated" : "trace");
+        printf("board  rank  part  notes  dropped  extra   first ms    last ms   worst ms  drift ppm   late\n");
+        // heard times of the onsets of every score time, over all boards
+        std::map<int64_t, std::vector<int64_t>> together;
+        for (size_t i = 0; i < boards.size(); i++) {
+            const Board &b = boards[i];
+            if (b.rank < 0) {
+                printf("%5zu  never started\n", i);
+                continue;
+            }
+            std::vector<int64_t> matched;
+            BoardReport r = analyse(b, matched);
+            total_dropped += r.dropped;
+            for (size_t k = 0; k < matched.size(); k++)
+                if (matched[k] != INT64_MIN)
+                    together[b.intended[k].at].push_back(matched[k]);
+            printf("%5zu %5d %5d %6zu %8d %6d %10.3f %10.3f %10.3f %10.2f %6u\n", i, b.rank, b.part,
+                   b.intended.size(), r.dropped, r.extra, r.first_ms, r.last_ms, r.worst_ms, r.drift_ppm,
+                   b.playback.late);
+        }
+        std::vector<double> skew_ms;
+        for (const auto &chord : together) {
+            if (chord.second.size() < 2)
+                continue;
+            auto range = std::minmax_element(chord.second.begin(), chord.second.end());
+            skew_ms.push_back((*range.second - *range.first) / 1000.0);
+        }
+        printf("onset skew over %zu shared onsets: p50 %.3f ms, p99 %.3f ms, max %.3f ms\n", skew_ms.size(),
+               Sim::Percentile(skew_ms, 50), Sim::Percentile(skew_ms, 99), Sim::Percentile(skew_ms, 100));
+
+        if (!opt.wav.empty()) {
+            int64_t t0;
+            std::vector<int16_t> samples = render(boards, opt.rate, t0);
+            std::string path = opt.wav + "/" + song.name + ".wav";
+            if (!write_wav(path, samples, opt.rate)) {
+                fprintf(stderr, "%s: cannot write\n", path.c_str());
+                return 1;
+            }
+            printf("wrote %s, %.1f s\n", path.c_str(), samples.size() / (double)opt.rate);
+        }
+        printf("took %.2f s\n\n", std::chrono::duration<double>(std::chrono::steady_clock::now() - song_began).count());
+    }
+    printf("%zu songs, %.1f s of music in %.2f s, %d notes dropped\n", opt.files.size(), played_s,
+           std::chrono::duration<double>(std::chrono::steady_clock::now() - began).count(), total_dropped);
+    return 0;
+}
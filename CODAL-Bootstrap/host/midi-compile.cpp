@@ -0,0 +1,1120 @@
+#include "PackedSong.h"
+#include "SongImage.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+/*
+    Compiles Standard MIDI Files into the song.cpp that tools/generate-music.py writes, byte for
+    byte, without its quadratic cost.
+
+    generate-music.py pairs every note_on with its note_off by rescanning the whole file
+    (find_duration), once per part. Here every file is read once:
+        1) the tracks are parsed and merged the way mido merges them: by tick, ties in track
+           order. Times in seconds are accumulated message by message with mido's tempo
+           arithmetic, so they come out as the same doubles and compare the same way
+        2) a table of active notes per pitch pairs them: a message with velocity 0 for a pitch
+           ends every pending note of that pitch that started strictly before it, which is the
+           one find_duration() would have found
+        3) the notes are shared out between the parts as in midi_to_events(), by
+           allocate_balanced() unless --allocation first-free, then go through
+           deduplicate_rests(), segment_on_breaks() and merge_event_segments()
+    The segments of all files are then quantised as in event_tokens() and packed with
+    back-references as in compress_motifs(), or with --compression segments deduplicated as in
+    compress_segments() and packed as in pack_events(). Both note the seek index of
+    index_entries() as they go, every --index-events events. --image FILE also writes the song
+    for tools/patch-hex.py as song_image() does, with --batch FILE is a directory that gets a
+    <name>.bin for every <name>.cpp.
+
+    Files are read and turned into segments in parallel, --jobs threads (default: one per
+    core). With --batch DIR every file is a song of its own, written to DIR/<name>.cpp, and the
+    threads take whole files.
+
+    Every file's allocation is reported on stderr as generate-music.py reports it.
+
+    Usage:
+        midi-compile [--parts 3] [--unit-ms 5] [--min-length-ms 5000] [--output song.cpp]
+                     [--allocation balanced|first-free] [--keep melody,velocity]
+                     [--compression motif|segments] [--index-events 512] [--image FILE]
+                    [--jobs N] song.mid...
+        midi-compile --batch DIR [--parts 3] [--unit-ms 5] [--min-length-ms 5000] [--image DIR]
+                     [--jobs N] a.mid b.mid...
+*/
+
+namespace {
+
+enum Allocation { BALANCED, FIRST_FREE };
+enum Compression { MOTIF, SEGMENTS };
+enum Keep { KEEP_MELODY, KEEP_VELOCITY };
+const size_t MAX_KEEP = 2;
+
+struct Options
+{
+    int parts = 3;
+    int unit_ms = 5;
+    int64_t min_length_ms = 5000;
+    std::string output = "song.cpp";
+    std::string image;
+    std::string batch;
+    Allocation allocation = BALANCED;
+    std::vector<Keep> keep;
+    Compression compression = MOTIF;
+    int index_events = Song::INDEX_EVENTS;
+    int jobs = 0;
+    std::vector<std::string> files;
+};
+
+// segment_on_breaks() defaults
+const int64_t MIN_BREAK_NOTE_MS = 100;
+const int64_t MIN_BREAK_REST_MS = 50;
+const uint32_t DEFAULT_TEMPO = 500000;
+
+struct Error : std::runtime_error
+{
+    using std::runtime_error::runtime_error;
+};
+
+// -------------------------------------------------------------------
+// Standard MIDI File, as far as mido reads it
+
+enum Kind : uint8_t { OTHER, NOTE_ON, NOTE_OFF, SET_TEMPO, END_OF_TRACK };
+
+struct Message
+{
+    uint64_t tick;      // absolute
+    Kind kind;
+    uint8_t note;
+    uint8_t velocity;
+    uint32_t tempo;
+};
+
+struct MidiFile
+{
+    int type = 0;
+    int ticks_per_beat = 0;
+    std::vector<Message> merged;
+};
+
+class Reader
+{
+public:
+    Reader(const uint8_t *data, size_t size) : p(data), end(data + size) {}
+
+    size_t Left() const { return end - p; }
+
+    uint8_t Byte()
+    {
+        if (p == end)
+            throw Error("unexpected end of file");
+        return *p++;
+    }
+
+    const uint8_t *Bytes(size_t n)
+    {
+        if (Left() < n)
+            throw Error("unexpected end of file");
+        const uint8_t *at = p;
+        p += n;
+        return at;
+    }
+
+    uint32_t Be32()
+    {
+        const uint8_t *b = Bytes(4);
+        return ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3];
+    }
+
+    uint16_t Be16()
+    {
+        const uint8_t *b = Bytes(2);
+        return (uint16_t)((b[0] << 8) | b[1]);
+    }
+
+    uint64_t Variable()
+    {
+        uint64_t v = 0;
+        uint8_t b;
+        do {
+            b = Byte();
+            v = (v << 7) | (b & 0x7f);
+        } while (b & 0x80);
+        return v;
+    }
+
+private:
+    const uint8_t *p;
+    const uint8_t *end;
+};
+
+// bytes after the status byte of the channel and system messages mido knows
+int data_length(uint8_t status)
+{
+    switch (status & 0xf0) {
+    case 0x80: case 0x90: case 0xa0: case 0xb0: case 0xe0:
+        return 2;
+    case 0xc0: case 0xd0:
+        return 1;
+    }
+    switch (status) {
+    case 0xf1: case 0xf3:
+        return 1;
+    case 0xf2:
+        return 2;
+    case 0xf6: case 0xf8: case 0xfa: case 0xfb: case 0xfc: case 0xfe:
+        return 0;
+    }
+    char what[48];
+    snprintf(what, sizeof(what), "undefined status byte 0x%02x", status);
+    throw Error(what);
+}
+
+void read_track(Reader &in, std::vector<Message> &out)
+{
+    if (memcmp(in.Bytes(4), "MTrk", 4) != 0)
+        throw Error("no MTrk header at start of track");
+    uint32_t size = in.Be32();
+    Reader track(in.Bytes(size), size);
+
+    uint64_t tick = 0;
+    int last_status = -1;
+    while (track.Left() > 0) {
+        tick += track.Variable();
+        Message m = {tick, OTHER, 0, 0, 0};
+        uint8_t status = track.Byte();
+        uint8_t data[2];
+        int have = 0;
+        if (status < 0x80) {
+            if (last_status < 0)
+                throw Error("running status without last_status");
+            data[have++] = status;
+            status = last_status;
+        } else if (status != 0xff) {
+            // meta messages do not set running status
+            last_status = status;
+        }
+
+        if (status == 0xff) {
+            uint8_t type = track.Byte();
+            uint64_t length = track.Variable();
+            const uint8_t *body = track.Bytes(length);
+            if (type == 0x51) {
+                if (length < 3)
+                    throw Error("short set_tempo");
+                m.kind = SET_TEMPO;
+                m.tempo = (body[0] << 16) | (body[1] << 8) | body[2];
+            } else if (type == 0x2f) {
+                m.kind = END_OF_TRACK;
+            }
+        } else if (status == 0xf0 || status == 0xf7) {
+            if (have)
+                throw Error("running status on a sysex");
+            track.Bytes(track.Variable());
+        } else {
+            int length = data_length(status);
+            if (have > length)
+                throw Error("running status on a message without data");
+            for (; have < length; have++)
+                data[have] = track.Byte();
+            for (int i = 0; i < length; i++)
+                if (data[i] > 127)
+                    throw Error("data byte must be in range 0..127");
+            if ((status & 0xf0) == 0x90 || (status & 0xf0) == 0x80) {
+                m.kind = (status & 0xf0) == 0x90 ? NOTE_ON : NOTE_OFF;
+                m.note = data[0];
+                m.velocity = data[1];
+            }
+        }
+        out.push_back(m);
+    }
+}
+
+MidiFile read_midi(const std::string &path)
+{
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f)
+        throw Error(strerror(errno));
+    std::vector<uint8_t> bytes;
+    uint8_t chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+        bytes.insert(bytes.end(), chunk, chunk + n);
+    fclose(f);
+
+    Reader in(bytes.data(), bytes.size());
+    if (memcmp(in.Bytes(4), "MThd", 4) != 0)
+        throw Error("MThd not found, probably not a MIDI file");
+    uint32_t size = in.Be32();
+    if (size < 6)
+        throw Error("short MThd");
+    MidiFile midi;
+    midi.type = (int16_t)in.Be16();
+    int tracks = (int16_t)in.Be16();
+    midi.ticks_per_beat = (int16_t)in.Be16();
+    in.Bytes(size - 6);
+    if (midi.ticks_per_beat == 0)
+        throw Error("ticks per beat is 0");
+    if (midi.type == 2)
+        throw Error("can't merge tracks in type 2 (asynchronous) file");
+
+    // concatenated in track order and sorted stably by tick, as mido's merge_tracks() does
+    for (int i = 0; i < tracks; i++)
+        read_track(in, midi.merged);
+    std::stable_sort(midi.merged.begin(), midi.merged.end(),
+                     [](const Message &a, const Message &b) { return a.tick < b.tick; });
+    // mido drops them, their delta goes to the next message
+    midi.merged.erase(std::remove_if(midi.merged.begin(), midi.merged.end(),
+                                     [](const Message &m) { return m.kind == END_OF_TRACK; }),
+                      midi.merged.end());
+    return midi;
+}
+
+// -------------------------------------------------------------------
+// generate-music.py
+
+// Python's round() of a float, half to even
+int64_t py_round(double x)
+{
+    return (int64_t)std::nearbyint(x);
+}
+
+int midi_period_us(int note)
+{
+    if (note == 0)
+        return 0;
+    double freq = 27.5 * pow(2.0, (note - 21) / 12.0);
+    return (int)py_round(1000000 / freq);
+}
+
+int midi_velocity(int velocity)
+{
+    return (int)py_round(pow(128.0, velocity / 100.0) - 1);
+}
+
+int velocity_level(int velocity)
+{
+    int best = 0;
+    double best_distance = INFINITY;
+    for (int i = 0; i < 8; i++) {
+        double distance = fabs(log((double)Song::VELOCITY[i]) - log((double)std::max(velocity, 1)));
+        if (distance < best_distance) {
+            best = i;
+            best_distance = distance;
+        }
+    }
+    return best;
+}
+
+// NOTE_OF_PERIOD, the higher note wins a shared period as in the dict comprehension
+const std::vector<uint8_t> &note_of_period()
+{
+    static const std::vector<uint8_t> table = [] {
+        std::vector<uint8_t> t(midi_period_us(1) + 1, 0);
+        for (int note = 1; note < 128; note++)
+            t[midi_period_us(note)] = note;
+        return t;
+    }();
+    return table;
+}
+
+struct Event
+{
+    int32_t period;
+    int64_t duration;   // ms
+    int32_t velocity;
+
+    bool operator==(const Event &o) const
+    {
+        return period == o.period && duration == o.duration && velocity == o.velocity;
+    }
+};
+
+// a run of events of one part of one file, [begin, end)
+struct Segment
+{
+    size_t begin;
+    size_t end;
+};
+
+struct Part
+{
+    std::vector<Event> events;
+    std::vector<Segment> segments;
+};
+
+struct Note
+{
+    size_t index;
+    double start;       // s
+    int64_t duration;   // ms
+    int period;
+    int velocity;
+    int pitch;
+};
+
+/*
+    midi_notes(): the notes in order of their onset
+*/
+std::vector<Note> midi_notes(const MidiFile &midi)
+{
+    struct Pending
+    {
+        double start;
+        double end;
+        bool ended;
+    };
+    std::vector<Pending> times;
+    std::vector<Note> notes;
+    // notes of each pitch waiting for their end, oldest first from head
+    std::vector<std::vector<uint32_t>> pending(128);
+    std::vector<size_t> head(128, 0);
+
+    double scale = DEFAULT_TEMPO * 1e-6 / midi.ticks_per_beat;
+    double time = 0;
+    uint64_t tick = 0;
+    for (const Message &m : midi.merged) {
+        if (m.tick > tick)
+            time += (double)(m.tick - tick) * scale;
+        tick = m.tick;
+
+        if (m.kind == SET_TEMPO) {
+            // from the next message on
+            scale = m.tempo * 1e-6 / midi.ticks_per_beat;
+        } else if (m.kind == NOTE_ON && m.velocity > 0) {
+            int velocity = midi_velocity(m.velocity);
+            if (velocity <= 10)
+                continue;
+            pending[m.note].push_back(notes.size());
+            times.push_back({time, 0, false});
+            notes.push_back({notes.size(), time, 0, midi_period_us(m.note), velocity, m.note});
+        } else if ((m.kind == NOTE_ON || m.kind == NOTE_OFF) && m.velocity == 0) {
+            std::vector<uint32_t> &waiting = pending[m.note];
+            size_t &first = head[m.note];
+            while (first < waiting.size() && times[waiting[first]].start < time) {
+                times[waiting[first]].end = time;
+                times[waiting[first]].ended = true;
+                first++;
+            }
+            if (first == waiting.size()) {
+                waiting.clear();
+                first = 0;
+            }
+        }
+    }
+    for (Note &n : notes)
+        if (times[n.index].ended)
+            n.duration = py_round((times[n.index].end - n.start) * 1000);
+    return notes;
+}
+
+// a part's clock once it has played `n`, as Microbit.addNote() moves it
+double advance(double clock, const Note &n)
+{
+    int64_t pause = py_round((n.start - clock) * 1000);
+    return clock + pause / 1000.0 + n.duration / 1000.0;
+}
+
+const int NONE = -1;
+
+std::vector<int> allocate_first_free(const std::vector<Note> &notes, int parts)
+{
+    std::vector<double> clock(parts, 0);
+    std::vector<int> assigned(notes.size(), NONE);
+    for (const Note &n : notes) {
+        for (int i = 0; i < parts; i++) {
+            if (clock[i] <= n.start) {
+                clock[i] = advance(clock[i], n);
+                assigned[n.index] = i;
+                break;
+            }
+        }
+    }
+    return assigned;
+}
+
+// drop_key(), the criteria first and unused ones 0
+typedef std::array<double, 2 + MAX_KEEP> DropKey;
+
+DropKey drop_key(const Note &n, const std::vector<Keep> &keep)
+{
+    DropKey key = {};
+    size_t at = MAX_KEEP - keep.size();
+    for (Keep criterion : keep)
+        key[at++] = criterion == KEEP_MELODY ? n.pitch : n.velocity;
+    key[at++] = -(n.start + n.duration / 1000.0);
+    key[at] = -(double)n.index;
+    return key;
+}
+
+/*
+    allocate_balanced(), see generate-music.py
+*/
+std::vector<int> allocate_balanced(const std::vector<Note> &notes, int parts, const std::vector<Keep> &keep)
+{
+    typedef std::tuple<double, int, uint64_t> Busy;     // clock, part, version
+    typedef std::tuple<int64_t, int> Free;              // load, part
+    typedef std::tuple<DropKey, size_t, int> Candidate; // key, note, part
+    std::priority_queue<Busy, std::vector<Busy>, std::greater<Busy>> busy;
+    std::priority_queue<Free, std::vector<Free>, std::greater<Free>> free;
+    std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> candidates;
+
+    std::vector<double> clock(parts, 0);
+    std::vector<int64_t> load(parts, 0);
+    std::vector<uint64_t> version(parts, 0);
+    std::vector<int64_t> sounding(parts, NONE);
+    std::vector<double> previous(notes.size(), 0);
+    std::vector<int> assigned(notes.size(), NONE);
+    for (int i = 0; i < parts; i++)
+        free.push({0, i});
+
+    auto assign = [&](const Note &n, int part) {
+        previous[n.index] = clock[part];
+        clock[part] = advance(clock[part], n);
+        load[part] += n.duration;
+        version[part]++;
+        sounding[part] = n.index;
+        assigned[n.index] = part;
+        busy.push({clock[part], part, version[part]});
+        candidates.push({drop_key(n, keep), n.index, part});
+    };
+
+    for (const Note &n : notes) {
+        while (!busy.empty() && std::get<0>(busy.top()) <= n.start) {
+            auto [end, part, v] = busy.top();
+            busy.pop();
+            if (v == version[part]) {
+                sounding[part] = NONE;
+                free.push({load[part], part});
+            }
+        }
+        if (!free.empty()) {
+            int part = std::get<1>(free.top());
+            free.pop();
+            assign(n, part);
+            continue;
+        }
+        while (sounding[std::get<2>(candidates.top())] != (int64_t)std::get<1>(candidates.top()))
+            candidates.pop();
+        auto [key, index, part] = candidates.top();
+        if (drop_key(n, keep) <= key)
+            continue;
+        candidates.pop();
+        // the evicted note was the part's last one, its clock goes back to before it
+        clock[part] = previous[index];
+        load[part] -= notes[index].duration;
+        assigned[index] = NONE;
+        assign(n, part);
+    }
+    return assigned;
+}
+
+struct AllocationStats
+{
+    size_t notes;
+    size_t dropped;
+    std::vector<int64_t> load;  // ms every part sounds for
+};
+
+/*
+    midi_to_events(): the events every part plays, rests included
+*/
+std::vector<std::vector<Event>> midi_to_events(const MidiFile &midi, const Options &opt, AllocationStats &stats)
+{
+    std::vector<Note> notes = midi_notes(midi);
+    std::vector<int> assigned = opt.allocation == FIRST_FREE ? allocate_first_free(notes, opt.parts)
+                                                             : allocate_balanced(notes, opt.parts, opt.keep);
+
+    // Microbit.addNote()
+    std::vector<double> clock(opt.parts, 0);
+    std::vector<std::vector<Event>> out(opt.parts);
+    stats = {notes.size(), 0, std::vector<int64_t>(opt.parts, 0)};
+    for (const Note &n : notes) {
+        int i = assigned[n.index];
+        if (i == NONE) {
+            stats.dropped++;
+            continue;
+        }
+        int64_t pause = py_round((n.start - clock[i]) * 1000);
+        out[i].push_back({0, pause, n.velocity});
+        clock[i] += pause / 1000.0;
+        out[i].push_back({n.period, n.duration, n.velocity});
+        clock[i] += n.duration / 1000.0;
+        if (n.period)
+            stats.load[i] += n.duration;
+    }
+    return out;
+}
+
+/*
+    deduplicate_rests(), segment_on_breaks() and merge_event_segments() of one part
+*/
+Part segment(const std::vector<Event> &events, int64_t min_length_ms)
+{
+    Part part;
+    int64_t rest = 0;
+    for (const Event &e : events) {
+        if (e.period == 0) {
+            rest += e.duration;
+            continue;
+        }
+        if (rest > 0)
+            part.events.push_back({0, rest, 0});
+        rest = 0;
+        part.events.push_back(e);
+    }
+    if (rest > 0)
+        part.events.push_back({0, rest, 0});
+
+    // a break ends a segment, merged ones run until they are long enough
+    size_t begin = 0;
+    int64_t length = 0;
+    for (size_t i = 0; i < part.events.size(); i++) {
+        const Event &e = part.events[i];
+        length += e.duration;
+        bool is_break = e.period == 0 ? e.duration >= MIN_BREAK_REST_MS : e.duration >= MIN_BREAK_NOTE_MS;
+        if (is_break && length >= min_length_ms) {
+            part.segments.push_back({begin, i + 1});
+            begin = i + 1;
+            length = 0;
+        }
+    }
+    if (begin < part.events.size())
+        part.segments.push_back({begin, part.events.size()});
+    return part;
+}
+
+// compress_motifs() constants
+const int MAX_MATCH = Song::MIN_MATCH + Song::LONG_LENGTH + 255;
+const int MAX_TRANSPOSE = 15;
+const int CHAIN = 64;
+
+struct Token
+{
+    int pitch;
+    int level;
+    uint32_t units;
+};
+
+/*
+    compress_segments(), or every segment with --compression motif, of one part over the files
+    in order
+*/
+std::vector<Event> part_events(const std::vector<const Part *> &files, Compression compression)
+{
+    std::vector<Event> events;
+    if (compression == MOTIF) {
+        for (const Part *part : files)
+            for (const Segment &s : part->segments)
+                events.insert(events.end(), part->events.begin() + s.begin, part->events.begin() + s.end);
+        return events;
+    }
+
+    struct Unique
+    {
+        const Event *events;
+        size_t size;
+    };
+    std::unordered_map<uint64_t, std::vector<Unique>> seen;
+    for (const Part *part : files) {
+        for (const Segment &s : part->segments) {
+            const Event *first = part->events.data() + s.begin;
+            size_t size = s.end - s.begin;
+            uint64_t hash = size;
+            for (size_t i = 0; i < size; i++) {
+                hash = (hash ^ (uint64_t)first[i].period) * 0x100000001b3ull;
+                hash = (hash ^ (uint64_t)first[i].duration) * 0x100000001b3ull;
+                hash = (hash ^ (uint64_t)first[i].velocity) * 0x100000001b3ull;
+            }
+            std::vector<Unique> &bucket = seen[hash];
+            bool repeat = std::any_of(bucket.begin(), bucket.end(), [&](const Unique &u) {
+                return u.size == size && std::equal(first, first + size, u.events);
+            });
+            if (repeat)
+                continue;
+            bucket.push_back({first, size});
+            events.insert(events.end(), first, first + size);
+        }
+    }
+    return events;
+}
+
+/*
+    event_tokens()
+*/
+std::vector<Token> event_tokens(const std::vector<Event> &events, int unit_ms)
+{
+    const std::vector<uint8_t> &pitch_of = note_of_period();
+    std::vector<Token> tokens;
+    // quantize(): starts on the unit grid, durations as their differences
+    int64_t start = 0, previous = 0;
+    for (const Event &e : events) {
+        start += e.duration;
+        int64_t q = (start + unit_ms / 2) / unit_ms;
+        if (q <= previous)
+            continue;
+        int64_t units = q - previous;
+        previous = q;
+        while (e.period == 0 && units > 0xffff) {
+            tokens.push_back({0, 0, 0xffff});
+            units -= 0xffff;
+        }
+        if (units > 0xffff)
+            throw Error("a note is longer than 65535 units");
+        int pitch = e.period ? pitch_of.at(e.period) : 0;
+        tokens.push_back({pitch, pitch ? velocity_level(e.velocity) : 0, (uint32_t)units});
+    }
+    return tokens;
+}
+
+void pack_word(std::vector<uint8_t> &data, const Token &t)
+{
+    int field = t.units < Song::LONG_DURATION ? (int)t.units : Song::LONG_DURATION;
+    uint16_t word = t.pitch | (t.level << Song::PITCH_BITS) | (field << Song::DURATION_SHIFT);
+    data.push_back(word & 0xff);
+    data.push_back(word >> 8);
+    if (field == Song::LONG_DURATION) {
+        data.push_back(t.units & 0xff);
+        data.push_back(t.units >> 8);
+    }
+}
+
+int token_size(const Token &t)
+{
+    return t.units >= Song::LONG_DURATION ? 4 : 2;
+}
+
+int reference_size(int length)
+{
+    return length - Song::MIN_MATCH < Song::LONG_LENGTH ? 3 : 4;
+}
+
+/*
+    motif_key(), 28 bits per event
+*/
+uint64_t motif_key(const Token &a, const Token &b)
+{
+    int base = a.pitch ? a.pitch : b.pitch;
+    auto one = [&](const Token &t) -> uint64_t {
+        uint64_t level = t.pitch ? t.level + 1 : 0;
+        uint64_t relative = t.pitch ? t.pitch - base + 128 : 128;
+        return (uint64_t)t.units | level << 16 | relative << 20;
+    };
+    return one(a) | one(b) << 28;
+}
+
+/*
+    match_length()
+*/
+int match_length(const std::vector<Token> &tokens, size_t j, size_t i, int &transpose)
+{
+    int n = (int)std::min<size_t>(MAX_MATCH, tokens.size() - i);
+    bool found = false;
+    transpose = 0;
+    int k = 0;
+    for (; k < n; k++) {
+        const Token &a = tokens[j + k], &b = tokens[i + k];
+        if (a.units != b.units || a.level != b.level || (a.pitch == 0) != (b.pitch == 0))
+            break;
+        if (a.pitch) {
+            if (!found) {
+                if (abs(b.pitch - a.pitch) > MAX_TRANSPOSE + (b.pitch < a.pitch))
+                    break;
+                transpose = b.pitch - a.pitch;
+                found = true;
+            } else if (b.pitch - a.pitch != transpose) {
+                break;
+            }
+        }
+    }
+    return k;
+}
+
+struct PackedPart
+{
+    std::vector<uint8_t> data;
+    std::vector<Song::IndexEntry> index;
+};
+
+/*
+    Notes an index_entries() entry when token i is the first at or after the next checkpoint,
+    returns whether it did
+*/
+class Indexer
+{
+public:
+    explicit Indexer(int index_events) : index_events(index_events), checkpoint(index_events) {}
+
+    bool At(size_t i, const PackedPart &part, std::vector<Song::IndexEntry> &index)
+    {
+        if (!index_events || i < checkpoint)
+            return false;
+        index.push_back({units, (uint32_t)part.data.size()});
+        // next_checkpoint()
+        checkpoint = (i / index_events + 1) * index_events;
+        return true;
+    }
+
+    void Add(const Token &t) { units += t.units; }
+
+private:
+    size_t index_events;
+    size_t checkpoint;
+    uint32_t units = 0;
+};
+
+/*
+    compress_motifs() and index_entries()
+*/
+PackedPart compress_motifs(const std::vector<Token> &tokens, int index_events)
+{
+    std::unordered_map<uint64_t, std::vector<uint32_t>> chains;
+    PackedPart part;
+    std::vector<uint8_t> &data = part.data;
+    Indexer indexer(index_events);
+    // the events before the last index entry are out of reach
+    size_t floor = 0;
+    size_t i = 0;
+    while (i < tokens.size()) {
+        if (indexer.At(i, part, part.index))
+            floor = i;
+        int best = 0, transpose = 0;
+        size_t distance = 0;
+        if (i + Song::MIN_MATCH <= tokens.size()) {
+            auto found = chains.find(motif_key(tokens[i], tokens[i + 1]));
+            if (found != chains.end()) {
+                const std::vector<uint32_t> &candidates = found->second;
+                int longest = (int)std::min<size_t>(MAX_MATCH, tokens.size() - i);
+                int checked = 0;
+                for (auto j = candidates.rbegin(); j != candidates.rend() && checked < CHAIN; ++j, checked++) {
+                    if (i - *j > (size_t)Song::WINDOW || *j < floor)
+                        break;
+                    int t;
+                    int length = match_length(tokens, *j, i, t);
+                    if (length > best) {
+                        best = length;
+                        transpose = t;
+                        distance = i - *j;
+                        if (best == longest)
+                            break;
+                    }
+                }
+            }
+        }
+        int literal = 0;
+        for (int k = 0; k < best; k++)
+            literal += token_size(tokens[i + k]);
+        size_t step = 1;
+        if (best >= Song::MIN_MATCH && reference_size(best) < literal) {
+            int code = std::min(best - Song::MIN_MATCH, Song::LONG_LENGTH);
+            uint16_t word = (transpose + 16) | (code << 5) | (Song::REFERENCE << Song::DURATION_SHIFT);
+            data.push_back(word & 0xff);
+            data.push_back(word >> 8);
+            data.push_back((uint8_t)(distance - 1));
+            if (code == Song::LONG_LENGTH)
+                data.push_back((uint8_t)(best - Song::MIN_MATCH - Song::LONG_LENGTH));
+            step = best;
+        } else {
+            pack_word(data, tokens[i]);
+        }
+        for (size_t k = i; k < i + step; k++) {
+            indexer.Add(tokens[k]);
+            if (k + 1 < tokens.size())
+                chains[motif_key(tokens[k], tokens[k + 1])].push_back((uint32_t)k);
+        }
+        i += step;
+    }
+    return part;
+}
+
+PackedPart compile_part(const std::vector<const Part *> &files, const Options &opt)
+{
+    std::vector<Token> tokens = event_tokens(part_events(files, opt.compression), opt.unit_ms);
+    if (opt.compression == MOTIF)
+        return compress_motifs(tokens, opt.index_events);
+    PackedPart part;
+    Indexer indexer(opt.index_events);
+    for (size_t i = 0; i < tokens.size(); i++) {
+        indexer.At(i, part, part.index);
+        indexer.Add(tokens[i]);
+        pack_word(part.data, tokens[i]);
+    }
+    return part;
+}
+
+/*
+    song_image()
+*/
+std::vector<uint8_t> song_image(const std::vector<PackedPart> &parts, int unit_ms)
+{
+    if (parts.size() > (size_t)SongImage::MAX_PARTS)
+        throw Error("--image takes at most 16 parts");
+    std::vector<uint8_t> table = {SongImage::VERSION, (uint8_t)parts.size(), (uint8_t)unit_ms,
+                                  (uint8_t)(unit_ms >> 8)};
+    std::vector<uint8_t> body;
+    auto put = [](std::vector<uint8_t> &out, uint32_t v) {
+        for (int i = 0; i < 4; i++)
+            out.push_back(v >> (8 * i));
+    };
+    uint32_t base = SongImage::SONG_HEADER_SIZE + SongImage::PART_SIZE * parts.size();
+    for (const PackedPart &part : parts) {
+        uint32_t data_offset = base + body.size();
+        body.insert(body.end(), part.data.begin(), part.data.end());
+        body.resize((body.size() + 3) & ~(size_t)3);
+        uint32_t index_offset = part.index.empty() ? 0 : base + body.size();
+        for (const Song::IndexEntry &e : part.index) {
+            put(body, e.units);
+            put(body, e.offset);
+        }
+        put(table, data_offset);
+        put(table, part.data.size());
+        put(table, index_offset);
+        put(table, part.index.size());
+    }
+    table.insert(table.end(), body.begin(), body.end());
+    return table;
+}
+
+/*
+    Transformer and song_table() for every part, and their bytes in `packed`
+*/
+std::string song_source(const std::vector<std::vector<Part>> &files, const Options &opt,
+                        std::vector<PackedPart> &packed_parts)
+{
+    std::string out;
+    char line[128];
+    for (int i = 0; i < opt.parts; i++) {
+        std::vector<const Part *> parts;
+        for (const std::vector<Part> &file : files)
+            parts.push_back(&file[i]);
+        packed_parts.push_back(compile_part(parts, opt));
+        const PackedPart &packed = packed_parts.back();
+        const std::vector<uint8_t> &data = packed.data;
+
+        snprintf(line, sizeof(line), "const uint8_t _song_part%d_data[] = {\n", i);
+        out += line;
+        for (size_t at = 0; at < data.size(); at += 16) {
+            out += "   ";
+            for (size_t j = at; j < std::min(at + 16, data.size()); j++) {
+                snprintf(line, sizeof(line), " 0x%02x,", data[j]);
+                out += line;
+            }
+            out += "\n";
+        }
+        out += "};\n";
+        // index_source()
+        char index[64] = "nullptr, 0";
+        if (!packed.index.empty()) {
+            snprintf(line, sizeof(line), "const Song::IndexEntry _song_part%d_index[] = {\n", i);
+            out += line;
+            for (size_t at = 0; at < packed.index.size(); at += 8) {
+                out += "   ";
+                for (size_t j = at; j < std::min(at + 8, packed.index.size()); j++) {
+                    snprintf(line, sizeof(line), " {%u, %u},", packed.index[j].units, packed.index[j].offset);
+                    out += line;
+                }
+                out += "\n";
+            }
+            out += "};\n";
+            snprintf(index, sizeof(index), "_song_part%d_index, %zu", i, packed.index.size());
+        }
+        snprintf(line, sizeof(line),
+                 "const Song::PackedSong _song_part%d = {_song_part%d_data, sizeof(_song_part%d_data), %d, %s};\n\n",
+                 i, i, i, opt.unit_ms, index);
+        out += line;
+    }
+    out += "const Song::PackedSong _song_parts[] = {";
+    for (int i = 0; i < opt.parts; i++) {
+        snprintf(line, sizeof(line), "%s_song_part%d", i ? ", " : "", i);
+        out += line;
+    }
+    snprintf(line, sizeof(line), "};\nconst int _song_part_count = %d;\n", opt.parts);
+    out += line;
+    return out;
+}
+
+std::vector<Part> compile_file(const std::string &path, const Options &opt)
+{
+    AllocationStats stats;
+    std::vector<std::vector<Event>> events = midi_to_events(read_midi(path), opt, stats);
+    // allocation_report()
+    fprintf(stderr, "%s: %zu notes, %zu dropped (%.1f%%), parts sound %.1f..%.1f s\n", path.c_str(), stats.notes,
+            stats.dropped, 100.0 * stats.dropped / std::max<size_t>(stats.notes, 1),
+            *std::min_element(stats.load.begin(), stats.load.end()) / 1000.0,
+            *std::max_element(stats.load.begin(), stats.load.end()) / 1000.0);
+    std::vector<Part> parts;
+    for (const std::vector<Event> &part : events)
+        parts.push_back(segment(part, opt.min_length_ms));
+    return parts;
+}
+
+void write_file(const std::string &path, const std::string &text)
+{
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f || fwrite(text.data(), 1, text.size(), f) != text.size() || fclose(f) != 0)
+        throw Error(path + ": " + strerror(errno));
+}
+
+void write_file(const std::string &path, const std::vector<uint8_t> &data)
+{
+    write_file(path, std::string(data.begin(), data.end()));
+}
+
+/*
+    Runs work(i) for every i < n on `jobs` threads, returns how many failed
+*/
+template <typename F> int parallel_for(size_t n, int jobs, F work)
+{
+    std::atomic<size_t> next{0};
+    std::atomic<int> failed{0};
+    auto worker = [&] {
+        for (size_t i; (i = next++) < n;) {
+            try {
+                work(i);
+            } catch (const std::exception &e) {
+                fprintf(stderr, "%s\n", e.what());
+                failed++;
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < std::min<size_t>(jobs, n); t++)
+        threads.emplace_back(worker);
+    worker();
+    for (std::thread &t : threads)
+        t.join();
+    return failed;
+}
+
+std::string stem(const std::string &path)
+{
+    size_t slash = path.find_last_of('/');
+    std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+    size_t dot = name.find_last_of('.');
+    return dot == std::string::npos || dot == 0 ? name : name.substr(0, dot);
+}
+
+void usage()
+{
+    fprintf(stderr, "usage: midi-compile [--parts N] [--unit-ms MS] [--min-length-ms MS] [--output FILE]\n"
+                    "                    [--allocation balanced|first-free] [--keep melody,velocity]\n"
+                    "                    [--compression motif|segments] [--index-events N] [--image FILE]\n"
+                    "                    [--batch DIR] [--jobs N] song.mid...\n");
+    exit(1);
+}
+
+std::vector<Keep> parse_keep(const std::string &list)
+{
+    std::vector<Keep> keep;
+    size_t at = 0;
+    while (at <= list.size()) {
+        size_t comma = std::min(list.find(',', at), list.size());
+        std::string criterion = list.substr(at, comma - at);
+        at = comma + 1;
+        if (criterion.empty())
+            continue;
+        if ((criterion != "melody" && criterion != "velocity") || keep.size() == MAX_KEEP)
+            usage();
+        keep.push_back(criterion == "melody" ? KEEP_MELODY : KEEP_VELOCITY);
+    }
+    return keep;
+}
+
+Options parse(int argc, char **argv)
+{
+    Options opt;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("--", 0) != 0) {
+            opt.files.push_back(arg);
+            continue;
+        }
+        if (i + 1 >= argc)
+            usage();
+        const char *v = argv[++i];
+        if (arg == "--parts")
+            opt.parts = atoi(v);
+        else if (arg == "--unit-ms")
+            opt.unit_ms = atoi(v);
+        else if (arg == "--min-length-ms")
+            opt.min_length_ms = atoll(v);
+        else if (arg == "--output")
+            opt.output = v;
+        else if (arg == "--batch")
+            opt.batch = v;
+        else if (arg == "--image")
+            opt.image = v;
+        else if (arg == "--allocation" && (!strcmp(v, "balanced") || !strcmp(v, "first-free")))
+            opt.allocation = strcmp(v, "balanced") ? FIRST_FREE : BALANCED;
+        else if (arg == "--keep")
+            opt.keep = parse_keep(v);
+        else if (arg == "--compression" && (!strcmp(v, "motif") || !strcmp(v, "segments")))
+            opt.compression = strcmp(v, "motif") ? SEGMENTS : MOTIF;
+        else if (arg == "--index-events")
+            opt.index_events = atoi(v);
+        else if (arg == "--jobs")
+            opt.jobs = atoi(v);
+        else
+            usage();
+    }
+    if (opt.files.empty() || opt.parts < 1 || opt.unit_ms < 1 || opt.index_events < 0)
+        usage();
+    if (opt.jobs < 1)
+        opt.jobs = std::max(1u, std::thread::hardware_concurrency());
+    return opt;
+}
+}
+
+int main(int argc, char **argv)
+{
+    Options opt = parse(argc, argv);
+
+    if (!opt.batch.empty()) {
+        int failed = parallel_for(opt.files.size(), opt.jobs, [&](size_t i) {
+            try {
+                std::vector<std::vector<Part>> song = {compile_file(opt.files[i], opt)};
+                std::vector<PackedPart> packed;
+                std::string name = stem(opt.files[i]);
+                write_file(opt.batch + "/" + name + ".cpp", song_source(song, opt, packed));
+                if (!opt.image.empty())
+                    write_file(opt.image + "/" + name + ".bin", song_image(packed, opt.unit_ms));
+            } catch (const Error &e) {
+                throw Error(opt.files[i] + ": " + e.what());
+            }
+        });
+        return failed ? 1 : 0;
+    }
+
+    // the files make one song, as for generate-music.py
+    std::vector<std::vector<Part>> files(opt.files.size());
+    int failed = parallel_for(opt.files.size(), opt.jobs, [&](size_t i) {
+        try {
+            files[i] = compile_file(opt.files[i], opt);
+        } catch (const Error &e) {
+            throw Error(opt.files[i] + ": " + e.what());
+        }
+    });
+    if (failed)
+        return 1;
+    try {
+        std::vector<PackedPart> packed;
+        write_file(opt.output, song_source(files, opt, packed));
+        if (!opt.image.empty())
+            write_file(opt.image, song_image(packed, opt.unit_ms));
+    } catch (const Error &e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,197 @@
+#include "SyntheticSong.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+/*
+    Size and decoding speed of Song::PackedSong against the music_event_t array that
+    tools/generate-music.py used to emit.
+
+    A part from SyntheticSong.h is stored both ways, checked to decode to the same events and
+    then walked repeatedly the way Playback's CueList walks it.
+
+    Given files of packed parts instead (the bytes of a _song_partN_data array, as
+    tools/motif-bench.py writes them), plays each one through Song::PackedSource, which expands
+    back-references, and reports its size and decoding cost.
+
+    Usage:
+        song-bench [--events 20000] [--repeat 200] [--unit-ms 5] [--seed 1]
+        song-bench [--repeat 200] [--unit-ms 5] part.bin...
+*/
+
+namespace {
+
+constexpr uint8_t EXAMPLE[] = {0xbc, 0x52, 0x00, 0xfc, 0x64, 0x00};
+static_assert(Song::decode(EXAMPLE, 5).period_us == 3822);
+static_assert(Song::decode(EXAMPLE, 5).duration_ms == 100);
+static_assert(Song::decode(EXAMPLE, 5).velocity == 161);
+static_assert(Song::decode(EXAMPLE + 2, 5).duration_ms == 500);
+static_assert(Song::count({EXAMPLE, sizeof(EXAMPLE), 5}) == 2);
+// the two events again a semitone up, then three and 36 events copied from two back
+constexpr uint8_t REFERENCES[] = {0xbc, 0x52, 0x00, 0xfc, 0x64, 0x00, 0x11, 0x00, 0x01,
+                                  0x30, 0x00, 0x01, 0xf0, 0x03, 0x01, 0x03};
+static_assert(Song::token_size(REFERENCES + 6) == 3 && Song::token_size(REFERENCES + 12) == 4);
+static_assert(Song::count({REFERENCES, sizeof(REFERENCES), 5}) == 2 + 2 + 3 + 36);
+
+/*
+    A reference transposing past the top note stays on it, at the velocity of the note it copies
+*/
+bool transposition_clamps()
+{
+    // note 120 at level 2, then two events 15 semitones up from one back
+    const uint8_t data[] = {0x78, 0x51, 0x1f, 0x00, 0x00};
+    Song::PackedSource source({data, sizeof(data), 5});
+    music_event_t e;
+    int events = 0;
+    while (source.Next(e) == Song::Source::EVENT) {
+        if (events++ > 0 && (e.period_us != (int)Song::PERIOD_US[127] || e.velocity != Song::VELOCITY[2]))
+            return false;
+    }
+    return events == 3;
+}
+
+struct Options
+{
+    int events = 20000;
+    int repeat = 200;
+    int unit_ms = 5;
+    uint64_t seed = 1;
+    std::vector<std::string> files;
+};
+
+template <typename F> double time_ns_per_event(const Options &opt, size_t events, F walk)
+{
+    auto start = std::chrono::steady_clock::now();
+    uint64_t sink = 0;
+    for (int r = 0; r < opt.repeat; r++)
+        sink += walk();
+    auto end = std::chrono::steady_clock::now();
+    // keep the loop from being optimised away
+    if (sink == 42)
+        printf(" ");
+    return std::chrono::duration<double, std::nano>(end - start).count() / ((double)opt.repeat * events);
+}
+
+void usage()
+{
+    fprintf(stderr, "usage: song-bench [--events N] [--repeat N] [--unit-ms MS] [--seed N] [part.bin...]\n");
+    exit(1);
+}
+
+/*
+    Events and decoding cost of every file, through PackedSource as Playback reads them
+*/
+int bench_files(const Options &opt)
+{
+    printf("file                                   bytes   events  bytes/event  decode ns/event\n");
+    for (const std::string &name : opt.files) {
+        std::ifstream in(name, std::ios::binary);
+        if (!in) {
+            fprintf(stderr, "cannot read %s\n", name.c_str());
+            return 1;
+        }
+        std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        Song::PackedSong song = {data.data(), (uint32_t)data.size(), (uint16_t)opt.unit_ms};
+        size_t n = 0;
+        music_event_t e;
+        Song::PackedSource counter(song);
+        while (counter.Next(e) == Song::Source::EVENT)
+            n++;
+        if (Song::count(song) != n) {
+            fprintf(stderr, "%s: count() gives %u events, expanding gives %zu\n", name.c_str(), (unsigned)Song::count(song), n);
+            return 1;
+        }
+        double ns = time_ns_per_event(opt, std::max<size_t>(n, 1), [&] {
+            // the window is part of the source, as for every track Playback holds
+            Song::PackedSource source(song);
+            uint64_t total = 0;
+            music_event_t e;
+            while (source.Next(e) == Song::Source::EVENT)
+                total += e.period_us + e.duration_ms + e.velocity;
+            return total;
+        });
+        printf("%-36s %8zu %8zu %12.2f %16.2f\n", name.c_str(), data.size(), n, (double)data.size() / std::max<size_t>(n, 1), ns);
+    }
+    return 0;
+}
+}
+
+int main(int argc, char **argv)
+{
+    Options opt;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("--", 0) != 0) {
+            opt.files.push_back(arg);
+            continue;
+        }
+        if (i + 1 >= argc)
+            usage();
+        const char *v = argv[++i];
+        if (arg == "--events")
+            opt.events = atoi(v);
+        else if (arg == "--repeat")
+            opt.repeat = atoi(v);
+        else if (arg == "--unit-ms")
+            opt.unit_ms = atoi(v);
+        else if (arg == "--seed")
+            opt.seed = strtoull(v, nullptr, 10);
+        else
+            usage();
+    }
+    if (!transposition_clamps()) {
+        fprintf(stderr, "a transposed reference leaves the note range\n");
+        return 1;
+    }
+    if (!opt.files.empty())
+        return bench_files(opt);
+
+    std::vector<music_event_t> events = SyntheticSong::Make(opt.events, opt.seed);
+    std::vector<uint8_t> data = SyntheticSong::Pack(events, opt.unit_ms);
+    Song::PackedSong song = {data.data(), (uint32_t)data.size(), (uint16_t)opt.unit_ms};
+
+    size_t i = 0;
+    Song::PackedSource check(song);
+    music_event_t e;
+    while (check.Next(e) == Song::Source::EVENT) {
+        const music_event_t &want = events[i++];
+        if (e.period_us != want.period_us || e.duration_ms != want.duration_ms || e.velocity != want.velocity) {
+            fprintf(stderr, "event %zu decodes differently\n", i - 1);
+            return 1;
+        }
+    }
+    if (i != events.size()) {
+        fprintf(stderr, "decoded %zu of %zu events\n", i, events.size());
+        return 1;
+    }
+
+    const music_event_t *array = events.data();
+    size_t n = events.size();
+    double array_ns = time_ns_per_event(opt, n, [&] {
+        uint64_t total = 0;
+        for (size_t k = 0; k < n; k++)
+            total += array[k].period_us + array[k].duration_ms + array[k].velocity;
+        return total;
+    });
+    double packed_ns = time_ns_per_event(opt, n, [&] {
+        uint64_t total = 0;
+        Song::PackedSource source(song);
+        music_event_t e;
+        while (source.Next(e) == Song::Source::EVENT)
+            total += e.period_us + e.duration_ms + e.velocity;
+        return total;
+    });
+
+    printf("%zu events, unit %d ms\n", n, opt.unit_ms);
+    printf("format            bytes  bytes/event  decode ns/event\n");
+    printf("music_event_t  %8zu  %11.2f  %15.2f\n", n * sizeof(music_event_t), (double)sizeof(music_event_t),
+           array_ns);
+    printf("PackedSong     %8zu  %11.2f  %15.2f\n", data.size(), (double)data.size() / n, packed_ns);
+    return 0;
+}
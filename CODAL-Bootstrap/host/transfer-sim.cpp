@@ -0,0 +1,311 @@
+#include "MicroBit.h"
+#include "Playback.h"
+#include "SongTransfer.h"
+#include "Synchronization.h"
+#include "SyntheticSong.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/*
+    Benchmark for SongTransfer on simulated ensembles.
+
+    Every node runs ClockSync::Init() and Sync(), then the master serves one synthetic part per
+    rank (SyntheticSong.h) and the followers receive theirs. By default a follower reads its
+    ring as fast as chunks come in, so the numbers are those of the radio protocol alone. With
+    --play every node plays its part instead, the master from flash and the followers from the
+    ring while it fills, and the report shows whether the stream kept ahead of the song.
+    --background runs ClockSync::StartBackgroundSync() alongside, as main.cpp does.
+
+    Completion is measured from the moment the master starts serving. A follower checks every
+    event it reads against the part it should have got.
+
+    Usage:
+        transfer-sim [--nodes 3,10,30] [--loss 0,0.01,0.05] [--events 2000] [--trials 3]
+                     [--latency-us 300] [--jitter-us 200] [--no-collisions] [--play]
+                     [--background] [--timeout-s 120] [--seed 1] [--verbose]
+*/
+
+namespace {
+
+const ClockSync::timestamp_t START_DELAY_US = 100000;
+
+// a draining follower stops waiting for the next chunk after this long
+const int GIVE_UP_MS = 5000;
+
+struct Options
+{
+    std::vector<int> nodes = {3, 10, 30};
+    std::vector<double> losses = {0, 0.01, 0.05};
+    int events = 2000;
+    int trials = 3;
+    bool play = false;
+    bool background = false;
+    double timeout_s = 120;
+    Sim::NetworkConfig net;
+};
+
+struct NodeResult
+{
+    Sim::sim_time_t done = -1;  // follower: last event read, master: stopped serving
+    uint32_t events = 0;
+    uint32_t wrong = 0;
+    SongTransfer::Stats transfer = {};
+    Playback::Stats playback = {};
+};
+
+struct TrialResult
+{
+    std::vector<NodeResult> nodes;
+    Sim::sim_time_t serve_start = -1;
+    int master = 0;
+};
+
+TrialResult run_trial(const Options &opt, int n, double loss, uint64_t seed,
+                      const std::vector<std::vector<music_event_t>> &songs,
+                      const std::vector<Song::PackedSong> &parts)
+{
+    Sim::NetworkConfig net_config = opt.net;
+    net_config.seed = seed;
+    net_config.loss = loss;
+    Sim::Network net(net_config);
+    std::mt19937_64 rng(seed);
+
+    TrialResult trial;
+    trial.nodes.resize(n);
+    std::vector<uint32_t> serials;
+    while ((int)serials.size() < n) {
+        uint32_t s = (uint32_t)rng();
+        if (std::find(serials.begin(), serials.end(), s) == serials.end())
+            serials.push_back(s);
+    }
+    trial.master = std::min_element(serials.begin(), serials.end()) - serials.begin();
+
+    for (int i = 0; i < n; i++) {
+        Sim::NodeConfig c;
+        c.serial = serials[i];
+        c.boot_us = rng() % 200000;
+        c.clock_offset_us = rng() % 10000000;
+        c.drift_ppm = (int)(rng() % 101) - 50;
+
+        NodeResult *r = &trial.nodes[i];
+        Sim::sim_time_t *serve_start = &trial.serve_start;
+        net.AddNode(c, [r, n, serve_start, &opt, &songs, &parts] {
+            auto uBit = std::make_shared<MicroBit>();
+            uBit->init();
+            ClockSync::Init(uBit, n);
+            ClockSync::Sync();
+            if (opt.background)
+                ClockSync::StartBackgroundSync();
+            int rank = ClockSync::Rank();
+            ClockSync::timestamp_t start = ClockSync::UnblockTime() + START_DELAY_US;
+
+            if (rank == 0) {
+                *serve_start = Sim::Now();
+                SongTransfer::Serve(uBit, parts.data(), parts.size());
+                if (opt.play)
+                    Playback::Play(uBit, &uBit->audio.virtualOutputPin, parts[0], start);
+                while (SongTransfer::Serving() || Playback::Playing()) {
+                    uBit->sleep(10);
+                    r->transfer = SongTransfer::GetStats();
+                }
+                r->done = Sim::Now();
+                r->playback = Playback::GetStats();
+                ClockSync::StopBackgroundSync();
+                return;
+            }
+
+            const std::vector<music_event_t> &expected = songs[rank % songs.size()];
+            Song::Source &source = SongTransfer::Receive(uBit);
+            if (opt.play) {
+                Playback::Play(uBit, &uBit->audio.virtualOutputPin, source, start);
+                while (Playback::Playing())
+                    uBit->sleep(10);
+                r->events = expected.size();
+                r->done = Sim::Now();
+            } else {
+                music_event_t e;
+                Song::Source::Status status;
+                int waited_ms = 0;
+                while ((status = source.Next(e)) != Song::Source::END && waited_ms < GIVE_UP_MS) {
+                    if (status == Song::Source::PENDING) {
+                        uBit->sleep(1);
+                        waited_ms++;
+                        continue;
+                    }
+                    waited_ms = 0;
+                    const music_event_t &want = expected[std::min<size_t>(r->events, expected.size() - 1)];
+                    if (r->events >= expected.size() || e.period_us != want.period_us ||
+                        e.duration_ms != want.duration_ms || e.velocity != want.velocity)
+                        r->wrong++;
+                    r->events++;
+                }
+                if (status == Song::Source::END)
+                    r->done = Sim::Now();
+            }
+            // the master may still be waiting for our last acknowledgement
+            uBit->sleep(2000);
+            r->transfer = SongTransfer::GetStats();
+            r->playback = Playback::GetStats();
+            SongTransfer::Stop();
+            ClockSync::StopBackgroundSync();
+        });
+    }
+
+    net.Run((Sim::sim_time_t)(opt.timeout_s * 1e6));
+    return trial;
+}
+
+void report(const Options &opt, int n, double loss, const std::vector<TrialResult> &trials)
+{
+    std::vector<double> done_ms;
+    double events = 0, last_ms = 0, data = 0, retransmitted = 0, rounds = 0;
+    uint32_t wrong = 0, underruns = 0, late = 0, max_late_us = 0;
+    int complete = 0, followers = 0;
+    for (const TrialResult &t : trials) {
+        for (int i = 0; i < n; i++) {
+            const NodeResult &r = t.nodes[i];
+            if (i == t.master) {
+                data += r.transfer.data_packets;
+                retransmitted += r.transfer.retransmissions;
+                rounds += r.transfer.rounds;
+                continue;
+            }
+            followers++;
+            underruns += r.playback.underruns;
+            late += r.playback.late;
+            max_late_us = std::max(max_late_us, r.playback.max_late_us);
+            if (r.done < 0 || t.serve_start < 0)
+                continue;
+            complete++;
+            wrong += r.wrong;
+            double ms = (r.done - t.serve_start) / 1000.0;
+            done_ms.push_back(ms);
+            last_ms = std::max(last_ms, ms);
+            events += r.events;
+        }
+    }
+
+    printf("%5d %6.3f %4d/%-5d %9.0f %9.0f %11.0f %9.0f %9.0f %7.0f %6u", n, loss, complete, followers,
+           Sim::Percentile(done_ms, 50), Sim::Percentile(done_ms, 100),
+           last_ms > 0 ? events / trials.size() / (last_ms / 1000.0) : 0, data / trials.size(),
+           retransmitted / trials.size(), rounds / trials.size(), wrong);
+    if (opt.play)
+        printf(" %9u %6u %8.2f", underruns, late, max_late_us / 1000.0);
+    printf("\n");
+}
+
+std::vector<int> parse_list(const char *s)
+{
+    std::vector<int> out;
+    while (*s) {
+        out.push_back(atoi(s));
+        const char *comma = strchr(s, ',');
+        if (comma == nullptr)
+            break;
+        s = comma + 1;
+    }
+    return out;
+}
+
+std::vector<double> parse_doubles(const char *s)
+{
+    std::vector<double> out;
+    while (*s) {
+        out.push_back(atof(s));
+        const char *comma = strchr(s, ',');
+        if (comma == nullptr)
+            break;
+        s = comma + 1;
+    }
+    return out;
+}
+
+void usage()
+{
+    fprintf(stderr, "usage: transfer-sim [--nodes 3,10,30] [--loss 0,0.01,0.05] [--events N] [--trials N]\n"
+                    "                    [--latency-us US] [--jitter-us US] [--no-collisions] [--play]\n"
+                    "                    [--background] [--timeout-s S] [--seed N] [--verbose]\n");
+    exit(1);
+}
+}
+
+int main(int argc, char **argv)
+{
+    Options opt;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--verbose") {
+            opt.net.verbose = true;
+            continue;
+        }
+        if (arg == "--play") {
+            opt.play = true;
+            continue;
+        }
+        if (arg == "--background") {
+            opt.background = true;
+            continue;
+        }
+        if (arg == "--no-collisions") {
+            opt.net.collisions = false;
+            continue;
+        }
+        if (i + 1 >= argc)
+            usage();
+        const char *v = argv[++i];
+        if (arg == "--nodes")
+            opt.nodes = parse_list(v);
+        else if (arg == "--loss")
+            opt.losses = parse_doubles(v);
+        else if (arg == "--events")
+            opt.events = atoi(v);
+        else if (arg == "--trials")
+            opt.trials = atoi(v);
+        else if (arg == "--latency-us")
+            opt.net.latency_us = atoll(v);
+        else if (arg == "--jitter-us")
+            opt.net.jitter_us = atoll(v);
+        else if (arg == "--timeout-s")
+            opt.timeout_s = atof(v);
+        else if (arg == "--seed")
+            opt.net.seed = strtoull(v, nullptr, 10);
+        else
+            usage();
+    }
+
+    printf("%s, %d events per part, latency %lld us, jitter %lld us, collisions %s, %d trials\n",
+           opt.play ? "followers play from the ring" : "followers drain the ring", opt.events,
+           (long long)opt.net.latency_us, (long long)opt.net.jitter_us, opt.net.collisions ? "on" : "off",
+           opt.trials);
+    printf("times in ms from the master starting to serve; events/s over all followers until the last is done\n");
+    printf("nodes   loss   complete   done p50       max    events/s      data   resent  rounds  wrong");
+    if (opt.play)
+        printf(" underruns   late  max late");
+    printf("\n");
+
+    for (int n : opt.nodes) {
+        // one part per rank, as the generator would split the song for n boards
+        std::vector<std::vector<music_event_t>> songs;
+        std::vector<std::vector<uint8_t>> data;
+        std::vector<Song::PackedSong> parts;
+        for (int p = 0; p < n; p++) {
+            songs.push_back(SyntheticSong::Make(opt.events, opt.net.seed * 1000 + p));
+            data.push_back(SyntheticSong::Pack(songs.back(), 5));
+        }
+        for (const std::vector<uint8_t> &d : data)
+            parts.push_back({d.data(), (uint32_t)d.size(), 5});
+
+        for (double loss : opt.losses) {
+            std::vector<TrialResult> trials;
+            for (int t = 0; t < opt.trials; t++)
+                trials.push_back(run_trial(opt, n, loss, opt.net.seed + t, songs, parts));
+            report(opt, n, loss, trials);
+        }
+    }
+    return 0;
+}
@@ -1,12 +1,10 @@
-
-import sys
 with open('./main-tmp.cpp') as f:
   data= f.read()
 
-with open(f'../tools/note{sys.argv[1]}.cpp') as f:
-  note = f.read()
+# every part of the song, written by tools/generate-music.py
+with open('../tools/song.cpp') as f:
+  song = f.read()
 
-data = data.replace('XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX', note)
+data = data.replace('XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX', song)
 with open('./source/main.cpp', 'w') as f:
   f.write(data)
-
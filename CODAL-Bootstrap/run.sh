@@ -1,32 +1,35 @@
 #!/bin/bash
 
-declare -i numubits=0
-
-for i in {0..10}
-do
-  if test -f "../tools/note$i.cpp"; then
-    numubits=i+1
-  else
-    break
+# One image for every microbit: it carries all parts of tools/song.cpp and each
+# device plays the one matching its rank in master selection, see ClockSync::Rank
+#
+# ./run.sh song writes tools/song.bin (generate-music.py --image) into the
+# MICROBIT.hex of the last build instead, in well under a second, see SongImage.h
+if test "$1" = "song"; then
+  if ! test -f MICROBIT.hex; then
+    echo "MICROBIT.hex not found, run ./run.sh once first"
+    exit 1
+  fi
+  python3 ../tools/patch-hex.py MICROBIT.hex ../tools/song.bin --output MICROBIT-song.hex || exit 1
+  image=MICROBIT-song.hex
+else
+  if ! test -f "../tools/song.cpp"; then
+    echo "../tools/song.cpp not found, run tools/generate-music.py first"
+    exit 1
   fi
-done
 
-echo "found $numubits note files"
+  rm MICROBIT.hex
+  cmake -B cmake-build-file .
 
-rm MICROBIT.hex
-cmake -B cmake-build-file .
-
-for (( i=0; i<numubits; i++ ))
-do
-  python3 replace.py $i
+  python3 replace.py
 
   cmake --build cmake-build-file --target MICROBIT_hex "-j6"
+  image=MICROBIT.hex
+fi
 
-  md5 MICROBIT.hex
-  mv MICROBIT.hex MICROBIT0.hex
-  cp MICROBIT0.hex /Volumes/MICROBIT/MICROBIT.hex
-done
+md5 $image
 
-cp MICROBIT0.hex /Volumes/MICROBIT/MICROBIT.hex
-cp MICROBIT1.hex /Volumes/MICROBIT\ 1/MICROBIT.hex
-cp MICROBIT2.hex /Volumes/MICROBIT\ 2/MICROBIT.hex
+for volume in /Volumes/MICROBIT*
+do
+  cp $image "$volume/MICROBIT.hex"
+done
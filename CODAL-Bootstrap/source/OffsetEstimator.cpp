@@ -0,0 +1,102 @@
+#include "OffsetEstimator.h"
+
+#include <math.h>
+
+namespace ClockSync {
+
+void OffsetEstimator::Reset()
+{
+    count = 0;
+    next = 0;
+    offset = 0;
+    skew = 0;
+    reference = 0;
+    error = 0;
+}
+
+void OffsetEstimator::Add(uint64_t local, int64_t o, int32_t delay)
+{
+    samples[next] = {local, o, delay};
+    next = (next + 1) % MAX_SAMPLES;
+    if (count < MAX_SAMPLES)
+        count++;
+}
+
+bool OffsetEstimator::Fit(int keep)
+{
+    if (count == 0)
+        return false;
+    if (keep < 1 || keep > count)
+        keep = count;
+
+    // insertion sort of sample indices by delay, count is tiny
+    int order[MAX_SAMPLES];
+    for (int i = 0; i < count; i++) {
+        int j = i;
+        while (j > 0 && samples[order[j - 1]].delay > samples[i].delay) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+    // equal delays say nothing about which sample is better, keep all of them rather than
+    // whichever happen to come first in the buffer
+    while (keep < count && samples[order[keep]].delay == samples[order[keep - 1]].delay)
+        keep++;
+
+    // work relative to the first kept sample so the sums stay small
+    uint64_t base = samples[order[0]].local;
+    int64_t base_o = samples[order[0]].offset;
+    double sum_t = 0, sum_o = 0;
+    int64_t min_t = 0, max_t = 0;
+    for (int k = 0; k < keep; k++) {
+        const Sample &s = samples[order[k]];
+        int64_t t = (int64_t)(s.local - base);
+        sum_t += t;
+        sum_o += s.offset - base_o;
+        if (t < min_t)
+            min_t = t;
+        if (t > max_t)
+            max_t = t;
+    }
+    double mean_t = sum_t / keep;
+    double mean_o = sum_o / keep;
+
+    double slope = 0;
+    if (keep >= 3 && (uint64_t)(max_t - min_t) >= MIN_SKEW_SPAN) {
+        double sxx = 0, sxy = 0;
+        for (int k = 0; k < keep; k++) {
+            const Sample &s = samples[order[k]];
+            double dt = (int64_t)(s.local - base) - mean_t;
+            sxx += dt * dt;
+            sxy += dt * (s.offset - base_o - mean_o);
+        }
+        // the error of the slope is the offset noise over sqrt(sxx), a single late sample
+        // next to a burst gives a long span but not a usable slope
+        slope = sxx >= (double)MIN_SKEW_SPREAD * MIN_SKEW_SPREAD ? sxy / sxx : 0;
+        // more than MAX_SKEW is not a crystal, most likely a bad sample, fall back to the mean
+        if (slope * 4294967296.0 > MAX_SKEW || slope * 4294967296.0 < -MAX_SKEW)
+            slope = 0;
+    }
+
+    double sum_r2 = 0;
+    for (int k = 0; k < keep; k++) {
+        const Sample &s = samples[order[k]];
+        double dt = (int64_t)(s.local - base) - mean_t;
+        double r = s.offset - base_o - mean_o - slope * dt;
+        sum_r2 += r * r;
+    }
+
+    reference = base + (int64_t)(mean_t >= 0 ? mean_t + 0.5 : mean_t - 0.5);
+    offset = base_o + (int64_t)(mean_o >= 0 ? mean_o + 0.5 : mean_o - 0.5);
+    skew = (int32_t)(slope * 4294967296.0);
+    error = (uint32_t)(sqrt(sum_r2 / keep) + 0.5);
+    return true;
+}
+
+int64_t OffsetEstimator::Correction(uint64_t local) const
+{
+    // (local - reference) * skew stays within 64 bits for ~50 days at MAX_SKEW
+    return offset + (((int64_t)(local - reference) * skew) >> 32);
+}
+}
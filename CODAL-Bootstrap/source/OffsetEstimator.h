@@ -0,0 +1,84 @@
+#ifndef OFFSET_ESTIMATOR_H
+#define OFFSET_ESTIMATOR_H
+
+#include <stdint.h>
+
+/*
+    Main idea:
+        A single SYNC/DELAY_REQ exchange gives one offset, and a packet delayed on either leg
+        biases it by half of the extra delay. Instead, keep the last MAX_SAMPLES exchanges and
+        estimate from the ones with the lowest round trip delay, which are the least likely to
+        have been queued somewhere.
+
+        With enough of them spread over time, fit a line
+            offset(t) = offset + skew * (t - reference)
+        so that crystal drift between the follower and the master is corrected as well.
+
+    Units:
+        local times and offsets are in microseconds like ClockSync::timestamp_t, skew is the
+        rate difference scaled by 2^32 (1 ppm ~ 4295)
+*/
+
+namespace ClockSync {
+class OffsetEstimator
+{
+public:
+    static const int MAX_SAMPLES = 32;
+
+    // skew is only fitted when the kept samples span at least this long (10s), shorter spans
+    // give a slope dominated by timestamp noise
+    static const uint64_t MIN_SKEW_SPAN = 10000000;
+    // and the samples are spread out, sqrt(sum (t - mean t)^2) >= 20s, so that the slope is
+    // within ~10 ppm with a couple of hundred microseconds of jitter
+    static const uint64_t MIN_SKEW_SPREAD = 20000000;
+    static const int32_t MAX_SKEW = 500 * 4295; // 500 ppm
+
+    /*
+        Post:
+            drops every sample and the fit, Correction() returns 0
+    */
+    void Reset();
+
+    /*
+        Pre:
+            delay >= 0, a negative round trip means the DELAY_RESP belonged to an older request
+        Post:
+            the sample replaces the oldest one once MAX_SAMPLES are stored
+    */
+    void Add(uint64_t local, int64_t offset, int32_t delay);
+
+    int Size() const { return count; }
+
+    /*
+        Post:
+            offset, skew and reference describe the fit over the `keep` lowest-delay samples,
+            error is the root mean square of their residuals around it, returns false (and
+            leaves them untouched) if there are no samples
+    */
+    bool Fit(int keep);
+
+    /*
+        Returns the correction to add to the local time `local`
+    */
+    int64_t Correction(uint64_t local) const;
+
+    int64_t offset = 0;
+    int32_t skew = 0;
+    uint64_t reference = 0;
+    uint32_t error = 0;
+
+private:
+    struct Sample
+    {
+        uint64_t local;
+        int64_t offset;
+        int32_t delay;
+    };
+
+    Sample samples[MAX_SAMPLES];
+    int count = 0;
+    int next = 0;
+};
+}
+
+#endif
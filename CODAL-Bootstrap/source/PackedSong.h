@@ -0,0 +1,345 @@
+#ifndef PACKED_SONG_H
+#define PACKED_SONG_H
+
+#include <stdint.h>
+
+/*
+    Main idea:
+        A song as generated by tools/generate-music.py used to be an array of music_event_t,
+        three ints per event. Most of that is redundant: the period is always one of the 128
+        MIDI notes, the velocity one of a handful of loudness levels, and the durations of a
+        performance do not need millisecond precision. Store instead
+
+            word (16 bits, little endian)
+                bits  0..6   pitch, MIDI note number, 0 for a rest
+                bits  7..9   velocity level, index into VELOCITY
+                bits 10..15  duration in units of PackedSong::unit_ms, 1..62
+            if the duration field is LONG_DURATION (63)
+                uint16_t     duration in units, little endian
+
+        so an event takes 2 bytes, 4 for notes and rests longer than 62 units.
+
+    Back-references:
+        a word with duration field REFERENCE (0) repeats earlier events instead
+            bits  0..4   transposition + 16 in semitones, applied to notes, not to rests
+            bits  5..9   length - MIN_MATCH, LONG_LENGTH if the length byte follows
+            uint8_t      distance - 1, how many events back the copy starts
+            uint8_t      length - MIN_MATCH - LONG_LENGTH, if present
+        the copy may overlap the events it produces, so a phrase played n times in a row is
+        one reference. tools/generate-music.py writes them for phrases that repeat within the
+        last WINDOW events, Expander plays them back from a copy of those.
+
+    Index:
+        every INDEX_EVENTS events or so, the generator notes where the next event or
+        back-reference starts and how many units of the song come before it. No reference
+        reaches back past such an entry, so decoding can start there with an empty window.
+        PackedSource::Seek() finds the last entry before the time it is given by binary search
+        and decodes at most one interval of events from there, instead of the whole song up to
+        it. Songs without an index are decoded from the start.
+
+    Quantisation:
+        the generator rounds the start of every event to the unit grid and takes durations as
+        differences of those, so the error stays within half a unit over the whole song
+        instead of adding up. Events that round to no length are dropped.
+
+    Decoding:
+        PackedSource reads straight from the flash copy of the song, its Expander holds the
+        window the back-references copy from. decode() and count() are constexpr, count() only
+        needs the lengths of the references, not the events they copy
+
+    RAM:
+        the window takes WINDOW entries of 4 bytes, 1 KB for each part being decoded: one per
+        part Playback plays (1 KB by default, at most 8 KB with Synth::MAX_VOICES parts mixed,
+        of the 128 KB of a V2) plus one in SongTransfer's ring on a follower. It cannot be read
+        back from flash instead, a reference may copy events that were copied themselves and so
+        only exist expanded. In exchange a part takes about a third of the flash it took as
+        plain events (tools/motif-bench.py), which is what lets songs fit SongImage's 64 KB
+*/
+
+#define ARTICULATION_MS 10
+
+typedef struct {
+    int period_us;
+    int duration_ms;
+    int velocity;
+} music_event_t;
+
+namespace Song {
+
+// period of every MIDI note in microseconds, round(1e6 / (440 * 2^((n - 69) / 12)))
+constexpr uint32_t PERIOD_US[128] = {
+    122312, 115447, 108968, 102852, 97079, 91631, 86488, 81634,
+    77052, 72727, 68645, 64793, 61156, 57724, 54484, 51426,
+    48540, 45815, 43244, 40817, 38526, 36364, 34323, 32396,
+    30578, 28862, 27242, 25713, 24270, 22908, 21622, 20408,
+    19263, 18182, 17161, 16198, 15289, 14431, 13621, 12856,
+    12135, 11454, 10811, 10204, 9631, 9091, 8581, 8099,
+    7645, 7215, 6810, 6428, 6067, 5727, 5405, 5102,
+    4816, 4545, 4290, 4050, 3822, 3608, 3405, 3214,
+    3034, 2863, 2703, 2551, 2408, 2273, 2145, 2025,
+    1911, 1804, 1703, 1607, 1517, 1432, 1351, 1276,
+    1204, 1136, 1073, 1012, 956, 902, 851, 804,
+    758, 716, 676, 638, 602, 568, 536, 506,
+    478, 451, 426, 402, 379, 358, 338, 319,
+    301, 284, 268, 253, 239, 225, 213, 201,
+    190, 179, 169, 159, 150, 142, 134, 127,
+    119, 113, 106, 100, 95, 89, 84, 80,
+};
+
+// analog values of the velocity levels, geometric between the quietest note the generator
+// keeps (11) and the loudest midi_velocity() produces (472)
+constexpr uint16_t VELOCITY[8] = {11, 19, 32, 55, 94, 161, 275, 472};
+
+constexpr int PITCH_BITS = 7;
+constexpr int VELOCITY_BITS = 3;
+constexpr int DURATION_SHIFT = PITCH_BITS + VELOCITY_BITS;
+constexpr int PITCH_MASK = (1 << PITCH_BITS) - 1;
+constexpr uint16_t LONG_DURATION = 63;
+
+constexpr uint16_t REFERENCE = 0;
+constexpr int MIN_MATCH = 2;
+constexpr int LONG_LENGTH = 31;
+constexpr int WINDOW = 256;
+
+// tools/generate-music.py --index-events default
+constexpr int INDEX_EVENTS = 512;
+
+struct IndexEntry
+{
+    uint32_t units;     // start of the token, in units from the start of the song
+    uint32_t offset;    // bytes from the start of the song
+};
+
+struct PackedSong
+{
+    const uint8_t *data;
+    uint32_t size;      // bytes
+    uint16_t unit_ms;   // duration unit
+    const IndexEntry *index = nullptr;  // by increasing units
+    uint32_t index_size = 0;
+};
+
+constexpr uint16_t read_u16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+/*
+    Pre:
+        p points at the start of an event or a back-reference
+    Post:
+        returns its size in bytes
+*/
+constexpr int token_size(const uint8_t *p)
+{
+    uint16_t word = read_u16(p);
+    if ((word >> DURATION_SHIFT) == REFERENCE)
+        return ((word >> 5) & 31) == LONG_LENGTH ? 4 : 3;
+    return (word >> DURATION_SHIFT) == LONG_DURATION ? 4 : 2;
+}
+
+/*
+    Pre:
+        p points at the start of an event or a back-reference
+    Post:
+        returns the number of events it stands for, 1 for an event
+*/
+constexpr int token_events(const uint8_t *p)
+{
+    uint16_t word = read_u16(p);
+    if ((word >> DURATION_SHIFT) != REFERENCE)
+        return 1;
+    int code = (word >> 5) & 31;
+    return MIN_MATCH + code + (code == LONG_LENGTH ? p[3] : 0);
+}
+
+// the event of pitch and velocity bits `note` lasting `units`
+constexpr music_event_t event_of(uint16_t note, uint32_t units, uint16_t unit_ms)
+{
+    int pitch = note & PITCH_MASK;
+    int level = (note >> PITCH_BITS) & ((1 << VELOCITY_BITS) - 1);
+    music_event_t e = {};
+    e.period_us = pitch == 0 ? 0 : (int)PERIOD_US[pitch];
+    e.duration_ms = (int)(units * unit_ms);
+    e.velocity = pitch == 0 ? 0 : VELOCITY[level];
+    return e;
+}
+
+constexpr music_event_t decode(const uint8_t *p, uint16_t unit_ms)
+{
+    uint16_t word = read_u16(p);
+    uint32_t units = word >> DURATION_SHIFT;
+    if (units == LONG_DURATION)
+        units = read_u16(p + 2);
+    return event_of(word, units, unit_ms);
+}
+
+/*
+    Turns events and back-references into events, keeping the last WINDOW events to copy from.
+    A reference is expanded one event per call, so it costs no more than the events it stands for
+*/
+class Expander
+{
+public:
+    /*
+        Pre:
+            token holds the whole event or reference at the read position, see token_size()
+        Post:
+            e is the next event, returns how far to move the read position: the token's size,
+            or 0 while a reference has events left
+    */
+    int Next(const uint8_t *token, uint16_t unit_ms, music_event_t &e)
+    {
+        uint16_t word = read_u16(token);
+        uint16_t field = word >> DURATION_SHIFT;
+        if (field != REFERENCE) {
+            Entry entry = {(uint16_t)(word & ((1 << DURATION_SHIFT) - 1)),
+                           field == LONG_DURATION ? read_u16(token + 2) : field};
+            e = push(entry, unit_ms);
+            return field == LONG_DURATION ? 4 : 2;
+        }
+        int code = (word >> 5) & 31;
+        if (left == 0)
+            left = token_events(token);
+        Entry entry = window[(written - (token[2] + 1)) % WINDOW];
+        int pitch = entry.note & PITCH_MASK;
+        if (pitch != 0) {
+            // only a corrupt song leaves the note range, it must not carry into the velocity
+            pitch += (word & 31) - 16;
+            pitch = pitch < 1 ? 1 : pitch > PITCH_MASK ? PITCH_MASK : pitch;
+            entry.note = (uint16_t)((entry.note & ~PITCH_MASK) | pitch);
+        }
+        e = push(entry, unit_ms);
+        return --left == 0 ? (code == LONG_LENGTH ? 4 : 3) : 0;
+    }
+
+    // in the middle of a reference
+    bool Copying() const { return left > 0; }
+
+    // forgets the window, before decoding from an IndexEntry
+    void Reset()
+    {
+        written = 0;
+        left = 0;
+    }
+
+private:
+    struct Entry
+    {
+        uint16_t note;  // pitch and velocity bits
+        uint16_t units;
+    };
+    static_assert(sizeof(Entry) == 4, "the window is budgeted at 4 bytes an event");
+
+    music_event_t push(Entry entry, uint16_t unit_ms)
+    {
+        window[written++ % WINDOW] = entry;
+        return event_of(entry.note, entry.units, unit_ms);
+    }
+
+    Entry window[WINDOW] = {};
+    uint32_t written = 0;
+    int left = 0;               // events of the current reference still to give
+};
+
+/*
+    Where Playback takes the events from, either a PackedSong in flash or one that is still
+    arriving over the radio (see SongTransfer.h)
+*/
+class Source
+{
+public:
+    enum Status { EVENT, PENDING, END };
+
+    /*
+        Post:
+            EVENT and the next event in e, or
+            PENDING if it has not arrived yet, the call can be repeated later, or
+            END after the last event
+    */
+    virtual Status Next(music_event_t &e) = 0;
+
+protected:
+    ~Source() = default;
+};
+
+class PackedSource : public Source
+{
+public:
+    PackedSource() = default;
+    explicit PackedSource(const PackedSong &song) : song(song), p(song.data), end(song.data + song.size), unit_ms(song.unit_ms) {}
+
+    Status Next(music_event_t &e) override
+    {
+        if (held) {
+            e = held_event;
+            held = false;
+            return EVENT;
+        }
+        if (p >= end)
+            return END;
+        p += expander.Next(p, unit_ms, e);
+        return EVENT;
+    }
+
+    /*
+        Post:
+            Next() gives the event sounding `ms` into the song and the ones after it, returns
+            when that event starts, <= ms. Past the end, Next() gives END and the length of
+            the song is returned
+    */
+    uint32_t Seek(uint32_t ms)
+    {
+        // the last entry starting at or before ms
+        uint32_t lo = 0, hi = song.index_size;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (song.index[mid].units * unit_ms <= ms)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        uint32_t start = 0;
+        p = song.data;
+        if (lo > 0) {
+            start = song.index[lo - 1].units * unit_ms;
+            p += song.index[lo - 1].offset;
+        }
+        expander.Reset();
+        held = false;
+
+        while (p < end) {
+            p += expander.Next(p, unit_ms, held_event);
+            if (start + held_event.duration_ms > ms) {
+                held = true;
+                break;
+            }
+            start += held_event.duration_ms;
+        }
+        return start;
+    }
+
+private:
+    PackedSong song = {};
+    const uint8_t *p = nullptr;
+    const uint8_t *end = nullptr;
+    uint16_t unit_ms = 1;
+    Expander expander;
+    // decoded by Seek(), Next() gives it first
+    bool held = false;
+    music_event_t held_event = {};
+};
+
+/*
+    Returns the number of events, back-references expanded, walks the whole song
+*/
+constexpr uint32_t count(const PackedSong &s)
+{
+    uint32_t n = 0;
+    for (const uint8_t *p = s.data; p < s.data + s.size; p += token_size(p))
+        n += token_events(p);
+    return n;
+}
+}
+
+#endif
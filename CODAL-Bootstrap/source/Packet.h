@@ -0,0 +1,584 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <stdint.h>
+
+/*
+    Main idea:
+        ClockSync's messages used to be one 13 byte datagram each, FLAG | SERIAL (4) | TIMESTAMP (8),
+        copied into a heap allocated PTP_packet inside the radio handler. Most of those bytes were
+        padding, a DELAY_REQ carries nothing but who sent it. Instead a datagram is a frame of
+        typed records, each only as long as its fields, so that several of them (the master's
+        DELAY_RESPs to the followers of a round) share one frame, and the nodes are named by their
+        rank, one byte, once the election has given every node the same membership.
+
+    Frame:
+        TAG | CHECKSUM | RECORD...
+            TAG         FRAME_TAG | VERSION, a frame of another version is dropped whole. VERSION
+                        goes up with every change to the records: 2 added TREE_POLL and
+                        SUBTREE_DONE, 3 JOIN and EPOCH, 4 the RBS_ records, 5
+                        DELAY_REQ's REMAINING and FOLLOW_UP's SLOTS, 6 TREE_POLL's WINDOW
+            CHECKSUM    of the whole frame, see checksum()
+        RECORD
+            TYPE | fields, multi-byte fields are big endian
+
+    Records (NODE: rank of the sender, or of the addressee for SYNC_PING and DELAY_RESP):
+        ANNOUNCE        SERIAL (4) | MEMBERS (2) | VIEW (4) | RUNNING, nodes have no rank yet
+        SYNC_PING       NODE | ROUND (4)
+        DELAY_REQ       NODE | TURNAROUND (4) | REMAINING
+        DELAY_RESP      NODE | ARRIVAL (4), the low 32 bits of the master's clock, see widen()
+        SYNC_BROADCAST  NODE | ROUND (4)
+        FOLLOW_UP       NODE | ROUND (4) | DEPARTURE (8) | ERROR (2) | SLOTS (2)
+        UNBLOCK         BARRIER | REPEAT | DEADLINE (8) | LENGTH | ACKED (LENGTH)
+        BARRIER_ACK     NODE | BARRIER | REPEAT | TURNAROUND (4)
+        TREE_POLL       NODE | WINDOW (2), in microseconds, 0 outside TREE_SYNC's rounds
+        SUBTREE_DONE    NODE | NODES (2) | MAX_ERROR (2)
+        JOIN            NODE
+        EPOCH           NODE | UNBLOCK (8)
+        RBS_CUE         NODE | ROUND (4), NODE is the beacon to pulse
+        RBS_PULSE       NODE | ROUND (4)
+        RBS_REPORT      NODE | ROUND (4) | ARRIVAL (8), NODE is the beacon that sent the pulse
+        See Synchronization.cpp for what they mean.
+
+    Decoding:
+        works in place on the received bytes, nothing is allocated or copied. Reader walks the
+        records of a frame and decodes the one it stands on into a plain struct on the stack,
+        so it can run in the radio's interrupt context. Everything is constexpr.
+*/
+
+namespace Packet {
+
+const uint8_t FRAME_TAG = 0x20;
+const uint8_t VERSION = 6;
+const int HEADER_SIZE = 2;
+
+// MICROBIT_RADIO_MAX_PACKET_SIZE, without pulling in MicroBit.h
+const int MAX_FRAME_SIZE = 32;
+
+enum Type : uint8_t {
+    ANNOUNCE,
+    SYNC_PING,
+    DELAY_REQ,
+    DELAY_RESP,
+    SYNC_BROADCAST,
+    FOLLOW_UP,
+    UNBLOCK,
+    BARRIER_ACK,
+    TREE_POLL,
+    SUBTREE_DONE,
+    JOIN,
+    EPOCH,
+    RBS_CUE,
+    RBS_PULSE,
+    RBS_REPORT,
+    TYPE_COUNT
+};
+
+// bytes of every record, TYPE included; UNBLOCK's ACKED comes on top
+constexpr int RECORD_SIZE[TYPE_COUNT] = {12, 6, 7, 6, 6, 18, 12, 8, 4, 6, 2, 10, 6, 6, 14};
+
+// most acknowledgement bytes an UNBLOCK alone in a frame can carry, one bit per follower
+const int MAX_ACKED = MAX_FRAME_SIZE - HEADER_SIZE - RECORD_SIZE[UNBLOCK];
+
+struct Announce
+{
+    static constexpr Type TYPE = ANNOUNCE;
+    uint32_t serial;
+    uint16_t members;
+    uint32_t view;
+    uint8_t running;        // the sender is past its election
+};
+
+struct SyncPing
+{
+    static constexpr Type TYPE = SYNC_PING;
+    uint8_t node;
+    uint32_t round;
+};
+
+struct DelayReq
+{
+    static constexpr Type TYPE = DELAY_REQ;
+    uint8_t node;
+    uint32_t turnaround_us;
+    uint8_t remaining;      // samples the sender still needs once this exchange has given one
+};
+
+struct DelayResp
+{
+    static constexpr Type TYPE = DELAY_RESP;
+    uint8_t node;
+    uint32_t arrival;
+};
+
+struct SyncBroadcast
+{
+    static constexpr Type TYPE = SYNC_BROADCAST;
+    uint8_t node;
+    uint32_t round;
+};
+
+struct FollowUp
+{
+    static constexpr Type TYPE = FOLLOW_UP;
+    uint8_t node;
+    uint32_t round;
+    uint64_t departure;
+    uint16_t error_us;      // of the sender's clock against the master's
+    uint16_t slots;         // of the round to answer in, 0 to answer at once
+};
+
+struct Unblock
+{
+    static constexpr Type TYPE = UNBLOCK;
+    uint8_t barrier;
+    uint8_t repeat;
+    uint64_t deadline;
+    uint8_t length;
+    const uint8_t *acked;   // into the frame when decoded
+};
+
+struct BarrierAck
+{
+    static constexpr Type TYPE = BARRIER_ACK;
+    uint8_t node;
+    uint8_t barrier;
+    uint8_t repeat;
+    uint32_t turnaround_us;
+};
+
+struct TreePoll
+{
+    static constexpr Type TYPE = TREE_POLL;
+    uint8_t node;
+    uint16_t window_us;
+};
+
+struct SubtreeDone
+{
+    static constexpr Type TYPE = SUBTREE_DONE;
+    uint8_t node;
+    uint16_t nodes;
+    uint16_t max_error_us;
+};
+
+struct Join
+{
+    static constexpr Type TYPE = JOIN;
+    uint8_t node;
+};
+
+struct Epoch
+{
+    static constexpr Type TYPE = EPOCH;
+    uint8_t node;
+    uint64_t unblock;
+};
+
+struct RbsCue
+{
+    static constexpr Type TYPE = RBS_CUE;
+    uint8_t node;
+    uint32_t round;
+};
+
+struct RbsPulse
+{
+    static constexpr Type TYPE = RBS_PULSE;
+    uint8_t node;
+    uint32_t round;
+};
+
+struct RbsReport
+{
+    static constexpr Type TYPE = RBS_REPORT;
+    uint8_t node;
+    uint32_t round;
+    uint64_t arrival;       // the master's time the pulse reached it
+};
+
+constexpr uint32_t get32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+constexpr uint64_t get64(const uint8_t *p)
+{
+    return ((uint64_t)get32(p) << 32) | get32(p + 4);
+}
+
+constexpr void put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+constexpr void put64(uint8_t *p, uint64_t v)
+{
+    put32(p, v >> 32);
+    put32(p + 4, v);
+}
+
+/*
+    Post:
+        the 64-bit time whose low 32 bits are `low` closest to `near`, which has to be within
+        half the 32-bit range, about 35 minutes
+*/
+constexpr uint64_t widen(uint32_t low, uint64_t near)
+{
+    return near + (int32_t)(low - (uint32_t)near);
+}
+
+/*
+    Post:
+        rotate-and-xor of the bytes, so a flipped bit or two swapped bytes change it; the radio's
+        CRC catches noise already, this catches frames of another layout that happen to pass it
+*/
+constexpr uint8_t checksum(const uint8_t *data, int len)
+{
+    uint8_t c = VERSION;
+    for (int i = 0; i < len; i++)
+        c = (uint8_t)((c << 1) | (c >> 7)) ^ data[i];
+    return c;
+}
+
+constexpr int encoded_size(const Unblock &m) { return RECORD_SIZE[UNBLOCK] + m.length; }
+template <typename M> constexpr int encoded_size(const M &) { return RECORD_SIZE[M::TYPE]; }
+
+// fields of every record, after TYPE
+constexpr void encode(uint8_t *p, const Announce &m)
+{
+    put32(p, m.serial);
+    p[4] = m.members >> 8;
+    p[5] = m.members;
+    put32(p + 6, m.view);
+    p[10] = m.running;
+}
+
+constexpr void decode(const uint8_t *p, Announce &m)
+{
+    m.serial = get32(p);
+    m.members = (p[4] << 8) | p[5];
+    m.view = get32(p + 6);
+    m.running = p[10];
+}
+
+constexpr void encode(uint8_t *p, const SyncPing &m)
+{
+    p[0] = m.node;
+    put32(p + 1, m.round);
+}
+
+constexpr void decode(const uint8_t *p, SyncPing &m)
+{
+    m.node = p[0];
+    m.round = get32(p + 1);
+}
+
+constexpr void encode(uint8_t *p, const DelayReq &m)
+{
+    p[0] = m.node;
+    put32(p + 1, m.turnaround_us);
+    p[5] = m.remaining;
+}
+
+constexpr void decode(const uint8_t *p, DelayReq &m)
+{
+    m.node = p[0];
+    m.turnaround_us = get32(p + 1);
+    m.remaining = p[5];
+}
+
+constexpr void encode(uint8_t *p, const DelayResp &m)
+{
+    p[0] = m.node;
+    put32(p + 1, m.arrival);
+}
+
+constexpr void decode(const uint8_t *p, DelayResp &m)
+{
+    m.node = p[0];
+    m.arrival = get32(p + 1);
+}
+
+constexpr void encode(uint8_t *p, const SyncBroadcast &m)
+{
+    p[0] = m.node;
+    put32(p + 1, m.round);
+}
+
+constexpr void decode(const uint8_t *p, SyncBroadcast &m)
+{
+    m.node = p[0];
+    m.round = get32(p + 1);
+}
+
+constexpr void encode(uint8_t *p, const FollowUp &m)
+{
+    p[0] = m.node;
+    put32(p + 1, m.round);
+    put64(p + 5, m.departure);
+    p[13] = m.error_us >> 8;
+    p[14] = m.error_us;
+    p[15] = m.slots >> 8;
+    p[16] = m.slots;
+}
+
+constexpr void decode(const uint8_t *p, FollowUp &m)
+{
+    m.node = p[0];
+    m.round = get32(p + 1);
+    m.departure = get64(p + 5);
+    m.error_us = (p[13] << 8) | p[14];
+    m.slots = (p[15] << 8) | p[16];
+}
+
+constexpr void encode(uint8_t *p, const Unblock &m)
+{
+    p[0] = m.barrier;
+    p[1] = m.repeat;
+    put64(p + 2, m.deadline);
+    p[10] = m.length;
+    for (int i = 0; i < m.length; i++)
+        p[11 + i] = m.acked[i];
+}
+
+constexpr void decode(const uint8_t *p, Unblock &m)
+{
+    m.barrier = p[0];
+    m.repeat = p[1];
+    m.deadline = get64(p + 2);
+    m.length = p[10];
+    m.acked = p + 11;
+}
+
+constexpr void encode(uint8_t *p, const BarrierAck &m)
+{
+    p[0] = m.node;
+    p[1] = m.barrier;
+    p[2] = m.repeat;
+    put32(p + 3, m.turnaround_us);
+}
+
+constexpr void decode(const uint8_t *p, BarrierAck &m)
+{
+    m.node = p[0];
+    m.barrier = p[1];
+    m.repeat = p[2];
+    m.turnaround_us = get32(p + 3);
+}
+
+constexpr void encode(uint8_t *p, const TreePoll &m)
+{
+    p[0] = m.node;
+    p[1] = m.window_us >> 8;
+    p[2] = m.window_us;
+}
+
+constexpr void decode(const uint8_t *p, TreePoll &m)
+{
+    m.node = p[0];
+    m.window_us = (p[1] << 8) | p[2];
+}
+
+constexpr void encode(uint8_t *p, const SubtreeDone &m)
+{
+    p[0] = m.node;
+    p[1] = m.nodes >> 8;
+    p[2] = m.nodes;
+    p[3] = m.max_error_us >> 8;
+    p[4] = m.max_error_us;
+}
+
+constexpr void decode(const uint8_t *p, SubtreeDone &m)
+{
+    m.node = p[0];
+    m.nodes = (p[1] << 8) | p[2];
+    m.max_error_us = (p[3] << 8) | p[4];
+}
+
+constexpr void encode(uint8_t *p, const Join &m) { p[0] = m.node; }
+
+constexpr void decode(const uint8_t *p, Join &m) { m.node = p[0]; }
+
+constexpr void encode(uint8_t *p, const Epoch &m)
+{
+    p[0] = m.node;
+    put64(p + 1, m.unblock);
+}
+
+constexpr void decode(const uint8_t *p, Epoch &m)
+{
+    m.node = p[0];
+    m.unblock = get64(p + 1);
+}
+
+constexpr void encode(uint8_t *p, const RbsCue &m)
+{
+    p[0] = m.node;
+    put32(p + 1, m.round);
+}
+
+constexpr void decode(const uint8_t *p, RbsCue &m)
+{
+    m.node = p[0];
+    m.round = get32(p + 1);
+}
+
+constexpr void encode(uint8_t *p, const RbsPulse &m)
+{
+    p[0] = m.node;
+    put32(p + 1, m.round);
+}
+
+constexpr void decode(const uint8_t *p, RbsPulse &m)
+{
+    m.node = p[0];
+    m.round = get32(p + 1);
+}
+
+constexpr void encode(uint8_t *p, const RbsReport &m)
+{
+    p[0] = m.node;
+    put32(p + 1, m.round);
+    put64(p + 5, m.arrival);
+}
+
+constexpr void decode(const uint8_t *p, RbsReport &m)
+{
+    m.node = p[0];
+    m.round = get32(p + 1);
+    m.arrival = get64(p + 5);
+}
+
+/*
+    Builds a frame in place, records are appended until the next one does not fit
+*/
+class Writer
+{
+public:
+    constexpr Writer() { Clear(); }
+
+    constexpr void Clear()
+    {
+        buffer[0] = FRAME_TAG | VERSION;
+        length = HEADER_SIZE;
+        records = 0;
+    }
+
+    /*
+        Post:
+            appends m and returns true if it fits, leaves the frame as it was otherwise
+    */
+    template <typename M> constexpr bool Add(const M &m)
+    {
+        int n = encoded_size(m);
+        if (length + n > MAX_FRAME_SIZE)
+            return false;
+        buffer[length] = M::TYPE;
+        encode(buffer + length + 1, m);
+        length += n;
+        records++;
+        return true;
+    }
+
+    /*
+        Post:
+            fills in the checksum and returns the frame, Size() bytes long
+    */
+    constexpr const uint8_t *Seal()
+    {
+        buffer[1] = 0;
+        buffer[1] = checksum(buffer, length);
+        return buffer;
+    }
+
+    constexpr int Size() const { return length; }
+    constexpr int Records() const { return records; }
+    constexpr bool Empty() const { return records == 0; }
+
+private:
+    uint8_t buffer[MAX_FRAME_SIZE] = {};
+    int length = HEADER_SIZE;
+    int records = 0;
+};
+
+/*
+    Walks the records of a received frame:
+
+        Packet::Reader r(data, len);
+        while (r.Next())
+            if (r.Type() == Packet::DELAY_REQ) {
+                Packet::DelayReq m;
+                r.Get(m);
+            }
+
+    A frame with the wrong tag, version or checksum has no records. Reading stops at the first
+    record of unknown type or running past the end.
+*/
+class Reader
+{
+public:
+    constexpr Reader(const uint8_t *data, int len) : data(data), len(len)
+    {
+        valid = len >= HEADER_SIZE && len <= MAX_FRAME_SIZE && data[0] == (FRAME_TAG | VERSION) &&
+                data[1] == frame_checksum(data, len);
+        next = HEADER_SIZE;
+    }
+
+    constexpr bool Valid() const { return valid; }
+
+    /*
+        Post:
+            moves to the next record and returns whether there is one
+    */
+    constexpr bool Next()
+    {
+        if (!valid || next >= len || data[next] >= TYPE_COUNT)
+            return false;
+        int n = RECORD_SIZE[data[next]];
+        if (data[next] == UNBLOCK && next + n <= len)
+            n += data[next + n - 1];
+        if (next + n > len)
+            return false;
+        current = next;
+        next += n;
+        return true;
+    }
+
+    constexpr Packet::Type Type() const { return (Packet::Type)data[current]; }
+
+    /*
+        Post:
+            decodes the current record into m and returns true if it is of m's type
+    */
+    template <typename M> constexpr bool Get(M &m) const
+    {
+        if (Type() != M::TYPE)
+            return false;
+        decode(data + current + 1, m);
+        return true;
+    }
+
+private:
+    static constexpr uint8_t frame_checksum(const uint8_t *data, int len)
+    {
+        // as Writer::Seal() computed it, with the checksum byte still zero
+        uint8_t c = checksum(data, 1);
+        c = (uint8_t)((c << 1) | (c >> 7));
+        for (int i = HEADER_SIZE; i < len; i++)
+            c = (uint8_t)((c << 1) | (c >> 7)) ^ data[i];
+        return c;
+    }
+
+    const uint8_t *data;
+    int len;
+    int next = HEADER_SIZE;
+    int current = HEADER_SIZE;
+    bool valid = false;
+};
+}
+
+#endif
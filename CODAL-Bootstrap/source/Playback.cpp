@@ -0,0 +1,296 @@
+#include "Playback.h"
+#include "Telemetry.h"
+
+#include <algorithm>
+#include <vector>
+
+namespace {
+
+enum TrackState { TRACK_DONE, TRACK_WAITING, TRACK_STARVED };
+
+// one part being played
+struct Track
+{
+    Song::PackedSource packed;
+    Playback::CueList cues;
+    bool starved;
+};
+
+NODE_LOCAL std::shared_ptr<MicroBit> uBit;
+// nullptr when the tracks play on Synth voices
+NODE_LOCAL Pin *pin;
+// one per part playing, each holds the 1 KB window of its source, so only as many as Play() was given
+NODE_LOCAL std::vector<Track> tracks;
+NODE_LOCAL Playback::LatePolicy late_policy;
+NODE_LOCAL volatile bool playing;
+NODE_LOCAL Playback::Stats stats;
+}
+
+namespace Playback {
+
+namespace {
+
+/*
+    Pre:
+        not playing
+    Post:
+        tracks holds `count` tracks, the ones already there are kept when it did
+*/
+void use_tracks(int count)
+{
+    if (tracks.size() != (size_t)count)
+        tracks = std::vector<Track>(count);
+}
+
+void apply(int track, const Cue &c)
+{
+    if (pin) {
+        pin->setAnalogValue(c.velocity);
+        pin->setAnalogPeriodUs(c.period_us);
+    } else {
+        Synth::NoteOn(track, c.period_us, c.velocity);
+    }
+}
+
+/*
+    Applies the due cues of one track, `early` is how long until its next one when it is waiting
+*/
+TrackState advance_track(int t, int64_t &early)
+{
+    Track &track = tracks[t];
+    CueList &cues = track.cues;
+    while (!cues.Done()) {
+        if (cues.Starved()) {
+            cues.Refill();
+            if (cues.Starved()) {
+                // count each gap in the stream once, and only once it holds up a note
+                if (!track.starved && (int64_t)(cues.NextStart() - ClockSync::SystemTime()) <= 0) {
+                    stats.underruns++;
+                    track.starved = true;
+                }
+                return TRACK_STARVED;
+            }
+            track.starved = false;
+            continue;
+        }
+        const Cue &c = cues.Front();
+        early = (int64_t)(c.at - ClockSync::SystemTime());
+        if (early > 0)
+            return TRACK_WAITING;
+
+        uint32_t late = (uint32_t)-early;
+        if (late > LATE_TOLERANCE_US && cues.FrontIsOnset() && late_policy == LATE_SKIP) {
+            stats.skipped++;
+            cues.SkipNote();
+            continue;
+        }
+        if (late > LATE_TOLERANCE_US)
+            stats.late++;
+        stats.max_late_us = std::max(stats.max_late_us, late);
+        stats.cues++;
+        if (cues.FrontIsOnset())
+            Telemetry::RecordOnset(late);
+        apply(t, c);
+        cues.Pop();
+    }
+    return TRACK_DONE;
+}
+
+/*
+    Moves the packed source of `track` to the event sounding at `from`, by its index, and
+    returns when that event starts, for the CueList to go on from. The rest of the way is left
+    to CueList::Seek()
+*/
+ClockSync::timestamp_t seek_packed(Track &track, ClockSync::timestamp_t start, ClockSync::timestamp_t from)
+{
+    if ((int64_t)(from - start) <= 0)
+        return start;
+    return start + (ClockSync::timestamp_t)track.packed.Seek((uint32_t)((from - start) / 1000)) * 1000;
+}
+
+void begin(LatePolicy policy)
+{
+    late_policy = policy;
+    stats = {};
+    playing = true;
+    uBit->messageBus.listen(MICROBIT_ID_PLAYBACK, PLAYBACK_EVT_CUE, on_cue, MESSAGE_BUS_LISTENER_IMMEDIATE);
+    advance();
+}
+}
+
+CueList::CueList(Song::Source &source, ClockSync::timestamp_t start) : source(&source), event_start(start), ended(false)
+{
+    LoadOnset();
+}
+
+void CueList::LoadOnset()
+{
+    has_front = false;
+    music_event_t e;
+    Song::Source::Status status;
+    // rests only move the clock on
+    while ((status = source->Next(e)) == Song::Source::EVENT && e.period_us == 0)
+        event_start += (ClockSync::timestamp_t)e.duration_ms * 1000;
+    if (status != Song::Source::EVENT) {
+        ended = status == Song::Source::END;
+        return;
+    }
+
+    int articulation = std::min(ARTICULATION_MS, e.duration_ms / 2);
+    front = {event_start, e.period_us, e.velocity};
+    release = {event_start + (ClockSync::timestamp_t)(e.duration_ms - articulation) * 1000, 0, 0};
+    has_front = true;
+    onset = true;
+    event_start += (ClockSync::timestamp_t)e.duration_ms * 1000;
+}
+
+void CueList::Refill()
+{
+    LoadOnset();
+}
+
+void CueList::Pop()
+{
+    if (onset) {
+        front = release;
+        onset = false;
+    } else {
+        LoadOnset();
+    }
+}
+
+void CueList::SkipNote()
+{
+    LoadOnset();
+}
+
+void CueList::Seek(ClockSync::timestamp_t t)
+{
+    while (has_front && onset && (int64_t)(release.at - t) <= 0)
+        LoadOnset();
+    if (has_front && onset && (int64_t)(front.at - t) < 0)
+        front.at = t;
+}
+
+void Play(std::shared_ptr<MicroBit> u, Pin *p, const Song::PackedSong &song, ClockSync::timestamp_t start,
+          LatePolicy policy)
+{
+    PlayFrom(std::move(u), p, song, start, start, policy);
+}
+
+void Play(std::shared_ptr<MicroBit> u, Pin *p, Song::Source &source, ClockSync::timestamp_t start,
+          LatePolicy policy)
+{
+    PlayFrom(std::move(u), p, source, start, start, policy);
+}
+
+void PlayFrom(std::shared_ptr<MicroBit> u, Pin *p, const Song::PackedSong &song, ClockSync::timestamp_t start,
+              ClockSync::timestamp_t from, LatePolicy policy)
+{
+    Stop();
+    use_tracks(1);
+    tracks[0].packed = Song::PackedSource(song);
+    start = seek_packed(tracks[0], start, from);
+    PlayFrom(std::move(u), p, tracks[0].packed, start, from, policy);
+}
+
+void PlayFrom(std::shared_ptr<MicroBit> u, Pin *p, Song::Source &source, ClockSync::timestamp_t start,
+              ClockSync::timestamp_t from, LatePolicy policy)
+{
+    Stop();
+    uBit = std::move(u);
+    pin = p;
+    // keeps tracks[0].packed, which source is when called with a PackedSong
+    use_tracks(1);
+    tracks[0].cues = CueList(source, start);
+    if ((int64_t)(from - start) > 0)
+        tracks[0].cues.Seek(from);
+    tracks[0].starved = false;
+    begin(policy);
+}
+
+void Play(std::shared_ptr<MicroBit> u, const Song::PackedSong *parts, int count, ClockSync::timestamp_t start,
+          LatePolicy policy)
+{
+    PlayFrom(std::move(u), parts, count, start, start, policy);
+}
+
+void PlayFrom(std::shared_ptr<MicroBit> u, const Song::PackedSong *parts, int count, ClockSync::timestamp_t start,
+              ClockSync::timestamp_t from, LatePolicy policy)
+{
+    Stop();
+    uBit = std::move(u);
+    pin = nullptr;
+    use_tracks(std::min(count, MAX_PARTS));
+    for (size_t t = 0; t < tracks.size(); t++) {
+        Track &track = tracks[t];
+        track.packed = Song::PackedSource(parts[t]);
+        track.cues = CueList(track.packed, seek_packed(track, start, from) - Synth::LATENCY_US);
+        if ((int64_t)(from - start) > 0)
+            track.cues.Seek(from - Synth::LATENCY_US);
+        track.starved = false;
+    }
+    begin(policy);
+}
+
+void Stop()
+{
+    if (!playing)
+        return;
+    target_disable_irq();
+    playing = false;
+    system_timer_cancel_event(MICROBIT_ID_PLAYBACK, PLAYBACK_EVT_CUE);
+    if (pin) {
+        pin->setAnalogValue(0);
+        pin->setAnalogPeriodUs(0);
+    } else {
+        for (size_t t = 0; t < tracks.size(); t++)
+            Synth::NoteOff(t);
+    }
+    target_enable_irq();
+}
+
+bool Playing()
+{
+    return playing;
+}
+
+const Stats &GetStats()
+{
+    return stats;
+}
+
+void advance()
+{
+    bool waiting = false;
+    bool starved = false;
+    ClockSync::timestamp_t wait = MAX_ARM_US;
+    for (size_t t = 0; t < tracks.size(); t++) {
+        int64_t early = 0;
+        switch (advance_track(t, early)) {
+        case TRACK_WAITING:
+            waiting = true;
+            wait = std::min<ClockSync::timestamp_t>(wait, early);
+            break;
+        case TRACK_STARVED:
+            starved = true;
+            wait = std::min(wait, STARVED_POLL_US);
+            break;
+        case TRACK_DONE:
+            break;
+        }
+    }
+    if (waiting || starved)
+        system_timer_event_after_us(wait, MICROBIT_ID_PLAYBACK, PLAYBACK_EVT_CUE);
+    else
+        playing = false;
+}
+
+void on_cue(MicroBitEvent e)
+{
+    if (!playing)
+        return;
+    stats.wakeups++;
+    advance();
+}
+}
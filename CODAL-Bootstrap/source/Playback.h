@@ -0,0 +1,212 @@
+#ifndef PLAYBACK_H
+#define PLAYBACK_H
+
+#include "MicroBit.h"
+#include "PackedSong.h"
+#include "Synchronization.h"
+#include "Synth.h"
+
+#include <stdint.h>
+
+/*
+    Main idea:
+        Instead of waking up every millisecond and comparing SystemTime() against the next
+        change, turn the song into a list of cues with absolute start times on the master's
+        clock and arm a system timer event for exactly the next one. The timer's handler
+        applies the cue to the pin and arms the following one, so the CPU only wakes up when
+        something has to happen.
+
+    Cues:
+        every note event i gives
+            ON  at start + (d_0 + ... + d_{i-1})
+            OFF at start + (d_0 + ... + d_i) - ARTICULATION_MS
+        rests give no cue, the previous OFF already silenced the pin. The times are derived
+        from the score each time, not from when the previous cue happened to fire, so rounding
+        and late wake-ups do not add up over the song.
+
+    Streaming:
+        the events come from a Song::Source. When the next one has not arrived yet the list is
+        starved, the timer is re-armed every STARVED_POLL_US to look again and the note is
+        treated as late once it is there.
+
+    Late cues:
+        a cue whose time has already passed when it comes up is handled by LatePolicy
+            LATE_COMPRESS   play it at once, the note is shortened so that the following
+                            cues stay on time
+            LATE_SKIP       drop a note whose onset is more than LATE_TOLERANCE_US late,
+                            the pin stays silent until the next note
+
+    Several parts:
+        given an array of songs, each one gets its own list of cues and Synth voice, see
+        Synth.h, instead of the pin. The timer is armed for the earliest cue of all the lists,
+        and every cue is brought forward by Synth::LATENCY_US so that the note leaves the mixer
+        when the pin would have played it.
+*/
+
+namespace Playback {
+
+// Message bus id of the timer events driving the cues
+const uint16_t MICROBIT_ID_PLAYBACK = 2048;
+const uint16_t PLAYBACK_EVT_CUE = 1;
+
+// A cue is armed at most this far ahead and re-armed on wake-up, so the local timer never runs
+// long enough for drift or a background slew to move it off the master's clock
+const ClockSync::timestamp_t MAX_ARM_US = 100000;
+
+const ClockSync::timestamp_t LATE_TOLERANCE_US = 2000;
+
+const ClockSync::timestamp_t STARVED_POLL_US = 5000;
+
+// most parts played at once, one per voice
+const int MAX_PARTS = Synth::MAX_VOICES;
+
+enum LatePolicy { LATE_COMPRESS, LATE_SKIP };
+
+struct Cue
+{
+    ClockSync::timestamp_t at;  // SystemTime() of the change
+    int period_us;              // 0 silences the pin
+    int velocity;
+};
+
+/*
+    Walks the cues of a song while decoding it in place, see the comment at the top
+*/
+class CueList
+{
+public:
+    CueList() = default;
+    CueList(Song::Source &source, ClockSync::timestamp_t start);
+
+    bool Done() const { return !has_front && ended; }
+
+    // the source has not delivered the next event yet
+    bool Starved() const { return !has_front && !ended; }
+
+    // start of the event the source has not delivered yet, when Starved()
+    ClockSync::timestamp_t NextStart() const { return event_start; }
+
+    /*
+        Pre:
+            Starved()
+        Post:
+            asks the source again
+    */
+    void Refill();
+
+    const Cue &Front() const { return front; }
+
+    /*
+        Pre:
+            !Done(), !Starved()
+        Post:
+            Front() is the next cue
+    */
+    void Pop();
+
+    /*
+        Pre:
+            !Done(), !Starved(), Front() is a note onset
+        Post:
+            drops the note, Front() is the next note's onset
+    */
+    void SkipNote();
+
+    /*
+        Pre:
+            Front() is a note onset, as after construction
+        Post:
+            drops every note released by SystemTime() t, the note still sounding at t starts at
+            t instead. Stops early if the source has not delivered that far yet
+    */
+    void Seek(ClockSync::timestamp_t t);
+
+    bool FrontIsOnset() const { return onset; }
+
+private:
+    void LoadOnset();
+
+    Song::Source *source = nullptr;
+    ClockSync::timestamp_t event_start = 0; // start of the source's next event
+    bool has_front = false;
+    bool ended = true;
+    bool onset = false;
+    Cue front;
+    Cue release;
+};
+
+struct Stats
+{
+    uint32_t cues;          // applied to the pin or a voice
+    uint32_t wakeups;       // timer events handled
+    uint32_t late;          // applied after their time
+    uint32_t skipped;       // notes dropped under LATE_SKIP
+    uint32_t underruns;     // times the source had not delivered the next event in time
+    uint32_t max_late_us;
+};
+
+/*
+    Pre:
+        ClockSync::Sync() has returned, the song's data stays valid until playback ends
+    Post:
+        starts playing `song` on `pin` from SystemTime() `start` and returns at once, the cues
+        are applied from the timer event's handler
+*/
+void Play(std::shared_ptr<MicroBit> uBit, Pin *pin, const Song::PackedSong &song, ClockSync::timestamp_t start,
+          LatePolicy policy = LATE_COMPRESS);
+
+/*
+    Same for a song read from `source`, which stays valid until playback ends
+*/
+void Play(std::shared_ptr<MicroBit> uBit, Pin *pin, Song::Source &source, ClockSync::timestamp_t start,
+          LatePolicy policy = LATE_COMPRESS);
+
+/*
+    Same as Play() for a microbit joining the performance late, see ClockSync::Join(): the notes
+    released by SystemTime() `from` are skipped rather than played late, the note sounding at
+    `from` starts then. A PackedSong with an index is entered by Song::PackedSource::Seek(),
+    the same for restarting the ensemble at a bar or looping a passage; any other source is
+    read from its start up to `from`
+*/
+void PlayFrom(std::shared_ptr<MicroBit> uBit, Pin *pin, const Song::PackedSong &song, ClockSync::timestamp_t start,
+              ClockSync::timestamp_t from, LatePolicy policy = LATE_COMPRESS);
+
+void PlayFrom(std::shared_ptr<MicroBit> uBit, Pin *pin, Song::Source &source, ClockSync::timestamp_t start,
+              ClockSync::timestamp_t from, LatePolicy policy = LATE_COMPRESS);
+
+/*
+    Pre:
+        as Play(), 0 < count <= MAX_PARTS, Synth::Start() has been called
+    Post:
+        starts playing parts[i] on Synth voice i, and returns at once
+*/
+void Play(std::shared_ptr<MicroBit> uBit, const Song::PackedSong *parts, int count, ClockSync::timestamp_t start,
+          LatePolicy policy = LATE_COMPRESS);
+
+void PlayFrom(std::shared_ptr<MicroBit> uBit, const Song::PackedSong *parts, int count,
+              ClockSync::timestamp_t start, ClockSync::timestamp_t from, LatePolicy policy = LATE_COMPRESS);
+
+/*
+    Post:
+        cancels the pending cue and silences the pin or the voices
+*/
+void Stop();
+
+bool Playing();
+
+const Stats &GetStats();
+
+// -------------------------------------------------------------------
+
+/*
+    Applies every cue that is due and arms the timer for the next one
+*/
+void advance();
+
+/*
+    Handler of the PLAYBACK_EVT_CUE timer event
+*/
+void on_cue(MicroBitEvent e);
+}
+
+#endif
@@ -0,0 +1,99 @@
+#include "RadioDispatch.h"
+#include "RadioStamp.h"
+
+namespace {
+
+NODE_LOCAL std::shared_ptr<MicroBit> uBit;
+NODE_LOCAL RadioDispatch::handler_t handlers[RadioDispatch::MAX_HANDLERS];
+
+// oldest first, written by on_stamp()
+NODE_LOCAL uint64_t stamps[RadioDispatch::MAX_STAMPS];
+NODE_LOCAL volatile int stamp_first, stamp_count;
+}
+
+namespace RadioDispatch {
+
+void Init(std::shared_ptr<MicroBit> u)
+{
+    if (uBit == u)
+        return;
+    if (uBit)
+        uBit->messageBus.ignore(MICROBIT_ID_RADIO, MICROBIT_RADIO_EVT_DATAGRAM, on_datagram);
+    uBit = std::move(u);
+    for (handler_t &h : handlers)
+        h = nullptr;
+    // whatever arrived before anybody listened would be read by the first event instead of
+    // its own datagram
+    uint8_t buf[MICROBIT_RADIO_MAX_PACKET_SIZE];
+    while (uBit->radio.datagram.recv(buf, sizeof(buf)) > 0)
+        ;
+    target_disable_irq();
+    stamp_count = 0;
+    target_enable_irq();
+    RadioStamp::Init(on_stamp);
+    uBit->messageBus.listen(MICROBIT_ID_RADIO, MICROBIT_RADIO_EVT_DATAGRAM, on_datagram, MESSAGE_BUS_LISTENER_IMMEDIATE);
+}
+
+void Listen(handler_t handler)
+{
+    target_disable_irq();
+    bool listening = false;
+    for (handler_t h : handlers)
+        listening = listening || h == handler;
+    for (handler_t &h : handlers) {
+        if (!listening && h == nullptr) {
+            h = handler;
+            listening = true;
+        }
+    }
+    target_enable_irq();
+    if (!listening)
+        target_panic(PANIC_NO_HANDLER_SLOT);
+}
+
+void Ignore(handler_t handler)
+{
+    target_disable_irq();
+    for (handler_t &h : handlers)
+        if (h == handler)
+            h = nullptr;
+    target_enable_irq();
+}
+
+void on_datagram(MicroBitEvent e)
+{
+    uint8_t buf[MICROBIT_RADIO_MAX_PACKET_SIZE];
+    int len = uBit->radio.datagram.recv(buf, sizeof(buf));
+    if (len <= 0)
+        return;
+    e.timestamp = arrival(e.timestamp);
+    for (handler_t h : handlers)
+        if (h != nullptr)
+            h(e, buf, len);
+}
+
+void on_stamp(uint64_t at_us)
+{
+    if (stamp_count == MAX_STAMPS)
+        return;
+    stamps[(stamp_first + stamp_count) % MAX_STAMPS] = at_us;
+    stamp_count = stamp_count + 1;
+}
+
+uint64_t arrival(uint64_t dispatched)
+{
+    uint64_t at = dispatched;
+    target_disable_irq();
+    int queued = uBit->radio.dataReady();
+    if (stamp_count == queued + 1) {
+        at = stamps[stamp_first];
+        stamp_first = (stamp_first + 1) % MAX_STAMPS;
+        stamp_count = stamp_count - 1;
+    } else if (queued == 0) {
+        // a frame was dropped, or stamped twice, since the queue was last empty
+        stamp_count = 0;
+    }
+    target_enable_irq();
+    return at;
+}
+}
@@ -0,0 +1,89 @@
+#ifndef RADIO_DISPATCH_H
+#define RADIO_DISPATCH_H
+
+#include "MicroBit.h"
+
+#include <memory>
+#include <stdint.h>
+
+#ifndef NODE_LOCAL
+#define NODE_LOCAL
+#endif
+
+/*
+    Main idea:
+        The radio keeps received datagrams in a queue and raises one event per datagram, whoever
+        handles the event has to recv() it. With ClockSync and SongTransfer both on the air at
+        once, two listeners would each pop a datagram per event and read each other's packets.
+        A single listener receives the datagram and hands the same bytes to every registered
+        handler instead, each one picks the packets it knows by their first byte.
+
+    Arrival times:
+        the event CODAL raises is stamped when it is dispatched. The handlers get it with the
+        timestamp RadioStamp took when the radio received the frame instead. Stamps are paired
+        with datagrams in order, which only holds while there is one stamp for each frame still
+        queued. When MicroBitRadio drops a frame for want of a buffer there is one more, the
+        datagrams keep the dispatch time until the queue runs empty and the stamps start over
+
+    Flags (first byte of every datagram):
+          0..15    unused, ClockSync's fixed 13 byte packets before Packet.h
+         16..31    SongTransfer
+         32..47    Packet.h frames (ClockSync), the low four bits are the version
+*/
+
+namespace RadioDispatch {
+
+// handlers are called in the radio event's context, with the event for its timestamp
+typedef void (*handler_t)(MicroBitEvent e, const uint8_t *data, int len);
+
+// one slot for each handler that exists, a handler is registered at most once: ClockSync's
+// master_selection, barrier_listener, on_barrier_ack, on_delay_req, follower_listener,
+// on_subtree_done, on_rbs_pulse, on_rival_sync and on_join, SongTransfer's master_listener and
+// follower_listener. A new handler needs a slot here
+const int MAX_HANDLERS = 11;
+
+// target_panic() code when Listen() finds no free slot
+const int PANIC_NO_HANDLER_SLOT = 120;
+
+// stamps of frames not dispatched yet, more than the radio has receive buffers
+const int MAX_STAMPS = 8;
+
+/*
+    Post:
+        the datagram event of uBit's radio is dispatched to the registered handlers, calling it
+        again with the same uBit does nothing
+*/
+void Init(std::shared_ptr<MicroBit> uBit);
+
+/*
+    Pre:
+        Init() has been called
+    Post:
+        handler gets every datagram received from now on. With MAX_HANDLERS others already
+        registered it panics with PANIC_NO_HANDLER_SLOT rather than drop the handler's packets
+*/
+void Listen(handler_t handler);
+
+/*
+    Post:
+        handler gets no more datagrams
+*/
+void Ignore(handler_t handler);
+
+// -------------------------------------------------------------------
+
+void on_datagram(MicroBitEvent e);
+
+// RadioStamp's handler, in interrupt context
+void on_stamp(uint64_t at_us);
+
+/*
+    Pre:
+        the datagram whose event was dispatched at `dispatched` has just been received
+    Post:
+        returns the time the radio took it in, or `dispatched` when the stamps are not in step
+*/
+uint64_t arrival(uint64_t dispatched);
+}
+
+#endif
@@ -0,0 +1,50 @@
+#include "RadioStamp.h"
+#include "MicroBit.h"
+#include "nrf.h"
+
+namespace {
+
+const int PPI_CHANNEL = 19;
+
+RadioStamp::handler_t handler;
+}
+
+extern "C" void SWI5_EGU5_IRQHandler(void)
+{
+    NRF_EGU5->EVENTS_TRIGGERED[0] = 0;
+    (void)NRF_EGU5->EVENTS_TRIGGERED[0];
+    // the TIMER and the system timer both count microseconds off the same clock, so the age of
+    // the capture carries over
+    NRF_TIMER4->TASKS_CAPTURE[1] = 1;
+    uint64_t now = system_timer_current_time_us();
+    uint32_t age = NRF_TIMER4->CC[1] - NRF_TIMER4->CC[0];
+    if (handler)
+        handler(now - age);
+}
+
+namespace RadioStamp {
+
+void Init(handler_t h)
+{
+    handler = h;
+    if (NRF_PPI->CHEN & (1u << PPI_CHANNEL))
+        return;
+
+    NRF_TIMER4->TASKS_STOP = 1;
+    NRF_TIMER4->MODE = TIMER_MODE_MODE_Timer;
+    NRF_TIMER4->BITMODE = TIMER_BITMODE_BITMODE_32Bit;
+    NRF_TIMER4->PRESCALER = 4;  // 16 MHz / 2^4
+    NRF_TIMER4->TASKS_CLEAR = 1;
+    NRF_TIMER4->TASKS_START = 1;
+
+    NRF_EGU5->EVENTS_TRIGGERED[0] = 0;
+    NRF_EGU5->INTENSET = EGU_INTENSET_TRIGGERED0_Msk;
+    NVIC_ClearPendingIRQ(SWI5_EGU5_IRQn);
+    NVIC_EnableIRQ(SWI5_EGU5_IRQn);
+
+    NRF_PPI->CH[PPI_CHANNEL].EEP = (uint32_t)&NRF_RADIO->EVENTS_CRCOK;
+    NRF_PPI->CH[PPI_CHANNEL].TEP = (uint32_t)&NRF_TIMER4->TASKS_CAPTURE[0];
+    NRF_PPI->FORK[PPI_CHANNEL].TEP = (uint32_t)&NRF_EGU5->TASKS_TRIGGER[0];
+    NRF_PPI->CHENSET = 1u << PPI_CHANNEL;
+}
+}
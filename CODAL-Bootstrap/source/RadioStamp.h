@@ -0,0 +1,35 @@
+#ifndef RADIO_STAMP_H
+#define RADIO_STAMP_H
+
+#include <stdint.h>
+
+/*
+    Main idea:
+        CODAL raises the datagram event from MicroBitRadio's idle callback, whenever the
+        scheduler gets to it, so MicroBitEvent::timestamp is when the frame was dispatched, not
+        when it was received. Instead the radio's CRCOK event, through a PPI channel, captures a
+        free-running 1 MHz TIMER the moment a frame is in intact, and through the channel's fork
+        triggers an EGU interrupt that turns the capture into system_timer_current_time_us()
+        time and hands it on. Frames are stamped in the order they arrive, RadioDispatch pairs
+        the stamps with the datagrams in the same order.
+
+    Resources:
+        TIMER4, PPI channel 19 and EGU5 (SWI5_EGU5_IRQn) are taken for this, the CODAL drivers
+        must leave them alone. The host build has a stand-in that stamps each frame with the
+        time the simulated radio received it
+*/
+
+namespace RadioStamp {
+
+// called in interrupt context with the local time in microseconds a frame was received at
+typedef void (*handler_t)(uint64_t at_us);
+
+/*
+    Post:
+        handler is called once for every frame the radio receives intact from now on, whether
+        MicroBitRadio then finds a buffer for it or not
+*/
+void Init(handler_t handler);
+}
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef SONG_IMAGE_H
+#define SONG_IMAGE_H
+
+#include "PackedSong.h"
+
+#include <stdint.h>
+
+/*
+    Main idea:
+        Changing the song should not mean rebuilding CODAL. The image reserves a block of flash
+        for it, tools/patch-hex.py finds the block in a copy of MICROBIT.hex by its MAGIC and
+        writes a song there, records and checksums included. The block is a const array in its
+        own section, .song_image, which song_image.ld places in an output section of its own:
+        in flash, on a SONG_IMAGE_ALIGN page, kept by --gc-sections. The array's contents at
+        build time are only a placeholder, so it is read through a pointer the compiler cannot
+        see through.
+
+    Region (multi-byte fields are little endian, as in PackedSong.h):
+        MAGIC (16) | CAPACITY (4) | SIZE (4) | CHECKSUM (4) | RESERVED (4) | SONG (CAPACITY)
+            CAPACITY    bytes of SONG, fixed at build time by SONG_IMAGE_CAPACITY
+            SIZE        bytes of SONG in use, 0 while the image carries no song
+            CHECKSUM    Fletcher-32 of those SIZE bytes, see fletcher32()
+
+    Song, as tools/generate-music.py --image and midi-compile --image write it:
+        VERSION | PARTS | UNIT_MS (2) | PARTS x PART (16) | data and index arrays
+        PART
+            DATA_OFFSET (4) | DATA_SIZE (4) | INDEX_OFFSET (4) | INDEX_ENTRIES (4)
+            offsets from the start of SONG, every array starts on 4 bytes so that the index
+            can be read in place as Song::IndexEntry
+*/
+
+// flash page the region starts on, must match song_image.ld and patch-hex.py
+#define SONG_IMAGE_ALIGN 4096
+
+#ifndef SONG_IMAGE_CAPACITY
+#define SONG_IMAGE_CAPACITY (64 * 1024)
+#endif
+
+namespace SongImage {
+
+// MAGIC is "MICROBIT-SONG-v1", spelt out only in the region's initializer so that
+// patch-hex.py finds no other copy of it in the image
+const uint8_t VERSION = 1;
+const int HEADER_SIZE = 32;
+const int SONG_HEADER_SIZE = 4;
+const int PART_SIZE = 16;
+const int MAX_PARTS = 16;
+
+struct Region
+{
+    char magic[16];
+    uint32_t capacity;
+    uint32_t size;
+    uint32_t checksum;
+    uint32_t reserved;
+    uint8_t song[SONG_IMAGE_CAPACITY];
+};
+
+static_assert(sizeof(Region) == HEADER_SIZE + SONG_IMAGE_CAPACITY, "Region must match the layout patch-hex.py writes");
+
+/*
+    Fletcher-32 over bytes, sums modulo 65535, the second in the high half
+*/
+constexpr uint32_t fletcher32(const uint8_t *data, uint32_t len)
+{
+    uint32_t a = 0, b = 0;
+    for (uint32_t i = 0; i < len; i++) {
+        a = (a + data[i]) % 65535;
+        b = (b + a) % 65535;
+    }
+    return b << 16 | a;
+}
+
+/*
+    Pre:
+        max <= MAX_PARTS
+    Post:
+        fills parts with the parts of the song patched into the image, pointing into flash, and
+        returns how many. 0 if there is none, or it does not check out and patch-hex.py has to
+        be run again
+*/
+int Load(Song::PackedSong *parts, int max);
+}
+
+#endif
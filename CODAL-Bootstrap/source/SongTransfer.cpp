@@ -0,0 +1,335 @@
+#include "SongTransfer.h"
+#include "RadioDispatch.h"
+
+#include <algorithm>
+#include <vector>
+
+// FLAGS, see RadioDispatch.h
+#define SONG_DATA 16
+#define SONG_DATA_LAST 17
+#define SONG_POLL 18
+#define SONG_ACK 19
+
+#define POLL_SIZE 3
+#define ACK_SIZE 9
+
+namespace {
+
+struct Receiver
+{
+    uint32_t base;      // as last acknowledged
+    uint32_t received;
+    int credit;
+    bool heard;         // has acknowledged at least once
+    int silent;         // polls since the last acknowledgement
+    bool fresh;         // acknowledged since its window was last sent
+};
+
+NODE_LOCAL std::shared_ptr<MicroBit> uBit;
+NODE_LOCAL SongTransfer::Stats stats;
+
+// master
+NODE_LOCAL const Song::PackedSong *parts;
+NODE_LOCAL int part_count;
+NODE_LOCAL std::vector<Receiver> receivers; // index rank - 1
+NODE_LOCAL std::vector<uint32_t> first_unsent;
+NODE_LOCAL std::vector<uint32_t> window_start, window_wanted;  // per part, this round
+NODE_LOCAL volatile bool serving, serve_alive;
+
+// follower
+NODE_LOCAL SongTransfer::Ring ring;
+NODE_LOCAL volatile bool receiving, part_known, unit_known;
+NODE_LOCAL int my_part;
+}
+
+namespace SongTransfer {
+
+void Ring::Reset(uint16_t unit)
+{
+    base = 0;
+    received = 0;
+    read = 0;
+    size = -1;
+    unit_ms = unit;
+    expander = Song::Expander();
+}
+
+int Ring::Credit() const
+{
+    int in_use = base - read / CHUNK_SIZE;
+    return std::min(RING_CHUNKS - in_use, WINDOW);
+}
+
+bool Ring::Write(uint32_t seq, const uint8_t *data, int len, bool last)
+{
+    if (seq < base || seq >= base + Credit() || len > CHUNK_SIZE)
+        return false;
+    uint32_t bit = 1u << (seq - base);
+    if (received & bit)
+        return false;
+    std::copy(data, data + len, buffer + (seq % RING_CHUNKS) * CHUNK_SIZE);
+    if (last)
+        size = seq * CHUNK_SIZE + len;
+    // the bytes are in place before the chunk counts as received
+    uint32_t r = received | bit;
+    uint32_t b = base;
+    while (r & 1) {
+        r >>= 1;
+        b++;
+    }
+    received = r;
+    base = b;
+    return true;
+}
+
+uint32_t Ring::Available() const
+{
+    uint32_t available = base * CHUNK_SIZE;
+    int32_t s = size;
+    return s >= 0 ? std::min<uint32_t>(available, s) : available;
+}
+
+Song::Source::Status Ring::Next(music_event_t &e)
+{
+    uint32_t available = Available();
+    int32_t s = size;
+    if (s >= 0 && read >= (uint32_t)s)
+        return END;
+    if (read + 2 > available)
+        return PENDING;
+    uint8_t token[4] = {At(read), At(read + 1)};
+    int n = Song::token_size(token);
+    if (read + n > available)
+        return PENDING;
+    for (int i = 2; i < n; i++)
+        token[i] = At(read + i);
+    read = read + expander.Next(token, unit_ms, e);
+    return EVENT;
+}
+
+/*
+    Number of chunks part is sent in, the last one holds what is left and may be empty
+*/
+uint32_t chunks_of(int part)
+{
+    return parts[part].size / CHUNK_SIZE + 1;
+}
+
+/*
+    Whether the follower still misses part of its part and has not been given up on
+*/
+bool pending(const Receiver &r, int part)
+{
+    return r.base < chunks_of(part) && r.silent <= SILENT_ROUNDS;
+}
+
+bool send_chunk(int part, uint32_t seq)
+{
+    uint32_t chunks = chunks_of(part);
+    if (seq >= chunks)
+        return false;
+    bool last = seq == chunks - 1;
+    uint32_t offset = seq * CHUNK_SIZE;
+    int len = last ? parts[part].size - offset : CHUNK_SIZE;
+
+    uint8_t buf[MICROBIT_RADIO_MAX_PACKET_SIZE];
+    buf[0] = last ? SONG_DATA_LAST : SONG_DATA;
+    buf[1] = part_count;
+    buf[2] = parts[part].unit_ms;
+    buf[3] = part;
+    buf[4] = seq >> 8;
+    buf[5] = seq;
+    std::copy(parts[part].data + offset, parts[part].data + offset + len, buf + HEADER_SIZE);
+    uBit->radio.datagram.send(buf, HEADER_SIZE + len);
+
+    stats.data_packets++;
+    if (seq < first_unsent[part])
+        stats.retransmissions++;
+    else
+        first_unsent[part] = seq + 1;
+    return true;
+}
+
+void Serve(std::shared_ptr<MicroBit> u, const Song::PackedSong *p, int count)
+{
+    Stop();
+    uBit = std::move(u);
+    parts = p;
+    part_count = count;
+    stats = {};
+    // ranks start at 1 for the followers, whose rings are empty to begin with
+    receivers.assign(std::max(ClockSync::EnsembleSize() - 1, 0), Receiver{0, 0, WINDOW, false, 0, true});
+    first_unsent.assign(count, 0);
+    window_start.assign(count, 0);
+    window_wanted.assign(count, 0);
+    serving = true;
+    serve_alive = true;
+    RadioDispatch::Listen(master_listener);
+    create_fiber(serve_rounds);
+}
+
+bool Serving()
+{
+    return serve_alive;
+}
+
+void serve_rounds()
+{
+    uint16_t round = 0;
+    while (serving) {
+        bool waiting = false, sent = false, heard = true;
+        for (int part = 0; part < part_count; part++) {
+            // chunks some follower of this part has room for and has not acknowledged,
+            // relative to the lowest base among them
+            uint32_t lo = UINT32_MAX;
+            for (size_t i = 0; i < receivers.size(); i++)
+                if ((int)((i + 1) % part_count) == part && pending(receivers[i], part)) {
+                    lo = std::min(lo, receivers[i].base);
+                    heard = heard && receivers[i].heard;
+                }
+            window_start[part] = lo;
+            window_wanted[part] = 0;
+            if (lo == UINT32_MAX)
+                continue;
+            waiting = true;
+
+            // a follower that did not answer the last poll may have all of it already, it is
+            // polled again rather than sent the whole window
+            for (size_t i = 0; i < receivers.size(); i++) {
+                Receiver &r = receivers[i];
+                if ((int)((i + 1) % part_count) != part || !pending(r, part) || !r.fresh)
+                    continue;
+                r.fresh = false;
+                for (int k = 0; k < r.credit && r.base + k - lo < (uint32_t)WINDOW; k++)
+                    if (!(r.received & (1u << k)))
+                        window_wanted[part] |= 1u << (r.base + k - lo);
+            }
+        }
+        // parts take turns chunk by chunk, so every follower gets the start of its part
+        // within the first few packets instead of after all the parts before it
+        for (int k = 0; k < WINDOW; k++)
+            for (int part = 0; part < part_count; part++)
+                if (window_wanted[part] & (1u << k))
+                    sent = send_chunk(part, window_start[part] + k) || sent;
+        if (!waiting)
+            break;
+
+        round++;
+        for (size_t i = 0; i < receivers.size(); i++)
+            if (pending(receivers[i], (i + 1) % part_count) && ++receivers[i].silent > SILENT_ROUNDS)
+                stats.given_up++;
+        uint8_t buf[POLL_SIZE] = {SONG_POLL, (uint8_t)(round >> 8), (uint8_t)round};
+        uBit->radio.datagram.send(buf, POLL_SIZE);
+        stats.rounds++;
+        uBit->sleep(receivers.size() * ACK_SLOT_US / 1000 + ROUND_MARGIN_MS);
+        // full rings only empty as fast as the song plays
+        if (!sent && heard)
+            uBit->sleep(IDLE_ROUND_MS);
+    }
+    RadioDispatch::Ignore(master_listener);
+    serve_alive = false;
+}
+
+void master_listener(MicroBitEvent e, const uint8_t *buffer, int len)
+{
+    if (len != ACK_SIZE || buffer[0] != SONG_ACK)
+        return;
+    size_t rank = buffer[1];
+    if (rank < 1 || rank > receivers.size())
+        return;
+    Receiver &r = receivers[rank - 1];
+    r.base = (buffer[2] << 8) | buffer[3];
+    r.received = ((uint32_t)buffer[4] << 24) | (buffer[5] << 16) | (buffer[6] << 8) | buffer[7];
+    r.credit = std::min<int>(buffer[8], WINDOW);
+    r.heard = true;
+    r.silent = 0;
+    r.fresh = true;
+    stats.acks++;
+}
+
+Song::Source &Receive(std::shared_ptr<MicroBit> u)
+{
+    Stop();
+    uBit = std::move(u);
+    stats = {};
+    ring.Reset(1);
+    part_known = false;
+    unit_known = false;
+    receiving = true;
+    uBit->messageBus.listen(MICROBIT_ID_SONG_TRANSFER, SONG_TRANSFER_EVT_ACK, send_ack, MESSAGE_BUS_LISTENER_IMMEDIATE);
+    RadioDispatch::Listen(follower_listener);
+    return ring;
+}
+
+bool Complete()
+{
+    return ring.Complete();
+}
+
+void follower_listener(MicroBitEvent e, const uint8_t *buffer, int len)
+{
+    if (!receiving || len < 1)
+        return;
+    if (buffer[0] == SONG_POLL && len == POLL_SIZE) {
+        // answer in our own slot, counted from when the poll arrived
+        int64_t slot = (int64_t)(ClockSync::Rank() - 1) * ACK_SLOT_US;
+        int64_t wait = slot - (int64_t)(ClockSync::LocalTime() - e.timestamp);
+        if (wait > 0)
+            system_timer_event_after_us(wait, MICROBIT_ID_SONG_TRANSFER, SONG_TRANSFER_EVT_ACK);
+        else
+            send_ack(e);
+    } else if ((buffer[0] == SONG_DATA || buffer[0] == SONG_DATA_LAST) && len >= HEADER_SIZE) {
+        if (!part_known) {
+            my_part = ClockSync::Rank() % std::max<int>(buffer[1], 1);
+            part_known = true;
+        }
+        if (buffer[3] != my_part)
+            return;
+        if (!unit_known) {
+            ring.Reset(buffer[2]);
+            unit_known = true;
+        }
+        uint32_t seq = (buffer[4] << 8) | buffer[5];
+        if (ring.Write(seq, buffer + HEADER_SIZE, len - HEADER_SIZE, buffer[0] == SONG_DATA_LAST))
+            stats.chunks++;
+        else
+            stats.duplicates++;
+    }
+}
+
+void send_ack(MicroBitEvent e)
+{
+    if (!receiving)
+        return;
+    uint32_t base = ring.Base(), received = ring.Received();
+    uint8_t buf[ACK_SIZE] = {SONG_ACK,
+                             (uint8_t)ClockSync::Rank(),
+                             (uint8_t)(base >> 8),
+                             (uint8_t)base,
+                             (uint8_t)(received >> 24),
+                             (uint8_t)(received >> 16),
+                             (uint8_t)(received >> 8),
+                             (uint8_t)received,
+                             (uint8_t)ring.Credit()};
+    uBit->radio.datagram.send(buf, ACK_SIZE);
+    stats.acks++;
+}
+
+void Stop()
+{
+    if (receiving) {
+        receiving = false;
+        RadioDispatch::Ignore(follower_listener);
+        system_timer_cancel_event(MICROBIT_ID_SONG_TRANSFER, SONG_TRANSFER_EVT_ACK);
+        uBit->messageBus.ignore(MICROBIT_ID_SONG_TRANSFER, SONG_TRANSFER_EVT_ACK, send_ack);
+    }
+    serving = false;
+    while (serve_alive)
+        uBit->sleep(ROUND_MARGIN_MS);
+}
+
+const Stats &GetStats()
+{
+    return stats;
+}
+}
@@ -0,0 +1,173 @@
+#ifndef SONG_TRANSFER_H
+#define SONG_TRANSFER_H
+
+#include "MicroBit.h"
+#include "PackedSong.h"
+#include "Synchronization.h"
+
+#include <memory>
+#include <stdint.h>
+
+/*
+    Main idea:
+        Only the master needs the song in its image. After Sync() it streams the other parts
+        to the followers over the radio while everybody already plays, each follower keeps its
+        part in a small ring buffer that Playback reads from and that frees up as the notes go by.
+
+    Protocol (master --> followers):
+        SONG_DATA / SONG_DATA_LAST -->
+            FLAG | PARTS | UNIT_MS | PART | SEQ (2) | up to CHUNK_SIZE bytes of the part
+            a part is cut into size / CHUNK_SIZE + 1 chunks, the last one, possibly empty,
+            is sent as SONG_DATA_LAST so its length gives the size of the part
+        SONG_POLL -->
+            FLAG | ROUND (2)
+        <-- SONG_ACK, follower of rank r in slot r - 1 after the poll
+            FLAG | RANK | BASE (2) | RECEIVED (4) | CREDIT
+            BASE is the first chunk missing, bit i of RECEIVED is set if chunk BASE + i is in,
+            CREDIT is how many chunks from BASE the ring has room for
+
+        A round sends, for every part, the chunks that some follower playing it has room for
+        and has not acknowledged (at most WINDOW of them from the lowest BASE), then polls.
+        The rings start empty, so the first round sends a whole window without asking.
+        Lost data shows up as a gap in RECEIVED and is sent again the next round, a lost poll
+        or acknowledgement just repeats the window. Follower of rank r plays part r % PARTS,
+        like the single image does.
+
+    The master stops once every follower has acknowledged its whole part or gone silent for
+    SILENT_ROUNDS polls. Followers keep answering polls until Stop(), their last
+    acknowledgement may have been lost.
+*/
+
+namespace SongTransfer {
+
+// Message bus id of the timer event sending a follower's SONG_ACK in its slot
+const uint16_t MICROBIT_ID_SONG_TRANSFER = 2049;
+const uint16_t SONG_TRANSFER_EVT_ACK = 1;
+
+const int HEADER_SIZE = 6;
+const int CHUNK_SIZE = MICROBIT_RADIO_MAX_PACKET_SIZE - HEADER_SIZE;
+
+// chunks in flight per part, one bit each in SONG_ACK
+const int WINDOW = 32;
+
+// follower's buffer, in chunks
+const int RING_CHUNKS = 64;
+
+const uint32_t ACK_SLOT_US = 4000;
+const uint32_t ROUND_MARGIN_MS = 10;
+
+// pause between rounds when every follower's ring is full
+const uint32_t IDLE_ROUND_MS = 100;
+
+// a follower that has not answered this many polls in a row is given up on
+const int SILENT_ROUNDS = 50;
+
+/*
+    Follower's copy of its part: chunks land in their slot of a ring as they arrive, in any
+    order within the window, and are read back as events once every chunk before them is in.
+    Write() is called from the radio handler and Next() from Playback's timer handler.
+*/
+class Ring : public Song::Source
+{
+public:
+    void Reset(uint16_t unit_ms);
+
+    /*
+        Post:
+            stores chunk `seq` if it falls in the window and is new, returns whether it did
+    */
+    bool Write(uint32_t seq, const uint8_t *data, int len, bool last);
+
+    Status Next(music_event_t &e) override;
+
+    uint32_t Base() const { return base; }
+    uint32_t Received() const { return received; }
+
+    // chunks from Base() there is room for
+    int Credit() const;
+
+    bool Complete() const { return size >= 0 && base * CHUNK_SIZE >= (uint32_t)size; }
+
+private:
+    uint32_t Available() const;
+    uint8_t At(uint32_t offset) const { return buffer[offset % (RING_CHUNKS * CHUNK_SIZE)]; }
+
+    uint8_t buffer[RING_CHUNKS * CHUNK_SIZE];
+    volatile uint32_t base = 0;     // chunks before it have all arrived
+    volatile uint32_t received = 0; // bit i: chunk base + i has arrived
+    volatile uint32_t read = 0;     // bytes handed to Playback
+    volatile int32_t size = -1;     // of the part, once SONG_DATA_LAST is in
+    uint16_t unit_ms = 1;
+    Song::Expander expander;
+};
+
+struct Stats
+{
+    uint32_t rounds;            // master: polls sent
+    uint32_t data_packets;      // master: chunks sent
+    uint32_t retransmissions;   // master: chunks sent more than once
+    uint32_t acks;              // master: received, follower: sent
+    uint32_t given_up;          // master: followers dropped after SILENT_ROUNDS
+    uint32_t chunks;            // follower: stored
+    uint32_t duplicates;        // follower: already stored or outside the window
+};
+
+/*
+    Pre:
+        ClockSync::Init() has returned and this is the master, parts stay valid until Stop()
+    Post:
+        starts a fiber streaming parts[r % count] to the follower of rank r and returns at once
+*/
+void Serve(std::shared_ptr<MicroBit> uBit, const Song::PackedSong *parts, int count);
+
+/*
+    Post:
+        true while the master still has followers without their whole part
+*/
+bool Serving();
+
+/*
+    Pre:
+        ClockSync::Init() has returned and this is a follower
+    Post:
+        starts receiving this follower's part, returns the ring to play it from
+*/
+Song::Source &Receive(std::shared_ptr<MicroBit> uBit);
+
+/*
+    Post:
+        true once the follower has its whole part
+*/
+bool Complete();
+
+/*
+    Post:
+        stops serving or receiving, returns when the master's fiber has exited
+*/
+void Stop();
+
+const Stats &GetStats();
+
+// -------------------------------------------------------------------
+
+/*
+    Body of the master's fiber
+*/
+void serve_rounds();
+
+/*
+    Sends chunk seq of part, returns whether the part has a chunk seq
+*/
+bool send_chunk(int part, uint32_t seq);
+
+void master_listener(MicroBitEvent e, const uint8_t *buffer, int len);
+
+void follower_listener(MicroBitEvent e, const uint8_t *buffer, int len);
+
+/*
+    Handler of the SONG_TRANSFER_EVT_ACK timer event
+*/
+void send_ack(MicroBitEvent e);
+}
+
+#endif
@@ -1,156 +1,672 @@
-
-
 #include "Synchronization.h"
+#include "OffsetEstimator.h"
+#include "RadioDispatch.h"
+#include "Telemetry.h"
+
+#include <algorithm>
+#include <math.h>
+#include <iterator>
+#include <vector>
 
-// FLAGS
-#define PTP_PACKET_SIZE 9
-#define SYNC_PING 0
-#define DELAY_REQ 1
-#define DELAY_RESP 2
-#define MASTER_SELECTION 3
-#define EMPTY_FIELD 0
-#define SET_UNBLOCK_TIME 4
 /*
-Each packet will be sent with the flag at the begining specyfing the purpose of the message
+Every datagram is a Packet.h frame of one or more records, the type of each specifying the purpose
+of the message. Nodes are named by their Rank(), the master is node 0
     SYNC_PING
-        initial timestamp broadcasted by the master in PTP
+        SYNC addressed to one follower, the departure time follows in a FOLLOW_UP as for
+        SYNC_BROADCAST
     DELAY_REQ
-        message from slave to master, part of PTP
+        message from slave to master, part of PTP, TURNAROUND is how long the follower held the
+        SYNC before answering, in its own microseconds
     DELAY_RESP
-        message from master to slave containing the time of arrival of DELAY_REQ
-    MASTER_SELECTION
-        used in intial phase to agree on the master
-    READY_PING
-        indicating readiness for synchronization
-
-    Packet:
-        FLAG | SERIAL_NUMBER | TIMESTAMP
-        FLAG: u_int8_t
-        PAYLOAD:
-            serial number:  uint32_t (microbit_serial_number())
-            timestamp: unsigned long (32 bits, 4 bytes)
+        message from master to slave containing the time of arrival of DELAY_REQ. The master
+        collects them until the slots of its round are over and sends them in as few frames as
+        they fit in
+    ANNOUNCE
+        used in intial phase to agree on the master, see Init()
+    UNBLOCK
+        deadline of a barrier, see Barrier()
+    BARRIER_ACK
+        follower's acknowledgement of UNBLOCK, see Barrier()
+    SYNC_BROADCAST
+        start of a broadcast round, NODE is the time source: the master, or in TREE_SYNC the
+        parent of the followers it is meant for
+    FOLLOW_UP
+        sent right after SYNC_PING/SYNC_BROADCAST with the time the SYNC left its source, in
+        the master's time, and how far off the source's clock is expected to be
+    TREE_POLL
+        TREE_SYNC, a time source asking its children whether their subtrees are done
+    SUBTREE_DONE
+        child's answer once it and every node below it have fitted their clocks
+    JOIN
+        a rebooted member asking the master for exchanges, see Join()
+    EPOCH
+        sent with the FOLLOW_UP answering a JOIN, the ensemble's UnblockTime()
+    RBS_CUE
+        RBS_SYNC, the master asking a beacon for a pulse, sent with the report of the last one
+        and a TREE_POLL
+    RBS_PULSE
+        the beacon's answer, it carries no time, only its round
+    RBS_REPORT
+        the master's time of arrival of the last round's pulse
+
+    Times of arrival are taken from MicroBitEvent::timestamp as RadioDispatch hands the event on:
+    the time the radio received the frame, captured in hardware (RadioStamp.h), not the time
+    CODAL got round to raising the event, so they do not depend on how long the idle callback
+    and the message bus take to dispatch it. Times of departure are read right after send() returns,
+    i.e. once the frame is out, on both sides, so the two legs of an exchange are symmetric.
 */
 // TODO: clear the message queue before the timing sync stuff
-// TODO: somehow make sure we know all followers received the `time_to_unlock`
 
 namespace {
 
-std::shared_ptr<MicroBit> uBit;
-size_t num_of_microbits;
-int offset;
-uint32_t serial_number;
+NODE_LOCAL std::shared_ptr<MicroBit> uBit;
+NODE_LOCAL ClockSync::OffsetEstimator estimator;
+NODE_LOCAL int sample_window = 8, sample_keep = 4;
+NODE_LOCAL uint32_t serial_number;
+NODE_LOCAL uint8_t node_id;
 
 // used for master selection
-bool is_master;
-uint32_t lowest_serial;
-volatile size_t num_of_serials_received;
+NODE_LOCAL bool is_master, ensemble_running;
+NODE_LOCAL uint32_t lowest_serial;
+NODE_LOCAL volatile bool electing, round_changed, announce_pending;
+NODE_LOCAL volatile int round_agreed;
+NODE_LOCAL int election_rounds;
 
 // used for sync
-volatile bool delay_resp_received, sync_received;
-ClockSync::timestamp_t ping_departure, ping_delay;
-ClockSync::timestamp_t sync_timestamp, sync_arrival;
-int num_of_pings;
+NODE_LOCAL volatile bool delay_resp_received, sync_received;
+NODE_LOCAL ClockSync::timestamp_t ping_departure, ping_delay;
+NODE_LOCAL ClockSync::timestamp_t sync_timestamp, sync_arrival;
+NODE_LOCAL int num_of_pings;
+
+// fibers that can be in wait_for() at once: the caller of Sync() or Join(), sync_fiber,
+// barrier_rounds and Background
+const int MAX_WAITERS = 4;
+
+// deadlines of the fibers in wait_for(), 0 for a free slot, and the one the CLOCKSYNC_EVT_DEADLINE
+// timer is armed for, 0 when it is not, see on_deadline()
+NODE_LOCAL ClockSync::timestamp_t wait_deadlines[MAX_WAITERS];
+NODE_LOCAL ClockSync::timestamp_t armed_deadline;
+
+NODE_LOCAL std::set<ClockSync::serial_t> discovered_serials;
+NODE_LOCAL volatile uint8_t current_follower;
+NODE_LOCAL volatile int follower_delay_reqs;
+
+// DELAY_RESPs waiting for CLOCKSYNC_EVT_FLUSH
+NODE_LOCAL Packet::Writer responses;
+
+// used for broadcast rounds, by follower in node order
+NODE_LOCAL std::vector<bool> followers_seen;
+NODE_LOCAL volatile size_t num_followers_seen;
+NODE_LOCAL volatile int delay_reqs_this_round;
+NODE_LOCAL volatile uint16_t sync_slots;
+NODE_LOCAL uint32_t master_round;
+// the round each follower last answered, whether it has reported its last sample, and how many
+// of those still sampling have yet to answer the current round
+NODE_LOCAL std::vector<uint32_t> answered_round;
+NODE_LOCAL std::vector<bool> followers_sampled;
+NODE_LOCAL volatile size_t num_followers_sampled;
+NODE_LOCAL volatile size_t round_pending;
+// follower: has its samples and tells the master again whenever a round asks
+NODE_LOCAL volatile bool samples_done, sampled_pending;
+
+// SYNC waiting for its FOLLOW_UP
+NODE_LOCAL uint32_t pending_round;
+NODE_LOCAL ClockSync::timestamp_t pending_arrival;
+NODE_LOCAL bool pending_in_slots;
+NODE_LOCAL uint16_t source_error;
+
+// tree sync, sync_source is the rank whose SYNCs this node follows
+NODE_LOCAL int tree_fanout = ClockSync::TREE_FANOUT;
+NODE_LOCAL bool tree_mode;
+NODE_LOCAL uint8_t sync_source;
+NODE_LOCAL ClockSync::TreeStats tree_stats;
+NODE_LOCAL volatile bool subtree_done, subtree_done_pending;
+NODE_LOCAL std::vector<bool> children_done;  // by child, in node order
+NODE_LOCAL volatile size_t num_children_done;
+NODE_LOCAL volatile uint16_t subtree_nodes, subtree_max_error;
+// every source's window for a round, the master's choice passed down with TREE_POLL, 0 until known
+NODE_LOCAL volatile uint16_t tree_window;
+
+// reference broadcast, apart from the PTP exchanges' state so that a stray SYNC cannot end up
+// in a sample. rbs_round and rbs_arrival are the last pulse heard: on the master the one of the
+// current round from rbs_beacon, on a follower any, waiting for its report. rbs_local and
+// rbs_master are the follower's last sample, the pulse's arrival on both clocks
+NODE_LOCAL volatile bool rbs_heard, rbs_received;
+NODE_LOCAL uint8_t rbs_beacon;
+NODE_LOCAL uint32_t rbs_round;
+NODE_LOCAL ClockSync::timestamp_t rbs_arrival, rbs_local, rbs_master;
+
+// the nodes the last Sync() left out, and when a follower last heard anybody, see
+// silence_left()
+NODE_LOCAL std::vector<int> silent_nodes;
+NODE_LOCAL volatile ClockSync::timestamp_t ensemble_heard;
+// when each follower or child was last heard in the rounds running, see drop_silent()
+NODE_LOCAL std::vector<ClockSync::timestamp_t> heard_at;
 
-std::set<ClockSync::serial_t> discovered_serials;
-volatile bool follower_has_synced;
+NODE_LOCAL volatile ClockSync::timestamp_t time_to_unblock;
+NODE_LOCAL volatile bool unblock_pkt_received;
 
-volatile ClockSync::timestamp_t time_to_unblock;
-volatile bool unblock_pkt_received;
+// barrier, master
+NODE_LOCAL ClockSync::BarrierStats barrier_stats;
+NODE_LOCAL uint8_t barrier_id;
+NODE_LOCAL std::vector<bool> barrier_acked;  // by follower, in node order
+NODE_LOCAL volatile size_t barrier_pending;
+NODE_LOCAL volatile uint8_t barrier_repeat;
+NODE_LOCAL volatile ClockSync::timestamp_t barrier_departure, sync_departure;
+// slots of the round this node serves, its DELAY_RESPs wait for them to be over
+NODE_LOCAL volatile uint16_t serving_slots;
+NODE_LOCAL volatile uint32_t max_rtt;
+NODE_LOCAL volatile bool barrier_running, barrier_alive;
+
+// barrier, follower
+NODE_LOCAL volatile int barriers_heard, barriers_used;
+NODE_LOCAL volatile bool ack_pending;
+NODE_LOCAL uint8_t ack_barrier, ack_repeat;
+NODE_LOCAL ClockSync::timestamp_t ack_arrival;
+
+// failover, master_node is the rank of the current master and rival_master a lower rank
+// heard running the master's rounds as well, -1 while there is none
+NODE_LOCAL uint8_t master_node;
+NODE_LOCAL volatile int rival_master;
+NODE_LOCAL volatile ClockSync::timestamp_t master_heard;
+NODE_LOCAL ClockSync::FailoverStats failover_stats;
+
+// live join: joining while this node waits for answers, join_node the node the master is to
+// answer next, -1 if none
+NODE_LOCAL volatile bool joining;
+NODE_LOCAL volatile int join_node;
+
+// SyncAsync(): what Sync() is doing, and whom to tell when it is done
+NODE_LOCAL volatile ClockSync::SyncPhase sync_phase;
+NODE_LOCAL ClockSync::SyncMode async_mode;
+NODE_LOCAL void (*async_done)();
+
+// used for background resynchronisation
+NODE_LOCAL volatile bool background_running, background_alive;
+NODE_LOCAL uint32_t background_period;
+NODE_LOCAL int background_replies;
+NODE_LOCAL int64_t slew_error;
+NODE_LOCAL ClockSync::timestamp_t slew_start;
 }
 
 namespace ClockSync {
-const timestamp_t UNBLOCK_DELAY = 500;
+// Airtime of a frame of `bytes` at the radio's 1Mbps, preamble, address, header and CRC included
+constexpr uint32_t airtime_us(int bytes)
+{
+    return 8 * (bytes + 12);
+}
+
+// How far a frame's departure and arrival may each move with the radio stack
+const uint32_t STACK_JITTER_US = 200;
+
+// Rounds: followers answer in one of the slots FOLLOW_UP gives after it, in BROADCAST_SYNC
+// their own, see answer_slot(), otherwise a random one of two per follower asked, see
+// round_slots(). A slot fits one answer alone in a frame, a DELAY_REQ or the SUBTREE_DONE or
+// BARRIER_ACK sent in slots the same way, give or take the stack's jitter on the sender's end
+// and on the source's. The DELAY_RESPs go out after the slots
+const int SLOT_FRAME_SIZE = Packet::HEADER_SIZE + std::max({Packet::RECORD_SIZE[Packet::DELAY_REQ],
+                                                            Packet::RECORD_SIZE[Packet::SUBTREE_DONE],
+                                                            Packet::RECORD_SIZE[Packet::BARRIER_ACK]});
+const uint32_t SLOT_US = airtime_us(SLOT_FRAME_SIZE) + 2 * STACK_JITTER_US;
+const int MIN_SLOTS = 8;
+// Followers asked to answer one BROADCAST_SYNC round at most, as many as one frame of DELAY_RESPs
+// answers. The others answer later rounds in turn, see answer_groups()
+const size_t ROUND_ANSWERS = (Packet::MAX_FRAME_SIZE - Packet::HEADER_SIZE) / Packet::RECORD_SIZE[Packet::DELAY_RESP];
+// the FOLLOW_UP is on air in the first slots, nobody answers in them
+const int FOLLOW_UP_SLOTS = 2;
+// after the last slot, on top of a round trip, for the answer sent in it to come in. The
+// DELAY_RESPs go out before the next SYNC, which does not wait for them to arrive
+const uint32_t ROUND_MARGIN_US = 1000;
+const uint32_t POLL_MS = 10;
+
+// A follower sends its DELAY_REQ again when the DELAY_RESP is not in RESP_TIMEOUT_US after the
+// slots of the round, or after the DELAY_REQ if that is later, REQ_RETRIES times at most, and
+// otherwise waits for the next SYNC
+const timestamp_t RESP_TIMEOUT_US = 2 * DEFAULT_RTT_US;
+const int REQ_RETRIES = 2;
+
+// SEQUENTIAL_SYNC: the master pings a follower again when its DELAY_REQ is not in after this long
+const timestamp_t PING_RETRY_US = 500000;
+
+// RBS_SYNC: a follower's pulse is all there is to its turn as the beacon and nobody else sends in
+// it, the master leaves out one that missed SILENT_TURNS turns running rather than SILENT_ROUNDS
+const int SILENT_TURNS = 2;
+
+// A wake() that comes between a waiting fiber's check and its wait is lost, this bounds the cost
+const timestamp_t WAKE_GUARD_US = 100000;
+
+static_assert(Packet::MAX_FRAME_SIZE <= MICROBIT_RADIO_MAX_PACKET_SIZE, "frames have to fit a datagram");
+
+// Background corrections are slewed in at most this rate, so SystemTime() never goes backwards
+// or leaps over a note
+const uint32_t MAX_SLEW_PPM = 500;
+
+/*
+    Children of `node`: every follower of the master, or in TREE_SYNC up to tree_fanout ranks
+    starting at first_child()
+*/
+int first_child(int node)
+{
+    return tree_mode ? node * tree_fanout + 1 : 1;
+}
+
+size_t children_of(int node)
+{
+    int size = EnsembleSize();
+    if (!tree_mode)
+        return node == master_node ? size - 1 : 0;
+    return std::clamp(size - first_child(node), 0, tree_fanout);
+}
+
+int parent_of(int node)
+{
+    return tree_mode && node > 0 ? (node - 1) / tree_fanout : 0;
+}
+
+int round_slots(size_t answering)
+{
+    return std::max<int>(MIN_SLOTS, 2 * answering);
+}
+
+/*
+    A source asks its children in groups of at most ROUND_ANSWERS ranks, so that a round does
+    not grow with their number and its DELAY_RESPs fit one frame: group g answers the rounds
+    numbered g modulo answer_groups(), every child in a slot of its own after the
+    FOLLOW_UP_SLOTS
+*/
+int answer_groups(int source)
+{
+    return std::max<int>(1, (children_of(source) + ROUND_ANSWERS - 1) / ROUND_ANSWERS);
+}
+
+// the source `node` answers to
+int source_of(int node)
+{
+    return tree_mode ? parent_of(node) : master_node;
+}
+
+bool answers_round(int node, uint32_t round)
+{
+    int source = source_of(node);
+    int groups = answer_groups(source);
+    return (node - first_child(source)) % groups == (int)(round % groups);
+}
+
+int answer_slot(int node)
+{
+    int source = source_of(node);
+    return FOLLOW_UP_SLOTS + (node - first_child(source)) / answer_groups(source);
+}
+
+int slots_per_round(int source)
+{
+    return round_slots(children_of(source));
+}
+
+/*
+    A round of `slots` slots: the slots, the round trip measured so far and the margin for the
+    last DELAY_RESP
+*/
+timestamp_t round_us(int slots)
+{
+    return (timestamp_t)SLOT_US * slots + (max_rtt > 0 ? max_rtt : DEFAULT_RTT_US) + ROUND_MARGIN_US;
+}
+
+/*
+    When the slots of the round this node serves are over, in its local time
+*/
+timestamp_t slots_end()
+{
+    return sync_departure + (timestamp_t)SLOT_US * serving_slots;
+}
+
+/*
+    How long a follower waits for SYNCs or the barrier while it hears nobody: SILENT_ROUNDS of
+    the longest round anybody runs, or of the master's pings in SEQUENTIAL_SYNC
+*/
+timestamp_t source_timeout_us()
+{
+    return SILENT_ROUNDS * std::max(PING_RETRY_US, round_us(round_slots(EnsembleSize())));
+}
+
+/*
+    What is left of source_timeout_us() counted from `since` or the last frame heard, whichever
+    is later, 0 once it is over
+*/
+timestamp_t silence_left(timestamp_t since)
+{
+    timestamp_t last = ensemble_heard;
+    timestamp_t heard = std::max(since, last);
+    int64_t left = (int64_t)(heard + source_timeout_us() - LocalTime());
+    return left > 0 ? left : 0;
+}
+
+/*
+    TREE_SYNC: the nodes with children, ranks 0 to tree_sources() - 1, take turns on the air in
+    SystemTime(). Each has a window of tree_window microseconds in every cycle of one window per
+    source, and runs one round in it; the master sizes the window to its rounds, with a slot to
+    spare for the sources' clocks being a little apart
+*/
+int tree_sources()
+{
+    return std::max(1, (EnsembleSize() - 2) / tree_fanout + 1);
+}
+
+uint16_t tree_window_us()
+{
+    int groups = answer_groups(node_id);
+    int answering = ((int)children_of(node_id) + groups - 1) / groups;
+    return std::min<timestamp_t>(round_us(FOLLOW_UP_SLOTS + answering) + SLOT_US, UINT16_MAX);
+}
+
+/*
+    Waits for the start of this node's next window, see tree_sources()
+*/
+void wait_window()
+{
+    timestamp_t cycle = (timestamp_t)tree_window * tree_sources();
+    timestamp_t now = SystemTime();
+    timestamp_t start = now - now % cycle + (timestamp_t)tree_window * node_id;
+    if ((int64_t)(start - now) < 0)
+        start += cycle;
+    while ((int64_t)(start - SystemTime()) > 0)
+        wait_for(start - SystemTime());
+}
+
+uint16_t clamp_error(uint32_t error_us)
+{
+    return std::min<uint32_t>(error_us, UINT16_MAX);
+}
+
+/*
+    Returns the part of the last background correction that has not been slewed in yet
+*/
+int64_t slew_remaining(timestamp_t local)
+{
+    if (slew_error == 0)
+        return 0;
+    int64_t decay = (int64_t)((local - slew_start) * MAX_SLEW_PPM / 1000000);
+    if (slew_error > 0)
+        return std::max<int64_t>(slew_error - decay, 0);
+    return std::min<int64_t>(slew_error + decay, 0);
+}
+
+timestamp_t LocalTime()
+{
+    return system_timer_current_time_us();
+}
+
+/*
+    SystemTime() at the local time `local`
+*/
+timestamp_t to_system(timestamp_t local)
+{
+    return local + estimator.Correction(local) + slew_remaining(local);
+}
 
 timestamp_t SystemTime()
 {
-    return uBit->systemTime() + offset;
+    return to_system(LocalTime());
 };
 
+timestamp_t UnblockTime()
+{
+    return time_to_unblock;
+}
+
+void sleep_until(timestamp_t t)
+{
+    int64_t left = (int64_t)(t - SystemTime());
+    if (left > 0)
+        uBit->sleep((left + 999) / 1000);
+}
+
+void wake()
+{
+    MicroBitEvent(MICROBIT_ID_CLOCKSYNC, CLOCKSYNC_EVT_WAKE);
+}
+
+void arm_deadline()
+{
+    timestamp_t earliest = 0;
+    for (timestamp_t d : wait_deadlines)
+        if (d != 0 && (earliest == 0 || d < earliest))
+            earliest = d;
+    if (earliest == armed_deadline)
+        return;
+    if (armed_deadline != 0)
+        system_timer_cancel_event(MICROBIT_ID_CLOCKSYNC, CLOCKSYNC_EVT_DEADLINE);
+    armed_deadline = earliest;
+    if (earliest != 0)
+        system_timer_event_after_us(std::max<int64_t>((int64_t)(earliest - LocalTime()), 1), MICROBIT_ID_CLOCKSYNC,
+                                    CLOCKSYNC_EVT_DEADLINE);
+}
+
+void wait_for(timestamp_t timeout_us)
+{
+    timestamp_t period = std::min(timeout_us, WAKE_GUARD_US);
+    target_disable_irq();
+    timestamp_t *deadline = std::find(std::begin(wait_deadlines), std::end(wait_deadlines), 0);
+    if (deadline == std::end(wait_deadlines)) {
+        // more waiters than MAX_WAITERS, poll instead of waking
+        target_enable_irq();
+        fiber_sleep((period + 999) / 1000);
+        return;
+    }
+    *deadline = LocalTime() + period;
+    arm_deadline();
+    target_enable_irq();
+    fiber_wait_for_event(MICROBIT_ID_CLOCKSYNC, CLOCKSYNC_EVT_WAKE);
+    // woken early, the timer moves on to the next deadline or is cancelled
+    target_disable_irq();
+    *deadline = 0;
+    arm_deadline();
+    target_enable_irq();
+}
+
+void on_deadline(MicroBitEvent e)
+{
+    // the timer is spent, and every waiter re-arms it on its way out
+    armed_deadline = 0;
+    wake();
+}
+
+void SetSampleWindow(int samples, int keep)
+{
+    sample_window = std::clamp(samples, 1, (int)OffsetEstimator::MAX_SAMPLES);
+    sample_keep = std::clamp(keep, 1, sample_window);
+}
+
+void send(Packet::Writer &frame)
+{
+    const uint8_t *data = frame.Seal();
+    uBit->radio.datagram.send(data, frame.Size());
+}
+
+/*
+    Sends m alone in a frame
+*/
+template <typename M> void send(const M &m)
+{
+    Packet::Writer frame;
+    frame.Add(m);
+    send(frame);
+}
+
 /*
     Post:
-        Send a packet of form
-            FLAG | SERIAL_NUMBER | TIMESTAMP
+        an order independent hash of the serials, mixed so that views differing in one serial
+        do not cancel out
 */
-void send(uint8_t flag, uint32_t serial, timestamp_t timestamp)
+uint32_t view_hash(const std::set<serial_t> &serials, serial_t own)
+{
+    auto mix = [](uint32_t h) {
+        h ^= h >> 16;
+        h *= 0x85ebca6b;
+        h ^= h >> 13;
+        h *= 0xc2b2ae35;
+        return h ^ (h >> 16);
+    };
+    uint32_t hash = mix(own);
+    for (serial_t s : serials)
+        hash ^= mix(s);
+    return hash;
+}
+
+void announce()
 {
-    uint8_t buf[PTP_PACKET_SIZE];
-    buf[0] = flag;
-    buf[1] = serial >> 24;
-    buf[2] = serial >> 16;
-    buf[3] = serial >> 8;
-    buf[4] = serial;
-    buf[5] = timestamp >> 24;
-    buf[6] = timestamp >> 16;
-    buf[7] = timestamp >> 8;
-    buf[8] = timestamp;
-    uBit->radio.datagram.send(buf, 9);
+    send(Packet::Announce{serial_number, (uint16_t)(discovered_serials.size() + 1),
+                          view_hash(discovered_serials, serial_number), !electing});
 }
 
-void Init(std::shared_ptr<MicroBit> u, int n)                 // (2)
+void on_announce(MicroBitEvent e)
+{
+    announce_pending = false;
+    announce();
+}
+
+void Init(std::shared_ptr<MicroBit> u, int expected)                 // (2)
 {
     delay_resp_received = false;
     sync_received = false;
-    num_of_serials_received = 0;
-    offset = 0;
+    discovered_serials.clear();
+    estimator.Reset();
+    slew_error = 0;
+    master_round = 0;
     num_of_pings = 0;
+    electing = true;
+    announce_pending = false;
+    barrier_stats = {};
+    barriers_heard = 0;
+    barriers_used = 0;
+    ack_pending = false;
+    max_rtt = 0;
+    master_node = 0;
+    failover_stats = {};
+    ensemble_running = false;
+    joining = false;
+    join_node = -1;
+    sync_phase = SYNC_IDLE;
+    Telemetry::Reset();
 
     uBit = std::move(u);
-    num_of_microbits = n;
 
     // not sure how microbit_serial_number works but it in one of the samples
     lowest_serial = microbit_serial_number();
     serial_number = lowest_serial;
-    uBit->messageBus.listen(MICROBIT_ID_RADIO, MICROBIT_RADIO_EVT_DATAGRAM, master_selection, MESSAGE_BUS_LISTENER_IMMEDIATE);
     uBit->radio.enable();
     uBit->radio.setGroup(3);
+    uBit->messageBus.listen(MICROBIT_ID_CLOCKSYNC, CLOCKSYNC_EVT_ANNOUNCE, on_announce, MESSAGE_BUS_LISTENER_IMMEDIATE);
+    uBit->messageBus.listen(MICROBIT_ID_CLOCKSYNC, CLOCKSYNC_EVT_DEADLINE, on_deadline, MESSAGE_BUS_LISTENER_IMMEDIATE);
+    RadioDispatch::Init(uBit);
+    RadioDispatch::Listen(master_selection);
 
-    // This protocol for choosing master is fallible
-    // it might be the case that some microbits propagated their serial number before
-    // some of them enabled their radio, for now I will just force the microbits to wait
-    // some time before transmitting their serial. We have to come up with better solution
-//    uBit->sleep(60000); // sleeping for a minute
+    // Rounds of one announcement each at a random point, see the header. The round grows with
+    // the membership so that announcements stay about ELECTION_SLOT_MS apart on average
+    int quiet = 0, agreeing = 0;
+    election_rounds = 0;
+    while (true) {
+        uint32_t round_ms = std::max<uint32_t>(MIN_ELECTION_ROUND_MS, ELECTION_SLOT_MS * (discovered_serials.size() + 1));
+        uint32_t at = uBit->random(round_ms);
+        round_changed = false;
+        round_agreed = 0;
+        uBit->sleep(at);
+        announce();
+        uBit->sleep(round_ms - at);
+        election_rounds++;
 
-    timestamp_t sync_end = SystemTime() + 1000;
-    do {
-        send(MASTER_SELECTION, serial_number, EMPTY_FIELD);
-        uBit->sleep(100);
-    } while (!((num_of_serials_received >= num_of_microbits - 1) && SystemTime() > sync_end));
-    send(MASTER_SELECTION, serial_number, EMPTY_FIELD);
-    uBit->messageBus.ignore(MICROBIT_ID_RADIO, MICROBIT_RADIO_EVT_DATAGRAM, master_selection);
+        if (round_changed) {
+            quiet = 0;
+            agreeing = 0;
+            continue;
+        }
+        quiet++;
+        agreeing += round_agreed;
+        bool settled = agreeing > 0 ? quiet >= QUIET_ELECTION_ROUNDS : quiet >= ALONE_ELECTION_ROUNDS;
+        if (settled && (int)discovered_serials.size() + 1 >= expected)
+            break;
+    }
+    electing = false;
 
     is_master = lowest_serial == serial_number;
+    node_id = Rank();
+    responses.Clear();
+    // in TREE_SYNC followers answer DELAY_REQs too
+    uBit->messageBus.listen(MICROBIT_ID_CLOCKSYNC, CLOCKSYNC_EVT_FLUSH, flush_responses, MESSAGE_BUS_LISTENER_IMMEDIATE);
+    if (!is_master) {
+        uBit->messageBus.listen(MICROBIT_ID_CLOCKSYNC, CLOCKSYNC_EVT_BARRIER_ACK, send_barrier_ack, MESSAGE_BUS_LISTENER_IMMEDIATE);
+        uBit->messageBus.listen(MICROBIT_ID_CLOCKSYNC, CLOCKSYNC_EVT_SUBTREE_DONE, send_subtree_done, MESSAGE_BUS_LISTENER_IMMEDIATE);
+        uBit->messageBus.listen(MICROBIT_ID_CLOCKSYNC, CLOCKSYNC_EVT_SAMPLED, send_sampled, MESSAGE_BUS_LISTENER_IMMEDIATE);
+        RadioDispatch::Listen(barrier_listener);
+    }
     uBit->serial.printf(is_master ? "I'm master\r\n" : "I'm follower\r\n");
+    uBit->serial.printf("%d members after %d rounds, rank %d:", EnsembleSize(), election_rounds, Rank());
+    for (serial_t s : Members())
+        uBit->serial.printf(" %08x", (unsigned)s);
+    uBit->serial.printf("\r\n");
 }
 
+std::set<serial_t> Members()
+{
+    std::set<serial_t> members = discovered_serials;
+    members.insert(serial_number);
+    return members;
+}
 
+int ElectionRounds()
+{
+    return election_rounds;
+}
 
-std::unique_ptr<PTP_packet> toPTP_packet(const uint8_t *buffer)
+int Rank()
 {
-    auto packet = std::make_unique<PTP_packet>();
+    return std::distance(discovered_serials.begin(), discovered_serials.lower_bound(serial_number));
+}
 
-    packet->flag = buffer[0];
-    packet->serial = (buffer[1] << 24) + (buffer[2] << 16) + (buffer[3] << 8) + buffer[4];
-    packet->timestamp = (buffer[5] << 24) + (buffer[6] << 16) + (buffer[7] << 8) + buffer[8];
-    return packet;
+int EnsembleSize()
+{
+    return discovered_serials.size() + 1;
 }
 
-void master_selection(MicroBitEvent e)
+bool EnsembleRunning()
 {
-    uint8_t buffer[9];
-    uBit->radio.datagram.recv(buffer, PTP_PACKET_SIZE);
-    auto p = toPTP_packet(buffer);
+    return ensemble_running;
+}
 
 
-    if (p->serial == serial_number) {
+
+void master_selection(MicroBitEvent e, const uint8_t *buffer, int len)
+{
+    Packet::Reader frame(buffer, len);
+    Packet::Announce p;
+    while (frame.Next())
+        if (frame.Get(p) && p.serial != serial_number)
+            on_announcement(p.serial, p.members, p.view, p.running);
+}
+
+void on_announcement(serial_t serial, size_t members, uint32_t hash, bool running)
+{
+    if (electing) {
+        if (running)
+            ensemble_running = true;
+        if (discovered_serials.insert(serial).second) {
+            if (serial < lowest_serial)
+                lowest_serial = serial;
+            round_changed = true;
+        }
+        if (members == discovered_serials.size() + 1 && hash == view_hash(discovered_serials, serial_number))
+            round_agreed = round_agreed + 1;
+        else
+            round_changed = true;
         return;
     }
 
-    if (p->flag == MASTER_SELECTION)
-    {
-        discovered_serials.insert(p->serial);
-        if (p->serial < lowest_serial)
-            lowest_serial = p->serial;
-        num_of_serials_received = discovered_serials.size();
+    // done: the membership is frozen so that Rank() stays put, a node that still disagrees
+    // with it is answered once, after a random delay so that the answers do not collide
+    if (hash != view_hash(discovered_serials, serial_number) && !announce_pending) {
+        announce_pending = true;
+        uint32_t round_ms = std::max<uint32_t>(MIN_ELECTION_ROUND_MS, ELECTION_SLOT_MS * (discovered_serials.size() + 1));
+        system_timer_event_after_us((1 + uBit->random(round_ms)) * 1000, MICROBIT_ID_CLOCKSYNC, CLOCKSYNC_EVT_ANNOUNCE);
     }
 }
 
@@ -168,19 +684,74 @@ void master_selection(MicroBitEvent e)
 //    }
 //}
 
-void on_delay_req(MicroBitEvent e)
+void on_delay_req(MicroBitEvent e, const uint8_t *buffer, int len)
 {
-    ClockSync::timestamp_t t = uBit->systemTime();
-    uint8_t buffer[9];
-    uBit->radio.datagram.recv(buffer, PTP_PACKET_SIZE);
-    std::unique_ptr<PTP_packet> p = toPTP_packet(buffer);
-    if (p->flag == DELAY_REQ)
-    {
-        // if received DELAY_REQ ping respond with the time of packet's arrival
-        send(DELAY_RESP, p->serial, t);
-        follower_has_synced = true;
-
+    ClockSync::timestamp_t t = e.timestamp;
+    // in the master's time, a node serving its children in TREE_SYNC has its own clock fitted
+    uint32_t arrival = to_system(t);
+    size_t first_node = first_child(node_id);
+    Packet::Reader frame(buffer, len);
+    Packet::DelayReq p;
+    while (frame.Next()) {
+        if (!frame.Get(p) || p.node == node_id)
+            continue;
+        // the background sync answers every member, a rebooted master among them
+        bool child = p.node >= first_node && p.node < first_node + followers_seen.size();
+        if (!child && !background_running)
+            continue;
+        // if received DELAY_REQ ping respond with the time of packet's arrival, along with the
+        // other followers answering about now
+        target_disable_irq();
+        bool first = responses.Empty();
+        if (!responses.Add(Packet::DelayResp{p.node, arrival})) {
+            Packet::Writer full = responses;
+            responses.Clear();
+            responses.Add(Packet::DelayResp{p.node, arrival});
+            target_enable_irq();
+            send(full);
+        } else {
+            target_enable_irq();
+            if (first)
+                system_timer_event_after_us(std::max<int64_t>((int64_t)(slots_end() - LocalTime()), 1),
+                                            MICROBIT_ID_CLOCKSYNC, CLOCKSYNC_EVT_FLUSH);
+        }
+        // a DELAY_REQ answering an earlier SYNC comes out negative and is left out
+        int64_t rtt = (int64_t)(t - sync_departure) - (int64_t)p.turnaround_us;
+        if (rtt > 0 && rtt < INT32_MAX && (uint32_t)rtt > max_rtt)
+            max_rtt = rtt;
+        if (p.node == current_follower)
+            follower_delay_reqs = follower_delay_reqs + 1;
+        if (child && !followers_seen[p.node - first_node]) {
+            followers_seen[p.node - first_node] = true;
+            num_followers_seen = num_followers_seen + 1;
+        }
+        size_t i = p.node - first_node;
+        if (child && i < heard_at.size())
+            heard_at[i] = t;
+        // a DELAY_REQ of this round, in BROADCAST_SYNC from a follower still sampling
+        if (child && i < followers_sampled.size() && !followers_sampled[i]) {
+            if (rtt > 0 && answered_round[i] != master_round && answers_round(p.node, master_round)) {
+                answered_round[i] = master_round;
+                round_pending = round_pending - 1;
+            }
+            if (p.remaining == 0) {
+                followers_sampled[i] = true;
+                num_followers_sampled = num_followers_sampled + 1;
+            }
+        }
+        delay_reqs_this_round = delay_reqs_this_round + 1;
     }
+    wake();
+}
+
+void flush_responses(MicroBitEvent e)
+{
+    target_disable_irq();
+    Packet::Writer frame = responses;
+    responses.Clear();
+    target_enable_irq();
+    if (!frame.Empty())
+        send(frame);
 }
 
 //void on_delay_resp(MicroBitEvent e)
@@ -198,84 +769,282 @@ void on_delay_req(MicroBitEvent e)
 //}
 
 
-void SyncAsMaster()
+void SyncAsMaster(SyncMode mode)
 {
-    std::set<serial_t> followers;
-
-
 //    master --> follower
 //    SYNC_PING -->
 //    <-- DELAY_REQ
 //    DELAY_RESP -->
-    uBit->messageBus.listen(MICROBIT_ID_RADIO, MICROBIT_RADIO_EVT_DATAGRAM, on_delay_req, MESSAGE_BUS_LISTENER_IMMEDIATE);
-    for (serial_t follower_serial : discovered_serials) {
-        follower_has_synced = false;
-        while (!follower_has_synced) {
-            send(SYNC_PING, follower_serial, uBit->systemTime());
-            uBit->sleep(500);
+    max_rtt = 0;
+    followers_seen.assign(discovered_serials.size(), false);
+    num_followers_seen = 0;
+    RadioDispatch::Listen(on_delay_req);
+    sync_phase = SYNC_SERVING;
+    if (mode == SEQUENTIAL_SYNC) {
+        serving_slots = 0;
+        for (size_t follower = 1; follower <= discovered_serials.size(); follower++) {
+            current_follower = follower;
+            follower_delay_reqs = 0;
+            int silent = 0;
+            while (follower_delay_reqs < sample_window && silent < SILENT_ROUNDS) {
+                int answered = follower_delay_reqs;
+                master_round++;
+                send(Packet::SyncPing{(uint8_t)follower, master_round});
+                sync_departure = LocalTime();
+                send(Packet::FollowUp{node_id, master_round, sync_departure, 0, 0});
+                // move on as soon as the DELAY_REQ is in, retry after PING_RETRY_US otherwise
+                timestamp_t retry = sync_departure + PING_RETRY_US;
+                while (follower_delay_reqs == answered && (int64_t)(retry - LocalTime()) > 0)
+                    wait_for(retry - LocalTime());
+                // the next SYNC_PING would cut the exchange short, the DELAY_RESP goes out first
+                if (follower_delay_reqs != answered) {
+                    flush_responses(MicroBitEvent());
+                    silent = 0;
+                } else {
+                    silent++;
+                }
+            }
+            if (silent == SILENT_ROUNDS)
+                silent_nodes.push_back(follower);
         }
+    } else if (mode == RBS_SYNC) {
+        RbsRounds();
+    } else {
+        BroadcastRounds();
     }
-    uBit->messageBus.ignore(MICROBIT_ID_RADIO, MICROBIT_RADIO_EVT_DATAGRAM, on_delay_req);
-
-
-    timestamp_t time_to_unblock = SystemTime() + UNBLOCK_DELAY;
-//    uBit->sleep(300);
-    send(SET_UNBLOCK_TIME, serial_number, time_to_unblock);
-//    uBit->sleep(300);
-//    send(SET_UNBLOCK_TIME, serial_number, time_to_unblock);
-//    uBit->sleep(300);
-//    send(SET_UNBLOCK_TIME, serial_number, time_to_unblock);
 
-    uBit->sleep(time_to_unblock - SystemTime());
+    // the DELAY_RESP to a follower's last DELAY_REQ may be lost, its retries are still answered
+    sync_phase = SYNC_BARRIER;
+    Barrier();
+    RadioDispatch::Ignore(on_delay_req);
+    followers_sampled.clear();
+    heard_at.clear();
 }
 
 
-void follower_listener(MicroBitEvent e) {
-    timestamp_t t = uBit->systemTime();
-    uint8_t buffer[9];
-    uBit->radio.datagram.recv(buffer, PTP_PACKET_SIZE);
-    std::unique_ptr<PTP_packet> p = toPTP_packet(buffer);
-
-//    uBit->serial.printf("got %d pkt\r\n", p->flag);
-
+/*
+    master --> followers
+    SYNC_BROADCAST -->
+    FOLLOW_UP -->
+    <-- DELAY_REQ (each follower of the round's group still sampling, in its slot)
+    DELAY_RESP -->
 
-    if (p->flag == SYNC_PING && p->serial == serial_number) {
-        sync_arrival = t;
-        // if received SYNC_PING, simply save the time of arrival and break the loop in main thread
-        sync_timestamp = p->timestamp;
-        sync_received = true;
-    } else if (p->flag == SET_UNBLOCK_TIME) {
-        time_to_unblock = p->timestamp;
-        unblock_pkt_received = true; // used to break while
-    } else if (p->flag == DELAY_RESP && p->serial == serial_number){
-        ping_delay = p->timestamp;
-        delay_resp_received = true; // used to break while
+    A round asks one group of at most ROUND_ANSWERS followers, see answer_groups(), and ends
+    early once all of them still sampling have answered. Rounds of groups with nobody left
+    sampling are skipped. Rounds repeat until every follower has sent a DELAY_REQ with
+    REMAINING 0; one that had its DELAY_RESP lost answers its group's next round again, see
+    send_sampled(). A follower not heard from for SILENT_ROUNDS of its group's rounds, and at
+    least source_timeout_us(), is left out.
+*/
+void BroadcastRounds()
+{
+    size_t followers = children_of(node_id);
+    followers_seen.assign(followers, false);
+    num_followers_seen = 0;
+    answered_round.assign(followers, 0);
+    heard_at.assign(followers, LocalTime());
+    followers_sampled.assign(followers, false);
+    num_followers_sampled = 0;
+    int groups = answer_groups(node_id);
+    timestamp_t silence_us = std::max(source_timeout_us(),
+                                      SILENT_ROUNDS * groups * round_us(FOLLOW_UP_SLOTS + ROUND_ANSWERS));
+    while (num_followers_sampled < followers) {
+        // the next group with followers still sampling, the round ends with the last one's slot
+        size_t asked = 0;
+        int slots = 0;
+        for (int g = 0; g < groups && asked == 0; g++) {
+            master_round++;
+            for (size_t i = 0; i < followers; i++)
+                if (!followers_sampled[i] && answers_round(1 + i, master_round)) {
+                    asked++;
+                    slots = answer_slot(1 + i) + 1;
+                }
+        }
+        if (asked == 0)
+            continue;
+        round_pending = asked;
+        delay_reqs_this_round = 0;
+        serving_slots = slots;
+        send(Packet::SyncBroadcast{node_id, master_round});
+        // the radio returns from send() once the frame is out, so this is the departure time
+        sync_departure = LocalTime();
+        send(Packet::FollowUp{node_id, master_round, sync_departure, 0, (uint16_t)slots});
+        timestamp_t end = sync_departure + round_us(slots);
+        while (round_pending > 0 && (int64_t)(end - LocalTime()) > 0)
+            wait_for(end - LocalTime());
+        // everybody is in, or nobody else will be: the DELAY_RESPs need not wait for the slots,
+        // and go out before the next SYNC
+        flush_responses(MicroBitEvent());
+        drop_silent(followers_sampled, num_followers_sampled, silence_us);
     }
 }
-void SyncAsFollower()
-{
-
-    sync_received = false;
-    delay_resp_received = false;
-    unblock_pkt_received = false;
 
-    uBit->messageBus.listen(MICROBIT_ID_RADIO, MICROBIT_RADIO_EVT_DATAGRAM, follower_listener, MESSAGE_BUS_LISTENER_IMMEDIATE);
-
-    // Waiting for sync ping from master
-
-    while (!sync_received)
-        uBit->sleep(100);
-//    uBit->serial.printf("got sync pkt\r\n");
+timestamp_t failover_timeout_us()
+{
+    return (timestamp_t)FAILOVER_PERIODS * background_period * 1000;
+}
 
-    // Start listening for a response from master to req ping
+/*
+    Whether to follow a SYNC_BROADCAST from `node` that arrived at t. In the background sync a
+    node that has taken over from a silent master, or a lower rank than the current one, becomes
+    the new source
+*/
+bool follow_source(uint8_t node, timestamp_t t)
+{
+    if (node == sync_source) {
+        master_heard = t;
+        return true;
+    }
+    if (!background_running || node == node_id)
+        return false;
+    timestamp_t silence = t - master_heard;
+    if (node > sync_source && silence <= failover_timeout_us())
+        return false;
+    if (silence > failover_stats.gap_us)
+        failover_stats.gap_us = std::min<timestamp_t>(silence, UINT32_MAX);
+    failover_stats.failovers++;
+    failover_stats.master = node;
+    master_node = node;
+    sync_source = node;
+    master_heard = t;
+    return true;
+}
 
+void follower_listener(MicroBitEvent e, const uint8_t *buffer, int len) {
+    timestamp_t t = e.timestamp;
+    // whoever sent it, the ensemble is still at it
+    ensemble_heard = t;
+    // a TREE_POLL that came with a FOLLOW_UP is answered in this node's slot, in its group's round
+    timestamp_t poll_slot = 0;
+    bool poll_turn = true;
+    Packet::Reader frame(buffer, len);
+    while (frame.Next()) {
+        Packet::SyncPing ping;
+        Packet::SyncBroadcast broadcast;
+        Packet::FollowUp follow_up;
+        Packet::DelayResp resp;
+        Packet::TreePoll poll;
+        Packet::Epoch epoch;
+        Packet::RbsCue cue;
+        Packet::RbsPulse pulse;
+        Packet::RbsReport report;
+        if ((frame.Get(ping) && ping.node == node_id) || (frame.Get(broadcast) && follow_source(broadcast.node, t))) {
+            // save the time of arrival, the departure time comes with the FOLLOW_UP
+            pending_in_slots = frame.Type() == Packet::SYNC_BROADCAST;
+            pending_round = pending_in_slots ? broadcast.round : ping.round;
+            pending_arrival = t;
+        } else if (frame.Get(follow_up) && follow_up.round == pending_round &&
+                   (follow_up.node == sync_source || (joining && !pending_in_slots))) {
+            // whoever answered our JOIN is the master
+            if (joining)
+                master_node = sync_source = follow_up.node;
+            // break the loop in main thread
+            sync_arrival = pending_arrival;
+            sync_timestamp = follow_up.departure;
+            source_error = follow_up.error_us;
+            sync_slots = pending_in_slots ? follow_up.slots : 0;
+            if (sync_slots > 0) {
+                poll_slot = sync_arrival + (timestamp_t)SLOT_US * answer_slot(node_id);
+                poll_turn = answers_round(node_id, follow_up.round) && answer_slot(node_id) < sync_slots;
+            }
+            sync_received = true;
+            wake();
+            // past the round's last slot the master knows already, and a SUBTREE_DONE says as much
+            if (samples_done && !subtree_done && sync_slots > 0 && !sampled_pending &&
+                answers_round(node_id, follow_up.round) && answer_slot(node_id) < sync_slots) {
+                sampled_pending = true;
+                // the slots count from the SYNC, which came a frame earlier
+                timestamp_t slot = pending_arrival + (timestamp_t)SLOT_US * answer_slot(node_id);
+                system_timer_event_after_us(std::max<int64_t>((int64_t)(slot - LocalTime()), 1), MICROBIT_ID_CLOCKSYNC,
+                                            CLOCKSYNC_EVT_SAMPLED);
+            }
+        } else if (frame.Get(resp) && resp.node == node_id) {
+            // the master's clock has not moved far from the last FOLLOW_UP
+            ping_delay = Packet::widen(resp.arrival, sync_timestamp);
+            delay_resp_received = true;
+            wake();
+        } else if (frame.Get(epoch) && epoch.node == node_id && joining) {
+            time_to_unblock = epoch.unblock;
+            wake();
+        } else if (frame.Get(pulse)) {
+            // its arrival at the master comes with the next cue
+            rbs_round = pulse.round;
+            rbs_arrival = t;
+        } else if (frame.Get(report) && report.round == rbs_round && rbs_round != 0) {
+            rbs_local = rbs_arrival;
+            rbs_master = report.arrival;
+            rbs_received = true;
+            wake();
+        } else if (frame.Get(cue) && cue.node == node_id) {
+            // the pulse carries no time, so it does not matter how long it takes to go out
+            send(Packet::RbsPulse{node_id, cue.round});
+        } else if (frame.Get(poll) && poll.node == sync_source) {
+            if (poll.window_us != 0)
+                tree_window = poll.window_us;
+            if (!poll_turn || !subtree_done || subtree_done_pending)
+                continue;
+            // alone, in a random slot without a FOLLOW_UP: the parent's other children are asked
+            // as well
+            subtree_done_pending = true;
+            timestamp_t slot = poll_slot != 0 ? poll_slot
+                                              : t + (timestamp_t)SLOT_US * (1 + uBit->random(slots_per_round(sync_source)));
+            system_timer_event_after_us(std::max<int64_t>((int64_t)(slot - LocalTime()), 1), MICROBIT_ID_CLOCKSYNC,
+                                        CLOCKSYNC_EVT_SUBTREE_DONE);
+        }
+    }
+}
 
-    // send a DELAY_REQ ping and save the time of departure
-    ping_departure = uBit->systemTime();
-    send(DELAY_REQ, serial_number, EMPTY_FIELD);
+/*
+    Follower's half of one exchange after a SYNC sent at t1 (master's clock) arrived at t1_arrival:
+    send a DELAY_REQ, if the SYNC was broadcast in `slot`, or in a random one when that is -1, and
+    add the sample to the estimator once DELAY_RESP is in. The DELAY_REQ is sent again after
+    RESP_TIMEOUT_US without an answer, up to REQ_RETRIES times. Gives up when the next SYNC or
+    UNBLOCK arrives.
+*/
+bool exchange(timestamp_t t1, timestamp_t t1_arrival, int slot = -1)
+{
+    if (sync_slots > 0) {
+        timestamp_t send_at = t1_arrival + (timestamp_t)SLOT_US * slot;
+        if (slot < 0) {
+            // pick a random slot among those we have not polled past yet
+            int slots = sync_slots;
+            int first = (int)std::min<timestamp_t>((LocalTime() - t1_arrival + SLOT_US - 1) / SLOT_US, slots - 1);
+            // at a random point within the jitter the slot leaves room for, followers that picked
+            // the same slot would otherwise all wake on the FOLLOW_UP and send at the same
+            // microsecond
+            send_at = t1_arrival + (timestamp_t)SLOT_US * (first + uBit->random(slots - first)) +
+                      uBit->random(STACK_JITTER_US);
+        }
+        // the slots are shorter than a scheduler tick, uBit->sleep() would miss them
+        while ((int64_t)(send_at - LocalTime()) > 0)
+            wait_for(send_at - LocalTime());
+    }
 
-    while (!delay_resp_received)
-        uBit->sleep(100);
+    // send a DELAY_REQ ping and save the time of departure, send() returns once it is out
+    delay_resp_received = false;
+    timestamp_t departures[1 + REQ_RETRIES];
+    int sent = 0;
+    while (true) {
+        int remaining = std::max(sample_window - estimator.Size() - 1, 0);
+        send(Packet::DelayReq{node_id, (uint32_t)(LocalTime() - t1_arrival), (uint8_t)remaining});
+        departures[sent++] = LocalTime();
+        // the DELAY_RESP comes once the slots are over
+        timestamp_t retry = std::max(departures[sent - 1], t1_arrival + (timestamp_t)SLOT_US * sync_slots) + RESP_TIMEOUT_US;
+        while (!delay_resp_received && !sync_received && !unblock_pkt_received && (int64_t)(retry - LocalTime()) > 0)
+            wait_for(retry - LocalTime());
+        if (delay_resp_received || sync_received || unblock_pkt_received || sent > REQ_RETRIES)
+            break;
+    }
+    if (!delay_resp_received) {
+        Telemetry::RecordLostExchange();
+        return false;
+    }
+    // the DELAY_RESP may answer an earlier copy of the DELAY_REQ: paired with a later departure
+    // the round trip would come out short by a whole RESP_TIMEOUT_US, i.e. negative
+    int k = sent - 1;
+    while (k > 0 && (int64_t)(t1_arrival - t1) + (int64_t)(ping_delay - departures[k]) < 0)
+        k--;
+    ping_departure = departures[k];
 //    uBit->serial.printf("got delay resp pkt\r\n");
     /*
         OFFSET CALCULATIONS
@@ -286,13 +1055,84 @@ void SyncAsFollower()
             T2     - ping_departure
             T2'    - ping_delay
             offset = 1/2(T1' - T1 - T2' + T2)
+            delay  = (T1' - T1) + (T2' - T2), the round trip without the follower's turnaround
     */
-    offset = -((int)(sync_arrival - sync_timestamp) + (int)(ping_departure - ping_delay)) / 2;
+    int64_t offset = -((int64_t)(t1_arrival - t1) + (int64_t)(ping_departure - ping_delay)) / 2;
+    int64_t delay = (int64_t)(t1_arrival - t1) + (int64_t)(ping_delay - ping_departure);
+    if (delay < 0 || delay > INT32_MAX)
+        return false;
+    estimator.Add(t1_arrival, offset, delay);
+    Telemetry::RecordExchange(delay);
+    return true;
+}
+
+bool collect_samples()
+{
+    sync_received = false;
+    delay_resp_received = false;
+    unblock_pkt_received = false;
+
+    // Collect sample_window exchanges, a lost DELAY_REQ/DELAY_RESP is simply retried with the
+    // next SYNC. UNBLOCK ends the collection with whatever samples we have, and so does silence
+    estimator.Reset();
+    sync_phase = SYNC_SAMPLING;
+    timestamp_t since = LocalTime();
+    bool heard = true;
+    while (estimator.Size() < sample_window && !unblock_pkt_received) {
+        // Waiting for sync ping from master
+        while (!sync_received && !unblock_pkt_received && silence_left(since) > 0)
+            wait_for(silence_left(since));
+        if (!sync_received && !unblock_pkt_received) {
+            silent_nodes.push_back(sync_source);
+            heard = false;
+        }
+        if (unblock_pkt_received || !sync_received)
+            break;
+        sync_received = false;
+        // the listener overwrites these when the next SYNC arrives
+        timestamp_t t1 = sync_timestamp, t1_arrival = sync_arrival;
+        // a round for another group of followers, see answer_groups()
+        int slot = -1;
+        if (sync_slots > 0) {
+            if (!answers_round(node_id, pending_round))
+                continue;
+            slot = answer_slot(node_id);
+        }
+//        uBit->serial.printf("got sync pkt\r\n");
+
+        exchange(t1, t1_arrival, slot);
+    }
 //    uBit->serial.printf("sync_arrival %d sync_timestamp %d (%d)\r\n", sync_arrival, sync_timestamp, sync_arrival-sync_timestamp);
 //    uBit->serial.printf("ping_departure %d ping_delay %d (%d)\r\n", ping_departure, ping_delay, ping_departure-ping_delay);
-    while (!unblock_pkt_received)
-        uBit->sleep(100);
-    uBit->serial.printf("got unblock time %d, offset %d, (%d), (%d)\r\n", time_to_unblock, offset, SystemTime(), time_to_unblock - SystemTime());
+    fit_samples(sample_keep);
+    return heard;
+}
+
+void fit_samples(int keep)
+{
+    if (estimator.Fit(keep))
+        Telemetry::RecordFit(estimator.offset, estimator.skew, estimator.error);
+
+    // the hops' errors are independent, they add up in quadrature
+    tree_stats.parent = sync_source;
+    tree_stats.hop_error_us = estimator.error;
+    tree_stats.error_us = (uint32_t)(sqrt((double)source_error * source_error + (double)estimator.error * estimator.error) + 0.5);
+}
+
+void SyncAsFollower()
+{
+    RadioDispatch::Listen(follower_listener);
+    bool heard = collect_samples();
+    // BROADCAST_SYNC goes on until the master knows we are done
+    samples_done = true;
+    sync_phase = SYNC_BARRIER;
+    // nobody is left to send the UNBLOCK
+    if (heard)
+        Barrier();
+    samples_done = false;
+    RadioDispatch::Ignore(follower_listener);
+    uBit->serial.printf("got unblock time %d, offset %d, (%d), (%d)\r\n", (int)(time_to_unblock / 1000),
+                        (int)estimator.offset, (int)(SystemTime() / 1000), (int)(time_to_unblock - SystemTime()));
 
 //    while (true) {
 //        uint8_t buffer[9];
@@ -310,17 +1150,700 @@ void SyncAsFollower()
 //            break;
 //        }
 //    }
-    uBit->messageBus.ignore(MICROBIT_ID_RADIO, MICROBIT_RADIO_EVT_DATAGRAM, follower_listener);
-    uBit->sleep(time_to_unblock - SystemTime());
 }
 
-void Sync()
+/*
+    node --> children
+    SYNC_BROADCAST -->
+    FOLLOW_UP | TREE_POLL -->
+    <-- DELAY_REQ (each child in a random slot, until it has its samples)
+    DELAY_RESP -->
+    <-- SUBTREE_DONE (each child in a random slot, once its own subtree is done)
+
+    Every node first syncs from its parent, then serves its children with its fitted clock, so
+    nodes on the same level sync in parallel. The SUBTREE_DONEs flow back up, the master starts
+    the barrier once all of its children have reported and everybody hears the UNBLOCK.
+*/
+void SyncTree()
 {
-    if (is_master) {
-        SyncAsMaster();
+    subtree_done = false;
+    subtree_done_pending = false;
+    tree_window = 0;
+    bool heard = true;
+    if (!is_master) {
+        RadioDispatch::Listen(follower_listener);
+        heard = collect_samples();
+    }
+
+    subtree_nodes = 1;
+    subtree_max_error = clamp_error(tree_stats.error_us);
+    // without a clock of the master's to pass on the children are left to give up as well
+    if (heard && children_of(node_id) > 0) {
+        max_rtt = 0;
+        sync_phase = SYNC_SERVING;
+        TreeRounds();
+    }
+    tree_stats.subtree_nodes = subtree_nodes;
+    tree_stats.subtree_max_error_us = subtree_max_error;
+    subtree_done = true;
+
+    sync_phase = SYNC_BARRIER;
+    if (heard)
+        Barrier();
+    if (!is_master)
+        RadioDispatch::Ignore(follower_listener);
+}
+
+/*
+    One round in each of this node's windows, see tree_sources(), or back to back until the
+    master has sized them. A round asks one group of children, see answer_groups(), and ends
+    once those still sampling have sent their DELAY_REQ and the others their SUBTREE_DONE, or
+    after the group's last slot. The rounds do not give up on a child that falls quiet for a few
+    of them: with several sources on the air a child may miss a few SYNCs in a row. They stop
+    with the last child's SUBTREE_DONE. A child is still heard while it runs rounds for its own
+    subtree; one not heard from for source_timeout_us() is left out. The times sent are this
+    node's SystemTime(), so its children sync to the master through it.
+*/
+void TreeRounds()
+{
+    size_t children = children_of(node_id);
+    followers_seen.assign(children, false);
+    num_followers_seen = 0;
+    children_done.assign(children, false);
+    num_children_done = 0;
+    answered_round.assign(children, 0);
+    followers_sampled.assign(children, false);
+    num_followers_sampled = 0;
+    heard_at.assign(children, LocalTime());
+    uint16_t error = clamp_error(tree_stats.error_us);
+    int groups = answer_groups(node_id);
+    RadioDispatch::Listen(on_delay_req);
+    RadioDispatch::Listen(on_subtree_done);
+    while (num_children_done < children) {
+        // the next group with children not done, the round ends with the last one's slot
+        size_t asked = 0, waiting = 0;
+        int slots = 0;
+        for (int g = 0; g < groups && slots == 0; g++) {
+            master_round++;
+            for (size_t i = 0; i < children; i++)
+                if (!children_done[i] && answers_round(first_child(node_id) + i, master_round)) {
+                    waiting++;
+                    asked += !followers_sampled[i];
+                    slots = answer_slot(first_child(node_id) + i) + 1;
+                }
+        }
+        size_t done = num_children_done;
+        round_pending = asked;
+        serving_slots = slots;
+        if (tree_window != 0)
+            wait_window();
+        send(Packet::SyncBroadcast{node_id, master_round});
+        sync_departure = LocalTime();
+        Packet::Writer frame;
+        frame.Add(Packet::FollowUp{node_id, master_round, to_system(sync_departure), error, (uint16_t)slots});
+        frame.Add(Packet::TreePoll{node_id, tree_window});
+        send(frame);
+        timestamp_t end = sync_departure + round_us(slots);
+        if (tree_window != 0)
+            end = std::min<timestamp_t>(end, sync_departure + tree_window - SLOT_US);
+        // until each child of the group still sampling has sent its DELAY_REQ and every other
+        // one its SUBTREE_DONE: the DELAY_RESPs would go out over the slots still to come
+        while ((round_pending > 0 || num_children_done - done < waiting - asked) && num_children_done < children &&
+               (int64_t)(end - LocalTime()) > 0)
+            wait_for(end - LocalTime());
+        flush_responses(MicroBitEvent());
+        drop_silent(children_done, num_children_done, source_timeout_us());
+        // the round trip of the first answers sizes everybody's windows
+        if (is_master && tree_window == 0 && max_rtt > 0)
+            tree_window = tree_window_us();
+    }
+    RadioDispatch::Ignore(on_subtree_done);
+    RadioDispatch::Ignore(on_delay_req);
+    followers_sampled.clear();
+    heard_at.clear();
+}
+
+void drop_silent(std::vector<bool> &done, volatile size_t &num_done, timestamp_t silence_us)
+{
+    timestamp_t now = LocalTime();
+    target_disable_irq();
+    for (size_t i = 0; i < done.size(); i++) {
+        if (done[i] || now - heard_at[i] < silence_us)
+            continue;
+        done[i] = true;
+        num_done = num_done + 1;
+        silent_nodes.push_back(first_child(node_id) + i);
+    }
+    target_enable_irq();
+}
+
+void on_subtree_done(MicroBitEvent e, const uint8_t *buffer, int len)
+{
+    size_t first_node = first_child(node_id);
+    Packet::Reader frame(buffer, len);
+    Packet::SubtreeDone p;
+    Packet::FollowUp round;
+    while (frame.Next()) {
+        // a child running the rounds of its own subtree is still there
+        if (frame.Get(round) && round.node >= first_node && round.node < first_node + heard_at.size()) {
+            heard_at[round.node - first_node] = e.timestamp;
+            continue;
+        }
+        if (!frame.Get(p) || p.node < first_node || p.node >= first_node + children_done.size() ||
+            children_done[p.node - first_node])
+            continue;
+        children_done[p.node - first_node] = true;
+        subtree_nodes = subtree_nodes + p.nodes;
+        if (p.max_error_us > subtree_max_error)
+            subtree_max_error = p.max_error_us;
+        num_children_done = num_children_done + 1;
+    }
+    wake();
+}
+
+void send_sampled(MicroBitEvent e)
+{
+    send(Packet::DelayReq{node_id, (uint32_t)(LocalTime() - sync_arrival), 0});
+    sampled_pending = false;
+}
+
+void send_subtree_done(MicroBitEvent e)
+{
+    send(Packet::SubtreeDone{node_id, subtree_nodes, subtree_max_error});
+    subtree_done_pending = false;
+}
+
+/*
+    master --> followers
+    RBS_REPORT | RBS_CUE | TREE_POLL -->
+    <-- RBS_PULSE (the beacon named in RBS_CUE, to everybody)
+    <-- SUBTREE_DONE (each follower in a random slot, once it has its samples)
+
+    Every follower takes its turn as the beacon, so each of them misses only its own pulses. A
+    round whose pulse did not reach the master goes unreported, the followers simply wait for
+    the next one. A follower whose pulse the master has not heard in SILENT_TURNS of its turns
+    is left out.
+*/
+void RbsRounds()
+{
+    size_t children = children_of(node_id);
+    children_done.assign(children, false);
+    num_children_done = 0;
+    subtree_nodes = 1;
+    subtree_max_error = 0;
+    heard_at.assign(children, LocalTime());
+    rbs_heard = false;
+    uint32_t window = round_us(slots_per_round(node_id)) / 1000;
+    RadioDispatch::Listen(on_rbs_pulse);
+    RadioDispatch::Listen(on_subtree_done);
+    while (num_children_done < children) {
+        Packet::Writer frame;
+        if (rbs_heard)
+            frame.Add(Packet::RbsReport{rbs_beacon, master_round, rbs_arrival});
+        rbs_heard = false;
+        master_round++;
+        rbs_beacon = 1 + master_round % children;
+        frame.Add(Packet::RbsCue{rbs_beacon, master_round});
+        frame.Add(Packet::TreePoll{node_id, 0});
+        send(frame);
+        uBit->sleep(window);
+        // a follower pulses once in `children` rounds
+        drop_silent(children_done, num_children_done, (timestamp_t)SILENT_TURNS * children * window * 1000);
+    }
+    RadioDispatch::Ignore(on_subtree_done);
+    RadioDispatch::Ignore(on_rbs_pulse);
+    heard_at.clear();
+}
+
+void on_rbs_pulse(MicroBitEvent e, const uint8_t *buffer, int len)
+{
+    timestamp_t t = e.timestamp;
+    Packet::Reader frame(buffer, len);
+    Packet::RbsPulse p;
+    while (frame.Next()) {
+        if (!frame.Get(p) || p.round != master_round || p.node != rbs_beacon)
+            continue;
+        rbs_arrival = to_system(t);
+        rbs_heard = true;
+        heard_at[p.node - 1] = t;
+    }
+}
+
+void SyncRbs()
+{
+    subtree_done = false;
+    subtree_done_pending = false;
+    rbs_received = false;
+    unblock_pkt_received = false;
+    rbs_round = 0;
+    RadioDispatch::Listen(follower_listener);
+
+    estimator.Reset();
+    sync_phase = SYNC_SAMPLING;
+    timestamp_t since = LocalTime();
+    bool heard = true;
+    while (estimator.Size() < sample_window && !unblock_pkt_received) {
+        while (!rbs_received && !unblock_pkt_received && silence_left(since) > 0)
+            wait_for(silence_left(since));
+        if (!rbs_received && !unblock_pkt_received) {
+            silent_nodes.push_back(sync_source);
+            heard = false;
+        }
+        if (!rbs_received)
+            break;
+        rbs_received = false;
+        // both times are arrivals of the same pulse, there is no round trip to tell good samples
+        // from bad ones by. The longest one puts them behind the background sync's exchanges
+        estimator.Add(rbs_local, (int64_t)(rbs_master - rbs_local), INT32_MAX);
+    }
+    // and the fit is over every pulse
+    fit_samples(estimator.Size());
+
+    subtree_nodes = 1;
+    subtree_max_error = clamp_error(tree_stats.error_us);
+    subtree_done = true;
+    sync_phase = SYNC_BARRIER;
+    if (heard)
+        Barrier();
+    RadioDispatch::Ignore(follower_listener);
+}
+
+void Sync(SyncMode mode)
+{
+    timestamp_t entered = LocalTime();
+    // a beacon needs another one's pulses
+    if (mode == RBS_SYNC && EnsembleSize() < 3)
+        mode = BROADCAST_SYNC;
+    tree_mode = mode == TREE_SYNC;
+    sync_source = parent_of(node_id);
+    source_error = 0;
+    tree_stats = {};
+    silent_nodes.clear();
+    for (int node = node_id; node > 0; node = parent_of(node))
+        tree_stats.depth++;
+
+    if (tree_mode) {
+        SyncTree();
+    } else if (is_master) {
+        SyncAsMaster(mode);
+    } else if (mode == RBS_SYNC) {
+        SyncRbs();
     } else {
         SyncAsFollower();
     }
+    sync_phase = silent_nodes.empty() ? SYNC_DONE : SYNC_PARTIAL;
+    Telemetry::RecordBlocked(LocalTime() - entered);
+}
+
+void sync_fiber()
+{
+    Sync(async_mode);
+    if (async_done)
+        async_done();
+}
+
+void SyncAsync(void (*done)(), SyncMode mode)
+{
+    sync_phase = is_master && mode != TREE_SYNC ? SYNC_SERVING : SYNC_SAMPLING;
+    async_mode = mode;
+    async_done = done;
+    create_fiber(sync_fiber);
+}
+
+SyncPhase PollSync()
+{
+    return sync_phase;
+}
+
+const std::vector<int> &SilentNodes()
+{
+    return silent_nodes;
+}
+
+void SetTreeFanout(int fanout)
+{
+    tree_fanout = std::max(fanout, 1);
+}
+
+const TreeStats &GetTreeStats()
+{
+    return tree_stats;
+}
+
+bool Join(uint32_t timeout_ms)
+{
+    // a rebooted master is a follower now, the ensemble has moved on without it
+    if (is_master) {
+        is_master = false;
+        uBit->messageBus.listen(MICROBIT_ID_CLOCKSYNC, CLOCKSYNC_EVT_BARRIER_ACK, send_barrier_ack, MESSAGE_BUS_LISTENER_IMMEDIATE);
+        uBit->messageBus.listen(MICROBIT_ID_CLOCKSYNC, CLOCKSYNC_EVT_SUBTREE_DONE, send_subtree_done, MESSAGE_BUS_LISTENER_IMMEDIATE);
+        uBit->messageBus.listen(MICROBIT_ID_CLOCKSYNC, CLOCKSYNC_EVT_SAMPLED, send_sampled, MESSAGE_BUS_LISTENER_IMMEDIATE);
+        RadioDispatch::Listen(barrier_listener);
+    }
+    tree_mode = false;
+    sync_source = master_node;
+    source_error = 0;
+    tree_stats = {};
+    time_to_unblock = 0;
+    sync_received = false;
+    delay_resp_received = false;
+    unblock_pkt_received = false;
+    estimator.Reset();
+    slew_error = 0;
+
+    joining = true;
+    RadioDispatch::Listen(follower_listener);
+    timestamp_t entered = LocalTime();
+    timestamp_t deadline = entered + (timestamp_t)timeout_ms * 1000;
+    while ((estimator.Size() < sample_window || time_to_unblock == 0) && LocalTime() < deadline) {
+        send(Packet::Join{node_id});
+        timestamp_t retry = LocalTime() + (timestamp_t)JOIN_RETRY_MS * 1000;
+        while (!sync_received && (int64_t)(retry - LocalTime()) > 0)
+            wait_for(retry - LocalTime());
+        if (!sync_received)
+            continue;
+        sync_received = false;
+        exchange(sync_timestamp, sync_arrival);
+    }
+    RadioDispatch::Ignore(follower_listener);
+    joining = false;
+    Telemetry::RecordBlocked(LocalTime() - entered);
+
+    if (!estimator.Fit(sample_keep) || time_to_unblock == 0)
+        return false;
+    Telemetry::RecordFit(estimator.offset, estimator.skew, estimator.error);
+    tree_stats.depth = 1;
+    tree_stats.parent = sync_source;
+    tree_stats.hop_error_us = estimator.error;
+    tree_stats.error_us = (uint32_t)(sqrt((double)source_error * source_error + (double)estimator.error * estimator.error) + 0.5);
+    failover_stats.master = master_node;
+    uBit->serial.printf("joined master %d, offset %d, unblock time %d\r\n", (int)master_node, (int)estimator.offset,
+                        (int)(time_to_unblock / 1000));
+    return true;
+}
+
+/*
+    Slots a follower picks its BARRIER_ACK slot from, with `pending` followers left to answer
+*/
+int barrier_slots(size_t pending)
+{
+    return std::max<int>(MIN_SLOTS, 2 * pending);
+}
+
+timestamp_t barrier_round_us(size_t pending)
+{
+    return (timestamp_t)SLOT_US * barrier_slots(pending) + (max_rtt > 0 ? max_rtt : DEFAULT_RTT_US) +
+           BARRIER_MARGIN_MS * 1000;
+}
+
+timestamp_t Barrier()
+{
+    if (!is_master) {
+        timestamp_t since = LocalTime();
+        while (barriers_heard == barriers_used && silence_left(since) > 0)
+            wait_for(silence_left(since));
+        if (barriers_heard == barriers_used) {
+            silent_nodes.push_back(master_node);
+            return time_to_unblock;
+        }
+        barriers_used = barriers_heard;
+        sleep_until(time_to_unblock);
+        return time_to_unblock;
+    }
+
+    // a new deadline supersedes the one still being repeated
+    barrier_running = false;
+    while (barrier_alive)
+        uBit->sleep(POLL_MS);
+
+    size_t followers = discovered_serials.size();
+    barrier_id++;
+    barrier_acked.assign(followers, false);
+    barrier_pending = followers;
+    barrier_repeat = 0;
+
+    // every round is expected to leave half of the followers still to acknowledge
+    timestamp_t lead = 0;
+    for (int k = 0; k < BARRIER_ROUNDS; k++)
+        lead += barrier_round_us(std::max<size_t>(followers >> k, 1));
+    time_to_unblock = SystemTime() + lead;
+    barrier_stats.barriers++;
+    barrier_stats.lead_us = lead;
+    barrier_stats.missing = followers;
+
+    if (followers > 0) {
+        barrier_running = true;
+        barrier_alive = true;
+        RadioDispatch::Listen(on_barrier_ack);
+        create_fiber(barrier_rounds);
+    }
+    sleep_until(time_to_unblock);
+    return time_to_unblock;
+}
+
+void barrier_rounds()
+{
+    int late = 0;
+    while (barrier_running && barrier_pending > 0 && late < BARRIER_LATE_ROUNDS) {
+        uint8_t acked[Packet::MAX_ACKED] = {};
+        int bytes = std::min<int>((barrier_acked.size() + 7) / 8, Packet::MAX_ACKED);
+        for (int i = 0; i < bytes * 8 && i < (int)barrier_acked.size(); i++)
+            if (barrier_acked[i])
+                acked[i / 8] |= 1 << (i % 8);
+        size_t pending = barrier_pending;
+        send(Packet::Unblock{barrier_id, barrier_repeat, time_to_unblock, (uint8_t)bytes, acked});
+        barrier_departure = LocalTime();
+        barrier_stats.transmissions++;
+
+        uBit->sleep(barrier_round_us(pending) / 1000);
+        barrier_repeat = barrier_repeat + 1;
+        if (SystemTime() > time_to_unblock)
+            late++;
+    }
+    RadioDispatch::Ignore(on_barrier_ack);
+    barrier_stats.missing = barrier_pending;
+    barrier_stats.max_rtt_us = max_rtt;
+    barrier_alive = false;
+}
+
+void on_barrier_ack(MicroBitEvent e, const uint8_t *buffer, int len)
+{
+    timestamp_t t = e.timestamp;
+    Packet::Reader frame(buffer, len);
+    Packet::BarrierAck p;
+    while (frame.Next()) {
+        if (!frame.Get(p) || p.barrier != barrier_id || p.node < 1 || p.node > barrier_acked.size())
+            continue;
+        barrier_stats.acks++;
+        // round trip of an answer to the latest UNBLOCK, the follower's wait for its slot left out
+        if (p.repeat == barrier_repeat) {
+            int64_t rtt = (int64_t)(t - barrier_departure) - (int64_t)p.turnaround_us;
+            if (rtt > 0 && rtt < INT32_MAX && (uint32_t)rtt > max_rtt)
+                max_rtt = rtt;
+        }
+        if (!barrier_acked[p.node - 1]) {
+            barrier_acked[p.node - 1] = true;
+            barrier_pending = barrier_pending - 1;
+        }
+    }
+}
+
+void barrier_listener(MicroBitEvent e, const uint8_t *buffer, int len)
+{
+    Packet::Reader frame(buffer, len);
+    Packet::Unblock p;
+    while (frame.Next())
+        if (frame.Get(p))
+            on_unblock(p, e);
+}
+
+void on_unblock(const Packet::Unblock &p, MicroBitEvent e)
+{
+    ensemble_heard = e.timestamp;
+    if (barriers_heard == 0 || p.barrier != ack_barrier) {
+        time_to_unblock = p.deadline;
+        ack_barrier = p.barrier;
+        barriers_heard = barriers_heard + 1;
+        unblock_pkt_received = true;
+        wake();
+    }
+
+    // stay quiet if the master has our acknowledgement, followers past the bitmap always answer
+    int bits = p.length * 8;
+    size_t acked = 0;
+    for (int i = 0; i < bits; i++)
+        acked += (p.acked[i / 8] >> (i % 8)) & 1;
+    int i = node_id - 1;
+    if ((i < bits && (p.acked[i / 8] >> (i % 8)) & 1) || ack_pending)
+        return;
+    ack_pending = true;
+    ack_repeat = p.repeat;
+    ack_arrival = e.timestamp;
+    size_t pending = discovered_serials.size() - std::min(acked, discovered_serials.size());
+    timestamp_t slot = (timestamp_t)SLOT_US * uBit->random(barrier_slots(pending));
+    int64_t wait = (int64_t)(slot - (LocalTime() - ack_arrival));
+    if (wait > 0)
+        system_timer_event_after_us(wait, MICROBIT_ID_CLOCKSYNC, CLOCKSYNC_EVT_BARRIER_ACK);
+    else
+        send_barrier_ack(e);
+}
+
+void send_barrier_ack(MicroBitEvent e)
+{
+    send(Packet::BarrierAck{node_id, ack_barrier, ack_repeat, (uint32_t)(LocalTime() - ack_arrival)});
+    barrier_stats.acks++;
+    ack_pending = false;
+}
+
+const BarrierStats &GetBarrierStats()
+{
+    return barrier_stats;
+}
+
+void Background()
+{
+    background_alive = true;
+    while (background_running) {
+        if (is_master)
+            BackgroundMaster();
+        else
+            BackgroundFollower();
+    }
+    background_alive = false;
+}
+
+void BackgroundMaster()
+{
+    rival_master = -1;
+    followers_seen.assign(children_of(node_id), false);
+    num_followers_seen = 0;
+    // SystemTime() rather than the local clock, a node that took over carries on the timebase
+    uint16_t error = clamp_error(tree_stats.error_us);
+    join_node = -1;
+    RadioDispatch::Listen(on_delay_req);
+    RadioDispatch::Listen(on_rival_sync);
+    RadioDispatch::Listen(on_join);
+    while (background_running && rival_master < 0) {
+        master_round++;
+        serving_slots = slots_per_round(node_id);
+        send(Packet::SyncBroadcast{node_id, master_round});
+        sync_departure = LocalTime();
+        send(Packet::FollowUp{node_id, master_round, to_system(sync_departure), error, serving_slots});
+
+        // answer newcomers until the next round is due
+        timestamp_t next_round = sync_departure + (timestamp_t)background_period * 1000;
+        while (background_running && rival_master < 0 && (int64_t)(next_round - LocalTime()) > 0) {
+            if (join_node >= 0)
+                answer_join();
+            else
+                wait_for(next_round - LocalTime());
+        }
+    }
+    RadioDispatch::Ignore(on_join);
+    RadioDispatch::Ignore(on_rival_sync);
+    RadioDispatch::Ignore(on_delay_req);
+
+    if (rival_master >= 0) {
+        // two nodes took over at once, the lower rank keeps the part
+        is_master = false;
+        master_node = rival_master;
+        sync_source = master_node;
+        failover_stats.failovers++;
+        failover_stats.master = master_node;
+    }
+}
+
+void on_rival_sync(MicroBitEvent e, const uint8_t *buffer, int len)
+{
+    Packet::Reader frame(buffer, len);
+    Packet::SyncBroadcast p;
+    while (frame.Next())
+        if (frame.Get(p) && p.node < node_id) {
+            rival_master = p.node;
+            wake();
+        }
+}
+
+void on_join(MicroBitEvent e, const uint8_t *buffer, int len)
+{
+    Packet::Reader frame(buffer, len);
+    Packet::Join p;
+    while (frame.Next())
+        if (frame.Get(p) && p.node != node_id) {
+            join_node = p.node;
+            wake();
+        }
+}
+
+/*
+    One SYNC_PING exchange with the node that sent the last JOIN, its DELAY_REQ is answered by
+    on_delay_req like any other
+*/
+void answer_join()
+{
+    uint8_t node = join_node;
+    join_node = -1;
+    master_round++;
+    serving_slots = 0;
+    send(Packet::SyncPing{node, master_round});
+    sync_departure = LocalTime();
+    Packet::Writer frame;
+    frame.Add(Packet::FollowUp{node_id, master_round, to_system(sync_departure), clamp_error(tree_stats.error_us), 0});
+    frame.Add(Packet::Epoch{node, time_to_unblock});
+    send(frame);
+}
+
+void BackgroundFollower()
+{
+    sync_received = false;
+    unblock_pkt_received = false;
+    master_heard = LocalTime();
+    RadioDispatch::Listen(follower_listener);
+    while (background_running && !is_master) {
+        // the background SYNCs are the master's heartbeat
+        timestamp_t stagger = (timestamp_t)FAILOVER_STAGGER_MS * 1000 * std::max(node_id - 1, 0);
+        while (!sync_received && background_running && LocalTime() - master_heard <= failover_timeout_us() + stagger)
+            wait_for(master_heard + failover_timeout_us() + stagger + 1 - LocalTime());
+        if (!background_running)
+            break;
+        if (!sync_received) {
+            // nobody took over before our turn came
+            is_master = true;
+            master_node = node_id;
+            sync_source = node_id;
+            failover_stats.failovers++;
+            failover_stats.master = node_id;
+            break;
+        }
+        sync_received = false;
+        timestamp_t t1 = sync_timestamp, t1_arrival = sync_arrival;
+
+        // stay within the radio budget: on average background_replies followers answer a round
+        if (uBit->random(std::max<int>(discovered_serials.size(), 1)) >= background_replies)
+            continue;
+        if (!exchange(t1, t1_arrival))
+            continue;
+
+        // the fit is done on a copy, only the hand-over has to be atomic for callers of
+        // SystemTime() in interrupt context
+        OffsetEstimator next = estimator;
+        next.Fit(std::max(sample_keep, next.Size() / 2));
+        timestamp_t local = LocalTime();
+        target_disable_irq();
+        int64_t applied = estimator.Correction(local) + slew_remaining(local);
+        estimator = next;
+        slew_error = applied - estimator.Correction(local);
+        slew_start = local;
+        target_enable_irq();
+        Telemetry::RecordFit(estimator.offset, estimator.skew, estimator.error);
+    }
+    RadioDispatch::Ignore(follower_listener);
+}
+
+void StartBackgroundSync(uint32_t period_ms, int replies_per_round)
+{
+    if (background_running || background_alive)
+        return;
+    background_running = true;
+    // every follower against the master, as in BROADCAST_SYNC
+    tree_mode = false;
+    sync_source = master_node;
+    background_period = period_ms;
+    background_replies = std::max(replies_per_round, 1);
+    create_fiber(Background);
+}
+
+void StopBackgroundSync()
+{
+    background_running = false;
+    wake();
+    while (background_alive)
+        uBit->sleep(POLL_MS);
+}
+
+const FailoverStats &GetFailoverStats()
+{
+    return failover_stats;
 }
 }
 
@@ -1,11 +1,22 @@
+#ifndef SYNCHRONIZATION_H
+#define SYNCHRONIZATION_H
+
 
 #include "MicroBit.h"
+#include "Packet.h"
 #include <stdint.h>
 
 #include <memory>
 #include <set>
+#include <vector>
 #include <functional>
 
+// Storage class for per-device state. The host simulator runs every virtual micro:bit on its
+// own thread and defines this as thread_local, on the device it is a plain global
+#ifndef NODE_LOCAL
+#define NODE_LOCAL
+#endif
+
 /*
     Main idea:
         Simply perform a PTP, that is
@@ -24,23 +35,133 @@
 
 
 namespace ClockSync {
-typedef uint32_t timestamp_t;
+// microseconds, on the local clock or, from SystemTime(), on the master's
+typedef uint64_t timestamp_t;
 typedef uint32_t serial_t;
 
-struct PTP_packet
+/*
+    SEQUENTIAL_SYNC
+        master runs one SYNC_PING/DELAY_REQ/DELAY_RESP exchange per follower, at least 500ms each
+    BROADCAST_SYNC
+        master broadcasts one SYNC per round followed by a FOLLOW_UP with its departure time,
+        the followers answer in turns of up to five ranks, each in a slot of its own about one
+        DELAY_REQ's airtime long, so a round stays a few ms whatever the size of the ensemble.
+        Rounds end once every follower asked that is still sampling has answered. Faster than
+        SEQUENTIAL_SYNC at every size in clocksync-sim (0.37 s against 0.6 s at 30 nodes,
+        1.1 s against 2.3 s at 100)
+    TREE_SYNC
+        BROADCAST_SYNC down a tree of ranks: node r syncs from node (r - 1) / fanout and, once
+        its clock is fitted, runs the broadcast rounds for its own children in the master's
+        time, see SetTreeFanout(). The nodes with children share the air in turns, a window
+        each, so a node's rounds come less often the more of them there are. Slower than
+        BROADCAST_SYNC at every size in clocksync-sim, and than SEQUENTIAL_SYNC from 30 nodes
+        (0.9 s at 30, 4 s against 2.3 s at 100)
+    RBS_SYNC
+        reference broadcast: nobody's time of departure is used. The master cues a beacon, each
+        follower in turn, which broadcasts an unstamped RBS_PULSE; the master receives it like
+        everybody else and reports its own time of arrival in the next cue. Every other node
+        pairs that with its own arrival of the same pulse and fits its offset to the master's
+        clock over the pulses, so only the receivers' latencies enter the error, not how long
+        the sender took to get the frame out or to read the time after it. Followers send
+        nothing until they are done. Needs two followers, with fewer it runs BROADCAST_SYNC
+    Followers handle the first two alike, only the master's choice matters. TREE_SYNC and
+    RBS_SYNC have to be passed on every microbit.
+*/
+enum SyncMode { SEQUENTIAL_SYNC, BROADCAST_SYNC, TREE_SYNC, RBS_SYNC };
+
+// Message bus id of ClockSync's timer events
+const uint16_t MICROBIT_ID_CLOCKSYNC = 2050;
+const uint16_t CLOCKSYNC_EVT_ANNOUNCE = 1;
+const uint16_t CLOCKSYNC_EVT_BARRIER_ACK = 2;
+const uint16_t CLOCKSYNC_EVT_FLUSH = 3;
+const uint16_t CLOCKSYNC_EVT_SUBTREE_DONE = 4;
+// raised by the radio handlers whenever they have something for a waiting fiber, see wait_for()
+const uint16_t CLOCKSYNC_EVT_WAKE = 5;
+// a BROADCAST_SYNC follower reports its last sample in its slot of its group's next round
+const uint16_t CLOCKSYNC_EVT_SAMPLED = 6;
+// the timer of the earliest deadline of the fibers in wait_for(), passed on as CLOCKSYNC_EVT_WAKE
+const uint16_t CLOCKSYNC_EVT_DEADLINE = 7;
+
+/*
+    What Sync() is busy with, see PollSync()
+        SYNC_SAMPLING   follower: exchanging with its time source
+        SYNC_SERVING    master, or a node with children in TREE_SYNC: running the rounds
+        SYNC_BARRIER    waiting for the common deadline
+        SYNC_DONE       Sync() has returned
+        SYNC_PARTIAL    Sync() has returned without some node that fell silent, see SilentNodes()
+*/
+enum SyncPhase { SYNC_IDLE, SYNC_SAMPLING, SYNC_SERVING, SYNC_BARRIER, SYNC_DONE, SYNC_PARTIAL };
+
+// Failover: the background SYNCs are the master's heartbeat, a follower presumes the master gone
+// after FAILOVER_PERIODS background periods without one and takes over, the follower of rank r
+// FAILOVER_STAGGER_MS * (r - 1) later still so that the lowest surviving rank goes first
+const int FAILOVER_PERIODS = 3;
+const uint32_t FAILOVER_STAGGER_MS = 250;
+
+// Join() asks again after JOIN_RETRY_MS without an answer, and gives up after JOIN_TIMEOUT_MS,
+// long enough to sit out a failover
+const uint32_t JOIN_RETRY_MS = 100;
+const uint32_t JOIN_TIMEOUT_MS = 20000;
+
+const uint32_t MIN_ELECTION_ROUND_MS = 50;
+const uint32_t ELECTION_SLOT_MS = 2;
+const int QUIET_ELECTION_ROUNDS = 3;
+const int ALONE_ELECTION_ROUNDS = 10;
+
+// Barrier: the deadline leaves room for BARRIER_ROUNDS rounds, each expected to leave half of the
+// followers still to acknowledge, and the master goes on repeating for BARRIER_LATE_ROUNDS past it
+const int BARRIER_ROUNDS = 4;
+const int BARRIER_LATE_ROUNDS = 20;
+const uint32_t BARRIER_MARGIN_MS = 10;
+
+// round trip assumed before the master has measured one
+const uint32_t DEFAULT_RTT_US = 5000;
+
+// A phase of Sync() leaves out a node it has not heard from for SILENT_ROUNDS rounds of the whole
+// ensemble, or SILENT_ROUNDS unanswered pings in SEQUENTIAL_SYNC, and a follower that has heard
+// nobody for as long gives up on its time source
+const int SILENT_ROUNDS = 8;
+
+// children of every node in TREE_SYNC unless SetTreeFanout() says otherwise, 100 microbits
+// are three hops deep
+const int TREE_FANOUT = 8;
+
+struct BarrierStats
 {
-    uint8_t flag;
-    serial_t serial;
-    timestamp_t timestamp;
+    uint32_t barriers;          // master: started
+    uint32_t transmissions;     // master: UNBLOCK sent
+    uint32_t acks;              // master: received, follower: sent
+    uint32_t missing;           // master: followers that never acknowledged the last one
+    uint32_t lead_us;           // master: from starting the last one to its deadline
+    uint32_t max_rtt_us;        // master: largest round trip measured for it
+};
+
+struct TreeStats
+{
+    int depth;                      // hops from the master, 0 on the master
+    int parent;                     // rank of the node this one synced from
+    uint32_t hop_error_us;          // of the fit against the parent's clock
+    uint32_t error_us;              // against the master's, accumulated over the hops
+    // TREE_SYNC only: nodes of the subtree below this one, itself included, and the
+    // largest error_us among them
+    uint16_t subtree_nodes;
+    uint16_t subtree_max_error_us;
+};
+
+struct FailoverStats
+{
+    uint32_t failovers;             // masters this microbit has moved on from
+    int master;                     // rank of the current master
+    uint32_t gap_us;                // follower: longest time without a SYNC across a handover
 };
 
 /*
      Pre:
-        At least two microbits are required
         All microbits either use method (1) or all use method (2)
         if all microbits use method (1), then exactly one is called with is_master = true
     Post:
         initialization of the network as well provide an agreement on the choice of the master
+        and on the membership, at least `expected` microbits strong when it is given
     Ideas for choosing the master:
         1)  Specify the master by simply initializing one of the microbits
             with is_master set to true
@@ -48,10 +169,91 @@ struct PTP_packet
             network and choose the one that satisfies some property (I was
             thinking of choosing the one with smallest serial number, as it
             is fairly easy to implement and serial number provides uniqueness)
+    Election (2):
+        The number of microbits is not known in advance. Every node announces
+            Packet::Announce, SERIAL | MEMBERS (2) | VIEW (4) | RUNNING
+        once per round at a random point of the round, the round grows with the membership
+        (ELECTION_SLOT_MS per known node, at least MIN_ELECTION_ROUND_MS) so that collisions
+        stay rare whatever the ensemble size. VIEW is an order independent hash of every
+        serial the sender knows, itself included.
+        A node is done after QUIET_ELECTION_ROUNDS rounds in which it learned no new serial and
+        every announcement it heard had its own MEMBERS and VIEW, at least one of them
+        (or ALONE_ELECTION_ROUNDS rounds without hearing anybody). A node that missed someone
+        keeps disagreeing, which keeps the others announcing too, so all views converge.
+        After Init() a node still answers announcements that disagree with its view, so a
+        straggler can complete its membership, but it no longer adds members itself.
+    Late boots:
+        a node powering up after the others are done learns their membership but is not part
+        of it, pass `expected` to hold everybody in the election until that many have been seen.
+        A member that reboots gets the same membership and rank back, and learns from RUNNING
+        that the others are past their election, see EnsembleRunning()
 */
 //    ClockSync(MicroBit &uBit, int num_of_microbits, bool is_master); // (1)
 
-void Init(std::shared_ptr<MicroBit> uBit, int num_of_microbits);                 // (2)
+void Init(std::shared_ptr<MicroBit> uBit, int expected = 0);                 // (2)
+
+/*
+    Pre:
+        Init() has returned
+    Post:
+        returns the serials of every microbit in the ensemble, this one included
+*/
+std::set<serial_t> Members();
+
+/*
+    Pre:
+        Init() has returned
+    Post:
+        returns the number of rounds the election took on this microbit
+*/
+int ElectionRounds();
+
+/*
+    Pre:
+        Init() has returned
+    Post:
+        returns the position of this microbit's serial among all serials seen during master
+        selection, in ascending order; the master has rank 0
+    Note:
+        the election leaves every microbit with the same membership, so they get distinct
+        ranks 0..EnsembleSize() - 1. This lets one firmware image pick its part of the song at
+        runtime
+*/
+int Rank();
+
+/*
+    Pre:
+        Init() has returned
+    Post:
+        returns the number of microbits seen during master selection, this one included
+*/
+int EnsembleSize();
+
+/*
+    Pre:
+        Init() has returned
+    Post:
+        whether microbits that were already past their election answered this one's, i.e. it
+        (re)booted into a running ensemble and should Join() rather than Sync()
+*/
+bool EnsembleRunning();
+
+/*
+    Pre:
+        EnsembleRunning(), the master runs the background sync (StartBackgroundSync())
+    Post:
+        this microbit is a follower synchronized with the current master, the elected one or
+        whoever took over from it, and UnblockTime() is the ensemble's. Returns false if the
+        master did not answer within timeout_ms
+    Protocol:
+        JOIN -->                            every JOIN_RETRY_MS until answered
+        <-- SYNC_PING, FOLLOW_UP | EPOCH    from the master's background fiber, EPOCH carries
+                                            its UnblockTime()
+        DELAY_REQ -->
+        <-- DELAY_RESP
+        repeated for sample_window exchanges, which takes a fraction of a second
+*/
+bool Join(uint32_t timeout_ms = JOIN_TIMEOUT_MS);
 
 /*
     Pre:
@@ -70,38 +272,343 @@ void Init(std::shared_ptr<MicroBit> uBit, int num_of_microbits);
    crucial for providing a barrier sync) The times of microbits leaving the sync method might
    hugely vary
 */
-void Sync();
+void Sync(SyncMode mode = SEQUENTIAL_SYNC);
+
+/*
+    Pre:
+        as for Sync()
+    Post:
+        runs Sync(mode) on a fiber of its own and returns at once, `done` (if given) is called on
+        that fiber after Sync() has returned. The calling fiber is free meanwhile, PollSync()
+        tells how far the sync has got
+*/
+void SyncAsync(void (*done)() = nullptr, SyncMode mode = SEQUENTIAL_SYNC);
+
+/*
+    Post:
+        the phase of the running or last Sync(), SYNC_IDLE before the first
+*/
+SyncPhase PollSync();
+
+/*
+    Post:
+        ranks the last Sync() left out for falling silent: on a node running rounds the
+        followers or children that stopped answering for SILENT_ROUNDS rounds, on a follower
+        its time source or the master once it heard nobody for SILENT_ROUNDS rounds. Empty
+        unless PollSync() is SYNC_PARTIAL
+*/
+const std::vector<int> &SilentNodes();
 
 /*
     Post:
-        returns adjusted system time of a microbit
+        returns the local clock in microseconds, system_timer_current_time_us()
+*/
+timestamp_t LocalTime();
+
+/*
+    Post:
+        returns adjusted system time of a microbit, in microseconds
     Note:
-        function returns uBit.systemTime() + offset, where offset is calculated
-        using the synchronization protocol
+        function returns LocalTime() + offset + skew * (LocalTime() - reference),
+        where offset and skew are fitted by OffsetEstimator over the exchanges made in Sync()
+        and, if running, the background fiber. Background corrections are slewed in at
+        MAX_SLEW_PPM, so the returned time never decreases
 */
 timestamp_t SystemTime();
 
+/*
+    Pre:
+        Sync() has returned
+    Post:
+        returns the SystemTime() at which Sync() released every microbit, a common reference
+        for scheduling the performance
+*/
+timestamp_t UnblockTime();
+
+/*
+    Pre:
+        Init() has returned, every microbit calls it, Sync() does so on its way out
+    Post:
+        every microbit returns at the same SystemTime(), the deadline, and returns it. A
+        follower that only learns of the deadline after it has passed returns at once
+    Protocol:
+        UNBLOCK -->
+            Packet::Unblock, ACKED up to Packet::MAX_ACKED bytes
+            bit i of ACKED is set once the follower of rank i + 1 has acknowledged
+        <-- BARRIER_ACK, from every follower whose bit is clear, in a random slot
+            Packet::BarrierAck
+        The master repeats UNBLOCK from a fiber until every follower has acknowledged,
+        or for BARRIER_LATE_ROUNDS rounds past the deadline. The slots, and so the rounds, shrink
+        with the number of followers left. The deadline leaves room for BARRIER_ROUNDS rounds,
+        their length taken from the largest round trip measured since Sync() started, out of
+        the DELAY_REQs (TURNAROUND is how long the follower held the SYNC) and the
+        acknowledgements themselves. A follower that hears nobody for SILENT_ROUNDS rounds
+        gives up and returns the last deadline it knew
+*/
+timestamp_t Barrier();
+
+/*
+    Post:
+        counters of the barriers this microbit took part in
+*/
+const BarrierStats &GetBarrierStats();
+
+/*
+    Pre:
+        called before Sync(), with the same value on every microbit
+    Post:
+        TREE_SYNC gives every node up to `fanout` children, default TREE_FANOUT
+*/
+void SetTreeFanout(int fanout);
+
+/*
+    Pre:
+        Sync() has returned
+    Post:
+        where this microbit sat in the last Sync() and how far its clock is expected to be off.
+        hop_error_us is the root mean square residual of the exchanges kept by the fit, the
+        errors of independent hops add up as error_us = sqrt(parent's error_us^2 + hop_error_us^2)
+*/
+const TreeStats &GetTreeStats();
+
+/*
+    Pre:
+        Sync() has returned, every microbit calls it with the same parameters
+    Post:
+        starts a fiber that keeps the clocks aligned during playback, directly against the
+        master whatever the mode of Sync():
+            master broadcasts SYNC_BROADCAST/FOLLOW_UP every `period_ms` ms
+            on average `replies_per_round` followers answer a round with a DELAY_REQ
+            followers add the samples to their estimator, refit offset and skew, and slew
+            SystemTime() towards the new fit instead of stepping it
+        The fiber sleeps between rounds and its radio traffic is bounded by
+        2 + 2 * replies_per_round frames per period
+    Failover:
+        when the master falls silent for FAILOVER_PERIODS periods the lowest surviving rank
+        takes over, see FAILOVER_STAGGER_MS. It runs the master's rounds with its own
+        SystemTime(), which carries on the timebase agreed so far, and the followers keep
+        fitting and slewing against it, so playback continues without a jump. A master that
+        hears SYNCs from a lower rank gives way to it, which settles two nodes taking over at
+        once. Sync() and Barrier() still belong to the master elected in Init()
+*/
+void StartBackgroundSync(uint32_t period_ms = 2000, int replies_per_round = 4);
+
+/*
+    Post:
+        the background fiber has exited and released the radio, so Sync() may be called again.
+        Waits for the fiber to wake up, up to one period on the master
+*/
+void StopBackgroundSync();
+
+/*
+    Post:
+        who the master is after any failover and how long the handovers took
+*/
+const FailoverStats &GetFailoverStats();
+
+/*
+    Pre:
+        called before Sync(), with the same values on every microbit
+    Post:
+        each follower collects `samples` SYNC/DELAY_REQ exchanges (at most
+        OffsetEstimator::MAX_SAMPLES) and fits its clock over the `keep` with the lowest
+        round trip delay, default 8 and 4
+*/
+void SetSampleWindow(int samples, int keep);
+
 // -------------------------------------------------------------------
 
 
 /*
-    Sends a PTP_packet with given params
+    Seals and sends the frame, see Packet.h
+*/
+void send(Packet::Writer &frame);
+
+/*
+    Handler of the CLOCKSYNC_EVT_FLUSH timer event, sends the DELAY_RESPs batched so far
+*/
+void flush_responses(MicroBitEvent e);
+
+/*
+    Sleeps until SystemTime() reaches t, returns at once if it already has
+*/
+void sleep_until(timestamp_t t);
+
+/*
+    Raises CLOCKSYNC_EVT_WAKE, called by the handlers whenever they set a flag a fiber waits on
+*/
+void wake();
+
+/*
+    Blocks the calling fiber until the next wake() or for timeout_us, WAKE_GUARD_US at most.
+    Any wake() ends the wait, so callers wait in a loop on their own condition
+*/
+void wait_for(timestamp_t timeout_us);
+
+/*
+    Pre:
+        interrupts are disabled
+    Post:
+        the CLOCKSYNC_EVT_DEADLINE timer is armed for the earliest deadline of the fibers in
+        wait_for(), and for nothing else
+*/
+void arm_deadline();
+
+/*
+    Handler of the CLOCKSYNC_EVT_DEADLINE timer event, which is only ever armed for the earliest
+    deadline of the waiting fibers: wakes them. A waiter woken early moves the timer on to the
+    next deadline or cancels it, so no timer outlives the waits it is for
 */
-void send(uint8_t flag, uint32_t serial, timestamp_t timestamp);
+void on_deadline(MicroBitEvent e);
+
+/*
+    Body of the fiber SyncAsync() starts
+*/
+void sync_fiber();
 
 /*
     Sync subroutines designed for master and followers respectively
 */
-void SyncAsMaster();
+void SyncAsMaster(SyncMode mode);
+
+/*
+    Master's side of BROADCAST_SYNC, returns once every follower has reported its last sample
+*/
+void BroadcastRounds();
+
+/*
+    TREE_SYNC on every node: sync from the parent, serve the children, report the subtree
+*/
+void SyncTree();
+
+/*
+    Side of TREE_SYNC of a node with children, runs broadcast rounds for them in its windows
+    until every child has answered SUBTREE_DONE
+*/
+void TreeRounds();
+
+/*
+    Master's side of RBS_SYNC, cues pulses and reports their arrival until every follower has
+    answered SUBTREE_DONE
+*/
+void RbsRounds();
+
+/*
+    Master's handler of RBS_PULSE
+*/
+void on_rbs_pulse(MicroBitEvent e, const uint8_t *buffer, int len);
+
+/*
+    RBS_SYNC on a follower: fit the clock over sample_window pulses, pulse when cued, report
+    done
+*/
+void SyncRbs();
+
+/*
+    Time source's handler of SUBTREE_DONE
+*/
+void on_subtree_done(MicroBitEvent e, const uint8_t *buffer, int len);
+
+/*
+    Marks the followers or children not yet `done` that have not been heard from for
+    silence_us done after all, and adds them to SilentNodes()
+*/
+void drop_silent(std::vector<bool> &done, volatile size_t &num_done, timestamp_t silence_us);
+
+/*
+    Handler of the CLOCKSYNC_EVT_SAMPLED timer event, a follower that has its samples answering
+    a round with a DELAY_REQ of REMAINING 0
+*/
+void send_sampled(MicroBitEvent e);
+
+/*
+    Handler of the CLOCKSYNC_EVT_SUBTREE_DONE timer event, answers the parent's TREE_POLL
+*/
+void send_subtree_done(MicroBitEvent e);
+
+/*
+    Body of the master's barrier fiber, repeats UNBLOCK, see Barrier()
+*/
+void barrier_rounds();
+
+/*
+    Master's handler of BARRIER_ACK
+*/
+void on_barrier_ack(MicroBitEvent e, const uint8_t *buffer, int len);
+
+/*
+    Follower's handler of UNBLOCK, registered from Init() on so that a lost
+    acknowledgement is answered again after the follower has left Barrier()
+*/
+void barrier_listener(MicroBitEvent e, const uint8_t *buffer, int len);
+
+/*
+    Handler of the CLOCKSYNC_EVT_BARRIER_ACK timer event, sends the follower's BARRIER_ACK
+*/
+void send_barrier_ack(MicroBitEvent e);
+
+/*
+    Follower's handling of one UNBLOCK record, e is the datagram it came in
+*/
+void on_unblock(const Packet::Unblock &p, MicroBitEvent e);
 
 void SyncAsFollower();
 
 /*
-    Event used to handle initial exchange of serial numbers, that is
-    receive num_of_microbits - 1 packets and comapare incoming serial
-    numbers
+    Follower's sampling: sample_window exchanges with its time source, then the fit. Returns
+    false if it gave up after hearing nobody for SILENT_ROUNDS rounds
+*/
+bool collect_samples();
+
+/*
+    Fits the clock over the `keep` samples with the lowest round trip and fills in the
+    TreeStats errors
+*/
+void fit_samples(int keep);
+
+/*
+    Body of the background fiber, runs the master's or the follower's part as the role changes
+*/
+void Background();
+
+/*
+    Return when the background sync stops or the role changes, see StartBackgroundSync()
+*/
+void BackgroundMaster();
+
+void BackgroundFollower();
+
+/*
+    Background master's handler of other nodes' SYNC_BROADCASTs
+*/
+void on_rival_sync(MicroBitEvent e, const uint8_t *buffer, int len);
+
+/*
+    Background master's handler of JOIN, the fiber answers with answer_join()
+*/
+void on_join(MicroBitEvent e, const uint8_t *buffer, int len);
+
+void answer_join();
+
+/*
+    Event used to handle initial exchange of serial numbers, see Init()
 */
-void master_selection(MicroBitEvent e);
+void master_selection(MicroBitEvent e, const uint8_t *buffer, int len);
+
+/*
+    Broadcasts this node's ANNOUNCE record
+*/
+void announce();
+
+/*
+    Handles another node's ANNOUNCE
+*/
+void on_announcement(serial_t serial, size_t members, uint32_t hash, bool running);
+
+/*
+    Handler of the CLOCKSYNC_EVT_ANNOUNCE timer event, the answer to a straggler
+*/
+void on_announce(MicroBitEvent e);
 
 /*
     Used to store initial timestamp broadcasted by the master
@@ -109,11 +616,11 @@ void master_selection(MicroBitEvent e);
 void on_sync(MicroBitEvent e);
 
 /*
-    Master's event handling the delay_req ping sent by a follower
+    Time source's event handling the delay_req ping sent by a follower
     Upon receiving a ping, it should respond with the time it received
     the packet
 */
-void on_delay_req(MicroBitEvent e);
+void on_delay_req(MicroBitEvent e, const uint8_t *buffer, int len);
 
 /*
     Follower should use this event, after pinging the master, in
@@ -121,3 +628,5 @@ void on_delay_req(MicroBitEvent e);
 */
 void on_delay_resp(MicroBitEvent e);
 };
+
+#endif
@@ -0,0 +1,131 @@
+#include "Synth.h"
+#include "PackedSong.h"
+
+#include <algorithm>
+
+namespace {
+
+// the mixer's range for a stream of signed 16-bit samples
+const int SAMPLE_RANGE = 65535;
+
+const int32_t LOUDEST = Song::VELOCITY[7];
+
+// set by NoteOn() / NoteOff(), taken over by the oscillators at the start of a block so that a
+// block never renders a half-updated voice
+struct Pending
+{
+    bool dirty;
+    uint32_t increment;
+    int16_t target;
+};
+
+class Source : public DataSource
+{
+public:
+    ManagedBuffer pull() override;
+    void connect(DataSink &s) override { sink = &s; }
+    void disconnect() override { sink = nullptr; }
+    int getFormat() override { return DATASTREAM_FORMAT_16BIT_SIGNED; }
+    float getSampleRate() override { return Synth::SAMPLE_RATE; }
+
+    DataSink *sink = nullptr;
+};
+
+NODE_LOCAL std::shared_ptr<MicroBit> uBit;
+NODE_LOCAL Source source;
+NODE_LOCAL MixerChannel *channel;
+NODE_LOCAL ManagedBuffer blocks[2];
+NODE_LOCAL int ready;
+NODE_LOCAL Synth::Oscillator oscillators[Synth::MAX_VOICES];
+NODE_LOCAL Pending pending[Synth::MAX_VOICES];
+NODE_LOCAL Synth::Stats stats;
+
+void render_block(ManagedBuffer &block)
+{
+    uint64_t began = system_timer_current_time_us();
+    target_disable_irq();
+    for (int v = 0; v < Synth::MAX_VOICES; v++) {
+        if (!pending[v].dirty)
+            continue;
+        // a note off keeps the pitch while it fades
+        if (pending[v].increment)
+            oscillators[v].increment = pending[v].increment;
+        oscillators[v].target = pending[v].target;
+        pending[v].dirty = false;
+    }
+    target_enable_irq();
+    Synth::render(oscillators, Synth::MAX_VOICES, (int16_t *)block.getBytes(), Synth::BLOCK_FRAMES);
+    uint32_t took = (uint32_t)(system_timer_current_time_us() - began);
+    stats.blocks++;
+    stats.render_us += took;
+    stats.max_render_us = std::max(stats.max_render_us, took);
+}
+
+ManagedBuffer Source::pull()
+{
+    ManagedBuffer out = blocks[ready];
+    ready ^= 1;
+    render_block(blocks[ready]);
+    return out;
+}
+}
+
+namespace Synth {
+
+void Start(std::shared_ptr<MicroBit> u, Waveform waveform)
+{
+    Stop();
+    uBit = std::move(u);
+    const int16_t *table = wavetable(waveform);
+    for (int v = 0; v < MAX_VOICES; v++) {
+        oscillators[v] = {0, 0, 0, 0, table};
+        pending[v] = {};
+    }
+    stats = {};
+    for (ManagedBuffer &block : blocks)
+        block = ManagedBuffer(BLOCK_FRAMES * sizeof(int16_t));
+    ready = 0;
+    render_block(blocks[ready]);
+    channel = uBit->audio.mixer.addChannel(source, SAMPLE_RATE, SAMPLE_RANGE);
+    if (source.sink)
+        source.sink->pullRequest();
+}
+
+void Stop()
+{
+    if (!channel)
+        return;
+    uBit->audio.mixer.removeChannel(channel);
+    channel = nullptr;
+}
+
+bool Running()
+{
+    return channel != nullptr;
+}
+
+void NoteOn(int voice, int period_us, int velocity)
+{
+    if (period_us == 0) {
+        NoteOff(voice);
+        return;
+    }
+    Pending p = {true, increment_of(period_us, SAMPLE_RATE),
+                 (int16_t)(std::min<int32_t>(velocity, LOUDEST) * (INT16_MAX / VOICE_HEADROOM) / LOUDEST)};
+    target_disable_irq();
+    pending[voice] = p;
+    target_enable_irq();
+}
+
+void NoteOff(int voice)
+{
+    target_disable_irq();
+    pending[voice] = {true, 0, 0};
+    target_enable_irq();
+}
+
+const Stats &GetStats()
+{
+    return stats;
+}
+}
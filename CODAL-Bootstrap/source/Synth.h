@@ -0,0 +1,74 @@
+#ifndef SYNTH_H
+#define SYNTH_H
+
+#include "MicroBit.h"
+#include "Synchronization.h"
+#include "SynthKernel.h"
+
+#include <memory>
+#include <stdint.h>
+
+/*
+    Main idea:
+        The pin plays one square wave, so an arrangement needs a microbit per part. Synth mixes
+        up to MAX_VOICES wavetable voices in software instead and feeds the result to the audio
+        mixer as a stream of 16-bit blocks, so that one board can play several parts. Rendering
+        is SynthKernel.h, a fixed cost per sounding voice and sample.
+
+    Blocks:
+        two buffers of BLOCK_FRAMES samples. When the mixer pulls, it gets the block rendered
+        on the previous pull and the next one is rendered into the other buffer straight away,
+        so a pull never waits on the kernel. NoteOn() and NoteOff() take effect from the next
+        rendered block: a note sounds LATENCY_US after the call, the same on every board, and
+        Playback brings its cues forward by that much.
+
+    Level:
+        the loudest velocity is 1 / VOICE_HEADROOM of full scale, that many voices at full
+        velocity mix without clipping and more saturate rather than wrap
+*/
+
+namespace Synth {
+
+const int MAX_VOICES = 8;
+const int SAMPLE_RATE = 16000;
+const int BLOCK_FRAMES = 128;
+const int VOICE_HEADROOM = 4;
+
+// the block being played plus the one rendered ahead of it
+const ClockSync::timestamp_t LATENCY_US = 2 * BLOCK_FRAMES * 1000000ull / SAMPLE_RATE;
+
+struct Stats
+{
+    uint32_t blocks;            // rendered
+    uint32_t render_us;         // spent rendering, in total
+    uint32_t max_render_us;     // the slowest block
+};
+
+/*
+    Post:
+        a channel of uBit's audio mixer plays the voices, all silent
+*/
+void Start(std::shared_ptr<MicroBit> uBit, Waveform waveform = TRIANGLE);
+
+/*
+    Post:
+        the channel is removed from the mixer
+*/
+void Stop();
+
+bool Running();
+
+/*
+    Pre:
+        0 <= voice < MAX_VOICES, velocity as in PackedSong.h
+    Post:
+        the voice plays period_us at velocity from the next block, period 0 is NoteOff()
+*/
+void NoteOn(int voice, int period_us, int velocity);
+
+void NoteOff(int voice);
+
+const Stats &GetStats();
+}
+
+#endif
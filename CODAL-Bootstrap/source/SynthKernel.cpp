@@ -0,0 +1,128 @@
+#include "SynthKernel.h"
+
+#include <math.h>
+#include <string.h>
+
+#if defined(__ARM_FEATURE_DSP)
+#include <arm_acle.h>
+#endif
+
+namespace {
+
+const int FRAC_BITS = 15;
+const int FRAC_SHIFT = 32 - Synth::TABLE_BITS - FRAC_BITS;
+
+// acc + (a * b[15:0]) >> 16, the low halfword of b signed
+inline int32_t smlawb(int32_t a, int32_t b, int32_t acc)
+{
+#if defined(__ARM_FEATURE_DSP)
+    return __smlawb(a, b, acc);
+#else
+    return acc + (int32_t)(((int64_t)a * (int16_t)b) >> 16);
+#endif
+}
+
+inline int16_t saturate16(int32_t x)
+{
+#if defined(__ARM_FEATURE_DSP)
+    return (int16_t)__ssat(x, 16);
+#else
+    return (int16_t)(x > INT16_MAX ? INT16_MAX : x < INT16_MIN ? INT16_MIN : x);
+#endif
+}
+
+// the interpolated table value at `phase`
+inline int32_t sample(const int16_t *table, uint32_t phase)
+{
+    uint32_t index = phase >> (32 - Synth::TABLE_BITS);
+    int32_t frac = (phase >> FRAC_SHIFT) & ((1 << FRAC_BITS) - 1);
+    int32_t a = table[index];
+    int32_t b = table[index + 1];
+    // a + (b - a) * frac in Q15
+    return smlawb((b - a) << 1, frac, a);
+}
+
+void render_steady(Synth::Oscillator &o, int32_t *mix, int frames)
+{
+    uint32_t phase = o.phase;
+    const uint32_t increment = o.increment;
+    const int16_t *table = o.table;
+    const int32_t gain = o.gain;
+    for (int i = 0; i < frames; i++) {
+        mix[i] = smlawb(sample(table, phase) << 1, gain, mix[i]);
+        phase += increment;
+    }
+    o.phase = phase;
+}
+
+void render_ramp(Synth::Oscillator &o, int32_t *mix, int frames)
+{
+    uint32_t phase = o.phase;
+    const uint32_t increment = o.increment;
+    const int16_t *table = o.table;
+    // gain in Q15.16 so that the steps do not round away
+    int32_t gain = (int32_t)o.gain << 16;
+    const int32_t step = (((int32_t)o.target - o.gain) << 16) / frames;
+    for (int i = 0; i < frames; i++) {
+        gain += step;
+        mix[i] = smlawb(sample(table, phase) << 1, gain >> 16, mix[i]);
+        phase += increment;
+    }
+    o.phase = phase;
+    o.gain = o.target;
+}
+
+int16_t tables[Synth::WAVEFORM_COUNT][Synth::TABLE_SIZE + 1];
+bool tables_built;
+
+void build_tables()
+{
+    const int n = Synth::TABLE_SIZE;
+    for (int i = 0; i < n; i++) {
+        tables[Synth::SQUARE][i] = i < n / 2 ? INT16_MAX : -INT16_MAX;
+        // from 0 up to the top at a quarter, down to the bottom at three quarters
+        int ramp = 4 * INT16_MAX * i / n;
+        tables[Synth::TRIANGLE][i] = i < n / 4 ? ramp : i < 3 * n / 4 ? 2 * INT16_MAX - ramp : ramp - 4 * INT16_MAX;
+        tables[Synth::SAWTOOTH][i] = -INT16_MAX + 2 * INT16_MAX * i / n;
+        tables[Synth::SINE][i] = (int16_t)lrintf(INT16_MAX * sinf(2 * (float)M_PI * i / n));
+    }
+    for (int w = 0; w < Synth::WAVEFORM_COUNT; w++)
+        tables[w][n] = tables[w][0];
+    tables_built = true;
+}
+}
+
+namespace Synth {
+
+const int16_t *wavetable(Waveform waveform)
+{
+    if (!tables_built)
+        build_tables();
+    return tables[waveform];
+}
+
+uint32_t increment_of(int period_us, int sample_rate)
+{
+    if (period_us <= 0)
+        return 0;
+    return (uint32_t)((1000000ull << 32) / ((uint64_t)period_us * sample_rate));
+}
+
+void render(Oscillator *oscillators, int count, int16_t *out, int frames)
+{
+    int32_t mix[MAX_FRAMES];
+    memset(mix, 0, frames * sizeof(mix[0]));
+    for (int v = 0; v < count; v++) {
+        Oscillator &o = oscillators[v];
+        if (o.gain == o.target) {
+            // silent voices cost nothing
+            if (o.gain != 0)
+                render_steady(o, mix, frames);
+        } else {
+            render_ramp(o, mix, frames);
+        }
+    }
+    for (int i = 0; i < frames; i++)
+        out[i] = saturate16(mix[i]);
+}
+}
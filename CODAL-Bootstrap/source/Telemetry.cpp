@@ -0,0 +1,105 @@
+#include "Telemetry.h"
+#include "Packet.h"
+#include "Synchronization.h"
+
+#include <algorithm>
+
+namespace {
+
+NODE_LOCAL Telemetry::Counters counters;
+
+uint8_t *put_histogram(uint8_t *p, const Telemetry::Histogram &h)
+{
+    for (int i = 0; i < Telemetry::BINS; i++) {
+        p[0] = h.bins[i] >> 8;
+        p[1] = h.bins[i];
+        p += 2;
+    }
+    return p;
+}
+}
+
+namespace Telemetry {
+
+void Reset()
+{
+    counters = {};
+}
+
+void RecordExchange(uint32_t rtt_us)
+{
+    counters.exchanges++;
+    counters.rtt.Add(rtt_us);
+}
+
+void RecordLostExchange()
+{
+    counters.lost++;
+}
+
+void RecordFit(int64_t offset_us, int32_t skew, uint32_t error_us)
+{
+    counters.fits++;
+    counters.offset_us = (int32_t)std::clamp<int64_t>(offset_us, INT32_MIN, INT32_MAX);
+    counters.skew = skew;
+    counters.fit_error_us = error_us;
+}
+
+void RecordBlocked(uint64_t us)
+{
+    counters.blocked_us += (uint32_t)std::min<uint64_t>(us, UINT32_MAX - counters.blocked_us);
+}
+
+void RecordOnset(uint32_t late_us)
+{
+    counters.onsets++;
+    counters.lateness.Add(late_us);
+}
+
+const Counters &Get()
+{
+    return counters;
+}
+
+int Encode(uint8_t *buffer, const Counters &c, uint32_t serial, int rank, uint32_t uptime_ms)
+{
+    buffer[0] = MAGIC[0];
+    buffer[1] = MAGIC[1];
+    buffer[2] = VERSION;
+    buffer[3] = BODY_SIZE >> 8;
+    buffer[4] = BODY_SIZE & 0xff;
+
+    uint8_t *p = buffer + HEADER_SIZE;
+    Packet::put32(p, serial);
+    p[4] = rank >= 0 && rank < 255 ? rank : 255;
+    Packet::put32(p + 5, uptime_ms);
+    p += 9;
+    const uint32_t fields[] = {c.exchanges, c.lost, c.fits, (uint32_t)c.offset_us, (uint32_t)c.skew,
+                               c.fit_error_us, c.blocked_us, c.onsets};
+    for (uint32_t v : fields) {
+        Packet::put32(p, v);
+        p += 4;
+    }
+    *p++ = BINS;
+    p = put_histogram(p, c.rtt);
+    p = put_histogram(p, c.lateness);
+
+    // Fletcher-16 from VERSION on
+    uint16_t sum1 = 0, sum2 = 0;
+    for (const uint8_t *q = buffer + 2; q < p; q++) {
+        sum1 = (sum1 + *q) % 255;
+        sum2 = (sum2 + sum1) % 255;
+    }
+    p[0] = sum2;
+    p[1] = sum1;
+    return p + 2 - buffer;
+}
+
+void Dump(std::shared_ptr<MicroBit> uBit)
+{
+    uint8_t frame[FRAME_SIZE];
+    int size = Encode(frame, counters, microbit_serial_number(), ClockSync::Rank(),
+                      (uint32_t)(ClockSync::LocalTime() / 1000));
+    uBit->serial.send(frame, size);
+}
+}
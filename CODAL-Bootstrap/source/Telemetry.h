@@ -0,0 +1,103 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include "MicroBit.h"
+
+#include <memory>
+#include <stdint.h>
+
+/*
+    Main idea:
+        Count what the clock sync and the playback do while the show runs, in a fixed block of
+        RAM that costs a few instructions per update, and write it out over serial in one
+        binary frame when asked. tools/telemetry.py picks the frames out of the serial captures
+        of several boards and puts them side by side.
+
+    Histograms:
+        log2 bins of microseconds, bin 0 counts zeros and bin k >= 1 the values in
+        [2^(k-1), 2^k), the last bin everything from 2^(BINS-2) on. Counts saturate at 65535.
+
+    Frame (multi-byte fields are big endian, as in Packet.h):
+        MAGIC (2) | VERSION | LENGTH (2) | BODY (LENGTH) | CHECKSUM (2)
+            MAGIC       0xA5 0x5A, neither is ASCII so the frame stands out between printf lines
+            CHECKSUM    Fletcher-16 of VERSION, LENGTH and BODY
+        BODY
+            SERIAL (4) | RANK | UPTIME_MS (4)
+            EXCHANGES (4) | LOST (4) | FITS (4) | OFFSET (4) | SKEW (4) | FIT_ERROR (4)
+            BLOCKED_US (4) | ONSETS (4)
+            BINS | RTT (2 * BINS) | LATENESS (2 * BINS)
+        RANK is 255 before the election, OFFSET and SKEW are signed, SKEW as in OffsetEstimator.h
+*/
+
+namespace Telemetry {
+
+const int BINS = 20;
+
+const uint8_t MAGIC[2] = {0xA5, 0x5A};
+const uint8_t VERSION = 1;
+const int HEADER_SIZE = 5;
+const int BODY_SIZE = 4 + 1 + 4 + 8 * 4 + 1 + 2 * 2 * BINS;
+const int FRAME_SIZE = HEADER_SIZE + BODY_SIZE + 2;
+
+struct Histogram
+{
+    uint16_t bins[BINS];
+
+    void Add(uint32_t us)
+    {
+        int bin = us == 0 ? 0 : 32 - __builtin_clz(us);
+        if (bin >= BINS)
+            bin = BINS - 1;
+        if (bins[bin] != UINT16_MAX)
+            bins[bin]++;
+    }
+};
+
+struct Counters
+{
+    uint32_t exchanges;     // SYNC / DELAY_REQ exchanges that gave a sample
+    uint32_t lost;          // exchanges that got no DELAY_RESP
+    uint32_t fits;          // clock corrections applied
+    int32_t offset_us;      // of the last fit, the local clock's lag behind the master's
+    int32_t skew;
+    uint32_t fit_error_us;
+    uint32_t blocked_us;    // spent in ClockSync::Sync() and ClockSync::Join()
+    uint32_t onsets;        // notes played
+    Histogram rtt;          // round trip of every exchange
+    Histogram lateness;     // of every note onset behind its SystemTime()
+};
+
+/*
+    Post:
+        every counter is zero, ClockSync::Init() calls it
+*/
+void Reset();
+
+void RecordExchange(uint32_t rtt_us);
+
+void RecordLostExchange();
+
+void RecordFit(int64_t offset_us, int32_t skew, uint32_t error_us);
+
+void RecordBlocked(uint64_t us);
+
+void RecordOnset(uint32_t late_us);
+
+const Counters &Get();
+
+/*
+    Pre:
+        buffer holds FRAME_SIZE bytes
+    Post:
+        writes the frame of `counters` and returns its size
+*/
+int Encode(uint8_t *buffer, const Counters &counters, uint32_t serial, int rank, uint32_t uptime_ms);
+
+/*
+    Post:
+        writes the frame of the counters so far to uBit's serial port
+*/
+void Dump(std::shared_ptr<MicroBit> uBit);
+}
+
+#endif
@@ -2,6 +2,11 @@
 
 
 #include "Synchronization.h"
+#include "Playback.h"
+#include "SongImage.h"
+#include "SongTransfer.h"
+#include "Synth.h"
+#include "Telemetry.h"
 
 #define MIN_TRIGGER_DELAY_TIME 10
 
@@ -99,11 +104,20 @@
 //  }
 //}
 
-#include "note1.cpp"
+#include "song.cpp"
 
 #define MIN_TRIGGER_DELAY_TIME 10
-#define ARTICULATION_MS 10
-#define NUMBER_MICROBITS 3
+#define START_DELAY_US 100000
+// how many boards to wait for in the election, 0 to take whoever answers
+#define NUMBER_MICROBITS 0
+// followers take their part from the master's image over the radio instead of their own
+#define SONG_OVER_THE_AIR 1
+// parts each microbit mixes in software, see Synth.h; 1 plays a single part on the pin
+#define SYNTH_VOICES 1
+
+#if SYNTH_VOICES > 1 && SONG_OVER_THE_AIR
+#error "SYNTH_VOICES needs every part in each image, set SONG_OVER_THE_AIR to 0"
+#endif
 
 int main() {
 //    auto uBit = std::make_shared<MicroBit>();
@@ -127,41 +141,62 @@ int main() {
     uBit->init();
     ClockSync::Init(uBit, NUMBER_MICROBITS);
 
-    bool isArticulated = false;
-    int cur_note = 0;
-    int fin_note = sizeof(_song_events)/sizeof(_song_events[0]);
-    ClockSync::Sync();
-    //int time = uBit->systemTime();
-    int time = ClockSync::SystemTime();
-    int next_change = time + (_song_events[0]).duration_ms;
-    pin_ -> setAnalogValue((_song_events[0]).velocity);
-    pin_ -> setAnalogPeriodUs((_song_events[0]).period_us);
-    while (cur_note < fin_note) {
-        //time = uBit->systemTime();
-        time = ClockSync::SystemTime();
-        if (next_change < time) {
-            if (! isArticulated) {
-                pin_ -> setAnalogValue(0);
-                pin_ -> setAnalogPeriodUs(0);
-                next_change = next_change + ARTICULATION_MS;
-                isArticulated = true;
-            }
-            else {
-                isArticulated = false;
-                cur_note = cur_note + 1;
-                if (cur_note >= fin_note) {
-                    pin_ -> setAnalogValue(0);
-                    pin_ -> setAnalogPeriodUs(0);
-                }
-                else {
-                    pin_ -> setAnalogValue((_song_events[cur_note]).velocity);
-                    pin_ -> setAnalogPeriodUs((_song_events[cur_note]).period_us);
-                    next_change = next_change + (_song_events[cur_note]).duration_ms - ARTICULATION_MS;
-                }
-            }
+    // the song tools/patch-hex.py wrote into this image, or the one built in from song.cpp
+    Song::PackedSong image_parts[SongImage::MAX_PARTS];
+    int song_part_count = SongImage::Load(image_parts, SongImage::MAX_PARTS);
+    const Song::PackedSong *song_parts = song_part_count ? image_parts : _song_parts;
+    if (!song_part_count)
+        song_part_count = _song_part_count;
+
+    // a board that reset during the show rejoins it instead of waiting for a Sync() the others
+    // are long past
+    bool joined = ClockSync::EnsembleRunning() && ClockSync::Join();
+    if (!joined)
+        ClockSync::Sync();
+    // keep correcting drift while the song plays
+    ClockSync::StartBackgroundSync();
+
+    // every microbit starts from the same instant on the master's clock, the cues are then
+    // applied from a timer event, see Playback.h
+    ClockSync::timestamp_t start = ClockSync::UnblockTime() + START_DELAY_US;
+#if SYNTH_VOICES > 1
+    // board r plays parts r, r + N, r + 2N... of an ensemble of N, so that fewer microbits
+    // than parts still play the whole arrangement
+    Song::PackedSong parts[SYNTH_VOICES];
+    int count = 0;
+    for (int part = ClockSync::Rank() % song_part_count; part < song_part_count && count < SYNTH_VOICES;
+         part += ClockSync::EnsembleSize())
+        parts[count++] = song_parts[part];
+    Synth::Start(uBit);
+    Playback::PlayFrom(uBit, parts, count, start, joined ? ClockSync::SystemTime() : start);
+#else
+    if (joined) {
+        // straight to the note sounding now, from this board's own copy of the song as the
+        // stream is long over
+        Playback::PlayFrom(uBit, pin_, song_parts[ClockSync::Rank() % song_part_count], start,
+                           ClockSync::SystemTime());
+    } else {
+#if SONG_OVER_THE_AIR
+        // the followers play their part while it is still arriving, see SongTransfer.h
+        if (ClockSync::Rank() == 0) {
+            SongTransfer::Serve(uBit, song_parts, song_part_count);
+            Playback::Play(uBit, pin_, song_parts[0], start);
+        } else {
+            Playback::Play(uBit, pin_, SongTransfer::Receive(uBit), start);
         }
-        fiber_sleep(1);
+#else
+        // the same image runs on every microbit, the election decides who plays what
+        Playback::Play(uBit, pin_, song_parts[ClockSync::Rank() % song_part_count], start);
+#endif
     }
+#endif
+    while (Playback::Playing())
+        uBit->sleep(100);
+    Synth::Stop();
+    SongTransfer::Stop();
+    ClockSync::StopBackgroundSync();
+    // one frame with the show's timing figures, see tools/telemetry.py
+    Telemetry::Dump(uBit);
     while(true) {
         uBit->display.scroll("Hello World");
 
@@ -1,16 +1,56 @@
 import argparse
 import collections
+import heapq
 import itertools
+import math
 import sys
 
 import mido
 
 # number of microbits
 NUMBER_OF_MICROBITS = 3
+# events between the entries of the seek index, Song::INDEX_EVENTS
+INDEX_EVENTS = 512
 
 parser = argparse.ArgumentParser()
 parser.add_argument('filename', nargs='+')
 parser.add_argument('--min-length-ms', default=5000, type=int)
+parser.add_argument('--unit-ms', default=5, type=int,
+                    help='duration unit of the packed song, see PackedSong.h')
+parser.add_argument('--parts', default=NUMBER_OF_MICROBITS, type=int,
+                    help='number of parts to split the song into')
+parser.add_argument('--allocation', default='balanced', choices=['balanced', 'first-free'],
+                    help='how notes are shared out between the parts, see allocate()')
+parser.add_argument('--keep', default='',
+                    help='comma separated drop priority for balanced allocation: melody keeps '
+                         'higher notes, velocity louder ones, the rest is decided by count')
+parser.add_argument('--compression', default='motif', choices=['motif', 'segments'],
+                    help='motif: back-references to repeated, possibly transposed phrases, see '
+                         'compress_motifs(); segments: keep only the first copy of repeated segments')
+parser.add_argument('--index-events', default=INDEX_EVENTS, type=int,
+                    help='events between the entries of the seek index, 0 for none, see index_entries()')
+parser.add_argument('--output', default='song.cpp',
+                    help='file that replace.py pastes into main-tmp.cpp')
+parser.add_argument('--image',
+                    help='also write the song for tools/patch-hex.py to this file, see song_image()')
+
+# must match Song::VELOCITY and the field layout in CODAL-Bootstrap/source/PackedSong.h
+VELOCITY_LEVELS = [11, 19, 32, 55, 94, 161, 275, 472]
+PITCH_BITS = 7
+VELOCITY_BITS = 3
+LONG_DURATION = 63
+# must match CODAL-Bootstrap/source/SongImage.h
+IMAGE_VERSION = 1
+MAX_IMAGE_PARTS = 16
+# back-references, see compress_motifs()
+REFERENCE = 0
+MIN_MATCH = 2
+LONG_LENGTH = 31
+MAX_MATCH = MIN_MATCH + LONG_LENGTH + 255
+WINDOW = 256
+MAX_TRANSPOSE = 15
+# candidates compress_motifs() compares at each position, most recent first
+CHAIN = 64
 
 
 def pairs(items, sentinel=object()):
@@ -41,6 +81,294 @@ def midi_velocity(velocity):
     return int(round(128 ** (velocity / 100.0) - 1))
 
 
+NOTE_OF_PERIOD = {midi_period_us(note): note for note in range(1, 128)}
+
+
+def velocity_level(velocity):
+    '''
+    Index of the closest level in VELOCITY_LEVELS, on a log scale.
+    >>> velocity_level(11), velocity_level(127), velocity_level(472)
+    (0, 5, 7)
+    '''
+    return min(
+        range(len(VELOCITY_LEVELS)),
+        key=lambda i: abs(math.log(VELOCITY_LEVELS[i]) - math.log(max(velocity, 1))),
+    )
+
+
+def quantize(events, unit_ms):
+    '''
+    Round the start of every event to the unit grid and return durations in units,
+    dropping events that end up with no length.
+    >>> list(quantize([(100, 7, 50), (0, 6, 0), (200, 2, 50), (300, 9, 50)], 5))
+    [(100, 1, 50), (0, 2, 0), (300, 2, 50)]
+    '''
+    start = 0
+    previous = 0
+    for period, duration, velocity in events:
+        start += duration
+        q = (start + unit_ms // 2) // unit_ms
+        if q > previous:
+            yield (period, q - previous, velocity)
+            previous = q
+
+
+def pack_word(pitch, level, units):
+    '''
+    One event in the PackedSong.h layout, 2 bytes or 4 for LONG_DURATION and more units.
+    >>> pack_word(60, 5, 20).hex()
+    'bc52'
+    '''
+    assert 0 < units <= 0xffff
+    field = units if units < LONG_DURATION else LONG_DURATION
+    word = pitch | (level << PITCH_BITS) | (field << (PITCH_BITS + VELOCITY_BITS))
+    packed = word.to_bytes(2, 'little')
+    if field == LONG_DURATION:
+        packed += units.to_bytes(2, 'little')
+    return packed
+
+
+def pack_event(period, units, velocity):
+    '''
+    Encode one quantized event, 2 bytes or 4 for LONG_DURATION and more units.
+    >>> pack_event(3822, 20, 127).hex()
+    'bc52'
+    >>> pack_event(0, 100, 0).hex()
+    '00fc6400'
+    '''
+    return pack_word(*event_token(period, units, velocity))
+
+
+def event_token(period, units, velocity):
+    pitch = NOTE_OF_PERIOD[period] if period else 0
+    level = velocity_level(velocity) if pitch else 0
+    return (pitch, level, units)
+
+
+def event_tokens(events, unit_ms):
+    '''
+    (pitch, level, units) of every event pack_events() writes
+    >>> list(event_tokens([(3822, 20, 127), (0, 70000, 0)], 5))
+    [(60, 5, 4), (0, 0, 14000)]
+    '''
+    for period, units, velocity in quantize(events, unit_ms):
+        # rests too long for one event are split, notes that long are not a thing
+        while period == 0 and units > 0xffff:
+            yield (0, 0, 0xffff)
+            units -= 0xffff
+        yield event_token(period, units, velocity)
+
+
+def pack_events(events, unit_ms):
+    '''
+    >>> pack_events([(3822, 20, 127), (0, 400000, 0)], 5).hex()
+    'bc1200fcffff00fc8138'
+    '''
+    return b''.join(pack_word(*token) for token in event_tokens(events, unit_ms))
+
+
+def token_size(token):
+    return 4 if token[2] >= LONG_DURATION else 2
+
+
+def reference_size(length):
+    return 3 if length - MIN_MATCH < LONG_LENGTH else 4
+
+
+def motif_key(a, b):
+    '''
+    The same for two events and their transposition
+    >>> motif_key((60, 5, 4), (0, 0, 2)) == motif_key((62, 5, 4), (0, 0, 2))
+    True
+    '''
+    base = a[0] or b[0]
+    return tuple((units, level, pitch - base) if pitch else (units, -1, 0) for pitch, level, units in (a, b))
+
+
+def match_length(tokens, j, i):
+    '''
+    How many events from i repeat those from j under one transposition of at most
+    MAX_TRANSPOSE semitones, and the transposition
+    >>> match_length([(60, 5, 4), (0, 0, 2), (62, 5, 4), (0, 0, 2), (63, 5, 4)], 0, 2)
+    (2, 2)
+    '''
+    n = min(MAX_MATCH, len(tokens) - i)
+    transpose = None
+    k = 0
+    while k < n:
+        a, b = tokens[j + k], tokens[i + k]
+        if a[2] != b[2] or a[1] != b[1] or (a[0] == 0) != (b[0] == 0):
+            break
+        if a[0]:
+            if transpose is None:
+                if abs(b[0] - a[0]) > MAX_TRANSPOSE + (b[0] < a[0]):
+                    break
+                transpose = b[0] - a[0]
+            elif b[0] - a[0] != transpose:
+                break
+        k += 1
+    return k, transpose or 0
+
+
+def compress_motifs(tokens, index_events=0):
+    '''
+    LZ77 over events: every phrase that repeats one of the last WINDOW events, possibly
+    transposed, becomes a back-reference to it. Greedy, the longest match among the CHAIN most
+    recent candidates with the same motif_key() wins if it takes fewer bytes than the events.
+    No reference reaches back past an entry of index_entries(data, index_events).
+    See PackedSong.h for the layout, expand_motifs() undoes it.
+    >>> phrase = [(60, 5, 4), (62, 5, 4), (64, 5, 8)]
+    >>> data = compress_motifs(phrase + [(t + 2, l, u) for t, l, u in phrase])
+    >>> data.hex()
+    'bc12be12c022320002'
+    >>> expand_motifs(data) == phrase + [(t + 2, l, u) for t, l, u in phrase]
+    True
+    >>> compress_motifs(phrase + [(t + 2, l, u) for t, l, u in phrase], 3).hex()
+    'bc12be12c022be12c012c222'
+    '''
+    tokens = list(tokens)
+    chains = collections.defaultdict(list)
+    data = bytearray()
+    i = 0
+    # the events before the last index entry are out of reach
+    floor, checkpoint = 0, index_events
+    while i < len(tokens):
+        if index_events and i >= checkpoint:
+            floor, checkpoint = i, next_checkpoint(i, index_events)
+        best, transpose, distance = 0, 0, 0
+        if i + MIN_MATCH <= len(tokens):
+            candidates = chains.get(motif_key(tokens[i], tokens[i + 1]), ())
+            for j in itertools.islice(reversed(candidates), CHAIN):
+                if i - j > WINDOW or j < floor:
+                    break
+                length, t = match_length(tokens, j, i)
+                if length > best:
+                    best, transpose, distance = length, t, i - j
+                    if best == min(MAX_MATCH, len(tokens) - i):
+                        break
+        if best >= MIN_MATCH and reference_size(best) < sum(token_size(t) for t in tokens[i:i + best]):
+            code = min(best - MIN_MATCH, LONG_LENGTH)
+            word = (transpose + 16) | (code << 5) | (REFERENCE << (PITCH_BITS + VELOCITY_BITS))
+            data += word.to_bytes(2, 'little') + bytes([distance - 1])
+            if code == LONG_LENGTH:
+                data.append(best - MIN_MATCH - LONG_LENGTH)
+            step = best
+        else:
+            data += pack_word(*tokens[i])
+            step = 1
+        for k in range(i, i + step):
+            if k + 1 < len(tokens):
+                chains[motif_key(tokens[k], tokens[k + 1])].append(k)
+        i += step
+    return bytes(data)
+
+
+def expand_token(data, i, tokens):
+    '''
+    Appends the events of the event or back-reference at data[i] to tokens, returns where the
+    next one starts
+    '''
+    word = int.from_bytes(data[i:i + 2], 'little')
+    field = word >> (PITCH_BITS + VELOCITY_BITS)
+    if field == REFERENCE:
+        transpose = (word & 31) - 16
+        code = (word >> 5) & 31
+        length = MIN_MATCH + code
+        distance = data[i + 2] + 1
+        i += 3
+        if code == LONG_LENGTH:
+            length += data[i]
+            i += 1
+        for _ in range(length):
+            pitch, level, units = tokens[-distance]
+            # clamped to the note range as Song::Expander does
+            tokens.append((min(max(pitch + transpose, 1), 127) if pitch else 0, level, units))
+        return i
+    units = field
+    if field == LONG_DURATION:
+        units = int.from_bytes(data[i + 2:i + 4], 'little')
+    tokens.append((word & ((1 << PITCH_BITS) - 1), (word >> PITCH_BITS) & ((1 << VELOCITY_BITS) - 1), units))
+    return i + (4 if field == LONG_DURATION else 2)
+
+
+def expand_motifs(data):
+    '''
+    The tokens of a packed song, back-references expanded as Song::Expander does
+    >>> expand_motifs(bytes.fromhex('bc1200fcffff'))
+    [(60, 5, 4), (0, 0, 65535)]
+    '''
+    tokens = []
+    i = 0
+    while i < len(data):
+        i = expand_token(data, i, tokens)
+    return tokens
+
+
+def next_checkpoint(events, index_events):
+    return (events // index_events + 1) * index_events
+
+
+def index_entries(data, index_events):
+    '''
+    (start in units, byte offset) of the first event or back-reference at or after every
+    index_events events, where Song::PackedSource::Seek() starts decoding with an empty window.
+    compress_motifs() given the same index_events keeps references from reaching behind them
+    >>> index_entries(bytes.fromhex('bc12be12c022be12c012c222'), 3)
+    [(16, 6)]
+    '''
+    entries = []
+    if not index_events:
+        return entries
+    tokens = []
+    units = 0
+    checkpoint = index_events
+    i = 0
+    while i < len(data):
+        if len(tokens) >= checkpoint:
+            entries.append((units, i))
+            checkpoint = next_checkpoint(len(tokens), index_events)
+        n = len(tokens)
+        i = expand_token(data, i, tokens)
+        units += sum(t[2] for t in tokens[n:])
+    return entries
+
+
+def song_image(parts, unit_ms):
+    '''
+    The song as SongImage.h lays it out, for tools/patch-hex.py to write into MICROBIT.hex.
+    parts holds the bytes and index_entries() of every part
+    >>> song_image([(bytes.fromhex('bc1200fc'), [(4, 2)]), (bytes.fromhex('bc'), [])], 5).hex()
+    '010205002400000004000000280000000100000030000000010000000000000000000000bc1200fc0400000002000000bc000000'
+    '''
+    assert len(parts) <= MAX_IMAGE_PARTS
+    table = bytearray([IMAGE_VERSION, len(parts)]) + unit_ms.to_bytes(2, 'little')
+    body = bytearray()
+    base = len(table) + 16 * len(parts)
+    for data, entries in parts:
+        data_offset = base + len(body)
+        body += data + bytes(-len(data) % 4)
+        index_offset = base + len(body) if entries else 0
+        for units, offset in entries:
+            body += units.to_bytes(4, 'little') + offset.to_bytes(4, 'little')
+        for field in (data_offset, len(data), index_offset, len(entries)):
+            table += field.to_bytes(4, 'little')
+    return bytes(table + body)
+
+
+def index_source(name, entries):
+    '''
+    The Song::IndexEntry array of a part, nothing for a song too short to have entries
+    >>> list(index_source('_song_part0_index', [(16, 6), (40, 12)]))
+    ['const Song::IndexEntry _song_part0_index[] = {', '    {16, 6}, {40, 12},', '};']
+    '''
+    if not entries:
+        return
+    yield 'const Song::IndexEntry %s[] = {' % name
+    for i in range(0, len(entries), 8):
+        yield '    ' + ' '.join('{%d, %d},' % e for e in entries[i:i + 8])
+    yield '};'
+
+
 def find_duration(start_msg, start_msg_time, midi):
     # This is for finding the duration of a note
     duration = 0
@@ -88,51 +416,152 @@ class Microbit:
         return self.notes
 
 
-def midi_to_events(midi):
+Note = collections.namedtuple('Note', 'index start duration period velocity pitch')
+
+
+def midi_notes(midi):
     '''
-    ReturnType: [[Tuple]]
-    Given a midi file, emit 3-sized array with events for three separate microbits.
+    The notes of the file in order of their onset, start in seconds and duration in ms
     '''
-    duration = 0
+    notes = []
     time = 0
-
-    # initialisation
-    microbits = [Microbit(i) for i in range(NUMBER_OF_MICROBITS)]
-    # print(microbits)
-
     for msg in midi:
         time += msg.time
-        # print(f"msg.time {msg.time} / time {time}")
-        period = 0
-        velocity = 0
+        if msg.type != 'note_on' or msg.velocity == 0:
+            continue
+        velocity = midi_velocity(msg.velocity)
+        if velocity <= 10:
+            continue
+        duration = int(round(find_duration(msg, time, midi) * 1000))
+        notes.append(Note(len(notes), time, duration, midi_period_us(msg.note), velocity, msg.note))
+    return notes
 
-        if msg.type == 'note_on' and msg.velocity > 0:
-            duration = find_duration(msg, time, midi)
-            # print(msg)
-            # print(f"{duration} --duration--")
-            period = midi_period_us(msg.note)
-            velocity = midi_velocity(msg.velocity)
 
-        duration = int(round(duration * 1000))
-        # if duration <= 0:
-        #     continue
+def drop_key(note, keep):
+    '''
+    Notes with the smallest key are dropped first: the criteria of `keep` in order, then the
+    note ending last and the note starting last, so that with no criteria as many notes as
+    possible are kept
+    >>> n = Note(3, 1.0, 500, 2273, 94, 69)
+    >>> drop_key(n, ['melody', 'velocity'])
+    (69, 94, -1.5, -3)
+    '''
+    key = tuple(note.pitch if criterion == 'melody' else note.velocity for criterion in keep)
+    return key + (-(note.start + note.duration / 1000), -note.index)
 
-        if velocity <= 10:
+
+def allocate_first_free(notes, parts):
+    '''
+    Each note goes to the first part that is free when it starts, or is dropped
+    '''
+    clock = [0] * parts
+    assigned = [None] * len(notes)
+    for note in notes:
+        for i in range(parts):
+            if clock[i] <= note.start:
+                clock[i] = advance(clock[i], note)
+                assigned[note.index] = i
+                break
+    return assigned
+
+
+def advance(clock, note):
+    '''
+    The part's clock once it has played `note`, as Microbit.addNote() moves it
+    '''
+    pause = round((note.start - clock) * 1000)
+    return clock + pause / 1000 + note.duration / 1000
+
+
+def allocate_balanced(notes, parts, keep=()):
+    '''
+    Interval partitioning over the notes in order of onset. A note goes to the free part that
+    has sounded least so far. When every part is busy, the note with the smallest drop_key()
+    among the sounding ones and the new one is dropped, if it is a sounding one its part takes
+    the new note instead. With no criteria this keeps the most notes any allocation can.
+    O(n log(parts)) with lazily deleted heap entries.
+    >>> notes = [Note(0, 0, 1000, 1, 50, 60), Note(1, 0.1, 100, 1, 50, 72),
+    ...          Note(2, 0.15, 100, 1, 50, 48), Note(3, 0.5, 100, 1, 50, 60)]
+    >>> allocate_balanced(notes, 2)
+    [None, 1, 0, 0]
+    >>> allocate_balanced(notes, 2, ['melody'])
+    [0, 1, None, 1]
+    '''
+    clock = [0] * parts
+    load = [0] * parts
+    version = [0] * parts
+    sounding = [None] * parts
+    previous = [None] * len(notes)
+    assigned = [None] * len(notes)
+    free = [(0, i) for i in range(parts)]
+    busy = []
+    candidates = []
+
+    def assign(note, part):
+        previous[note.index] = clock[part]
+        clock[part] = advance(clock[part], note)
+        load[part] += note.duration
+        version[part] += 1
+        sounding[part] = note.index
+        assigned[note.index] = part
+        heapq.heappush(busy, (clock[part], part, version[part]))
+        heapq.heappush(candidates, (drop_key(note, keep), note.index, part))
+
+    for note in notes:
+        while busy and busy[0][0] <= note.start:
+            _, part, v = heapq.heappop(busy)
+            if v == version[part]:
+                sounding[part] = None
+                heapq.heappush(free, (load[part], part))
+        if free:
+            assign(note, heapq.heappop(free)[1])
             continue
+        while sounding[candidates[0][2]] != candidates[0][1]:
+            heapq.heappop(candidates)
+        key, index, part = candidates[0]
+        if drop_key(note, keep) <= key:
+            continue
+        heapq.heappop(candidates)
+        # the evicted note was the part's last one, its clock goes back to before it
+        clock[part] = previous[index]
+        load[part] -= notes[index].duration
+        assigned[index] = None
+        assign(note, part)
+    return assigned
+
+
+def midi_to_events(midi, parts=NUMBER_OF_MICROBITS, allocation='balanced', keep=(), stats=None):
+    '''
+    ReturnType: [[Tuple]]
+    Given a midi file, emit a parts-sized array with events for separate microbits. `stats`
+    gets the number of notes, of dropped notes and the ms every part sounds for.
+    '''
+    notes = midi_notes(midi)
+    if allocation == 'first-free':
+        assigned = allocate_first_free(notes, parts)
+    else:
+        assigned = allocate_balanced(notes, parts, keep)
+
+    microbits = [Microbit(i) for i in range(parts)]
+    for note in notes:
+        if assigned[note.index] is not None:
+            microbits[assigned[note.index]].addNote(note.period, note.duration, note.velocity, note.start)
 
-        i = 0
-        while i < (NUMBER_OF_MICROBITS):
-            if microbits[i].isFree(time):
-                # print("added note to microbit")
-                # print(i)
-                microbits[i].addNote(period, duration, velocity, time)
-                i = NUMBER_OF_MICROBITS
-            else:
-                i += 1
+    if stats is not None:
+        stats['notes'] = len(notes)
+        stats['dropped'] = assigned.count(None)
+        stats['load'] = [sum(d for p, d, _ in m.getOutput() if p) for m in microbits]
+    return [microbits[i].getOutput() for i in range(parts)]
 
-    output = [microbits[i].getOutput() for i in range(NUMBER_OF_MICROBITS)]
-    # print(output)
-    return output
+
+def allocation_report(filename, stats):
+    '''
+    >>> allocation_report('a.mid', {'notes': 10, 'dropped': 1, 'load': [1500, 2500]})
+    'a.mid: 10 notes, 1 dropped (10.0%), parts sound 1.5..2.5 s'
+    '''
+    return '%s: %d notes, %d dropped (%.1f%%), parts sound %.1f..%.1f s' % (
+        filename, stats['notes'], stats['dropped'], 100 * stats['dropped'] / max(stats['notes'], 1),
+        min(stats['load']) / 1000, max(stats['load']) / 1000)
 
 
 def deduplicate_rests(events):
@@ -229,6 +658,21 @@ def compress_segments(segments):
     return output_events, output_segments
 
 
+def concatenate_segments(segments):
+    '''
+    Same result as compress_segments() with every segment kept, repeats are left to
+    compress_motifs()
+    >>> concatenate_segments([[(1, 2, 3)], [(1, 2, 3), (0, 5, 0)]])
+    ([(1, 2, 3), (1, 2, 3), (0, 5, 0)], [(0, 1), (1, 2)])
+    '''
+    output_events = []
+    output_segments = []
+    for segment in segments:
+        output_segments.append((len(output_events), len(segment)))
+        output_events.extend(segment)
+    return output_events, output_segments
+
+
 def record_length(items, fn):
     n = 0
     for item in items:
@@ -238,20 +682,27 @@ def record_length(items, fn):
 
 
 class Transformer:
-    def __init__(self, midis, min_length_ms, microbit_nb):
+    def __init__(self, midis, min_length_ms, microbit_nb, unit_ms=5, parts=NUMBER_OF_MICROBITS,
+                 allocation='balanced', keep=(), stats=None, compression='motif', index_events=INDEX_EVENTS):
         self.midis = midis
+        self.compression = compression
+        self.index_events = index_events
+        self.allocation = allocation
+        self.keep = keep
+        # gets the midi_to_events() stats of every file
+        self.stats = stats
         self.min_length_ms = min_length_ms
         self.microbit_nb = microbit_nb
+        self.unit_ms = unit_ms
+        self.parts = parts
 
         self.metadata = []
+        # bytes and index_entries() of the part, once iterated
+        self.packed = None
 
     def __iter__(self):
-        yield 'typedef struct {'
-        yield ' int period_us;'
-        yield ' int duration_ms;'
-        yield ' int velocity;'
-        yield '} music_event_t;'
-        yield 'const music_event_t _song_events[] = {'
+        # Song::PackedSong comes from PackedSong.h, which main.cpp includes before this file
+        yield 'const uint8_t _song_part%d_data[] = {' % self.microbit_nb
 
         midi_lengths = []
 
@@ -260,7 +711,7 @@ class Transformer:
                 merge_event_segments(
                     segment_on_breaks(
                         deduplicate_rests(
-                            midi_to_events(midi)[self.microbit_nb],
+                            self.part_events(midi),
                         )
                     ),
                     self.min_length_ms,
@@ -271,11 +722,22 @@ class Transformer:
         ]
         event_segments = itertools.chain(*event_segments)
 
-        events, segments = compress_segments(event_segments)
-
-        for e in events:
-            yield '    {.period_us = %s, .duration_ms = %s, .velocity = %s},' % e
+        if self.compression == 'segments':
+            events, segments = compress_segments(event_segments)
+            data = pack_events(events, self.unit_ms)
+        else:
+            events, segments = concatenate_segments(event_segments)
+            data = compress_motifs(event_tokens(events, self.unit_ms), self.index_events)
+        for i in range(0, len(data), 16):
+            yield '    ' + ' '.join('0x%02x,' % b for b in data[i:i + 16])
         yield '};'
+        name = '_song_part%d_index' % self.microbit_nb
+        entries = index_entries(data, self.index_events)
+        self.packed = (data, entries)
+        yield from index_source(name, entries)
+        index = '%s, %d' % (name, len(entries)) if entries else 'nullptr, 0'
+        yield 'const Song::PackedSong _song_part%d = {_song_part%d_data, sizeof(_song_part%d_data), %d, %s};' % (
+            self.microbit_nb, self.microbit_nb, self.microbit_nb, self.unit_ms, index)
         yield ''
 
         # yield '#endif'
@@ -295,17 +757,57 @@ class Transformer:
             start += midi_length
 
 
+    def part_events(self, midi):
+        stats = None
+        if self.stats is not None:
+            stats = {}
+            self.stats.append(stats)
+        return midi_to_events(midi, self.parts, self.allocation, self.keep, stats)[self.microbit_nb]
+
+
+def song_table(parts):
+    '''
+    >>> list(song_table(2))
+    ['const Song::PackedSong _song_parts[] = {_song_part0, _song_part1};', 'const int _song_part_count = 2;']
+    '''
+    yield 'const Song::PackedSong _song_parts[] = {%s};' % ', '.join(
+        '_song_part%d' % i for i in range(parts))
+    yield 'const int _song_part_count = %d;' % parts
+
+
 def main(args):
     midis = [
         mido.MidiFile(filename)
         for filename in args.filename
     ]
-    for i in range(NUMBER_OF_MICROBITS):
-        with open(f"note{i}.cpp", mode='w') as note:
-            t = Transformer(midis, args.min_length_ms, i)
+    keep = [criterion for criterion in args.keep.split(',') if criterion]
+    if any(criterion not in ('melody', 'velocity') for criterion in keep):
+        parser.error('--keep takes melody and velocity')
+    if args.index_events < 0:
+        parser.error('--index-events takes 0 or more')
+    if args.image and args.parts > MAX_IMAGE_PARTS:
+        parser.error('--image takes at most %d parts' % MAX_IMAGE_PARTS)
+    stats = []
+    packed = []
+    # every part goes into the one image, main() picks its own by ClockSync::Rank()
+    with open(args.output, mode='w') as song:
+        for i in range(args.parts):
+            # the allocation is the same for every part, report it once
+            t = Transformer(midis, args.min_length_ms, i, args.unit_ms, args.parts,
+                            args.allocation, keep, stats if i == 0 else None, args.compression,
+                            args.index_events)
             for line in t:
                 print(line)
-                note.write(line + "\n")
+                song.write(line + "\n")
+            packed.append(t.packed)
+        for line in song_table(args.parts):
+            print(line)
+            song.write(line + "\n")
+    if args.image:
+        with open(args.image, mode='wb') as image:
+            image.write(song_image(packed, args.unit_ms))
+    for filename, file_stats in zip(args.filename, stats):
+        print(allocation_report(filename, file_stats), file=sys.stderr)
 
     # for filename, (start, durations) in zip(args.filename, t.metadata):
     #     durations = ' '.join(str(d) for d in durations)
@@ -0,0 +1,154 @@
+'''
+Times generate-music.py against the native midi-compile (CODAL-Bootstrap/host) on synthetic
+MIDI files of growing density and checks that both write the same song.cpp and --image.
+
+    cmake -S CODAL-Bootstrap/host -B CODAL-Bootstrap/host/build
+    cmake --build CODAL-Bootstrap/host/build --target midi-compile
+    python3 tools/midi-bench.py --notes 250,500,1000,100000 --batch 16
+
+The files have several tracks of overlapping notes, tempo changes and controller messages,
+and end some notes with a note_off of non-zero velocity, which generate-music.py never pairs.
+--batch N also compiles N files of the largest size as separate songs, once on one thread and
+once on every core.
+'''
+import argparse
+import filecmp
+import importlib.util
+import os
+import random
+import subprocess
+import sys
+import tempfile
+import time
+
+import mido
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+parser = argparse.ArgumentParser()
+parser.add_argument('--notes', default='250,500,1000,100000',
+                    help='comma separated note counts of the files to compare')
+parser.add_argument('--python-max', default=1000, type=int,
+                    help='largest file generate-music.py is timed on, it is quadratic')
+parser.add_argument('--batch', default=0, type=int,
+                    help='files compiled in batch mode')
+parser.add_argument('--parts', default=3, type=int)
+parser.add_argument('--seed', default=1, type=int)
+parser.add_argument('--compiler', default=os.path.join(
+    HERE, '..', 'CODAL-Bootstrap', 'host', 'build', 'midi-compile'))
+
+
+def load_generator():
+    spec = importlib.util.spec_from_file_location(
+        'generate_music', os.path.join(HERE, 'generate-music.py'))
+    module = importlib.util.module_from_spec(spec)
+    spec.loader.exec_module(module)
+    return module
+
+
+def synthetic_midi(path, notes, rng, tracks=4):
+    '''
+    A type 1 file of `notes` notes spread over `tracks` tracks, about eight sounding at once
+    '''
+    midi = mido.MidiFile(ticks_per_beat=480)
+    per_track = notes // tracks
+    for t in range(tracks):
+        track = mido.MidiTrack()
+        events = []
+        tick = 0
+        for i in range(per_track):
+            tick += rng.choice([0, 60, 120, 240, 480])
+            note = rng.randrange(36, 96)
+            length = rng.choice([60, 120, 240, 480, 960, 1920])
+            velocity = rng.randrange(20, 128)
+            events.append((tick, 'note_on', note, velocity))
+            off = 'note_off' if rng.random() < 0.3 else 'note_on'
+            events.append((tick + length, off, note, 64 if rng.random() < 0.05 else 0))
+            if rng.random() < 0.05:
+                events.append((tick, 'control_change', 7, rng.randrange(128)))
+            if t == 0 and rng.random() < 0.01:
+                events.append((tick, 'set_tempo', rng.randrange(300000, 900000), 0))
+        events.sort(key=lambda e: e[0])
+        last = 0
+        for tick, kind, a, b in events:
+            if kind == 'set_tempo':
+                track.append(mido.MetaMessage('set_tempo', tempo=a, time=tick - last))
+            elif kind == 'control_change':
+                track.append(mido.Message('control_change', control=a, value=b, time=tick - last))
+            else:
+                track.append(mido.Message(kind, note=a, velocity=b, time=tick - last))
+            last = tick
+        midi.tracks.append(track)
+    midi.save(path)
+
+
+def time_python(generator, filenames, output, image, parts):
+    start = time.perf_counter()
+    midis = [mido.MidiFile(f) for f in filenames]
+    packed = []
+    with open(output, 'w') as song:
+        for i in range(parts):
+            t = generator.Transformer(midis, 5000, i, 5, parts)
+            for line in t:
+                song.write(line + '\n')
+            packed.append(t.packed)
+        for line in generator.song_table(parts):
+            song.write(line + '\n')
+    with open(image, 'wb') as f:
+        f.write(generator.song_image(packed, 5))
+    return time.perf_counter() - start
+
+
+def time_native(compiler, args):
+    start = time.perf_counter()
+    subprocess.run([compiler] + args, check=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    return time.perf_counter() - start
+
+
+def main():
+    args = parser.parse_args()
+    if not os.path.exists(args.compiler):
+        sys.exit('%s not found, build the midi-compile target first' % args.compiler)
+    generator = load_generator()
+    rng = random.Random(args.seed)
+    sizes = [int(n) for n in args.notes.split(',')]
+
+    with tempfile.TemporaryDirectory() as tmp:
+        print(' notes  messages   python s   native s   speedup  same')
+        for notes in sizes:
+            path = os.path.join(tmp, 'song%d.mid' % notes)
+            synthetic_midi(path, notes, rng)
+            messages = sum(len(t) for t in mido.MidiFile(path).tracks)
+            native_out = os.path.join(tmp, 'native%d.cpp' % notes)
+            native_image = os.path.join(tmp, 'native%d.bin' % notes)
+            native = time_native(args.compiler, ['--parts', str(args.parts), '--output', native_out,
+                                                 '--image', native_image, path])
+            if notes > args.python_max:
+                print('%6d %9d %10s %10.3f %9s %5s' % (notes, messages, '-', native, '-', '-'))
+                continue
+            python_out = os.path.join(tmp, 'python%d.cpp' % notes)
+            python_image = os.path.join(tmp, 'python%d.bin' % notes)
+            python = time_python(generator, [path], python_out, python_image, args.parts)
+            same = (filecmp.cmp(native_out, python_out, shallow=False) and
+                    filecmp.cmp(native_image, python_image, shallow=False))
+            print('%6d %9d %10.3f %10.3f %8.0fx %5s' % (
+                notes, messages, python, native, python / native, 'yes' if same else 'NO'))
+
+        if args.batch:
+            files = []
+            for i in range(args.batch):
+                files.append(os.path.join(tmp, 'batch%d.mid' % i))
+                synthetic_midi(files[-1], sizes[-1], rng)
+            out = os.path.join(tmp, 'batch')
+            os.mkdir(out)
+            common = ['--parts', str(args.parts), '--batch', out] + files
+            one = time_native(args.compiler, ['--jobs', '1'] + common)
+            cores = os.cpu_count()
+            every = time_native(args.compiler, ['--jobs', str(cores)] + common)
+            print()
+            print('batch of %d files of %d notes: %.3f s on 1 thread, %.3f s on %d (%.1fx)' % (
+                args.batch, sizes[-1], one, every, cores, one / every))
+
+
+if __name__ == '__main__':
+    main()
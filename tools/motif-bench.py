@@ -0,0 +1,207 @@
+'''
+Compares the ways generate-music.py can pack a song on a corpus of MIDI files: plain events,
+--compression segments and --compression motif. The packed parts are then decoded on the host
+with song-bench (CODAL-Bootstrap/host), which plays them through Song::PackedSource as Playback
+does. When midi-compile has been built, it also checks that midi-compile writes the same bytes.
+
+    cmake -S CODAL-Bootstrap/host -B CODAL-Bootstrap/host/build
+    cmake --build CODAL-Bootstrap/host/build --target song-bench midi-compile
+    python3 tools/motif-bench.py tools/*.mid --synthetic 6
+
+Real arrangements are what this is about. For lack of a corpus in the repository, --synthetic
+N adds N generated files, built the way pop songs are: a few phrases and a bass line that
+return, transposed and with the odd note changed.
+
+segments only keeps the first copy of a repeated segment, so it does not play the whole song;
+the "lost" column counts the events it leaves out.
+'''
+import argparse
+import importlib.util
+import os
+import random
+import re
+import subprocess
+import sys
+import tempfile
+
+import mido
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+BUILD = os.path.join(HERE, '..', 'CODAL-Bootstrap', 'host', 'build')
+
+parser = argparse.ArgumentParser()
+parser.add_argument('filename', nargs='*', help='MIDI files of the corpus')
+parser.add_argument('--synthetic', default=6, type=int,
+                    help='generated files added to the corpus')
+parser.add_argument('--parts', default=3, type=int)
+parser.add_argument('--unit-ms', default=5, type=int)
+parser.add_argument('--min-length-ms', default=5000, type=int)
+parser.add_argument('--seed', default=1, type=int)
+parser.add_argument('--index-events', default=512, type=int,
+                    help='as for generate-music.py, references do not reach behind the entries')
+parser.add_argument('--repeat', default=200, type=int, help='decoding passes song-bench times')
+parser.add_argument('--bench', default=os.path.join(BUILD, 'song-bench'))
+parser.add_argument('--compiler', default=os.path.join(BUILD, 'midi-compile'))
+
+
+def load_generator():
+    spec = importlib.util.spec_from_file_location(
+        'generate_music', os.path.join(HERE, 'generate-music.py'))
+    module = importlib.util.module_from_spec(spec)
+    spec.loader.exec_module(module)
+    return module
+
+
+def phrase(rng, length):
+    '''
+    (pitch offset, length in ticks, velocity) of a short melodic idea
+    '''
+    notes = []
+    pitch = 0
+    for _ in range(length):
+        pitch += rng.choice([-2, -1, 0, 1, 2, 3, -3, 5])
+        notes.append((pitch, rng.choice([120, 240, 240, 480]), rng.choice([80, 96, 112])))
+    return notes
+
+
+def synthetic_song(path, rng, sections=64):
+    '''
+    A type 1 file: a melody made of a handful of phrases, each coming back transposed or with a
+    note changed, a bass line repeating one pattern under the chord changes and a few chords
+    '''
+    midi = mido.MidiFile(ticks_per_beat=480)
+    phrases = [phrase(rng, rng.randrange(4, 9)) for _ in range(4)]
+    bass = phrase(rng, 4)
+    roots = [0, 5, 7, 3, -2]
+    tracks = [[], [], []]
+    tick = 0
+    for s in range(sections):
+        root = rng.choice(roots)
+        notes = list(phrases[rng.randrange(len(phrases))])
+        if rng.random() < 0.2:
+            i = rng.randrange(len(notes))
+            notes[i] = (notes[i][0] + rng.choice([-1, 1]), notes[i][1], notes[i][2])
+        start = tick
+        for offset, length, velocity in notes:
+            tracks[0].append((tick, 72 + root + offset, length, velocity))
+            tick += length
+        # the bass plays its pattern until the phrase is over, the chord holds
+        t = start
+        while t < tick:
+            for offset, length, velocity in bass:
+                if t >= tick:
+                    break
+                tracks[1].append((t, 40 + root + offset, min(length, tick - t), velocity - 20))
+                t += length
+        for interval in (0, 4, 7):
+            tracks[2].append((start, 60 + root + interval, tick - start, 64))
+        tick += rng.choice([0, 0, 240])
+
+    for notes in tracks:
+        track = mido.MidiTrack()
+        events = []
+        for at, note, length, velocity in notes:
+            events.append((at, 1, note, velocity))
+            events.append((at + length, 0, note, 0))
+        events.sort()
+        last = 0
+        for at, _, note, velocity in events:
+            track.append(mido.Message('note_on', note=note, velocity=velocity, time=at - last))
+            last = at
+        midi.tracks.append(track)
+    midi.save(path)
+
+
+def part_segments(generator, events, min_length_ms):
+    return list(generator.merge_event_segments(
+        generator.segment_on_breaks(generator.deduplicate_rests(events)), min_length_ms))
+
+
+def native_parts(compiler, path, args, tmp):
+    '''
+    The bytes of every part in the song.cpp midi-compile writes for path
+    '''
+    out = os.path.join(tmp, 'native.cpp')
+    subprocess.run([compiler, '--parts', str(args.parts), '--unit-ms', str(args.unit_ms),
+                    '--min-length-ms', str(args.min_length_ms), '--index-events', str(args.index_events),
+                    '--output', out, path],
+                   check=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    with open(out) as f:
+        source = f.read()
+    arrays = re.findall(r'_song_part\d+_data\[\] = \{(.*?)\};', source, re.S)
+    return [bytes(int(b, 16) for b in re.findall(r'0x([0-9a-f]{2})', a)) for a in arrays]
+
+
+def decode_cost(bench, files, repeat, unit_ms):
+    '''
+    song-bench's ns/event of every file
+    '''
+    result = subprocess.run([bench, '--repeat', str(repeat), '--unit-ms', str(unit_ms)] + files,
+                            check=True, capture_output=True, text=True)
+    lines = result.stdout.splitlines()[1:]
+    return [float(line.split()[-1]) for line in lines]
+
+
+def main():
+    args = parser.parse_args()
+    if not os.path.exists(args.bench):
+        sys.exit('%s not found, build the song-bench target first' % args.bench)
+    generator = load_generator()
+    rng = random.Random(args.seed)
+
+    with tempfile.TemporaryDirectory() as tmp:
+        corpus = list(args.filename)
+        for i in range(args.synthetic):
+            corpus.append(os.path.join(tmp, 'synthetic%d.mid' % i))
+            synthetic_song(corpus[-1], rng)
+
+        print('file                   events    plain  segments   lost    motif  ratio  '
+              'plain ns  motif ns  native')
+        total = {'events': 0, 'plain': 0, 'segments': 0, 'motif': 0}
+        for path in corpus:
+            midi = mido.MidiFile(path)
+            plain_files, motif_files = [], []
+            sizes = {'events': 0, 'plain': 0, 'segments': 0, 'lost': 0, 'motif': 0}
+            motifs = []
+            for p, events in enumerate(generator.midi_to_events(midi, args.parts)):
+                segments = part_segments(generator, events, args.min_length_ms)
+                full, _ = generator.concatenate_segments(segments)
+                tokens = list(generator.event_tokens(full, args.unit_ms))
+                plain = b''.join(generator.pack_word(*t) for t in tokens)
+                kept, _ = generator.compress_segments(segments)
+                deduplicated = generator.pack_events(kept, args.unit_ms)
+                motif = generator.compress_motifs(tokens, args.index_events)
+                if generator.expand_motifs(motif) != tokens:
+                    sys.exit('%s: part %d does not expand back' % (path, p))
+                motifs.append(motif)
+                sizes['events'] += len(tokens)
+                sizes['plain'] += len(plain)
+                sizes['segments'] += len(deduplicated)
+                sizes['lost'] += len(tokens) - len(list(generator.event_tokens(kept, args.unit_ms)))
+                sizes['motif'] += len(motif)
+                for kind, data, names in (('plain', plain, plain_files), ('motif', motif, motif_files)):
+                    names.append(os.path.join(tmp, '%s-%d.%s' % (os.path.basename(path), p, kind)))
+                    with open(names[-1], 'wb') as f:
+                        f.write(data)
+            for key in total:
+                total[key] += sizes[key]
+
+            plain_ns = decode_cost(args.bench, plain_files, args.repeat, args.unit_ms)
+            motif_ns = decode_cost(args.bench, motif_files, args.repeat, args.unit_ms)
+            # weighted by the events of each part
+            weights = [len(generator.expand_motifs(m)) for m in motifs]
+            mean = lambda costs: sum(c * w for c, w in zip(costs, weights)) / max(sum(weights), 1)
+            native = '-'
+            if os.path.exists(args.compiler):
+                native = 'same' if native_parts(args.compiler, path, args, tmp) == motifs else 'DIFFERS'
+            print('%-20s %8d %8d %9d %6d %8d %5.2fx %9.2f %9.2f  %s' % (
+                os.path.basename(path)[:20], sizes['events'], sizes['plain'], sizes['segments'],
+                sizes['lost'], sizes['motif'], sizes['plain'] / max(sizes['motif'], 1),
+                mean(plain_ns), mean(motif_ns), native))
+        print('%-20s %8d %8d %9d %6s %8d %5.2fx' % (
+            'all', total['events'], total['plain'], total['segments'], '', total['motif'],
+            total['plain'] / max(total['motif'], 1)))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,181 @@
+'''
+Writes a song into copies of MICROBIT.hex instead of rebuilding the firmware. The image
+reserves a region for it, see CODAL-Bootstrap/source/SongImage.h; this finds the region by its
+MAGIC, puts the song that generate-music.py --image or midi-compile --image wrote there, and
+recomputes the checksums of the records it changed.
+
+    python3 tools/generate-music.py --image song.bin song.mid
+    python3 tools/patch-hex.py CODAL-Bootstrap/MICROBIT.hex song.bin --output MICROBIT-song.hex
+
+Given several songs, --output-dir DIR writes DIR/<song>.hex for each. The hex is read once
+for all of them. The rest of the region is cleared, so the result does not depend on what was
+patched into the input before. The input is plain Intel HEX, as the CODAL build writes it;
+only data records are changed.
+'''
+import argparse
+import os
+import sys
+import time
+
+# must match CODAL-Bootstrap/source/SongImage.h
+MAGIC = b'MICROBIT-SONG-v1'
+HEADER_SIZE = 32
+ALIGN = 4096  # SONG_IMAGE_ALIGN, the flash page song_image.ld starts the region on
+
+DATA, END, SEGMENT, LINEAR = 0x00, 0x01, 0x02, 0x04
+
+parser = argparse.ArgumentParser()
+parser.add_argument('hex', help='MICROBIT.hex as built')
+parser.add_argument('song', nargs='+', help='songs written by generate-music.py --image')
+parser.add_argument('--output', help='patched copy, for a single song')
+parser.add_argument('--output-dir', help='directory of patched copies, one per song')
+
+
+def fletcher32(data):
+    '''
+    SongImage::fletcher32()
+    >>> hex(fletcher32(b'abcde'))
+    '0x5c301ef'
+    '''
+    a = b = 0
+    for byte in data:
+        a = (a + byte) % 65535
+        b = (b + a) % 65535
+    return b << 16 | a
+
+
+def record_line(address, kind, data):
+    '''
+    One record, its checksum makes the bytes after the colon sum to 0
+    >>> record_line(0x0010, DATA, b'address gap')
+    ':0B0010006164647265737320676170A7'
+    '''
+    body = bytes([len(data), address >> 8 & 0xff, address & 0xff, kind]) + data
+    return ':' + (body + bytes([-sum(body) & 0xff])).hex().upper()
+
+
+def parse_hex(lines):
+    '''
+    (absolute address, data, line number) of every data record
+    >>> parse_hex([':020000040001F9', ':0400100001020304E2', ':00000001FF'])
+    [(65552, bytearray(b'\\x01\\x02\\x03\\x04'), 1)]
+    '''
+    records = []
+    base = 0
+    for n, line in enumerate(lines):
+        line = line.strip()
+        if not line.startswith(':'):
+            continue
+        body = bytes.fromhex(line[1:])
+        if sum(body) & 0xff:
+            raise ValueError('line %d: bad checksum' % (n + 1))
+        length, address, kind, data = body[0], body[1] << 8 | body[2], body[3], body[4:-1]
+        if len(data) != length:
+            raise ValueError('line %d: bad length' % (n + 1))
+        if kind == DATA:
+            records.append((base + address, bytearray(data), n))
+        elif kind == SEGMENT:
+            base = int.from_bytes(data, 'big') << 4
+        elif kind == LINEAR:
+            base = int.from_bytes(data, 'big') << 16
+        elif kind == END:
+            break
+    return records
+
+
+def find_region(records):
+    '''
+    Address and capacity of the region, read from the first HEADER_SIZE bytes after MAGIC. The
+    region has to start on its own page and lie whole in the image
+    >>> header = MAGIC + (16).to_bytes(4, 'little') + bytes(12)
+    >>> find_region([(0x1000, bytearray(header + bytes(16)), 0)])
+    (4096, 16)
+    >>> find_region([(0x1010, bytearray(header + bytes(16)), 0)])
+    Traceback (most recent call last):
+    ValueError: the song region at 0x1010 does not start on a 4096 byte page, is song_image.ld linked in?
+    >>> find_region([(0x1000, bytearray(header + bytes(8)), 0)])
+    Traceback (most recent call last):
+    ValueError: the song region is not all in the image
+    '''
+    found = []
+    run, start = bytearray(), None
+    for address, data, _ in sorted(records) + [(None, b'', None)]:
+        if start is None or address != start + len(run):
+            at = run.find(MAGIC)
+            while at >= 0:
+                header = run[at:at + HEADER_SIZE]
+                if len(header) == HEADER_SIZE:
+                    found.append((start + at, int.from_bytes(header[16:20], 'little'), start + len(run)))
+                at = run.find(MAGIC, at + 1)
+            run, start = bytearray(), address
+        run += data
+    if len(found) != 1:
+        raise ValueError('%d song regions in the image, expected 1' % len(found))
+    address, capacity, end = found[0]
+    if address % ALIGN:
+        raise ValueError('the song region at 0x%x does not start on a %d byte page, is song_image.ld '
+                         'linked in?' % (address, ALIGN))
+    if address + HEADER_SIZE + capacity > end:
+        raise ValueError('the song region is not all in the image')
+    return address, capacity
+
+
+def region_bytes(capacity, song):
+    '''
+    The region holding song, see SongImage.h
+    >>> region_bytes(8, b'\\x01\\x02').hex()
+    '4d4943524f4249542d534f4e472d7631080000000200000003000400000000000102000000000000'
+    '''
+    if len(song) > capacity:
+        raise ValueError('the song takes %d bytes, the image has room for %d' % (len(song), capacity))
+    header = MAGIC + b''.join(v.to_bytes(4, 'little') for v in (capacity, len(song), fletcher32(song), 0))
+    return header + song + bytes(capacity - len(song))
+
+
+def patch(lines, records, address, region):
+    '''
+    A copy of lines with region written at address
+    '''
+    out = list(lines)
+    end = address + len(region)
+    for start, data, n in records:
+        if start + len(data) <= address or start >= end:
+            continue
+        new = bytearray(data)
+        lo, hi = max(start, address), min(start + len(data), end)
+        new[lo - start:hi - start] = region[lo - address:hi - address]
+        if new != data:
+            out[n] = record_line(start & 0xffff, DATA, bytes(new))
+    return out
+
+
+def main(args):
+    if len(args.song) > 1 and not args.output_dir:
+        parser.error('several songs need --output-dir')
+    if not args.output and not args.output_dir:
+        parser.error('give --output or --output-dir')
+    began = time.perf_counter()
+    with open(args.hex) as f:
+        lines = f.read().splitlines()
+    records = parse_hex(lines)
+    address, capacity = find_region(records)
+    for song_path in args.song:
+        with open(song_path, 'rb') as f:
+            song = f.read()
+        if args.output_dir:
+            name = os.path.splitext(os.path.basename(song_path))[0] + '.hex'
+            output = os.path.join(args.output_dir, name)
+        else:
+            output = args.output
+        patched = patch(lines, records, address, region_bytes(capacity, song))
+        with open(output, 'w') as f:
+            f.write('\n'.join(patched) + '\n')
+        print('%s: %d of %d bytes at 0x%08x, %s' % (song_path, len(song), capacity, address, output))
+    print('%d images in %.3f s' % (len(args.song), time.perf_counter() - began), file=sys.stderr)
+
+
+if __name__ == '__main__':
+    try:
+        main(parser.parse_args())
+    except ValueError as e:
+        sys.exit('%s: %s' % (parser.parse_args().hex, e))
@@ -0,0 +1,163 @@
+'''
+Decodes the Telemetry frames (CODAL-Bootstrap/source/Telemetry.h) in serial captures of several
+boards and prints one line per board plus one for the whole ensemble.
+
+    cat /dev/ttyACM0 > board1.log    # one capture per board, until the song has ended
+    python3 tools/telemetry.py board*.log
+
+The printf lines around the frames are skipped. A board that dumped more than once is
+reported from its last frame.
+'''
+import argparse
+import struct
+import sys
+
+# must match CODAL-Bootstrap/source/Telemetry.h
+MAGIC = b'\xa5\x5a'
+VERSION = 1
+FIELDS = ('exchanges', 'lost', 'fits', 'offset_us', 'skew', 'fit_error_us',
+          'blocked_us', 'onsets')
+SKEW_PER_PPM = 4295
+
+parser = argparse.ArgumentParser()
+parser.add_argument('filename', nargs='+', help='serial capture of one board')
+parser.add_argument('--histograms', action='store_true',
+                    help='print the bins of the ensemble histograms as well')
+
+
+def fletcher16(data):
+    '''
+    >>> fletcher16(b'abcde')
+    51440
+    '''
+    sum1 = sum2 = 0
+    for byte in data:
+        sum1 = (sum1 + byte) % 255
+        sum2 = (sum2 + sum1) % 255
+    return (sum2 << 8) | sum1
+
+
+def bin_range(k):
+    '''
+    Microseconds counted by bin k, upper bound exclusive
+
+    >>> bin_range(0), bin_range(1), bin_range(11)
+    ((0, 1), (1, 2), (1024, 2048))
+    '''
+    if k == 0:
+        return (0, 1)
+    return (1 << (k - 1), 1 << k)
+
+
+def decode(body):
+    serial, rank, uptime_ms = struct.unpack_from('>IBI', body)
+    values = struct.unpack_from('>IIIiiIII', body, 9)
+    frame = dict(zip(FIELDS, values))
+    frame.update(serial=serial, rank=None if rank == 255 else rank, uptime_ms=uptime_ms)
+    bins = body[41]
+    frame['rtt'] = list(struct.unpack_from('>%dH' % bins, body, 42))
+    frame['lateness'] = list(struct.unpack_from('>%dH' % bins, body, 42 + 2 * bins))
+    return frame
+
+
+def frames(data):
+    '''
+    Every frame with a valid checksum in the capture, in order
+
+    >>> body = bytes(41) + bytes([1, 0, 2, 0, 3])
+    >>> head = bytes([VERSION, 0, len(body)])
+    >>> frame = MAGIC + head + body + fletcher16(head + body).to_bytes(2, 'big')
+    >>> [(f['rtt'], f['lateness']) for f in frames(b'text\\r\\n' + frame + frame[:-1])]
+    [([2], [3])]
+    '''
+    i = data.find(MAGIC)
+    while i >= 0 and i + 7 <= len(data):
+        version, length = struct.unpack_from('>BH', data, i + 2)
+        end = i + 5 + length + 2
+        if version == VERSION and end <= len(data):
+            checksum = struct.unpack_from('>H', data, end - 2)[0]
+            if fletcher16(data[i + 2:end - 2]) == checksum:
+                yield decode(data[i + 5:end - 2])
+                i = data.find(MAGIC, end)
+                continue
+        i = data.find(MAGIC, i + 1)
+
+
+def percentile(histogram, p):
+    '''
+    Upper bound of the bin holding the p-th percentile, None if the histogram is empty
+
+    >>> percentile([0, 3, 1], 50), percentile([0, 3, 1], 100), percentile([0, 0], 50)
+    (2, 4, None)
+    '''
+    total = sum(histogram)
+    if total == 0:
+        return None
+    seen = 0
+    for k, count in enumerate(histogram):
+        seen += count
+        if seen * 100 >= p * total:
+            return bin_range(k)[1]
+
+
+def ms(us):
+    return '-' if us is None else '%.2f' % (us / 1000)
+
+
+def report(name, boards):
+    rtt = [sum(col) for col in zip(*(b['rtt'] for b in boards))]
+    late = [sum(col) for col in zip(*(b['lateness'] for b in boards))]
+    exchanges = sum(b['exchanges'] for b in boards)
+    lost = sum(b['lost'] for b in boards)
+    offsets = [b['offset_us'] for b in boards if b['fits']]
+    skews = [b['skew'] / SKEW_PER_PPM for b in boards if b['fits']]
+    print('%-10s %4s %6d %5.1f%% %7s %7s %7s %9s %7s %7s %8.0f %6d %7s %7s %7s' % (
+        name,
+        '-' if len(boards) > 1 or boards[0]['rank'] is None else boards[0]['rank'],
+        exchanges,
+        100 * lost / max(exchanges + lost, 1),
+        ms(percentile(rtt, 50)), ms(percentile(rtt, 90)), ms(percentile(rtt, 100)),
+        ms(max(offsets, key=abs) if offsets else None),
+        '%.1f' % max(skews, key=abs) if skews else '-',
+        ms(max((b['fit_error_us'] for b in boards if b['fits']), default=None)),
+        max(b['blocked_us'] for b in boards) / 1000,
+        sum(b['onsets'] for b in boards),
+        ms(percentile(late, 50)), ms(percentile(late, 99)), ms(percentile(late, 100))))
+    return rtt, late
+
+
+def main():
+    args = parser.parse_args()
+    boards = {}
+    for filename in args.filename:
+        with open(filename, 'rb') as f:
+            found = list(frames(f.read()))
+        if not found:
+            print('%s: no telemetry frame' % filename, file=sys.stderr)
+            continue
+        # the last frame has the most, a board's serial identifies it across captures
+        boards[found[-1]['serial']] = found[-1]
+    if not boards:
+        sys.exit(1)
+
+    # histogram figures are bin upper bounds, the largest |offset| and |skew| are shown
+    print('board      rank  exch.  lost     rtt p50/p90/max    |offset|    skew fit err '
+          'blocked  notes    late p50/p99/max')
+    print('%-10s %4s %6s %6s %7s %7s %7s %9s %7s %7s %8s %6s %7s %7s %7s' % (
+        '', '', '', '', 'ms', '', '', 'ms', 'ppm', 'ms', 'ms', '', 'ms', '', ''))
+    ordered = sorted(boards.values(), key=lambda b: (b['rank'] is None, b['rank'], b['serial']))
+    for board in ordered:
+        report('%08x' % board['serial'], [board])
+    rtt, late = report('all', ordered)
+    if args.histograms:
+        for name, histogram in (('rtt', rtt), ('lateness', late)):
+            print()
+            print('%s bins (us):' % name)
+            for k, count in enumerate(histogram):
+                if count:
+                    low, high = bin_range(k)
+                    print('  [%7d, %7d) %6d' % (low, high, count))
+
+
+if __name__ == '__main__':
+    main()